@@ -0,0 +1,2344 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Set assembly & teardown, shared by zcstart, zcstop and zodcached.  Nothing
+ * in here exits; errors are logged and reported to the caller.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+static const char *const component_types[] = { "origin", "cache", "metadata" };
+
+/* Pinned extents are copied through these (see copy_start()) */
+static const char *const copy_types[] = { "copy", "copysrc", "copydst" };
+
+#define COPY_PREFIX	"zodcache-copy-"
+
+/* Creates a (hidden, unless udev_flags says otherwise) single-target device */
+static int create_device(const char *const name, const uint64_t sectors,
+			 const char *const type, const char *const params,
+			 const uint16_t udev_flags)
+{
+	struct dm_task *task;
+	int ret;
+
+	ret = 0;
+
+	if (		!(task = dm_task_create(DM_DEVICE_CREATE))	||
+
+			!dm_task_enable_checks(task)			||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_add_target(task, 0, sectors, type, params) ||
+
+			!dm_task_set_add_node(task,
+					      DM_ADD_NODE_ON_RESUME)	||
+
+			!zc_dm_task_run_sync(task, udev_flags)		) {
+
+		zc_err(LOG_ERR, "%s: failed to create device\n", name);
+		ret = -1;
+	}
+
+	if (task != NULL)
+		dm_task_destroy(task);
+	return ret;
+}
+
+static int do_component(const char *const dev, const char *const type,
+			const uint64_t offset, const uint64_t size,
+			const char *const uuid)
+{
+	char *name, *params;
+	int ret;
+
+	name = zc_asprintf("zodcache-%s-%s", type, uuid);
+	params = zc_asprintf("%s %" PRIu64, dev, offset / 512);
+
+	ret = create_device(name, size / 512, "linear", params,
+			    ZC_COMPONENT_UDEV_FLAGS);
+
+	free(params);
+	free(name);
+	return ret;
+}
+
+/* Marks the set as thin, if the member says so; see zodcache.h */
+static int member_thin(const char *const dev, _Bool *const thin)
+{
+	struct zc_sb_ext ext;
+	int fd, ret;
+
+	if ((fd = open(dev, O_RDONLY | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		return -1;
+	}
+
+	ret = zc_sb_ext_read(fd, &ext);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	if (ext.flags & ZC_SB_EXT_THIN)
+		*thin = 1;
+
+	return 0;
+}
+
+/*
+ * Creates the origin component.  The data of a converted origin may start at
+ * the beginning of the device, with its head relocated (see zc_sb_ext), which
+ * takes two segments.
+ */
+static int do_origin(const char *const dev, const struct zc_sb_v0 *const sb,
+		     const char *const uuid)
+{
+	char *name, *head, *rest;
+	struct dm_task *task;
+	struct zc_sb_ext ext;
+	uint64_t h;
+	int fd, ret;
+
+	if ((fd = open(dev, O_RDONLY | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		return -1;
+	}
+
+	ret = zc_sb_ext_read(fd, &ext);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	if (ext.o_reloc == 0)
+		return do_component(dev, "origin", sb->o_offset, sb->o_size,
+				    uuid);
+
+	h = sb->o_offset / 512;
+	if (sb->o_size / 512 <= h) {
+		zc_err(LOG_ERR, "%s: origin too small for relocation\n", dev);
+		return -1;
+	}
+
+	name = zc_asprintf("zodcache-origin-%s", uuid);
+	head = zc_asprintf("%s %" PRIu64, dev, ext.o_reloc / 512);
+	rest = zc_asprintf("%s %" PRIu64, dev, h);
+
+	if (		!(task = dm_task_create(DM_DEVICE_CREATE))	||
+
+			!dm_task_enable_checks(task)			||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_add_target(task, 0, h, "linear", head)	||
+
+			!dm_task_add_target(task, h, sb->o_size / 512 - h,
+					    "linear", rest)		||
+
+			!dm_task_set_add_node(task,
+					      DM_ADD_NODE_ON_RESUME)	||
+
+			!zc_dm_task_run_sync(task, ZC_COMPONENT_UDEV_FLAGS) ) {
+
+		zc_err(LOG_ERR, "%s: failed to create device\n", name);
+		ret = -1;
+	}
+
+	if (task != NULL)
+		dm_task_destroy(task);
+	free(rest);
+	free(head);
+	free(name);
+	return ret;
+}
+
+/* Removes one of a set's hidden devices, if it exists */
+static int remove_hidden(const char *const type, const char *const uuid)
+{
+	struct dm_info info;
+	char *name;
+	int ret;
+
+	name = zc_asprintf("zodcache-%s-%s", type, uuid);
+
+	ret = zc_dm_info(name, &info);
+	if (ret == 0 && info.exists)
+		ret = zc_dm_remove(name, ZC_COMPONENT_UDEV_FLAGS);
+
+	free(name);
+	return ret;
+}
+
+static int get_dev_size(const char *const dev, uint64_t *const size)
+{
+	int fd;
+
+	fd = open(dev, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		return -1;
+	}
+
+	if (ioctl(fd, BLKGETSIZE64, size) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns the program's exit status (127 if it couldn't be executed) */
+static int run_tool(char *const argv[])
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		zc_err(LOG_ERR, "fork: %m\n");
+		return -1;
+	}
+
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			zc_err(LOG_ERR, "waitpid: %m\n");
+			return -1;
+		}
+	}
+
+	if (!WIFEXITED(status)) {
+		zc_err(LOG_ERR, "%s: terminated abnormally\n", argv[0]);
+		return -1;
+	}
+
+	return WEXITSTATUS(status);
+}
+
+/* dm-cache (and dm-era) format metadata whose superblock is all zeroes */
+static int metadata_is_new(const char *const md_dev)
+{
+	uint64_t buf[512];
+	unsigned i;
+	int fd;
+
+	fd = open(md_dev, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", md_dev);
+		return -1;
+	}
+
+	if (read(fd, buf, sizeof buf) != sizeof buf) {
+		zc_err(LOG_ERR, "%s: failed to read metadata superblock\n",
+		       md_dev);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	for (i = 0; i < sizeof buf / sizeof buf[0]; ++i) {
+		if (buf[i] != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int copy_metadata(const char *const src, const char *const dst)
+{
+	static char buf[1048576];
+	int in, out, ret;
+	ssize_t count;
+
+	if ((in = open(src, O_RDONLY | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", src);
+		return -1;
+	}
+
+	if ((out = open(dst, O_WRONLY | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dst);
+		close(in);
+		return -1;
+	}
+
+	ret = -1;
+
+	while ((count = read(in, buf, sizeof buf)) > 0) {
+		if (write(out, buf, count) != count) {
+			zc_err(LOG_ERR, "%s: write failed: %m\n", dst);
+			goto out;
+		}
+	}
+
+	if (count < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", src);
+		goto out;
+	}
+
+	if (fsync(out) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dst);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	close(out);
+	close(in);
+	return ret;
+}
+
+/*
+ * cache_repair can't repair in place, so the repaired metadata is written to
+ * a temporary file (on tmpfs), checked, and then copied back.
+ */
+static int repair_metadata(const char *const uuid, const char *const md_dev)
+{
+	uint64_t size;
+	char *tmp;
+	int fd;
+
+	tmp = zc_asprintf(ZC_RUN_DIR "/repair-%s-XXXXXX", uuid);
+
+	if ((fd = mkostemp(tmp, O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", tmp);
+		free(tmp);
+		return -1;
+	}
+
+	if (get_dev_size(md_dev, &size) < 0)
+		goto error;
+
+	if (ftruncate(fd, size) < 0 || close(fd) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", tmp);
+		goto error;
+	}
+
+	zc_err(LOG_WARNING, "%s: repairing cache metadata\n", uuid);
+
+	if (run_tool((char *[]){ "cache_repair", "-i", (char *)md_dev,
+				 "-o", tmp, NULL }) != 0) {
+		zc_err(LOG_ERR, "%s: cache_repair failed\n", uuid);
+		goto error;
+	}
+
+	if (run_tool((char *[]){ "cache_check", "-q", tmp, NULL }) != 0) {
+		zc_err(LOG_ERR, "%s: repaired metadata failed check\n", uuid);
+		goto error;
+	}
+
+	if (copy_metadata(tmp, md_dev) < 0)
+		goto error;
+
+	unlink(tmp);
+	free(tmp);
+	return 0;
+
+error:
+	zc_err(LOG_ERR, "%s: not assembling; manual repair required\n", uuid);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+/*
+ * Opens a member device and reads its superblock extension.  Returns the file
+ * descriptor, which must be passed to zc_member_ext_commit() or closed.
+ */
+int zc_member_ext_open(const dev_t devno, struct zc_sb_ext *const ext)
+{
+	char *member;
+	int fd;
+
+	member = zc_asprintf("/dev/block/%u:%u", major(devno), minor(devno));
+
+	fd = open(member, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", member);
+		free(member);
+		return -1;
+	}
+
+	free(member);
+
+	if (zc_sb_ext_read(fd, ext) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Writes (and syncs) the extension and closes the file descriptor */
+int zc_member_ext_commit(const int fd, const dev_t devno,
+			 struct zc_sb_ext *const ext)
+{
+	if (zc_sb_ext_write(fd, ext) < 0 || fsync(fd) < 0) {
+		zc_err(LOG_ERR, "%u:%u: failed to update superblock "
+		       "extension: %m\n", major(devno), minor(devno));
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) < 0) {
+		zc_err(LOG_ERR, "%u:%u: %m\n", major(devno), minor(devno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Creates the component device for the dm-era metadata and checks it, unless
+ * the set was cleanly stopped.  dm-era metadata can't be repaired, so damaged
+ * metadata is reformatted, and the eras reported to users are moved past all
+ * those reported before; every block then counts as changed since any era
+ * that a backup tool may have recorded.
+ */
+static int prepare_era(const char *const uuid, const dev_t md_member,
+		       struct zc_sb_ext *const ext)
+{
+	static const char zeroes[4096];
+	char *member, *era_dev;
+	int fd, ret;
+
+	member = zc_asprintf("/dev/block/%u:%u", major(md_member),
+			     minor(md_member));
+	era_dev = zc_asprintf("/dev/mapper/zodcache-erameta-%s", uuid);
+
+	ret = do_component(member, "erameta", ext->era_offset * 512,
+			   ext->era_size * 512, uuid);
+	if (ret < 0 || (ext->flags & ZC_SB_EXT_CLEAN))
+		goto out;
+
+	if ((ret = metadata_is_new(era_dev)) != 0)
+		goto out;
+
+	ret = run_tool((char *[]){ "era_check", "-q", era_dev, NULL });
+	if (ret == 127) {
+		zc_err(LOG_WARNING, "%s: era_check not available; "
+		       "era metadata not checked\n", uuid);
+		ret = 0;
+		goto out;
+	}
+	if (ret <= 0)
+		goto out;
+
+	zc_err(LOG_WARNING, "%s: era metadata damaged; resetting changed-block "
+	       "tracking\n", uuid);
+	ret = -1;
+
+	if ((fd = open(era_dev, O_WRONLY | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", era_dev);
+		goto out;
+	}
+
+	if (pwrite(fd, zeroes, sizeof zeroes, 0) != sizeof zeroes ||
+			fsync(fd) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", era_dev);
+		close(fd);
+		goto out;
+	}
+
+	close(fd);
+	ext->era_base = ext->era_issued + 1;
+	ret = 0;
+
+out:
+	if (ret < 0)
+		remove_hidden("erameta", uuid);
+	free(era_dev);
+	free(member);
+	return ret;
+}
+
+/*
+ * Checks (and if necessary repairs) the cache metadata, unless the set was
+ * cleanly stopped by zcstop, then marks the set as in use.  Returns the
+ * set-wide extension in ext.
+ */
+static int prepare_metadata(const char *const uuid, const char *const md_dev,
+			    const dev_t md_member, struct zc_sb_ext *const ext)
+{
+	int fd, ret;
+
+	if ((fd = zc_member_ext_open(md_member, ext)) < 0)
+		return -1;
+
+	if (ext->flags & ZC_SB_EXT_CLEAN) {
+		zc_err(LOG_INFO, "%s: clean shutdown (generation %" PRIu64
+		       "); skipping metadata check\n", uuid, ext->generation);
+	}
+	else if ((ret = metadata_is_new(md_dev)) != 0) {
+		if (ret < 0)
+			goto error;
+	}
+	else {
+		zc_err(LOG_NOTICE, "%s: unclean shutdown; checking metadata\n",
+		       uuid);
+
+		ret = run_tool((char *[]){ "cache_check", "-q", (char *)md_dev,
+					   NULL });
+		if (ret == 127) {
+			zc_err(LOG_WARNING, "%s: cache_check not available; "
+			       "metadata not checked\n", uuid);
+		}
+		else if (ret != 0 && repair_metadata(uuid, md_dev) < 0) {
+			goto error;
+		}
+	}
+
+	if (ext->era_block_size != 0 && prepare_era(uuid, md_member, ext) < 0)
+		goto error;
+
+	ext->flags &= ~ZC_SB_EXT_CLEAN;
+
+	return zc_member_ext_commit(fd, md_member, ext);
+
+error:
+	close(fd);
+	return -1;
+}
+
+/* Sets with uncached zones or a pin area have a composite top-level device */
+static _Bool is_composite(const struct zc_sb_ext *const ext)
+{
+	return ext->zones_count != 0 || ext->pin_size != 0;
+}
+
+/*
+ * With changed-block tracking, the top-level device is a dm-era target, and
+ * the composite device (or the cache target) is hidden under it.  Returns the
+ * name of the device that the dm-era target (if any) sits on.
+ */
+static char *stack_name(const char *const uuid,
+			const struct zc_sb_ext *const ext)
+{
+	if (ext->era_block_size != 0)
+		return zc_asprintf(ZC_TRACKED_PREFIX "%s", uuid);
+
+	return zc_asprintf("zodcache-device-%s", uuid);
+}
+
+/*
+ * Adds the targets of a composite top-level device.  Uncached zones map
+ * straight to the origin component, and resident pins to the pin area.  Pins
+ * that are being copied map to the copy device, if there is one (copying),
+ * otherwise to their authoritative copy.  Everything else maps to the cache
+ * target, which covers the whole origin (so that cache block numbers don't
+ * depend on the zones or pins).
+ */
+static int add_overlay_targets(struct dm_task *const task,
+			       const char *const uuid,
+			       const struct zc_sb_ext *const ext,
+			       const uint64_t o_sectors, const _Bool copying)
+{
+	uint64_t z, p, pos, len, offset, next;
+	const struct zc_sb_pin *pin;
+	const char *prefix;
+	char *params;
+	int ok;
+
+	if (ext->zones_count > ZC_SB_EXT_MAX_ZONES ||
+				ext->pins_count > ZC_SB_EXT_MAX_PINS) {
+		zc_err(LOG_ERR, "%s: invalid zone or pin count\n", uuid);
+		return -1;
+	}
+
+	for (z = 0, p = 0, pos = 0; pos < o_sectors; pos += len) {
+
+		offset = pos;
+
+		if (z < ext->zones_count && ext->zones[z].start == pos) {
+			prefix = "zodcache-origin-";
+			len = ext->zones[z++].len;
+		}
+		else if (p < ext->pins_count && ext->pins[p].start == pos) {
+
+			pin = ext->pins + p++;
+			len = pin->len;
+
+			if (copying && pin->state != ZC_PIN_RESIDENT) {
+				prefix = COPY_PREFIX;
+				offset = 0;
+			}
+			else if (pin->state == ZC_PIN_PENDING) {
+				prefix = ZC_CACHED_PREFIX;
+			}
+			else {
+				prefix = "zodcache-pin-";
+				offset = pin->offset;
+			}
+		}
+		else {
+			next = o_sectors;
+			if (z < ext->zones_count && ext->zones[z].start < next)
+				next = ext->zones[z].start;
+			if (p < ext->pins_count && ext->pins[p].start < next)
+				next = ext->pins[p].start;
+
+			prefix = ZC_CACHED_PREFIX;
+			len = next - pos;
+		}
+
+		if (len > o_sectors - pos)
+			len = o_sectors - pos;
+
+		params = zc_asprintf("/dev/mapper/%s%s %" PRIu64,
+				     prefix, uuid, offset);
+		ok = dm_task_add_target(task, pos, len, "linear", params);
+		free(params);
+
+		if (!ok)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int create_overlay(const char *const name, const char *const uuid,
+			  const struct zc_sb_ext *const ext,
+			  const uint64_t o_sectors, const _Bool copying)
+{
+	struct dm_task *task;
+	int ret;
+
+	ret = 0;
+
+	if (		!(task = dm_task_create(DM_DEVICE_CREATE))	||
+
+			!dm_task_enable_checks(task)			||
+
+			!dm_task_set_name(task, name)			||
+
+			add_overlay_targets(task, uuid, ext, o_sectors,
+					    copying) < 0		||
+
+			!dm_task_set_add_node(task,
+					      DM_ADD_NODE_ON_RESUME)	||
+
+			!zc_dm_task_run_sync(task,
+					     zc_dm_udev_flags(name))	) {
+
+		zc_err(LOG_ERR, "%s: failed to create device\n", name);
+		ret = -1;
+	}
+
+	if (task != NULL)
+		dm_task_destroy(task);
+	return ret;
+}
+
+/* Removes the copy devices (if any) */
+static int copy_stop(const char *const uuid)
+{
+	unsigned i;
+	int ret;
+
+	for (ret = 0, i = 0; i < sizeof copy_types / sizeof copy_types[0]; ++i) {
+		if (remove_hidden(copy_types[i], uuid) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Starts copying a pin to (PENDING) or from (UNPINNING) the pin area.  The
+ * copy device is a raid1 device whose first leg is the authoritative copy and
+ * whose second leg is rebuilt from it.  While the top-level device maps the
+ * pin to the copy device, writes go to both copies.
+ */
+static int copy_start(const char *const uuid, const struct zc_sb_ext *const ext,
+		      const struct zc_sb_pin *const pin)
+{
+	char *name, *cached, *pin_dev, *params, *rate;
+	int ret;
+
+	name = zc_asprintf(COPY_PREFIX "%s", uuid);
+	cached = zc_asprintf("/dev/mapper/" ZC_CACHED_PREFIX "%s", uuid);
+	pin_dev = zc_asprintf("/dev/mapper/zodcache-pin-%s", uuid);
+	params = NULL;
+	ret = -1;
+
+	if (pin->state == ZC_PIN_PENDING) {
+		if (do_component(cached, "copysrc", pin->start * 512,
+				 pin->len * 512, uuid) < 0 ||
+				do_component(pin_dev, "copydst", pin->offset * 512,
+					     pin->len * 512, uuid) < 0)
+			goto out;
+	}
+	else {
+		if (do_component(pin_dev, "copysrc", pin->offset * 512,
+				 pin->len * 512, uuid) < 0 ||
+				do_component(cached, "copydst", pin->start * 512,
+					     pin->len * 512, uuid) < 0)
+			goto out;
+	}
+
+	if (ext->pin_rate != 0)
+		rate = zc_asprintf(" max_recovery_rate %" PRIu64, ext->pin_rate);
+	else
+		rate = zc_asprintf("%s", "");
+
+	params = zc_asprintf("raid1 %d 0 rebuild 1%s 2 - /dev/mapper/zodcache-"
+			     "copysrc-%s - /dev/mapper/zodcache-copydst-%s",
+			     ext->pin_rate != 0 ? 5 : 3, rate, uuid, uuid);
+	free(rate);
+
+	if (create_device(name, pin->len, "raid", params,
+			  ZC_COMPONENT_UDEV_FLAGS) < 0)
+		goto out;
+
+	zc_err(LOG_NOTICE, "%s: copying pinned extent at sector %" PRIu64
+	       " %s the pin area\n", uuid, pin->start,
+	       pin->state == ZC_PIN_PENDING ? "to" : "from");
+	ret = 0;
+
+out:
+	if (ret < 0)
+		copy_stop(uuid);
+	free(params);
+	free(pin_dev);
+	free(cached);
+	free(name);
+	return ret;
+}
+
+/* Big enough for a hex key or :SIZE:TYPE:DESCRIPTION */
+#define CRYPT_KEY_BUF_SIZE	(2 * ZC_CRYPT_MAX_KEY_SIZE + 1)
+
+/*
+ * Formats the dm-crypt table's key: the contents of a key file (in hex), or a
+ * kernel keyring key (:SIZE:TYPE:DESCRIPTION), which dm-crypt looks up itself.
+ */
+static int crypt_key(const struct zc_sb_ext *const ext,
+		     char buf[CRYPT_KEY_BUF_SIZE])
+{
+	uint8_t key[ZC_CRYPT_MAX_KEY_SIZE];
+	struct stat st;
+	ssize_t count;
+	unsigned i;
+	int fd, ret;
+
+	if (ext->crypt_key[0] != '/') {
+		snprintf(buf, CRYPT_KEY_BUF_SIZE, ":%" PRIu64 ":%s",
+			 ext->crypt_key_size, ext->crypt_key);
+		return 0;
+	}
+
+	ret = -1;
+
+	if ((fd = open(ext->crypt_key, O_RDONLY | O_CLOEXEC)) < 0 ||
+						fstat(fd, &st) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", ext->crypt_key);
+		goto out;
+	}
+
+	if ((uint64_t)st.st_size != ext->crypt_key_size ||
+					ext->crypt_key_size > sizeof key) {
+		zc_err(LOG_ERR, "%s: key file is not %" PRIu64 " bytes\n",
+		       ext->crypt_key, ext->crypt_key_size);
+		goto out;
+	}
+
+	count = read(fd, key, ext->crypt_key_size);
+	if (count != (ssize_t)ext->crypt_key_size) {
+		zc_err(LOG_ERR, "%s: failed to read key\n", ext->crypt_key);
+		goto out;
+	}
+
+	for (i = 0; i < ext->crypt_key_size; ++i)
+		sprintf(buf + 2 * i, "%02x", key[i]);
+
+	ret = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	explicit_bzero(key, sizeof key);
+	return ret;
+}
+
+/*
+ * Creates the dm-crypt device on top of the set's device.  Everything under it,
+ * including the cache, only ever sees ciphertext, so blocks are encrypted once
+ * (on their way in), rather than again on promotion or writeback.
+ */
+static int crypt_create(const char *const uuid,
+			const struct zc_sb_ext *const ext, const uint64_t size)
+{
+	char key[CRYPT_KEY_BUF_SIZE], opts[48];
+	uint64_t sector_size;
+	char *name, *params;
+	int ret;
+
+	if (crypt_key(ext, key) < 0)
+		return -1;
+
+	sector_size = ext->crypt_sector_size ? ext->crypt_sector_size : 512;
+	opts[0] = 0;
+	if (sector_size != 512) {
+		snprintf(opts, sizeof opts, " 1 sector_size:%" PRIu64,
+			 sector_size);
+	}
+
+	params = zc_asprintf("%s %s 0 /dev/mapper/zodcache-device-%s 0%s",
+			     ext->crypt_cipher, key, uuid, opts);
+	explicit_bzero(key, sizeof key);
+
+	name = zc_asprintf(ZC_CRYPT_PREFIX "%s", uuid);
+	ret = create_device(name, size / sector_size * (sector_size / 512),
+			    "crypt", params, ZC_DEV_UDEV_FLAGS);
+
+	if (ret == 0) {
+		zc_err(LOG_INFO, "%s: encrypted device is /dev/mapper/%s\n",
+		       uuid, name);
+		/* zc_tune_apply() ran before the device existed */
+		zc_tune_crypt(uuid, ext);
+	}
+
+	explicit_bzero(params, strlen(params));
+	free(params);
+	free(name);
+	return ret;
+}
+
+/* Removes the set's dm-crypt device, if it exists and isn't in use */
+static int crypt_remove(const char *const uuid)
+{
+	struct dm_info info;
+	char *name;
+	int ret;
+
+	name = zc_asprintf(ZC_CRYPT_PREFIX "%s", uuid);
+
+	if ((ret = zc_dm_info(name, &info)) == 0 && info.exists) {
+
+		if (info.open_count > 0) {
+			zc_err(LOG_ERR, "%s: device in use\n", name);
+			ret = -1;
+		}
+		else {
+			ret = zc_dm_remove(name, ZC_DEV_UDEV_FLAGS);
+		}
+	}
+
+	free(name);
+	return ret;
+}
+
+/*
+ * Activates the LVM thin pool whose data device is on the set's device.  Kept
+ * out of LVM autoactivation (lvchange --setautoactivation n), the pool is then
+ * never activated before the cache is in place.  lvm is queued as a transient
+ * unit, rather than run from here with the registry locked (and from udev's
+ * RUN, which it would hold up).  If that can't be done, for whatever reason,
+ * it is run directly; a pool left inactive would hold up boot.
+ */
+static void thin_activate(const char *const uuid, const dev_t o_devno)
+{
+	struct zc_sb_ext ext;
+	int fd, ret;
+
+	if ((fd = zc_member_ext_open(o_devno, &ext)) < 0)
+		return;
+
+	close(fd);
+
+	ret = run_tool((char *[]){ "systemd-run", "--no-block", "--quiet",
+				   "lvm", "lvchange", "-ay", ext.o_thin_pool,
+				   NULL });
+	if (ret != 0) {
+		ret = run_tool((char *[]){ "lvm", "lvchange", "-ay",
+					   ext.o_thin_pool, NULL });
+	}
+
+	if (ret != 0) {
+		zc_err(LOG_WARNING, "%s: failed to activate thin pool %s\n",
+		       uuid, ext.o_thin_pool);
+	}
+	else {
+		zc_err(LOG_INFO, "%s: activating thin pool %s\n", uuid,
+		       ext.o_thin_pool);
+	}
+}
+
+/* The order in which zc_set_reblock() rewrites the superblocks */
+static const unsigned reblock_order[] = {
+	ZC_SB_TYPE_CACHE, ZC_SB_TYPE_ORIGIN, ZC_SB_TYPE_METADATA
+};
+
+/*
+ * Makes the other members' block size match the cache member's, in case
+ * zc_set_reblock() was interrupted after writing the cache member's
+ * superblock (which also holds a combined cache device's layout).  The
+ * metadata was wiped before then, so either block size would be usable.
+ */
+static int reblock_repair(const char *const uuid,
+			  const struct zc_registry *const reg,
+			  uint64_t *const block_size)
+{
+	struct zc_sb_v0 sb;
+	unsigned i, t;
+	char *member;
+	int fd;
+
+	*block_size = 0;
+
+	for (i = 0; i < ZC_SB_TYPE_METADATA + 1; ++i) {
+
+		t = reblock_order[i];
+
+		/* A combined cache device is both the cache and metadata */
+		if (t == ZC_SB_TYPE_METADATA && reg->members[t] ==
+					reg->members[ZC_SB_TYPE_CACHE])
+			break;
+
+		member = zc_asprintf("/dev/block/%u:%u", major(reg->members[t]),
+				     minor(reg->members[t]));
+
+		if ((fd = open(member, O_RDWR | O_CLOEXEC)) < 0) {
+			zc_err(LOG_ERR, "%s: %m\n", member);
+			free(member);
+			return -1;
+		}
+
+		if (zc_sb_v0_pread(NULL, fd, &sb) < 0)
+			goto error;
+
+		if (t == ZC_SB_TYPE_CACHE) {
+			*block_size = sb.block_size;
+		}
+		else if (sb.block_size != *block_size) {
+
+			zc_err(LOG_WARNING, "%s: %s block size out of date "
+			       "(interrupted reblock); updating\n", uuid,
+			       zc_dev_type_format(sb.type, 0));
+
+			sb.block_size = *block_size;
+			sb.cksum = zc_sb_v0_cksum(&sb);
+
+			if (zc_sb_v0_pwrite(NULL, fd, &sb) < 0 ||
+					fsync(fd) < 0) {
+				zc_err(LOG_ERR, "%s: %m\n", member);
+				goto error;
+			}
+		}
+
+		close(fd);
+		free(member);
+	}
+
+	return 0;
+
+error:
+	close(fd);
+	free(member);
+	return -1;
+}
+
+/* Only called (with the registry locked) once all members have arrived */
+static int assemble(const struct zc_sb_v0 *const sb, const char *const uuid,
+		    const struct zc_registry *const reg)
+{
+	char *name, *stack, *cached, *params, *o_dev, *c_dev, *md_dev, *member;
+	dev_t c_devno;
+	uint64_t o_size, block_size;
+	struct zc_sb_ext ext;
+	_Bool copying;
+	int ret, pin;
+
+	o_dev = zc_asprintf("/dev/mapper/zodcache-origin-%s", uuid);
+	c_dev = zc_asprintf("/dev/mapper/zodcache-cache-%s", uuid);
+	md_dev = zc_asprintf("/dev/mapper/zodcache-metadata-%s", uuid);
+	name = zc_asprintf("zodcache-device-%s", uuid);
+	cached = zc_asprintf(ZC_CACHED_PREFIX "%s", uuid);
+	stack = params = NULL;
+	ret = -1;
+
+	if (sb->type == ZC_SB_TYPE_ORIGIN)
+		o_size = sb->o_size;
+	else if (get_dev_size(o_dev, &o_size) < 0)
+		goto out;
+
+	if (reblock_repair(uuid, reg, &block_size) < 0)
+		goto out;
+
+	if (prepare_metadata(uuid, md_dev,
+			     reg->members[ZC_SB_TYPE_METADATA], &ext) < 0)
+		goto undo;
+
+	stack = stack_name(uuid, &ext);
+	params = zc_asprintf("%s %s %s %" PRIu64 " 1 %s default 0",
+			     md_dev, c_dev, o_dev, block_size / 512,
+			     zc_cache_mode_format(sb->cache_mode, 0));
+
+	if (!is_composite(&ext)) {
+		if (create_device(stack, o_size / 512, "cache", params,
+				  zc_dm_udev_flags(stack)) < 0)
+			goto undo;
+		goto era;
+	}
+
+	if (create_device(cached, o_size / 512, "cache", params,
+			  ZC_COMPONENT_UDEV_FLAGS) < 0)
+		goto undo;
+
+	if (ext.pin_size != 0) {
+
+		c_devno = reg->members[ZC_SB_TYPE_CACHE];
+		member = zc_asprintf("/dev/block/%u:%u", major(c_devno),
+				     minor(c_devno));
+		ret = do_component(member, "pin", ext.pin_offset * 512,
+				   ext.pin_size * 512, uuid);
+		free(member);
+
+		if (ret < 0)
+			goto undo;
+	}
+
+	/* Restart an interrupted copy; the pin is usable without it */
+	copying = 0;
+	if ((pin = zc_pin_in_flight(&ext)) >= 0)
+		copying = (copy_start(uuid, &ext, ext.pins + pin) == 0);
+
+	if ((ret = create_overlay(stack, uuid, &ext, o_size / 512,
+				  copying)) < 0)
+		goto undo;
+
+	zc_err(LOG_INFO, "%s: %" PRIu64 " uncached zone(s), %" PRIu64
+	       " pinned extent(s)\n", uuid, ext.zones_count, ext.pins_count);
+
+era:
+	if (ext.era_block_size != 0) {
+
+		free(params);
+		params = zc_asprintf("/dev/mapper/zodcache-erameta-%s "
+				     "/dev/mapper/%s %" PRIu64, uuid, stack,
+				     ext.era_block_size);
+
+		if (create_device(name, o_size / 512, "era", params,
+				  ZC_DEV_UDEV_FLAGS) < 0)
+			goto undo;
+
+		zc_err(LOG_INFO, "%s: tracking changes in %" PRIu64
+		       "-sector blocks\n", uuid, ext.era_block_size);
+	}
+
+	/* Queue settings are all-or-nothing, and don't fail the assembly */
+	zc_tune_apply(uuid, &ext, block_size,
+		      reg->members[ZC_SB_TYPE_ORIGIN],
+		      reg->members[ZC_SB_TYPE_CACHE]);
+
+	/* Statistics are nice to have; don't fail the assembly over them */
+	if (ext.stats_areas != 0)
+		zc_stats_setup(uuid, &ext);
+
+	/* The key may not be available yet; see zc_set_crypt_open() */
+	if (ext.crypt_cipher[0] != 0 && crypt_create(uuid, &ext, o_size) < 0) {
+		zc_err(LOG_WARNING, "%s: encrypted device not created; "
+		       "retry with zcctl crypt open\n", uuid);
+	}
+
+	/* The set itself is usable even if the pool can't be activated */
+	if (reg->thin)
+		thin_activate(uuid, reg->members[ZC_SB_TYPE_ORIGIN]);
+
+	ret = 0;
+	goto out;
+
+undo:
+	remove_hidden("tracked", uuid);
+	copy_stop(uuid);
+	remove_hidden("pin", uuid);
+	remove_hidden("cached", uuid);
+	remove_hidden("erameta", uuid);
+	ret = -1;
+
+out:
+	free(params);
+	free(stack);
+	free(cached);
+	free(name);
+	free(md_dev);
+	free(c_dev);
+	free(o_dev);
+	return ret;
+}
+
+/*
+ * Returns the name of the set's cache target: the top-level device, or the
+ * hidden device under a composite device or dm-era target.
+ */
+char *zc_cache_target(const char *const uuid)
+{
+	static const char *const prefixes[] = {
+		ZC_CACHED_PREFIX, ZC_TRACKED_PREFIX
+	};
+
+	struct dm_info info;
+	unsigned i;
+	char *name;
+
+	for (i = 0; i < sizeof prefixes / sizeof prefixes[0]; ++i) {
+
+		name = zc_asprintf("%s%s", prefixes[i], uuid);
+
+		if (zc_dm_info(name, &info) == 0 && info.exists)
+			return name;
+
+		free(name);
+	}
+
+	return zc_asprintf("zodcache-device-%s", uuid);
+}
+
+/* Loads a new (inactive) table into a composite device */
+static int overlay_load(const char *const name, const char *const uuid,
+			const struct zc_sb_ext *const ext)
+{
+	char *cached, *copy;
+	struct dm_task *task;
+	struct dm_info info;
+	uint64_t o_size;
+	int ret;
+
+	cached = zc_asprintf("/dev/mapper/" ZC_CACHED_PREFIX "%s", uuid);
+	copy = zc_asprintf(COPY_PREFIX "%s", uuid);
+	task = NULL;
+	ret = -1;
+
+	if (get_dev_size(cached, &o_size) < 0 || zc_dm_info(copy, &info) < 0)
+		goto out;
+
+	if (		!(task = dm_task_create(DM_DEVICE_RELOAD))	||
+
+			!dm_task_set_name(task, name)			||
+
+			add_overlay_targets(task, uuid, ext, o_size / 512,
+					    info.exists) < 0		||
+
+			!dm_task_run(task)				) {
+
+		zc_err(LOG_ERR, "%s: failed to load new table\n", name);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (task != NULL)
+		dm_task_destroy(task);
+	free(copy);
+	free(cached);
+	return ret;
+}
+
+/*
+ * Replaces the table of a set's composite device.  The caller must ensure
+ * that no range whose mapping changes has data that exists only in its old
+ * mapping (e.g. dirty cache blocks).
+ */
+int zc_set_overlay_reload(const char *const uuid,
+			  const struct zc_sb_ext *const ext)
+{
+	char *name;
+	int ret;
+
+	name = stack_name(uuid, ext);
+
+	ret = (overlay_load(name, uuid, ext) < 0 || zc_dm_suspend(name) < 0 ||
+			zc_dm_resume(name, zc_dm_udev_flags(name)) < 0) ? -1 : 0;
+
+	free(name);
+	return ret;
+}
+
+/*
+ * Starts the copy of a pin and maps the pin to it.  The composite device is
+ * suspended first, so that no write can reach the pin's authoritative copy
+ * without also going to the copy that is being rebuilt.
+ */
+static int copy_start_online(const char *const uuid,
+			     const struct zc_sb_ext *const ext,
+			     const struct zc_sb_pin *const pin)
+{
+	uint16_t flags;
+	char *name;
+	int ret;
+
+	name = stack_name(uuid, ext);
+	flags = zc_dm_udev_flags(name);
+	ret = -1;
+
+	if (zc_dm_suspend(name) < 0)
+		goto out;
+
+	if (copy_start(uuid, ext, pin) < 0) {
+		zc_dm_resume(name, flags);
+		goto out;
+	}
+
+	if (overlay_load(name, uuid, ext) < 0) {
+		zc_dm_resume(name, flags);
+		copy_stop(uuid);
+		goto out;
+	}
+
+	ret = zc_dm_resume(name, flags);
+
+out:
+	free(name);
+	return ret;
+}
+
+/*
+ * Advances the copy of the set's in-flight pin (if any).  Starts the copy if
+ * it isn't running (e.g. the set was restarted); once both copies are in sync,
+ * records the pin's new state and then remaps it.  Returns 1 if a copy is
+ * running, 0 if there is nothing to do, -1 on error.
+ */
+int zc_set_pins_update(const char *const uuid)
+{
+	uint64_t done, total;
+	struct zc_registry reg;
+	struct zc_sb_pin *pin;
+	struct zc_sb_ext ext;
+	struct dm_info info;
+	char *copy;
+	int fd, i, ret;
+
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	copy = zc_asprintf(COPY_PREFIX "%s", uuid);
+	fd = -1;
+	ret = 0;
+
+	if (!reg.assembled || reg.members[ZC_SB_TYPE_METADATA] == 0)
+		goto out;
+
+	ret = -1;
+
+	if ((fd = zc_member_ext_open(reg.members[ZC_SB_TYPE_METADATA],
+				     &ext)) < 0)
+		goto out;
+
+	if ((i = zc_pin_in_flight(&ext)) < 0) {
+		ret = 0;
+		goto out;
+	}
+
+	pin = ext.pins + i;
+
+	if (zc_dm_info(copy, &info) < 0)
+		goto out;
+
+	if (!info.exists) {
+		if (copy_start_online(uuid, &ext, pin) == 0)
+			ret = 1;
+		goto out;
+	}
+
+	if ((ret = zc_dm_raid_sync(copy, &done, &total)) <= 0) {
+		if (ret == 0)
+			ret = 1;
+		goto out;
+	}
+
+	/* Both copies are identical; record the switch before making it */
+	if (pin->state == ZC_PIN_PENDING) {
+		pin->state = ZC_PIN_RESIDENT;
+		zc_err(LOG_NOTICE, "%s: extent at sector %" PRIu64 " pinned\n",
+		       uuid, pin->start);
+	}
+	else {
+		zc_err(LOG_NOTICE, "%s: extent at sector %" PRIu64
+		       " unpinned\n", uuid, pin->start);
+		zc_pin_delete(&ext, i);
+	}
+
+	ret = zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA], &ext);
+	fd = -1;
+
+	if (ret < 0 || zc_set_overlay_reload(uuid, &ext) < 0 ||
+						copy_stop(uuid) < 0)
+		ret = -1;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(copy);
+	zc_registry_close(&reg);
+	return ret;
+}
+
+/*
+ * Pins an origin range of a running set; the copy to the pin area runs in the
+ * background.  Only one pin can be copied at a time.
+ */
+int zc_set_pin(const char *const uuid, const uint64_t start,
+	       const uint64_t len)
+{
+	struct zc_cache_status status;
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	uint64_t o_size;
+	char *cached;
+	int fd;
+
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	cached = zc_asprintf(ZC_CACHED_PREFIX "%s", uuid);
+	fd = -1;
+
+	if (!reg.assembled) {
+		zc_err(LOG_ERR, "%s: set is not running\n", uuid);
+		goto error;
+	}
+
+	if ((fd = zc_member_ext_open(reg.members[ZC_SB_TYPE_METADATA],
+				     &ext)) < 0)
+		goto error;
+
+	if (zc_pin_in_flight(&ext) >= 0) {
+		zc_err(LOG_ERR, "%s: another extent is being copied\n", uuid);
+		goto error;
+	}
+
+	/* The block size and origin size, from the cache target */
+	if (zc_dm_cache_status(cached, &status) < 0)
+		goto error;
+
+	free(cached);
+	cached = zc_asprintf("/dev/mapper/" ZC_CACHED_PREFIX "%s", uuid);
+
+	if (get_dev_size(cached, &o_size) < 0)
+		goto error;
+
+	if (zc_pin_add(NULL, &ext, start, len, o_size / 512,
+		       status.block_size) < 0)
+		goto error;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0) {
+		fd = -1;
+		goto error;
+	}
+
+	free(cached);
+	zc_registry_close(&reg);
+
+	return zc_set_pins_update(uuid) < 0 ? -1 : 0;
+
+error:
+	if (fd >= 0)
+		close(fd);
+	free(cached);
+	zc_registry_close(&reg);
+	return -1;
+}
+
+/*
+ * Unpins an extent.  A resident pin is copied back to the origin in the
+ * background; a pin that hasn't been completely copied is simply dropped.
+ */
+int zc_set_unpin(const char *const uuid, const uint64_t start,
+		 const uint64_t len)
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int fd, i, in_flight;
+
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	fd = -1;
+
+	if (!reg.assembled) {
+		zc_err(LOG_ERR, "%s: set is not running\n", uuid);
+		goto error;
+	}
+
+	if ((fd = zc_member_ext_open(reg.members[ZC_SB_TYPE_METADATA],
+				     &ext)) < 0)
+		goto error;
+
+	if ((i = zc_pin_find(&ext, start, len)) < 0) {
+		zc_err(LOG_ERR, "%s: no such pinned extent\n", uuid);
+		goto error;
+	}
+
+	in_flight = zc_pin_in_flight(&ext);
+
+	if (ext.pins[i].state == ZC_PIN_UNPINNING ||
+				(in_flight >= 0 && in_flight != i)) {
+		zc_err(LOG_ERR, "%s: another copy is in progress\n", uuid);
+		goto error;
+	}
+
+	/* The origin copy of a PENDING pin is still authoritative */
+	if (ext.pins[i].state == ZC_PIN_PENDING)
+		zc_pin_delete(&ext, i);
+	else
+		ext.pins[i].state = ZC_PIN_UNPINNING;
+
+	i = zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA], &ext);
+	fd = -1;
+
+	if (i < 0 || zc_set_overlay_reload(uuid, &ext) < 0 ||
+						copy_stop(uuid) < 0)
+		goto error;
+
+	zc_registry_close(&reg);
+
+	return zc_set_pins_update(uuid) < 0 ? -1 : 0;
+
+error:
+	if (fd >= 0)
+		close(fd);
+	zc_registry_close(&reg);
+	return -1;
+}
+
+/* Loads a new (inactive) single-target table into a device */
+static int table_load(const char *const name, const uint64_t sectors,
+		      const char *const type, const char *const params)
+{
+	struct dm_task *task;
+	int ret;
+
+	ret = 0;
+
+	if (		!(task = dm_task_create(DM_DEVICE_RELOAD))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_add_target(task, 0, sectors, type, params) ||
+
+			!dm_task_run(task)				) {
+
+		zc_err(LOG_ERR, "%s: failed to load new table\n", name);
+		ret = -1;
+	}
+
+	if (task != NULL)
+		dm_task_destroy(task);
+	return ret;
+}
+
+/* Moves one of the (unused) component devices of a combined cache device */
+static int component_move(const char *const dev, const char *const type,
+			  const uint64_t offset, const uint64_t size,
+			  const char *const uuid)
+{
+	char *name, *params;
+	int ret;
+
+	name = zc_asprintf("zodcache-%s-%s", type, uuid);
+	params = zc_asprintf("%s %" PRIu64, dev, offset / 512);
+
+	ret = (table_load(name, size / 512, "linear", params) < 0 ||
+			zc_dm_suspend(name) < 0 ||
+			zc_dm_resume(name, ZC_COMPONENT_UDEV_FLAGS) < 0) ?
+								-1 : 0;
+	free(params);
+	free(name);
+	return ret;
+}
+
+/* Makes dm-cache format new metadata when the cache target is next loaded */
+static int metadata_wipe(const char *const md_dev)
+{
+	static const char zeroes[4096];
+	int fd;
+
+	if ((fd = open(md_dev, O_WRONLY | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", md_dev);
+		return -1;
+	}
+
+	if (pwrite(fd, zeroes, sizeof zeroes, 0) != sizeof zeroes ||
+			fsync(fd) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", md_dev);
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", md_dev);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Uncached zones & pins must stay aligned to the cache block size */
+static int reblock_check(const char *const uuid,
+			 const struct zc_sb_ext *const ext,
+			 const uint64_t block_sectors)
+{
+	uint64_t i;
+
+	for (i = 0; i < ext->zones_count && i < ZC_SB_EXT_MAX_ZONES; ++i) {
+		if (ext->zones[i].start % block_sectors != 0 ||
+				ext->zones[i].len % block_sectors != 0) {
+			zc_err(LOG_ERR, "%s: uncached zone at sector %" PRIu64
+			       " not aligned to new block size\n", uuid,
+			       ext->zones[i].start);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < ext->pins_count && i < ZC_SB_EXT_MAX_PINS; ++i) {
+		if (ext->pins[i].start % block_sectors != 0 ||
+				ext->pins[i].len % block_sectors != 0) {
+			zc_err(LOG_ERR, "%s: pinned extent at sector %" PRIu64
+			       " not aligned to new block size\n", uuid,
+			       ext->pins[i].start);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Changes the cache block size of a running set by reformatting its cache,
+ * whose contents are discarded.  The areas of a combined cache device are
+ * resized as mkzc would have sized them (see zc_plan()).  The cache must be
+ * clean; that is checked with the cache target suspended, after which the
+ * target maps straight to the origin until the new cache table is loaded (in
+ * writethrough mode).  The metadata is wiped before any superblock changes,
+ * and the cache member's superblock is written first; if the others aren't
+ * all written, they are brought into line when the set is next assembled
+ * (see reblock_repair()).  Returns the new layout in plan; with dry_run,
+ * only checks that the change is possible.
+ */
+int zc_set_reblock(const char *const uuid, const uint64_t block_size,
+		   const _Bool dry_run, struct zc_plan *const plan)
+{
+	char *target, *params, *o_dev, *c_dev, *md_dev, *member;
+	struct zc_sb_v0 sbs[ZC_SB_TYPE_METADATA + 1], *c_sb;
+	int fds[ZC_SB_TYPE_METADATA + 1], md_fd, ret;
+	struct zc_cache_status status;
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	uint64_t o_size;
+	uint16_t flags;
+	unsigned i, t;
+
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	o_dev = zc_asprintf("/dev/mapper/zodcache-origin-%s", uuid);
+	c_dev = zc_asprintf("/dev/mapper/zodcache-cache-%s", uuid);
+	md_dev = zc_asprintf("/dev/mapper/zodcache-metadata-%s", uuid);
+	target = zc_cache_target(uuid);
+	flags = zc_dm_udev_flags(target);
+	params = member = NULL;
+	c_sb = sbs + ZC_SB_TYPE_CACHE;
+	ret = -1;
+
+	for (t = 0; t <= ZC_SB_TYPE_METADATA; ++t)
+		fds[t] = -1;
+
+	if (!reg.assembled) {
+		zc_err(LOG_ERR, "%s: set is not running\n", uuid);
+		goto out;
+	}
+
+	/* A combined cache device is both the cache and metadata member */
+	for (t = 0; t <= ZC_SB_TYPE_METADATA; ++t) {
+
+		if (t == ZC_SB_TYPE_METADATA &&
+				c_sb->type == ZC_SB_TYPE_COMBINED)
+			break;
+
+		free(member);
+		member = zc_asprintf("/dev/block/%u:%u", major(reg.members[t]),
+				     minor(reg.members[t]));
+
+		if ((fds[t] = open(member, dry_run ? O_RDONLY | O_CLOEXEC :
+						O_RDWR | O_CLOEXEC)) < 0) {
+			zc_err(LOG_ERR, "%s: %m\n", member);
+			goto out;
+		}
+
+		if (zc_sb_v0_pread(NULL, fds[t], sbs + t) < 0)
+			goto out;
+	}
+
+	md_fd = fds[ZC_SB_TYPE_METADATA] >= 0 ? fds[ZC_SB_TYPE_METADATA] :
+						fds[ZC_SB_TYPE_CACHE];
+
+	if (zc_sb_ext_pread(NULL, md_fd, &ext) < 0 ||
+			reblock_check(uuid, &ext, block_size / 512) < 0)
+		goto out;
+
+	/* mkzc put the cache area at the alignment */
+	memset(plan, 0, sizeof *plan);
+	plan->origin_size = sbs[ZC_SB_TYPE_ORIGIN].o_size;
+	plan->block_size = block_size;
+	plan->alignment = c_sb->c_offset;
+	plan->md_version = 1;
+	plan->hint_size = ZC_PLAN_SMQ_HINT;
+
+	if (c_sb->type == ZC_SB_TYPE_COMBINED) {
+		plan->cache_size = c_sb->c_size + c_sb->md_size;
+	}
+	else {
+		plan->cache_size = c_sb->c_size;
+		plan->md_avail = sbs[ZC_SB_TYPE_METADATA].md_size;
+	}
+
+	if (zc_plan(NULL, plan) < 0)
+		goto out;
+
+	if (dry_run) {
+		ret = 0;
+		goto out;
+	}
+
+	free(params);
+	params = zc_asprintf("/dev/mapper/%s", target);
+
+	if (get_dev_size(params, &o_size) < 0)
+		goto out;
+
+	free(params);
+	params = zc_asprintf("%s 0", o_dev);
+
+	if (zc_dm_suspend(target) < 0)
+		goto out;
+
+	if (zc_dm_cache_status(target, &status) < 0) {
+		zc_dm_resume(target, flags);
+		goto out;
+	}
+
+	if (status.dirty != 0) {
+		zc_err(LOG_ERR, "%s: cache has %" PRIu64 " dirty blocks\n",
+		       uuid, status.dirty);
+		zc_dm_resume(target, flags);
+		goto out;
+	}
+
+	if (table_load(target, o_size / 512, "linear", params) < 0) {
+		zc_dm_resume(target, flags);
+		goto out;
+	}
+
+	if (zc_dm_resume(target, flags) < 0)
+		goto uncached;
+
+	/* In case the old layout is used after a crash (the cache was clean) */
+	if (metadata_wipe(md_dev) < 0)
+		goto uncached;
+
+	/* member is the combined cache device's path */
+	if (c_sb->type == ZC_SB_TYPE_COMBINED) {
+
+		c_sb->c_size = plan->c_size;
+		c_sb->md_offset = c_sb->c_offset + plan->c_size;
+		c_sb->md_size = plan->md_size;
+
+		if (component_move(member, "cache", c_sb->c_offset,
+				   c_sb->c_size, uuid) < 0 ||
+				component_move(member, "metadata",
+					       c_sb->md_offset, c_sb->md_size,
+					       uuid) < 0 ||
+				metadata_wipe(md_dev) < 0)
+			goto uncached;
+	}
+
+	/* The cache member's superblock commits the change; see assemble() */
+	for (i = 0; i < ZC_SB_TYPE_METADATA + 1; ++i) {
+
+		t = reblock_order[i];
+		if (fds[t] < 0)
+			continue;
+
+		sbs[t].block_size = block_size;
+		sbs[t].cksum = zc_sb_v0_cksum(sbs + t);
+
+		if (zc_sb_v0_pwrite(NULL, fds[t], sbs + t) < 0 ||
+				fsync(fds[t]) < 0) {
+			zc_err(LOG_ERR, "%s: failed to update %s superblock: "
+			       "%m\n", uuid,
+			       zc_dev_type_format(sbs[t].type, 0));
+			goto uncached;
+		}
+	}
+
+	free(params);
+	params = zc_asprintf("%s %s %s %" PRIu64 " 1 writethrough default 0",
+			     md_dev, c_dev, o_dev, block_size / 512);
+
+	if (table_load(target, o_size / 512, "cache", params) < 0 ||
+			zc_dm_suspend(target) < 0 ||
+			zc_dm_resume(target, flags) < 0)
+		goto uncached;
+
+	zc_err(LOG_NOTICE, "%s: reformatted cache with %" PRIu64 " x %" PRIu64
+	       "-sector blocks\n", uuid, plan->nr_blocks, block_size / 512);
+
+	zc_tune_apply(uuid, &ext, block_size, reg.members[ZC_SB_TYPE_ORIGIN],
+		      reg.members[ZC_SB_TYPE_CACHE]);
+
+	ret = 0;
+	goto out;
+
+uncached:
+	zc_err(LOG_CRIT, "%s: cache not reloaded; set runs uncached until it "
+	       "is restarted\n", uuid);
+
+out:
+	for (t = 0; t <= ZC_SB_TYPE_METADATA; ++t) {
+		if (fds[t] >= 0)
+			close(fds[t]);
+	}
+
+	free(member);
+	free(params);
+	free(target);
+	free(md_dev);
+	free(c_dev);
+	free(o_dev);
+	zc_registry_close(&reg);
+	return ret;
+}
+
+/*
+ * Creates a running set's dm-crypt device, e.g. once its keyring key has been
+ * loaded.  Does nothing if the device already exists.
+ */
+int zc_set_crypt_open(const char *const uuid)
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	struct dm_info info;
+	uint64_t size;
+	char *name;
+	int fd, ret;
+
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	ret = -1;
+	name = zc_asprintf(ZC_CRYPT_PREFIX "%s", uuid);
+
+	if (!reg.assembled) {
+		zc_err(LOG_ERR, "%s: set is not running\n", uuid);
+		goto out;
+	}
+
+	if ((fd = zc_member_ext_open(reg.members[ZC_SB_TYPE_METADATA],
+				     &ext)) < 0)
+		goto out;
+
+	close(fd);
+
+	if (ext.crypt_cipher[0] == 0) {
+		zc_err(LOG_ERR, "%s: set is not encrypted\n", uuid);
+		goto out;
+	}
+
+	if (zc_dm_info(name, &info) < 0)
+		goto out;
+
+	if (info.exists) {
+		ret = 0;
+		goto out;
+	}
+
+	free(name);
+	name = zc_asprintf("/dev/mapper/zodcache-device-%s", uuid);
+
+	if (get_dev_size(name, &size) < 0)
+		goto out;
+
+	ret = crypt_create(uuid, &ext, size);
+
+out:
+	free(name);
+	zc_registry_close(&reg);
+	return ret;
+}
+
+/* Removes a running set's dm-crypt device (if it isn't in use) */
+int zc_set_crypt_close(const char *const uuid)
+{
+	struct zc_registry reg;
+	int ret;
+
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	ret = crypt_remove(uuid);
+
+	zc_registry_close(&reg);
+	return ret;
+}
+
+/*
+ * Returns 1 if this device has already been registered (e.g. this is a change
+ * event for a device that is already in use), -1 if a different device has
+ * been registered as the same member of the set.
+ */
+static int is_registered(const struct zc_registry *const reg,
+			 const struct zc_sb_v0 *const sb, const dev_t devno,
+			 const char *const dev)
+{
+	uint64_t type;
+
+	type = (sb->type == ZC_SB_TYPE_COMBINED) ? ZC_SB_TYPE_CACHE : sb->type;
+
+	if (reg->members[type] == 0)
+		return 0;
+
+	if (reg->members[type] == devno)
+		return 1;
+
+	zc_err(LOG_ERR, "%s: %s device for %s already registered (%u:%u)\n",
+	       dev, zc_dev_type_format(sb->type, 0), reg->uuid,
+	       major(reg->members[type]), minor(reg->members[type]));
+	return -1;
+}
+
+static int wait_for_dev(const char *const dev)
+{
+	int fd;
+
+	while (1) {
+
+		fd = open(dev, O_RDONLY | O_EXCL | O_CLOEXEC);
+		if (fd >= 0)
+			break;
+
+		if (errno != EBUSY) {
+			zc_err(LOG_ERR, "%s: %m\n", dev);
+			return -1;
+		}
+
+		usleep(100000);
+	}
+
+	if (close(fd) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads and validates a device's superblock.  Returns 1 if the device is a
+ * valid zodcache component device, 0 if it isn't.  If quiet is set, devices
+ * that don't have a zodcache superblock at all are silently ignored, and
+ * invalid superblocks are only worth a notice.
+ */
+int zc_member_probe(const char *const dev, struct zc_sb_v0 *const sb,
+		    dev_t *const devno, const _Bool quiet)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(dev, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		close(fd);
+		return -1;
+	}
+
+	if (!S_ISBLK(st.st_mode)) {
+		zc_err(LOG_ERR, "%s: not a block device\n", dev);
+		close(fd);
+		return -1;
+	}
+
+	if (zc_sb_v0_read(fd, sb) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", dev);
+		return -1;
+	}
+
+	if (quiet && (sb->magic != ZC_SB_MAGIC))
+		return 0;
+
+	if (!zc_sb_v0_is_valid(sb)) {
+		zc_err(quiet ? LOG_NOTICE : LOG_ERR,
+		       "%s: invalid superblock (zcdump %s for more info)\n",
+		       dev, dev);
+		return 0;
+	}
+
+	if (sb->dev_major != major(st.st_rdev)) {
+		zc_err(quiet ? LOG_NOTICE : LOG_ERR,
+		       "%s: device major number mismatch "
+		       "(zcdump %s for more info)\n", dev, dev);
+		return 0;
+	}
+
+	*devno = st.st_rdev;
+	return 1;
+}
+
+static int teardown(const char *uuid, _Bool may_mark_clean);
+
+/*
+ * Asks udev to replay the arrival of the registered members of a set that has
+ * been torn down (except the one given), since they lost their component
+ * devices with it; zcstart (or zodcached) then starts them again.
+ */
+static void member_retrigger(const struct zc_registry *const reg,
+			     const dev_t except)
+{
+	unsigned i;
+	char *path;
+	int fd;
+
+	for (i = 0; i < ZC_SB_TYPE_METADATA + 1; ++i) {
+
+		/* A combined cache device is registered twice */
+		if (reg->members[i] == 0 || reg->members[i] == except ||
+				(i == ZC_SB_TYPE_METADATA && reg->members[i] ==
+					reg->members[ZC_SB_TYPE_CACHE]))
+			continue;
+
+		path = zc_asprintf("/sys/dev/block/%u:%u/uevent",
+				   major(reg->members[i]),
+				   minor(reg->members[i]));
+
+		fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (fd < 0 || write(fd, "change", 6) != 6)
+			zc_err(LOG_WARNING, "%s: %m\n", path);
+		if (fd >= 0)
+			close(fd);
+
+		free(path);
+	}
+}
+
+/*
+ * Creates a member's component device(s) and assembles the set if it is now
+ * complete.  Returns 1 if the set was assembled by this call.
+ */
+int zc_member_start(const char *const dev, const struct zc_sb_v0 *const sb,
+		    const dev_t devno)
+{
+	char uuid[ZC_UUID_BUF_SIZE];
+	struct zc_registry reg;
+	int ret;
+
+	zc_sb_uuid_format(sb, uuid);
+
+	/* Serializes everything that touches this set */
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	/* A member has left the set, which couldn't be torn down at the time */
+	if (reg.degraded) {
+
+		if (teardown(uuid, 0) < 0) {
+			zc_err(LOG_ERR, "%s: degraded set still in use; "
+			       "stop it to restart it\n", uuid);
+			zc_registry_close(&reg);
+			return -1;
+		}
+
+		zc_err(LOG_NOTICE, "%s: degraded set torn down\n", uuid);
+
+		if (zc_registry_remove(&reg) < 0) {
+			zc_registry_close(&reg);
+			return -1;
+		}
+
+		member_retrigger(&reg, devno);
+		memset(reg.members, 0, sizeof reg.members);
+		reg.degraded = 0;
+	}
+
+	if ((ret = is_registered(&reg, sb, devno, dev)) < 0) {
+		zc_registry_close(&reg);
+		return -1;
+	}
+
+	/* An earlier assembly of a complete set may have failed; retry it */
+	if (ret > 0)
+		goto try_assemble;
+
+	ret = -1;
+
+	if (wait_for_dev(dev) < 0 || member_thin(dev, &reg.thin) < 0)
+		goto out;
+
+	switch (sb->type) {
+
+		case ZC_SB_TYPE_ORIGIN:
+
+			if (do_origin(dev, sb, uuid) < 0)
+				goto out;
+			break;
+
+		case ZC_SB_TYPE_CACHE:
+
+			if (do_component(dev, "cache", sb->c_offset,
+					 sb->c_size, uuid) < 0)
+				goto out;
+			break;
+
+		case ZC_SB_TYPE_METADATA:
+
+			if (do_component(dev, "metadata", sb->md_offset,
+					 sb->md_size, uuid) < 0)
+				goto out;
+			break;
+
+		case ZC_SB_TYPE_COMBINED:
+
+			if (do_component(dev, "cache", sb->c_offset,
+					 sb->c_size, uuid) < 0)
+				goto out;
+			if (do_component(dev, "metadata", sb->md_offset,
+					 sb->md_size, uuid) < 0)
+				goto out;
+			reg.members[ZC_SB_TYPE_METADATA] = devno;
+			break;
+
+		default:
+
+			/* Should never get here */
+			abort();
+	}
+
+	reg.members[sb->type == ZC_SB_TYPE_COMBINED ? ZC_SB_TYPE_CACHE :
+							sb->type] = devno;
+
+	if (zc_registry_commit(&reg) < 0)
+		goto out;
+
+try_assemble:
+	ret = 0;
+
+	if (zc_registry_is_complete(&reg) && !reg.assembled) {
+
+		if (assemble(sb, uuid, &reg) < 0) {
+			ret = -1;
+			goto out;
+		}
+
+		reg.assembled = 1;
+		ret = (zc_registry_commit(&reg) < 0) ? -1 : 1;
+	}
+
+out:
+	zc_registry_close(&reg);
+	return ret;
+}
+
+/* Records a clean shutdown in the metadata device's superblock extension */
+static int mark_clean(const char *const uuid, const dev_t devno)
+{
+	struct zc_sb_ext ext;
+	int fd;
+
+	if ((fd = zc_member_ext_open(devno, &ext)) < 0)
+		return -1;
+
+	ext.flags |= ZC_SB_EXT_CLEAN;
+	++ext.generation;
+
+	if (zc_member_ext_commit(fd, devno, &ext) < 0)
+		return -1;
+
+	zc_err(LOG_INFO, "%s: stopped cleanly (generation %" PRIu64 ")\n",
+	       uuid, ext.generation);
+	return 0;
+}
+
+static int teardown(const char *const uuid, const _Bool may_mark_clean)
+{
+	struct zc_cache_status status;
+	struct dm_info info, cached_info;
+	char *name, *cached;
+	uint16_t udev_flags;
+	_Bool clean;
+	dev_t devno;
+	unsigned i;
+	int ret;
+
+	ret = 0;
+	clean = 0;
+	devno = 0;
+	cached = NULL;
+
+	name = zc_asprintf("zodcache-metadata-%s", uuid);
+	if (zc_dm_info(name, &info) < 0 ||
+		(info.exists && zc_dm_component_devno(name, &devno) < 0)) {
+		free(name);
+		return -1;
+	}
+	free(name);
+
+	if (crypt_remove(uuid) < 0)
+		return -1;
+
+	name = zc_asprintf("zodcache-device-%s", uuid);
+
+	if (zc_dm_info(name, &info) < 0)
+		goto error;
+
+	if (info.exists && info.open_count > 0) {
+		zc_err(LOG_ERR, "%s: device in use\n", name);
+		goto error;
+	}
+
+	udev_flags = ZC_DEV_UDEV_FLAGS;
+
+	/* A dm-era target has a composite device or the cache target under it */
+	cached = zc_asprintf(ZC_TRACKED_PREFIX "%s", uuid);
+
+	if (zc_dm_info(cached, &cached_info) < 0)
+		goto error;
+
+	if (cached_info.exists) {
+
+		if (info.exists && zc_dm_remove(name, udev_flags) < 0)
+			goto error;
+
+		free(name);
+		name = cached;
+		info = cached_info;
+		udev_flags = ZC_COMPONENT_UDEV_FLAGS;
+	}
+	else {
+		free(cached);
+	}
+
+	if (remove_hidden("erameta", uuid) < 0) {
+		cached = NULL;
+		goto error;
+	}
+
+	/* A composite device has the cache target under it */
+	cached = zc_asprintf(ZC_CACHED_PREFIX "%s", uuid);
+
+	if (zc_dm_info(cached, &cached_info) < 0)
+		goto error;
+
+	if (cached_info.exists) {
+
+		if (info.exists && zc_dm_remove(name, udev_flags) < 0)
+			goto error;
+
+		/* An interrupted copy is restarted when the set is started */
+		if (copy_stop(uuid) < 0 || remove_hidden("pin", uuid) < 0)
+			goto error;
+
+		free(name);
+		name = cached;
+		cached = NULL;
+		info = cached_info;
+		udev_flags = ZC_COMPONENT_UDEV_FLAGS;
+	}
+
+	if (info.exists) {
+
+		/* Commits the cache metadata and policy hints */
+		if (zc_dm_suspend(name) < 0)
+			goto error;
+
+		if (zc_dm_cache_status(name, &status) < 0) {
+			zc_dm_resume(name, udev_flags);
+			goto error;
+		}
+
+		if (status.failed || status.read_only || status.needs_check) {
+			zc_err(LOG_WARNING, "%s: cache is degraded; "
+			       "metadata will be checked at next start\n",
+			       name);
+		}
+		else {
+			clean = may_mark_clean;
+		}
+
+		if (zc_dm_remove(name, udev_flags) < 0) {
+			zc_dm_resume(name, udev_flags);
+			goto error;
+		}
+	}
+
+	free(cached);
+	free(name);
+
+	for (i = 0; i < sizeof component_types / sizeof component_types[0];
+									++i) {
+
+		name = zc_asprintf("zodcache-%s-%s", component_types[i], uuid);
+
+		if (zc_dm_info(name, &info) < 0)
+			goto error;
+
+		if (info.exists &&
+			    zc_dm_remove(name, ZC_COMPONENT_UDEV_FLAGS) < 0)
+			ret = -1;
+
+		free(name);
+	}
+
+	/* Only mark the set clean once it has been completely torn down */
+	if (clean && ret == 0)
+		ret = mark_clean(uuid, devno);
+
+	return ret;
+
+error:
+	free(cached);
+	free(name);
+	return -1;
+}
+
+/*
+ * Tears down an assembled (or partially assembled) set.  If mark_clean is set
+ * and the cache is healthy, the set is marked as cleanly stopped.
+ */
+int zc_set_stop(const char *const uuid, const _Bool mark_clean)
+{
+	struct zc_registry reg;
+	int ret;
+
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	ret = teardown(uuid, mark_clean);
+
+	/* The members have to be rediscovered by zcstart */
+	if (ret == 0)
+		ret = zc_registry_remove(&reg);
+
+	zc_registry_close(&reg);
+
+	return ret;
+}
+
+/*
+ * Handles the disappearance of a member device.  An incomplete set just loses
+ * the member's component device(s); an assembled set is torn down.  If that
+ * fails (e.g. the set is still mounted), the set is recorded as degraded, and
+ * the teardown is retried when a member next appears (see zc_member_start).
+ */
+int zc_member_gone(const char *const uuid, const dev_t devno)
+{
+	struct zc_registry reg;
+	struct dm_info info;
+	unsigned i;
+	char *name;
+	int ret;
+
+	if (zc_registry_open(&reg, uuid) < 0)
+		return -1;
+
+	if (reg.assembled || reg.degraded) {
+
+		zc_err(LOG_CRIT, "%s: member device %u:%u removed from "
+		       "%s set\n", uuid, major(devno), minor(devno),
+		       reg.assembled ? "assembled" : "degraded");
+
+		if (teardown(uuid, 0) == 0) {
+			member_retrigger(&reg, devno);
+			ret = zc_registry_remove(&reg);
+			zc_registry_close(&reg);
+			return ret;
+		}
+
+		zc_err(LOG_ERR, "%s: failed to tear down set; will retry when "
+		       "a member appears\n", uuid);
+
+		for (i = 0; i < ZC_SB_TYPE_METADATA + 1; ++i) {
+			if (reg.members[i] == devno)
+				reg.members[i] = 0;
+		}
+
+		reg.assembled = 0;
+		reg.degraded = 1;
+		zc_registry_commit(&reg);
+		zc_registry_close(&reg);
+		return -1;
+	}
+
+	for (ret = 0, i = 0; i < ZC_SB_TYPE_METADATA + 1; ++i) {
+
+		if (reg.members[i] != devno)
+			continue;
+
+		name = zc_asprintf("zodcache-%s-%s", component_types[i], uuid);
+
+		if (zc_dm_info(name, &info) < 0 || (info.exists &&
+			    zc_dm_remove(name, ZC_COMPONENT_UDEV_FLAGS) < 0))
+			ret = -1;
+		else
+			reg.members[i] = 0;
+
+		free(name);
+	}
+
+	if (zc_registry_commit(&reg) < 0)
+		ret = -1;
+
+	zc_registry_close(&reg);
+	return ret;
+}
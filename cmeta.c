@@ -0,0 +1,512 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * dm-cache and dm-era metadata snapshots.  The kernel doesn't support metadata
+ * snapshots for dm-cache (there is no reserve_metadata_snap message, as there
+ * is for thin pools), and cache_dump can't open the metadata device while it
+ * is in use, so the metadata is copied to a file on tmpfs, and cache_dump is
+ * run on the copy.  dm-era does support them, so era_invalidate reads a
+ * snapshot in place.
+ *
+ * The cache is only suspended for long enough to commit its metadata (and
+ * policy hints); the copy is made while it runs.  The metadata is copy-on-
+ * write, and a transaction never reuses blocks of the last committed one, so
+ * the copy is consistent as long as the superblock hasn't changed by the time
+ * it is finished.  A busy cache may commit during every copy, so after a few
+ * tries the copy is made with the cache suspended, as a last resort.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+#define CMETA_BUF_SIZE		1048576
+#define CMETA_SB_SIZE		4096	/* the superblock's metadata block */
+#define CMETA_LIVE_TRIES	4
+
+/*
+ * O_DIRECT, so that nothing stale comes from the page cache.  Returns 1 if
+ * the superblock changed during the copy (see above); with the cache
+ * suspended, it can't have.
+ */
+static int cmeta_copy(const char *const src, const int out)
+{
+	uint64_t size, done;
+	ssize_t count;
+	void *buf, *sb;
+	int in, ret;
+
+	if ((in = open(src, O_RDONLY | O_DIRECT | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", src);
+		return -1;
+	}
+
+	if (ioctl(in, BLKGETSIZE64, &size) < 0 ||
+			posix_memalign(&buf, 4096, CMETA_BUF_SIZE) != 0) {
+		zc_err(LOG_ERR, "%s: %m\n", src);
+		close(in);
+		return -1;
+	}
+
+	if (posix_memalign(&sb, 4096, CMETA_SB_SIZE) != 0) {
+		zc_err(LOG_ERR, "%s: %m\n", src);
+		free(buf);
+		close(in);
+		return -1;
+	}
+
+	for (done = 0; done < size; done += count) {
+
+		count = read(in, buf, CMETA_BUF_SIZE);
+		if (count < (done == 0 ? CMETA_SB_SIZE : 1)) {
+			zc_err(LOG_ERR, "%s: read failed: %m\n", src);
+			break;
+		}
+
+		if (done == 0)
+			memcpy(sb, buf, CMETA_SB_SIZE);
+
+		if (write(out, buf, count) != count) {
+			zc_err(LOG_ERR, "%s: snapshot write failed: %m\n", src);
+			break;
+		}
+	}
+
+	ret = done < size ? -1 : 0;
+
+	if (ret == 0) {
+		if (pread(in, buf, CMETA_SB_SIZE, 0) != CMETA_SB_SIZE) {
+			zc_err(LOG_ERR, "%s: read failed: %m\n", src);
+			ret = -1;
+		}
+		else if (memcmp(buf, sb, CMETA_SB_SIZE) != 0) {
+			ret = 1;
+		}
+	}
+
+	free(sb);
+	free(buf);
+	close(in);
+	return ret;
+}
+
+/* Empties the snapshot file for another try */
+static int cmeta_truncate(const char *const tmp, const int fd)
+{
+	if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Copies the set's cache metadata to a temporary file (see above).  Returns
+ * the file name, which the caller must unlink & free.
+ */
+char *zc_cmeta_snapshot(const char *const uuid)
+{
+	char *target, *md_dev, *tmp;
+	uint16_t flags;
+	int fd, ret, i;
+
+	target = zc_cache_target(uuid);
+	md_dev = zc_asprintf("/dev/mapper/zodcache-metadata-%s", uuid);
+	tmp = zc_asprintf(ZC_RUN_DIR "/cmeta-%s-XXXXXX", uuid);
+
+	if ((fd = mkostemp(tmp, O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", tmp);
+		free(tmp);
+		tmp = NULL;
+		goto out;
+	}
+
+	flags = zc_dm_udev_flags(target);
+
+	/* Suspending the cache commits its metadata and policy hints */
+	if (zc_dm_suspend(target) < 0) {
+		ret = -1;
+	}
+	else {
+		ret = zc_dm_resume(target, flags);
+		for (i = 0; ret == 0 && i < CMETA_LIVE_TRIES; ++i) {
+			if (i > 0 && cmeta_truncate(tmp, fd) < 0)
+				ret = -1;
+			else if ((ret = cmeta_copy(md_dev, fd)) == 1)
+				ret = 0;	/* changed; try again */
+			else
+				break;
+		}
+	}
+
+	/* Still committing; hold it still for the copy after all */
+	if (ret == 0 && i == CMETA_LIVE_TRIES) {
+
+		zc_err(LOG_NOTICE, "%s: cache metadata keeps changing; "
+		       "copying it with the cache suspended\n", uuid);
+
+		if (cmeta_truncate(tmp, fd) < 0 || zc_dm_suspend(target) < 0) {
+			ret = -1;
+		}
+		else {
+			ret = cmeta_copy(md_dev, fd);
+			if (zc_dm_resume(target, flags) < 0)
+				ret = -1;
+		}
+	}
+
+	if (close(fd) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", tmp);
+		ret = -1;
+	}
+
+	if (ret < 0) {
+		unlink(tmp);
+		free(tmp);
+		tmp = NULL;
+	}
+
+out:
+	free(md_dev);
+	free(target);
+	return tmp;
+}
+
+/* Returns the value of an XML attribute (e.g. name="value"), or NULL */
+static const char *cmeta_attr(const char *const line, const char *const name)
+{
+	const char *p;
+	size_t len;
+
+	len = strlen(name);
+
+	for (p = line; (p = strstr(p, name)) != NULL; p += len) {
+		if (p > line && p[-1] == ' ' && p[len] == '=' &&
+							p[len + 1] == '"')
+			return p + len + 2;
+	}
+
+	return NULL;
+}
+
+static int cmeta_u64(const char *const line, const char *const name,
+		     uint64_t *const value)
+{
+	const char *p;
+
+	if ((p = cmeta_attr(line, name)) == NULL)
+		return -1;
+
+	return sscanf(p, "%" SCNu64, value) == 1 ? 0 : -1;
+}
+
+/*
+ * Policy hints are base64.  smq's hint is the level of the block's entry in
+ * its queue (higher is hotter), a 32-bit little-endian value; wider hints
+ * (from some other policy) are ignored.
+ */
+static int cmeta_parse_hint(const char *const line, struct zc_cmeta *const cm)
+{
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				     "abcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	uint64_t cblock, bits;
+	unsigned nbits, i;
+	const char *p, *d;
+	uint32_t hint;
+
+	if (cmeta_u64(line, "cache_block", &cblock) < 0 ||
+			(p = cmeta_attr(line, "data")) == NULL)
+		return -1;
+
+	for (bits = 0, nbits = 0; *p != '"' && *p != '='; ++p, nbits += 6) {
+
+		if (*p == 0 || (d = strchr(base64, *p)) == NULL)
+			return -1;
+
+		if (nbits > 32)
+			return 0;
+
+		bits = bits << 6 | (d - base64);
+	}
+
+	bits >>= nbits % 8;
+
+	for (hint = 0, i = 0; i < nbits / 8; ++i)
+		hint |= ((bits >> (nbits / 8 - 1 - i) * 8) & 0xff) << i * 8;
+
+	if (cblock < cm->nr_cache_blocks)
+		cm->hints[cblock] = hint;
+
+	return 0;
+}
+
+static int cmeta_parse_line(const char *const line, struct zc_cmeta *const cm)
+{
+	struct zc_cmeta_mapping *m;
+	const char *p;
+	size_t size;
+
+	if (strstr(line, "<superblock ") != NULL) {
+
+		if (cmeta_u64(line, "block_size", &cm->block_size) < 0 ||
+				cmeta_u64(line, "nr_cache_blocks",
+					  &cm->nr_cache_blocks) < 0)
+			return -1;
+
+		if ((p = cmeta_attr(line, "policy")) != NULL)
+			sscanf(p, "%31[^\"]", cm->policy);
+
+		cm->hints = calloc(cm->nr_cache_blocks, sizeof *cm->hints);
+		if (cm->hints == NULL && cm->nr_cache_blocks != 0) {
+			zc_err(LOG_ERR, "%m\n");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (strstr(line, "<hint ") != NULL && cm->hints != NULL)
+		return cmeta_parse_hint(line, cm);
+
+	if (strstr(line, "<mapping ") == NULL)
+		return 0;
+
+	if (cm->nr_mappings == cm->size) {
+		size = cm->size ? cm->size * 2 : 1024;
+		m = realloc(cm->mappings, size * sizeof *m);
+		if (m == NULL) {
+			zc_err(LOG_ERR, "%m\n");
+			return -1;
+		}
+		cm->mappings = m;
+		cm->size = size;
+	}
+
+	m = cm->mappings + cm->nr_mappings;
+
+	if (cmeta_u64(line, "cache_block", &m->cblock) < 0 ||
+			cmeta_u64(line, "origin_block", &m->oblock) < 0 ||
+			(p = cmeta_attr(line, "dirty")) == NULL)
+		return -1;
+
+	m->dirty = (strncmp(p, "true", 4) == 0);
+	++cm->nr_mappings;
+
+	return 0;
+}
+
+/* Runs a tool with its output on a pipe */
+static FILE *cmeta_spawn(char *const argv[], pid_t *const pid)
+{
+	int pipefd[2];
+	FILE *fp;
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		zc_err(LOG_ERR, "pipe: %m\n");
+		return NULL;
+	}
+
+	if ((*pid = fork()) < 0) {
+		zc_err(LOG_ERR, "fork: %m\n");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return NULL;
+	}
+
+	if (*pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	close(pipefd[1]);
+
+	if ((fp = fdopen(pipefd[0], "r")) == NULL) {
+		zc_err(LOG_ERR, "fdopen: %m\n");
+		close(pipefd[0]);
+	}
+
+	return fp;
+}
+
+/* Reaps a tool started by cmeta_spawn(); ret is the result so far */
+static int cmeta_wait(const char *const tool, const pid_t pid, int ret)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			zc_err(LOG_ERR, "waitpid: %m\n");
+			return -1;
+		}
+	}
+
+	if (ret == 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+		zc_err(LOG_ERR, "%s %s\n", tool, WIFEXITED(status) &&
+		       WEXITSTATUS(status) == 127 ? "not available" : "failed");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* Reads the mappings & hints from a metadata snapshot (or an unused device) */
+int zc_cmeta_read(const char *const path, struct zc_cmeta *const cm)
+{
+	char *line;
+	size_t size;
+	pid_t pid;
+	FILE *fp;
+	int ret;
+
+	memset(cm, 0, sizeof *cm);
+
+	fp = cmeta_spawn((char *[]){ "cache_dump", (char *)path, NULL }, &pid);
+	if (fp == NULL)
+		return -1;
+
+	line = NULL;
+	size = 0;
+	ret = 0;
+
+	while (getline(&line, &size, fp) >= 0) {
+		if (ret == 0 && cmeta_parse_line(line, cm) < 0) {
+			zc_err(LOG_ERR, "cache_dump: unexpected output: %s",
+			       line);
+			ret = -1;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	ret = cmeta_wait("cache_dump", pid, ret);
+
+	if (ret == 0 && cm->block_size == 0) {
+		zc_err(LOG_ERR, "cache_dump: no superblock\n");
+		ret = -1;
+	}
+
+	if (ret < 0)
+		zc_cmeta_free(cm);
+
+	return ret;
+}
+
+void zc_cmeta_free(struct zc_cmeta *const cm)
+{
+	free(cm->hints);
+	free(cm->mappings);
+	memset(cm, 0, sizeof *cm);
+}
+
+/* Parses an era_invalidate line: <range begin=".." end=".."/> or <block ../> */
+static int era_parse_line(const char *const line, const zc_era_cb_t cb,
+			  void *const context)
+{
+	uint64_t begin, end;
+
+	if (strstr(line, "<range ") != NULL) {
+		if (cmeta_u64(line, "begin", &begin) < 0 ||
+				cmeta_u64(line, "end", &end) < 0)
+			return -1;
+	}
+	else if (strstr(line, "<block ") != NULL) {
+		if (cmeta_u64(line, "block", &begin) < 0)
+			return -1;
+		end = begin + 1;
+	}
+	else {
+		return 0;
+	}
+
+	cb(begin, end, context);
+	return 0;
+}
+
+/*
+ * Reports the blocks of a set's dm-era target that were written in (kernel)
+ * era since or later, as ranges of era blocks [begin, end).  Taking the
+ * metadata snapshot also ends the current era.
+ */
+int zc_era_changed(const char *const uuid, const uint64_t since,
+		   const zc_era_cb_t cb, void *const context)
+{
+	char *name, *md_dev, *line, buf[32];
+	size_t size;
+	pid_t pid;
+	FILE *fp;
+	int ret;
+
+	name = zc_asprintf("zodcache-device-%s", uuid);
+	md_dev = zc_asprintf("/dev/mapper/zodcache-erameta-%s", uuid);
+	ret = -1;
+
+	/* A snapshot may have been left behind by an interrupted caller */
+	if (zc_dm_message(name, "take_metadata_snap") < 0 &&
+			(zc_dm_message(name, "drop_metadata_snap") < 0 ||
+			 zc_dm_message(name, "take_metadata_snap") < 0))
+		goto out;
+
+	snprintf(buf, sizeof buf, "%" PRIu64, since);
+
+	fp = cmeta_spawn((char *[]){ "era_invalidate", "--metadata-snapshot",
+				     "--written-since", buf, md_dev, NULL },
+			 &pid);
+	if (fp == NULL)
+		goto drop;
+
+	line = NULL;
+	size = 0;
+	ret = 0;
+
+	while (getline(&line, &size, fp) >= 0) {
+		if (ret == 0 && era_parse_line(line, cb, context) < 0) {
+			zc_err(LOG_ERR, "era_invalidate: unexpected output: "
+			       "%s", line);
+			ret = -1;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	ret = cmeta_wait("era_invalidate", pid, ret);
+
+drop:
+	if (zc_dm_message(name, "drop_metadata_snap") < 0)
+		ret = -1;
+out:
+	free(md_dev);
+	free(name);
+	return ret;
+}
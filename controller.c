@@ -0,0 +1,562 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Adaptive migration_threshold controller (used by zodcached).
+ *
+ * Promotions and writeback compete with foreground I/O for the origin device.
+ * Every ZC_CTL_INTERVAL seconds, the controller measures the origin's p99
+ * latency (from the dm-stats histogram if the set has stats enabled,
+ * otherwise the average latency from /sys/block/dm-N/stat) and adjusts the
+ * cache's migration_threshold: halved when the origin is over its target,
+ * raised by an eighth of the range when there is headroom (or the origin is
+ * idle), and otherwise left alone.
+ *
+ * The controller also enforces the set's cache write (endurance) budget, if
+ * it has one.  Bytes written to the cache component are counted against a
+ * daily budget and periodically saved in the superblock extension.  Once 80%
+ * of the day's budget is used, migration_threshold is capped at one cache
+ * block, which throttles promotions; once it is exhausted, the set can also
+ * fall back to writethrough or passthrough mode (passthrough only once the
+ * cache is clean) until the next (UTC) day.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+/* Upper bound when the extension doesn't specify one (sectors) */
+#define CTL_DEFAULT_MAX		32768		/* 16 MiB */
+
+/* Raise the threshold only when p99 is below this fraction of the target */
+#define CTL_HEADROOM		0.75
+
+/* dm-cache's default, used if the controller has nothing better */
+#define CTL_KERNEL_DEFAULT	2048
+
+#define BUDGET_LOW_PCT		80
+#define BUDGET_SAVE_INTERVAL	600		/* seconds */
+#define SECS_PER_DAY		86400
+
+enum budget_state { BUDGET_OK, BUDGET_LOW, BUDGET_EXHAUSTED };
+
+static const char *const budget_states[] = { "ok", "low", "exhausted" };
+
+struct zc_ctl {
+	char			uuid[ZC_UUID_BUF_SIZE];
+	char			*dev_name;
+	char			*origin_name;
+	char			*cache_name;
+	dev_t			md_devno;
+	uint64_t		block_sectors;
+	uint64_t		cache_mode;		/* from the superblock */
+	uint64_t		mode;			/* current */
+	uint64_t		target;			/* ns; 0 = budget only */
+	uint64_t		min;			/* sectors */
+	uint64_t		max;
+	uint64_t		base_threshold;		/* if no target */
+	uint64_t		threshold;
+	uint64_t		budget_daily;		/* bytes; 0 = no budget */
+	uint64_t		budget_tbw;
+	uint64_t		budget_fallback;	/* mode; or UINT64_MAX */
+	uint64_t		budget_start;		/* days since the epoch */
+	uint64_t		budget_day;
+	uint64_t		budget_used;		/* bytes */
+	uint64_t		budget_total;
+	enum budget_state	budget_state;
+	time_t			budget_save;		/* next save */
+	_Bool			throttled;
+	_Bool			use_hist;
+	_Bool			primed;
+	struct timespec		time;
+	struct zc_disk_stat	origin;
+	struct zc_disk_stat	cache;
+	uint64_t		promotions;
+	uint64_t		demotions;
+	struct zc_stats_sample	hist;
+	uint64_t		last_p99;		/* for zc_ctl_report() */
+	double			last_qdepth;
+};
+
+int zc_disk_stat_read(const char *const name, struct zc_disk_stat *const ds)
+{
+	uint64_t f[11];
+	struct dm_info info;
+	char *path;
+	FILE *fp;
+	int n;
+
+	if (zc_dm_info(name, &info) < 0)
+		return -1;
+
+	if (!info.exists) {
+		zc_err(LOG_ERR, "%s: device does not exist\n", name);
+		return -1;
+	}
+
+	path = zc_asprintf("/sys/block/dm-%u/stat", info.minor);
+
+	if ((fp = fopen(path, "re")) == NULL) {
+		zc_err(LOG_ERR, "%s: %m\n", path);
+		free(path);
+		return -1;
+	}
+
+	n = fscanf(fp, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+		   " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+		   " %" SCNu64 " %" SCNu64 " %" SCNu64, &f[0], &f[1], &f[2],
+		   &f[3], &f[4], &f[5], &f[6], &f[7], &f[8], &f[9], &f[10]);
+	fclose(fp);
+
+	if (n != 11) {
+		zc_err(LOG_ERR, "%s: unexpected format\n", path);
+		free(path);
+		return -1;
+	}
+
+	free(path);
+
+	ds->ios = f[0] + f[4];
+	ds->ticks = f[3] + f[7];
+	ds->in_flight = f[8];
+	ds->time_in_queue = f[10];
+	ds->write_sectors = f[6];
+
+	return 0;
+}
+
+static uint64_t today(void)
+{
+	return time(NULL) / SECS_PER_DAY;
+}
+
+static enum budget_state budget_state(const struct zc_ctl *const ctl)
+{
+	if (ctl->budget_daily == 0 || ctl->budget_used * 100 <
+					ctl->budget_daily * BUDGET_LOW_PCT)
+		return BUDGET_OK;
+
+	return (ctl->budget_used < ctl->budget_daily) ?
+						BUDGET_LOW : BUDGET_EXHAUSTED;
+}
+
+/*
+ * Saves the write counters in the extension.  Everything else in the
+ * extension is re-read, since zcctl may have changed it; if the budget has
+ * been disabled in the meantime, nothing is written.
+ */
+static void budget_save(struct zc_ctl *const ctl)
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int fd;
+
+	if (ctl->budget_daily == 0)
+		return;
+
+	ctl->budget_save = time(NULL) + BUDGET_SAVE_INTERVAL;
+
+	/* Serializes with zcstop, zcctl, etc. */
+	if (zc_registry_open(&reg, ctl->uuid) < 0)
+		return;
+
+	if ((fd = zc_member_ext_open(ctl->md_devno, &ext)) >= 0) {
+
+		if (ext.budget_daily != 0) {
+			ext.budget_day = ctl->budget_day;
+			ext.budget_used = ctl->budget_used;
+			ext.budget_total = ctl->budget_total;
+			zc_member_ext_commit(fd, ctl->md_devno, &ext);
+		}
+		else {
+			close(fd);
+		}
+	}
+
+	zc_registry_close(&reg);
+}
+
+static void budget_account(struct zc_ctl *const ctl, const uint64_t bytes)
+{
+	enum budget_state state;
+	char used[ZC_SIZE_BUF_SIZE];
+	uint64_t day;
+
+	if (ctl->budget_daily == 0)
+		return;
+
+	if ((day = today()) != ctl->budget_day) {
+		zc_err(LOG_INFO, "%s: new budget day; %s written to cache "
+		       "yesterday\n", ctl->uuid,
+		       zc_size_format_r(ctl->budget_used, 0, used));
+		ctl->budget_day = day;
+		ctl->budget_used = 0;
+		ctl->budget_save = 0;
+	}
+
+	ctl->budget_used += bytes;
+	ctl->budget_total += bytes;
+
+	if ((state = budget_state(ctl)) != ctl->budget_state) {
+		zc_err(state == BUDGET_OK ? LOG_INFO : LOG_WARNING,
+		       "%s: cache write budget %s (%s of %" PRIu64 "%%)\n",
+		       ctl->uuid, budget_states[state],
+		       zc_size_format_r(ctl->budget_used, 0, used),
+		       ctl->budget_used * 100 / ctl->budget_daily);
+		ctl->budget_state = state;
+		ctl->budget_save = 0;
+	}
+
+	if (time(NULL) >= ctl->budget_save)
+		budget_save(ctl);
+}
+
+/* Falls back to a less write-intensive mode while the budget is exhausted */
+static void budget_set_mode(struct zc_ctl *const ctl,
+			    const struct zc_cache_status *const status)
+{
+	uint64_t mode;
+
+	if (ctl->budget_daily == 0)
+		return;
+
+	mode = ctl->cache_mode;
+
+	if (ctl->budget_state == BUDGET_EXHAUSTED &&
+					ctl->budget_fallback != UINT64_MAX) {
+
+		mode = ctl->budget_fallback;
+
+		/* Dirty blocks must be written back before passthrough */
+		if (mode == ZC_SB_MODE_PASSTHROUGH && status->dirty != 0)
+			mode = ZC_SB_MODE_WRITETHROUGH;
+	}
+
+	if (mode == ctl->mode)
+		return;
+
+	if (zc_dm_cache_set_mode(ctl->dev_name, mode) >= 0)
+		ctl->mode = mode;
+}
+
+struct zc_ctl *zc_ctl_new(const char *const uuid,
+			  const struct zc_sb_ext *const ext,
+			  const struct zc_sb_v0 *const sb, const dev_t md_devno)
+{
+	struct zc_cache_status status;
+	char daily[ZC_SIZE_BUF_SIZE];
+	struct zc_ctl *ctl;
+
+	ctl = calloc(1, sizeof *ctl);
+	if (ctl == NULL) {
+		zc_err(LOG_CRIT, "Memory allocation failure. Aborting.\n");
+		abort();
+	}
+
+	strcpy(ctl->uuid, uuid);
+	ctl->dev_name = zc_cache_target(uuid);
+	ctl->origin_name = zc_asprintf("zodcache-origin-%s", uuid);
+	ctl->cache_name = zc_asprintf("zodcache-cache-%s", uuid);
+	ctl->md_devno = md_devno;
+	ctl->block_sectors = sb->block_size / 512;
+	ctl->cache_mode = sb->cache_mode;
+	ctl->mode = UINT64_MAX;		/* check the table at the first tick */
+	ctl->target = ext->ctl_target;
+	ctl->use_hist = (ext->stats_areas != 0);
+
+	/* Never go below one cache block, or migrations would stop entirely */
+	ctl->min = ext->ctl_min_threshold ?: ctl->block_sectors;
+	ctl->max = ext->ctl_max_threshold ?: CTL_DEFAULT_MAX;
+	if (ctl->max < ctl->min)
+		ctl->max = ctl->min;
+
+	ctl->budget_daily = ext->budget_daily;
+	ctl->budget_tbw = ext->budget_tbw;
+	ctl->budget_fallback = (ext->flags & ZC_SB_EXT_FALLBACK) ?
+					ext->budget_fallback : UINT64_MAX;
+	ctl->budget_start = ext->budget_start;
+	ctl->budget_day = ext->budget_day;
+	ctl->budget_used = ext->budget_used;
+	ctl->budget_total = ext->budget_total;
+	ctl->budget_state = budget_state(ctl);
+
+	if (zc_dm_cache_status(ctl->dev_name, &status) < 0) {
+		zc_ctl_free(ctl);
+		return NULL;
+	}
+
+	ctl->threshold = status.migration_threshold;
+
+	/* Don't adopt a throttled value from a previous run */
+	ctl->base_threshold = (ctl->threshold > ctl->block_sectors) ?
+					ctl->threshold : CTL_KERNEL_DEFAULT;
+
+	if (ctl->target != 0) {
+		zc_err(LOG_INFO, "%s: controller enabled: origin p99 target %"
+		       PRIu64 "us, migration_threshold %" PRIu64 "-%" PRIu64
+		       " sectors (now %" PRIu64 "), using %s\n", uuid,
+		       ctl->target / 1000, ctl->min, ctl->max, ctl->threshold,
+		       ctl->use_hist ? "dm-stats histogram" :
+							"average latency");
+	}
+
+	if (ctl->budget_daily != 0) {
+		zc_err(LOG_INFO, "%s: cache write budget %s/day, fallback "
+		       "mode %s\n", uuid,
+		       zc_size_format_r(ctl->budget_daily, 0, daily),
+		       ctl->budget_fallback == UINT64_MAX ? "none" :
+			       zc_cache_mode_format(ctl->budget_fallback, 1));
+	}
+
+	return ctl;
+}
+
+void zc_ctl_free(struct zc_ctl *const ctl)
+{
+	budget_save(ctl);
+	zc_stats_sample_free(&ctl->hist);
+	free(ctl->cache_name);
+	free(ctl->origin_name);
+	free(ctl->dev_name);
+	free(ctl);
+}
+
+static int ctl_set_threshold(struct zc_ctl *const ctl, const uint64_t threshold)
+{
+	char msg[48];
+
+	snprintf(msg, sizeof msg, "migration_threshold %" PRIu64, threshold);
+
+	if (zc_dm_message(ctl->dev_name, msg) < 0)
+		return -1;
+
+	ctl->threshold = threshold;
+	return 0;
+}
+
+static double ms_avg(const uint64_t ticks, const uint64_t ios)
+{
+	return (ios == 0) ? 0.0 : (double)ticks / ios;
+}
+
+/* The current samples are kept for the next interval, so use a copy */
+static uint64_t hist_p99(const struct zc_stats_sample *const now,
+			 const struct zc_stats_sample *const prev)
+{
+	struct zc_stats_sample delta;
+	uint64_t p99;
+
+	delta = *now;
+	delta.areas = malloc(now->nr_areas * sizeof *now->areas);
+	if (delta.areas == NULL) {
+		zc_err(LOG_CRIT, "Memory allocation failure. Aborting.\n");
+		abort();
+	}
+
+	memcpy(delta.areas, now->areas, now->nr_areas * sizeof *now->areas);
+	zc_stats_delta(&delta, prev);
+	p99 = zc_stats_percentile(&delta, 0.99);
+	zc_stats_sample_free(&delta);
+
+	return p99;
+}
+
+void zc_ctl_tick(struct zc_ctl *const ctl)
+{
+	struct zc_disk_stat origin, cache;
+	struct zc_cache_status status;
+	struct zc_stats_sample hist;
+	uint64_t p99, threshold;
+	const char *reason;
+	struct timespec now;
+	double secs, qdepth;
+
+	if (		zc_disk_stat_read(ctl->origin_name, &origin) < 0	||
+
+			zc_disk_stat_read(ctl->cache_name, &cache) < 0	||
+
+			zc_dm_cache_status(ctl->dev_name, &status) < 0	)
+		return;
+
+	memset(&hist, 0, sizeof hist);
+	if (ctl->use_hist && zc_stats_sample(ctl->origin_name, &hist) < 0)
+		ctl->use_hist = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (!ctl->primed || status.failed)
+		goto save;
+
+	secs = (now.tv_sec - ctl->time.tv_sec) +
+				(now.tv_nsec - ctl->time.tv_nsec) / 1e9;
+	qdepth = (origin.time_in_queue - ctl->origin.time_in_queue) /
+								(secs * 1000);
+
+	/* Someone else (e.g. dmsetup message) changed the threshold */
+	if (status.migration_threshold != ctl->threshold)
+		ctl->threshold = status.migration_threshold;
+
+	if (ctl->use_hist && hist.nr_areas == ctl->hist.nr_areas) {
+		p99 = hist_p99(&hist, &ctl->hist);
+	}
+	else {
+		p99 = 1000000 * ms_avg(origin.ticks - ctl->origin.ticks,
+				       origin.ios - ctl->origin.ios);
+	}
+
+	ctl->last_p99 = p99;
+	ctl->last_qdepth = qdepth;
+
+	/* The counter starts again if the cache device is recreated */
+	if (cache.write_sectors >= ctl->cache.write_sectors) {
+		budget_account(ctl, (cache.write_sectors -
+				     ctl->cache.write_sectors) * 512);
+	}
+	else {
+		budget_account(ctl, cache.write_sectors * 512);
+	}
+
+	threshold = ctl->threshold;
+	reason = NULL;
+
+	if (ctl->target == 0) {
+		/* Only undo our own throttling; leave manual changes alone */
+		if (ctl->throttled) {
+			threshold = ctl->base_threshold;
+			reason = "write budget available";
+		}
+		else {
+			ctl->base_threshold = ctl->threshold;
+		}
+	}
+	else if (origin.ios == ctl->origin.ios) {
+		threshold = ctl->threshold + (ctl->max - ctl->min) / 8;
+		reason = "origin idle";
+	}
+	else if (p99 > ctl->target) {
+		threshold = ctl->threshold / 2;
+		reason = "over target";
+	}
+	else if (p99 < ctl->target * CTL_HEADROOM) {
+		threshold = ctl->threshold + (ctl->max - ctl->min) / 8;
+		reason = "under target";
+	}
+
+	if (ctl->target != 0) {
+		if (threshold < ctl->min)
+			threshold = ctl->min;
+		if (threshold > ctl->max)
+			threshold = ctl->max;
+	}
+
+	ctl->throttled = (ctl->budget_state != BUDGET_OK);
+
+	if (ctl->throttled && threshold > ctl->block_sectors) {
+		threshold = ctl->block_sectors;
+		reason = "write budget low";
+	}
+
+	if (threshold != ctl->threshold && ctl->target == 0) {
+		zc_err(LOG_INFO, "%s: %s: %.1f promotions/s; "
+		       "migration_threshold %" PRIu64 " -> %" PRIu64 "\n",
+		       ctl->dev_name, reason,
+		       (status.promotions - ctl->promotions) / secs,
+		       ctl->threshold, threshold);
+		ctl_set_threshold(ctl, threshold);
+	}
+	else if (threshold != ctl->threshold) {
+		zc_err(LOG_INFO, "%s: %s: origin p99 %.2fms (target %.2fms), "
+		       "queue depth %.1f, cache latency %.2fms, "
+		       "%.1f promotions/s, %.1f demotions/s; "
+		       "migration_threshold %" PRIu64 " -> %" PRIu64 "\n",
+		       ctl->dev_name, reason, p99 / 1e6, ctl->target / 1e6,
+		       qdepth, ms_avg(cache.ticks - ctl->cache.ticks,
+				      cache.ios - ctl->cache.ios),
+		       (status.promotions - ctl->promotions) / secs,
+		       (status.demotions - ctl->demotions) / secs,
+		       ctl->threshold, threshold);
+		ctl_set_threshold(ctl, threshold);
+	}
+
+	budget_set_mode(ctl, &status);
+
+save:
+	zc_stats_sample_free(&ctl->hist);
+	ctl->hist = hist;
+	ctl->time = now;
+	ctl->origin = origin;
+	ctl->cache = cache;
+	ctl->promotions = status.promotions;
+	ctl->demotions = status.demotions;
+	ctl->primed = 1;
+}
+
+/* "key: value" lines for the daemon's status command */
+void zc_ctl_report(const struct zc_ctl *const ctl, FILE *const fp)
+{
+	char used[ZC_SIZE_BUF_SIZE], daily[ZC_SIZE_BUF_SIZE];
+	uint64_t days, rate;
+
+	if (ctl->target != 0) {
+		fprintf(fp, "controller: target %.2fms, origin p99 %.2fms, "
+			"queue depth %.1f\n", ctl->target / 1e6,
+			ctl->last_p99 / 1e6, ctl->last_qdepth);
+	}
+
+	fprintf(fp, "migration_threshold: %" PRIu64 "\n", ctl->threshold);
+
+	if (ctl->budget_daily == 0)
+		return;
+
+	fprintf(fp, "write_budget: %s of %s today (%" PRIu64 "%%, %s)\n",
+		zc_size_format_r(ctl->budget_used, 0, used),
+		zc_size_format_r(ctl->budget_daily, 0, daily),
+		ctl->budget_used * 100 / ctl->budget_daily,
+		budget_states[ctl->budget_state]);
+
+	days = ctl->budget_day - ctl->budget_start + 1;
+	rate = ctl->budget_total / days;
+
+	fprintf(fp, "cache_written: %s in %" PRIu64 " day(s), %s/day\n",
+		zc_size_format_r(ctl->budget_total, 0, used), days,
+		zc_size_format_r(rate, 0, daily));
+
+	if (ctl->budget_tbw == 0)
+		return;
+
+	if (rate == 0) {
+		fputs("projected_lifetime: -\n", fp);
+	}
+	else {
+		fprintf(fp, "projected_lifetime: %" PRIu64 " days (%.1f "
+			"years) at current rate, %" PRIu64 " days at budget\n",
+			ctl->budget_total >= ctl->budget_tbw ? 0 :
+				(ctl->budget_tbw - ctl->budget_total) / rate,
+			ctl->budget_total >= ctl->budget_tbw ? 0.0 :
+				(ctl->budget_tbw - ctl->budget_total) / rate /
+									365.25,
+			ctl->budget_tbw / ctl->budget_daily);
+	}
+}
@@ -0,0 +1,600 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/sysmacros.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <stdio.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+int zc_dm_task_run_sync(struct dm_task *const task, const uint16_t udev_flags)
+{
+	uint32_t cookie;
+	int ret;
+
+	cookie = 0;
+
+	if (!dm_task_set_cookie(task, &cookie, udev_flags))
+		return 0;
+
+	ret = dm_task_run(task);
+
+	if (!dm_udev_wait(cookie))
+		return 0;
+
+	return ret;
+}
+
+/* Sets info->exists to 0 if the device doesn't exist */
+int zc_dm_info(const char *const name, struct dm_info *const info)
+{
+	struct dm_task *task;
+
+	if (		!(task = dm_task_create(DM_DEVICE_INFO))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_run(task)				||
+
+			!dm_task_get_info(task, info)			) {
+
+		zc_err(LOG_ERR, "%s: failed to get device info\n", name);
+		if (task != NULL)
+			dm_task_destroy(task);
+		return -1;
+	}
+
+	dm_task_destroy(task);
+	return 0;
+}
+
+/* Suspending a cache device commits its metadata (including policy hints) */
+int zc_dm_suspend(const char *const name)
+{
+	struct dm_task *task;
+
+	if (		!(task = dm_task_create(DM_DEVICE_SUSPEND))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_run(task)				) {
+
+		zc_err(LOG_ERR, "%s: failed to suspend device\n", name);
+		if (task != NULL)
+			dm_task_destroy(task);
+		return -1;
+	}
+
+	dm_task_destroy(task);
+	return 0;
+}
+
+int zc_dm_resume(const char *const name, const uint16_t udev_flags)
+{
+	struct dm_task *task;
+
+	if (		!(task = dm_task_create(DM_DEVICE_RESUME))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!zc_dm_task_run_sync(task, udev_flags)		) {
+
+		zc_err(LOG_ERR, "%s: failed to resume device\n", name);
+		if (task != NULL)
+			dm_task_destroy(task);
+		return -1;
+	}
+
+	dm_task_destroy(task);
+	return 0;
+}
+
+int zc_dm_remove(const char *const name, const uint16_t udev_flags)
+{
+	struct dm_task *task;
+
+	if (		!(task = dm_task_create(DM_DEVICE_REMOVE))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_retry_remove(task)			||
+
+			!zc_dm_task_run_sync(task, udev_flags)		) {
+
+		zc_err(LOG_ERR, "%s: failed to remove device\n", name);
+		if (task != NULL)
+			dm_task_destroy(task);
+		return -1;
+	}
+
+	dm_task_destroy(task);
+	return 0;
+}
+
+/*
+ * Returns the device number of the block device that underlies a (linear)
+ * component device.
+ */
+int zc_dm_component_devno(const char *const name, dev_t *const devno)
+{
+	struct dm_task *task;
+	struct dm_deps *deps;
+
+	if (		!(task = dm_task_create(DM_DEVICE_DEPS))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_run(task)				||
+
+			!(deps = dm_task_get_deps(task))		) {
+
+		zc_err(LOG_ERR, "%s: failed to get device dependencies\n",
+		       name);
+		if (task != NULL)
+			dm_task_destroy(task);
+		return -1;
+	}
+
+	if (deps->count != 1) {
+		zc_err(LOG_ERR, "%s: unexpected number of dependencies (%"
+		       PRIu32 ")\n", name, deps->count);
+		dm_task_destroy(task);
+		return -1;
+	}
+
+	*devno = makedev(MAJOR(deps->device[0]), MINOR(deps->device[0]));
+
+	dm_task_destroy(task);
+	return 0;
+}
+
+/* Skips a counted list of arguments ("<#args> <arg>*") */
+static const char *skip_args(const char *p)
+{
+	unsigned count;
+	int n;
+
+	if (sscanf(p, "%u%n", &count, &n) != 1)
+		return NULL;
+
+	for (p += n; count > 0; --count, p += n) {
+		n = -1;
+		sscanf(p, "%*s%n", &n);
+		if (n < 0)
+			return NULL;
+	}
+
+	return p;
+}
+
+/* Core args are key/value pairs; only migration_threshold is of interest */
+static const char *parse_core_args(const char *p,
+				   struct zc_cache_status *const s)
+{
+	char key[32], value[32];
+	unsigned count;
+	int n;
+
+	if (sscanf(p, "%u%n", &count, &n) != 1 || count % 2 != 0)
+		return NULL;
+
+	for (p += n; count > 0; count -= 2, p += n) {
+
+		if (sscanf(p, "%31s %31s%n", key, value, &n) != 2)
+			return NULL;
+
+		if (strcmp(key, "migration_threshold") == 0)
+			s->migration_threshold = strtoull(value, NULL, 10);
+	}
+
+	return p;
+}
+
+static int parse_cache_status(const char *p, struct zc_cache_status *const s)
+{
+	char mode[3], check[12];
+	int n;
+
+	memset(s, 0, sizeof *s);
+
+	if (strcmp(p, "Fail") == 0) {
+		s->failed = 1;
+		return 0;
+	}
+
+	if (sscanf(p, "%" SCNu64 " %" SCNu64 "/%" SCNu64 " %" SCNu64
+		   " %" SCNu64 "/%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+		   " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 "%n",
+		   &s->md_block_size, &s->md_used, &s->md_total,
+		   &s->block_size, &s->used, &s->total, &s->read_hits,
+		   &s->read_misses, &s->write_hits, &s->write_misses,
+		   &s->demotions, &s->promotions, &s->dirty, &n) != 13) {
+		return -1;
+	}
+
+	p += n;
+
+	/* Features & core args */
+	if ((p = skip_args(p)) == NULL || (p = parse_core_args(p, s)) == NULL)
+		return -1;
+
+	/* Policy name & policy args */
+	n = -1;
+	sscanf(p, "%*s%n", &n);
+	if (n < 0 || (p = skip_args(p + n)) == NULL)
+		return -1;
+
+	/* Metadata mode & needs_check were added in later kernels */
+	switch (sscanf(p, "%2s %11s", mode, check)) {
+
+		case 2:
+			s->needs_check = (strcmp(check, "needs_check") == 0);
+			/* fall through */
+		case 1:
+			s->read_only = (strcmp(mode, "ro") == 0);
+			break;
+	}
+
+	return 0;
+}
+
+int zc_dm_cache_status(const char *const name, struct zc_cache_status *const s)
+{
+	char *type, *params;
+	struct dm_task *task;
+	uint64_t start, len;
+
+	type = params = NULL;
+
+	if (		!(task = dm_task_create(DM_DEVICE_STATUS))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_run(task)				) {
+
+		zc_err(LOG_ERR, "%s: failed to get device status\n", name);
+		if (task != NULL)
+			dm_task_destroy(task);
+		return -1;
+	}
+
+	dm_get_next_target(task, NULL, &start, &len, &type, &params);
+
+	if (type == NULL || strcmp(type, "cache") != 0 || params == NULL) {
+		zc_err(LOG_ERR, "%s: not a cache device\n", name);
+		dm_task_destroy(task);
+		return -1;
+	}
+
+	if (parse_cache_status(params, s) < 0) {
+		zc_err(LOG_ERR, "%s: failed to parse cache status: %s\n",
+		       name, params);
+		dm_task_destroy(task);
+		return -1;
+	}
+
+	dm_task_destroy(task);
+	return 0;
+}
+
+/* Sends a message to the device's (first) target */
+int zc_dm_message(const char *const name, const char *const message)
+{
+	struct dm_task *task;
+
+	if (		!(task = dm_task_create(DM_DEVICE_TARGET_MSG))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_set_sector(task, 0)			||
+
+			!dm_task_set_message(task, message)		||
+
+			!dm_task_run(task)				) {
+
+		zc_err(LOG_ERR, "%s: failed to send message: %s\n", name,
+		       message);
+		if (task != NULL)
+			dm_task_destroy(task);
+		return -1;
+	}
+
+	dm_task_destroy(task);
+	return 0;
+}
+
+#define ZC_DM_INVALIDATE_BATCH	64		/* cache blocks per message */
+
+/* Invalidates cache blocks; the kernel only does so in passthrough mode */
+int zc_dm_cache_invalidate(const char *const name,
+			   const uint64_t *const cblocks, const uint64_t n)
+{
+	char *msg, *tmp;
+	uint64_t i;
+	int ret;
+
+	for (i = 0; i < n; ) {
+
+		msg = zc_asprintf("invalidate_cblocks");
+
+		do {
+			tmp = zc_asprintf("%s %" PRIu64, msg, cblocks[i]);
+			free(msg);
+			msg = tmp;
+		} while (++i < n && i % ZC_DM_INVALIDATE_BATCH != 0);
+
+		ret = zc_dm_message(name, msg);
+		free(msg);
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Layers under the top-level device are hidden, like components */
+uint16_t zc_dm_udev_flags(const char *const name)
+{
+	return (strncmp(name, ZC_CACHED_PREFIX,
+			sizeof ZC_CACHED_PREFIX - 1) == 0 ||
+		strncmp(name, ZC_TRACKED_PREFIX,
+			sizeof ZC_TRACKED_PREFIX - 1) == 0) ?
+				ZC_COMPONENT_UDEV_FLAGS : ZC_DEV_UDEV_FLAGS;
+}
+
+/*
+ * Reloads a cache device's table with a different I/O mode (ZC_SB_MODE_*) or
+ * policy (e.g. "cleaner 0"), keeping everything else.  A mode of UINT64_MAX
+ * or a NULL policy keeps the current one.  Returns 1 if the table was
+ * reloaded, 0 if nothing needed to change.
+ */
+int zc_dm_cache_reload(const char *const name, const uint64_t mode,
+		       const char *const policy)
+{
+	char *type, *params, *p, *core, *core_end, *new_params, *features, *tmp;
+	char word[32], cur_mode[32], fixed[256], cur_policy[64];
+	struct dm_task *task, *reload;
+	unsigned nr_features, nr_new;
+	const char *new_mode;
+	uint64_t start, len;
+	int n, m, ret;
+
+	new_mode = NULL;
+	if (mode != UINT64_MAX &&
+			(new_mode = zc_cache_mode_format(mode, 0)) == NULL)
+		return -1;
+
+	type = params = NULL;
+	reload = NULL;
+	new_params = features = NULL;
+	ret = -1;
+
+	if (		!(task = dm_task_create(DM_DEVICE_TABLE))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_run(task)				) {
+
+		zc_err(LOG_ERR, "%s: failed to get device table\n", name);
+		goto out;
+	}
+
+	dm_get_next_target(task, NULL, &start, &len, &type, &params);
+
+	if (type == NULL || strcmp(type, "cache") != 0 || params == NULL) {
+		zc_err(LOG_ERR, "%s: not a cache device\n", name);
+		goto out;
+	}
+
+	/* <metadata dev> <cache dev> <origin dev> <block size> <#features> */
+	n = -1;
+	sscanf(params, "%*s %*s %*s %*s%n", &n);
+	if (n < 0 || (size_t)n >= sizeof fixed ||
+			sscanf(params + n, "%u%n", &nr_features, &m) != 1)
+		goto parse_error;
+
+	memcpy(fixed, params, n);
+	fixed[n] = 0;
+	p = params + n + m;
+
+	/* Rebuild the feature list without the mode (default = writeback) */
+	features = zc_asprintf("%s", "");
+	nr_new = 0;
+	strcpy(cur_mode, "writeback");
+
+	for (; nr_features > 0; --nr_features, p += n) {
+
+		if (sscanf(p, "%31s%n", word, &n) != 1)
+			goto parse_error;
+
+		if (strcmp(word, "writeback") == 0 ||
+				strcmp(word, "writethrough") == 0 ||
+				strcmp(word, "passthrough") == 0) {
+			strcpy(cur_mode, word);
+			continue;
+		}
+
+		tmp = zc_asprintf("%s %s", features, word);
+		free(features);
+		features = tmp;
+		++nr_new;
+	}
+
+	/*
+	 * <#core args> <core args>*, then <policy> <#policy args> <args>*.
+	 * The table includes the current migration_threshold, so it survives.
+	 */
+	core = p;
+	if ((p = (char *)skip_args(p)) == NULL)
+		goto parse_error;
+	core_end = p;
+
+	n = -1;
+	sscanf(p, " %63s%n", cur_policy, &n);
+	if (n < 0)
+		goto parse_error;
+
+	if ((new_mode == NULL || strcmp(cur_mode, new_mode) == 0) &&
+			(policy == NULL ||
+			 strncmp(policy, cur_policy, strlen(cur_policy)) == 0)) {
+		ret = 0;
+		goto out;
+	}
+
+	*core_end = 0;
+	new_params = zc_asprintf("%s %u %s%s%s %s", fixed, nr_new + 1,
+				 new_mode ?: cur_mode, features, core,
+				 policy ?: p + 1 + strspn(p + 1, " "));
+
+	if (		!(reload = dm_task_create(DM_DEVICE_RELOAD))	||
+
+			!dm_task_set_name(reload, name)			||
+
+			!dm_task_add_target(reload, start, len, "cache",
+					    new_params)			||
+
+			!dm_task_run(reload)				) {
+
+		zc_err(LOG_ERR, "%s: failed to load new table\n", name);
+		goto out;
+	}
+
+	if (zc_dm_suspend(name) < 0 ||
+			zc_dm_resume(name, zc_dm_udev_flags(name)) < 0)
+		goto out;
+
+	zc_err(LOG_NOTICE, "%s: reloaded with %s mode, policy %s\n", name,
+	       new_mode ?: cur_mode, policy ?: cur_policy);
+	ret = 1;
+	goto out;
+
+parse_error:
+	zc_err(LOG_ERR, "%s: failed to parse device table\n", name);
+
+out:
+	if (reload != NULL)
+		dm_task_destroy(reload);
+	if (task != NULL)
+		dm_task_destroy(task);
+	free(new_params);
+	free(features);
+	return ret;
+}
+
+int zc_dm_cache_set_mode(const char *const name, const uint64_t mode)
+{
+	return zc_dm_cache_reload(name, mode, NULL);
+}
+
+/*
+ * Checks the progress of a raid1 device that is rebuilding one of its legs
+ * (see Documentation/device-mapper/dm-raid.txt).  Returns 1 if all legs are
+ * in sync, 0 if the rebuild is still running, -1 on error (including a failed
+ * leg).  done & total are the rebuild progress in sectors.
+ */
+int zc_dm_raid_sync(const char *const name, uint64_t *const done,
+		    uint64_t *const total)
+{
+	char *type, *params, health[32];
+	struct dm_task *task;
+	uint64_t start, len;
+	unsigned nr_devs;
+	int ret;
+
+	type = params = NULL;
+	ret = -1;
+
+	if (		!(task = dm_task_create(DM_DEVICE_STATUS))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_run(task)				) {
+
+		zc_err(LOG_ERR, "%s: failed to get device status\n", name);
+		goto out;
+	}
+
+	dm_get_next_target(task, NULL, &start, &len, &type, &params);
+
+	/* <raid_type> <#devices> <health_chars> <sync_ratio> ... */
+	if (type == NULL || strcmp(type, "raid") != 0 || params == NULL ||
+			sscanf(params, "%*s %u %31s %" SCNu64 "/%" SCNu64,
+			       &nr_devs, health, done, total) != 4) {
+		zc_err(LOG_ERR, "%s: failed to parse raid status: %s\n",
+		       name, params ?: "");
+		goto out;
+	}
+
+	if (strchr(health, 'D') != NULL) {
+		zc_err(LOG_ERR, "%s: raid leg failed (%s)\n", name, health);
+		goto out;
+	}
+
+	ret = (strspn(health, "A") == nr_devs && *done == *total);
+
+out:
+	if (task != NULL)
+		dm_task_destroy(task);
+	return ret;
+}
+
+/*
+ * Gets the current era of a dm-era device (see
+ * Documentation/device-mapper/era.txt).
+ */
+int zc_dm_era_status(const char *const name, uint64_t *const era)
+{
+	char *type, *params;
+	struct dm_task *task;
+	uint64_t start, len;
+	int ret;
+
+	type = params = NULL;
+	ret = -1;
+
+	if (		!(task = dm_task_create(DM_DEVICE_STATUS))	||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_run(task)				) {
+
+		zc_err(LOG_ERR, "%s: failed to get device status\n", name);
+		goto out;
+	}
+
+	dm_get_next_target(task, NULL, &start, &len, &type, &params);
+
+	/* <md block size> <#used md blocks>/<#total> <current era> <root> */
+	if (type == NULL || strcmp(type, "era") != 0 || params == NULL ||
+			sscanf(params, "%*u %*u/%*u %" SCNu64, era) != 1) {
+		zc_err(LOG_ERR, "%s: failed to parse era status: %s\n",
+		       name, params ?: "");
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (task != NULL)
+		dm_task_destroy(task);
+	return ret;
+}
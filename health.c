@@ -0,0 +1,631 @@
+/*
+ * Copyright 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Cache health monitor (used by zodcached).
+ *
+ * dm-cache raises a device-mapper event when it changes its own mode (to
+ * read-only or failed), so a thread per set waits for events on the cache
+ * target (DM_DEVICE_WAITEVENT) and wakes the daemon, which checks the cache
+ * status at once.  The latency of the cache component is also sampled every
+ * ZC_CTL_INTERVAL seconds, from /sys/block/dm-N/stat.
+ *
+ * A set is tripped when its cache fails, becomes read-only or needs a
+ * metadata check, or when the cache component's average latency is over the
+ * limit (or the origin's latency, if there is no limit) for health_trip
+ * intervals in a row; an interval in which the cache component completes
+ * none of its in-flight requests also counts.  Tripping is logged at
+ * LOG_ALERT.  Unless the action is ZC_HEALTH_ALERT, the set then bypasses the
+ * cache: writethrough mode at once, and passthrough once the cache is clean.
+ * The cleaner policy is loaded while there are dirty blocks (and always, for
+ * ZC_HEALTH_UNCACHE), since smq may never write them all back under load.  A
+ * slow cache device should never make the set slower than its origin.
+ *
+ * A bypassed cache gets little or no I/O, so its latency is then measured by
+ * probes (a few direct reads, in a short-lived thread, so that a hung device
+ * can't stall the daemon).  The normal cache mode is restored after
+ * health_recover good intervals in a row.  The bypass is recorded in the
+ * superblock extension, so it survives a restart of the daemon or the system.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+/* Fewer completed requests than this in an interval aren't a sample */
+#define HEALTH_MIN_IOS		8
+
+/* Used if there is no limit and the origin's latency isn't known yet */
+#define HEALTH_DEFAULT_LIMIT	10000000	/* ns */
+
+#define HEALTH_PROBE_READS	8
+#define HEALTH_PROBE_SIZE	4096
+
+static const char *const health_actions[] = {
+	"none", "alert only", "bypassing cache",
+	"writing back & bypassing cache"
+};
+
+struct zc_health {
+	char			uuid[ZC_UUID_BUF_SIZE];
+	char			*dev_name;
+	char			*origin_name;
+	char			*cache_name;
+	dev_t			md_devno;
+	uint64_t		cache_mode;		/* from the superblock */
+	uint64_t		action;
+	uint64_t		limit;			/* ns; 0 = origin */
+	uint64_t		trip;			/* intervals */
+	uint64_t		recover;
+	uint64_t		bad;			/* intervals in a row */
+	uint64_t		good;
+	uint64_t		mode;			/* or UINT64_MAX */
+	_Bool			tripped;
+	_Bool			bypassed;		/* cache mode changed */
+	_Bool			cleaner;		/* policy loaded */
+	_Bool			probing;
+	_Bool			primed;
+	char			reason[96];
+	uint64_t		last_cache;		/* ns; for the report */
+	uint64_t		last_origin;
+	struct zc_disk_stat	origin;
+	struct zc_disk_stat	cache;
+};
+
+/* Arguments of the event & probe threads, which own (and free) them */
+struct health_arg {
+	struct zc_health_msg	msg;
+	char			*name;			/* dm name or path */
+};
+
+static int health_fd = -1;
+
+int zc_health_pipe(void)
+{
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		zc_err(LOG_ERR, "pipe: %m\n");
+		return -1;
+	}
+
+	/* Messages are small enough to be atomic, so only reads block */
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+		zc_err(LOG_ERR, "fcntl: %m\n");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	health_fd = fds[1];
+	return fds[0];
+}
+
+static void health_send(const struct zc_health_msg *const msg)
+{
+	while (write(health_fd, msg, sizeof *msg) < 0 && errno == EINTR);
+}
+
+static struct health_arg *health_arg_new(const char *const uuid,
+					 const _Bool probe, char *const name)
+{
+	struct health_arg *arg;
+
+	arg = calloc(1, sizeof *arg);
+	if (arg == NULL) {
+		zc_err(LOG_CRIT, "Memory allocation failure. Aborting.\n");
+		abort();
+	}
+
+	strcpy(arg->msg.uuid, uuid);
+	arg->msg.probe = probe;
+	arg->name = name;
+
+	return arg;
+}
+
+static void health_arg_free(struct health_arg *const arg)
+{
+	free(arg->name);
+	free(arg);
+}
+
+/* Signals are left to the daemon's main thread */
+static int health_thread(void *(*const fn)(void *),
+			 struct health_arg *const arg)
+{
+	pthread_attr_t attr;
+	sigset_t all, old;
+	pthread_t thread;
+	int ret;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		errno = ret;
+		zc_err(LOG_ERR, "pthread_create: %m\n");
+		health_arg_free(arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Runs until the cache target is removed (when the set is stopped) */
+static void *health_waiter(void *const p)
+{
+	struct health_arg *const arg = p;
+	struct dm_task *task;
+	struct dm_info info;
+	uint32_t event_nr;
+
+	if (zc_dm_info(arg->name, &info) < 0 || !info.exists)
+		goto out;
+
+	for (event_nr = info.event_nr; ; event_nr = info.event_nr) {
+
+		if ((task = dm_task_create(DM_DEVICE_WAITEVENT)) == NULL)
+			break;
+
+		if (		!dm_task_set_name(task, arg->name)	||
+
+				!dm_task_set_event_nr(task, event_nr)	||
+
+				!dm_task_run(task)			||
+
+				!dm_task_get_info(task, &info)		||
+
+				!info.exists				) {
+
+			dm_task_destroy(task);
+			break;
+		}
+
+		dm_task_destroy(task);
+		health_send(&arg->msg);
+	}
+
+out:
+	health_arg_free(arg);
+	return NULL;
+}
+
+/* Average latency of a few random direct reads; UINT64_MAX on error */
+static void *health_prober(void *const p)
+{
+	struct health_arg *const arg = p;
+	struct timespec start, end;
+	uint64_t size, offset;
+	unsigned i;
+	void *buf;
+	int fd;
+
+	arg->msg.latency = UINT64_MAX;
+	buf = NULL;
+
+	if ((fd = open(arg->name, O_RDONLY | O_DIRECT | O_CLOEXEC)) < 0 ||
+			ioctl(fd, BLKGETSIZE64, &size) < 0 ||
+			size < HEALTH_PROBE_SIZE ||
+			posix_memalign(&buf, HEALTH_PROBE_SIZE,
+				       HEALTH_PROBE_SIZE) != 0)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < HEALTH_PROBE_READS; ++i) {
+
+		offset = ((uint64_t)random() << 31 | random()) %
+				(size / HEALTH_PROBE_SIZE) * HEALTH_PROBE_SIZE;
+
+		if (pread(fd, buf, HEALTH_PROBE_SIZE, offset) !=
+							HEALTH_PROBE_SIZE)
+			goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	arg->msg.latency = ((end.tv_sec - start.tv_sec) * 1000000000 +
+			    (end.tv_nsec - start.tv_nsec)) / HEALTH_PROBE_READS;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	health_send(&arg->msg);
+	health_arg_free(arg);
+	return NULL;
+}
+
+/* Records the bypass in the extension (or forgets it) */
+static void health_save(const struct zc_health *const h, const _Bool bypassed)
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int fd;
+
+	if (zc_registry_open(&reg, h->uuid) < 0)
+		return;
+
+	if ((fd = zc_member_ext_open(h->md_devno, &ext)) >= 0) {
+
+		if (bypassed)
+			ext.flags |= ZC_SB_EXT_BYPASSED;
+		else
+			ext.flags &= ~ZC_SB_EXT_BYPASSED;
+
+		zc_member_ext_commit(fd, h->md_devno, &ext);
+	}
+
+	zc_registry_close(&reg);
+}
+
+/*
+ * Dirty blocks must be written back before passthrough.  Once loaded, the
+ * cleaner policy stays until the set is restored.  A failed reload isn't
+ * retried until something changes (it is logged by zc_dm_cache_reload()).
+ */
+static void health_bypass(struct zc_health *const h,
+			  const struct zc_cache_status *const status)
+{
+	uint64_t mode;
+	_Bool cleaner;
+
+	if (!h->tripped || h->action < ZC_HEALTH_PASSTHROUGH || status->failed)
+		return;
+
+	mode = (status->dirty == 0) ? ZC_SB_MODE_PASSTHROUGH :
+						ZC_SB_MODE_WRITETHROUGH;
+	cleaner = (status->dirty != 0 || h->action == ZC_HEALTH_UNCACHE);
+
+	if (mode == h->mode && (!cleaner || h->cleaner))
+		return;
+
+	h->bypassed = 1;
+	h->mode = mode;
+	h->cleaner |= cleaner;
+
+	zc_dm_cache_reload(h->dev_name, mode, cleaner ? "cleaner 0" : NULL);
+}
+
+static int health_restore(struct zc_health *const h)
+{
+	if (!h->bypassed)
+		return 0;
+
+	zc_dm_cache_reload(h->dev_name, h->cache_mode,
+			   h->cleaner ? "default 0" : NULL);
+	health_save(h, 0);
+
+	h->bypassed = 0;
+	h->cleaner = 0;
+	h->mode = UINT64_MAX;
+
+	return 1;
+}
+
+static void health_trip(struct zc_health *const h,
+			const struct zc_cache_status *const status)
+{
+	h->good = 0;
+
+	if (!h->tripped) {
+
+		zc_err(LOG_ALERT, "%s: cache unhealthy (%s); %s\n", h->uuid,
+		       h->reason, health_actions[h->action]);
+
+		h->tripped = 1;
+		if (h->action >= ZC_HEALTH_PASSTHROUGH)
+			health_save(h, 1);
+	}
+
+	health_bypass(h, status);
+}
+
+static uint64_t health_limit(const struct zc_health *const h)
+{
+	return h->limit ?: h->last_origin ?: HEALTH_DEFAULT_LIMIT;
+}
+
+/* Returns 1 if the normal cache mode was restored */
+static int health_sample(struct zc_health *const h, const uint64_t latency,
+			 const struct zc_cache_status *const status)
+{
+	uint64_t limit;
+
+	limit = health_limit(h);
+
+	if (latency <= limit) {
+
+		h->bad = 0;
+
+		if (!h->tripped || ++h->good < h->recover)
+			return 0;
+
+		zc_err(LOG_NOTICE, "%s: cache healthy again (latency %.2fms, "
+		       "limit %.2fms)%s\n", h->uuid, latency / 1e6,
+		       limit / 1e6, h->bypassed ? "; restoring cache mode" :
+									"");
+		h->tripped = 0;
+		h->good = 0;
+
+		return health_restore(h);
+	}
+
+	h->good = 0;
+
+	if (!h->tripped && ++h->bad < h->trip)
+		return 0;
+
+	if (latency == UINT64_MAX) {
+		snprintf(h->reason, sizeof h->reason,
+			 "cache I/O stalled or failed");
+	}
+	else {
+		snprintf(h->reason, sizeof h->reason, "cache latency %.2fms, "
+			 "limit %.2fms", latency / 1e6, limit / 1e6);
+	}
+
+	health_trip(h, status);
+
+	return 0;
+}
+
+/* Returns 1 if the set is tripped because of the cache target's state */
+static int health_state(struct zc_health *const h,
+			const struct zc_cache_status *const status)
+{
+	const char *reason;
+
+	if (status->failed)
+		reason = "cache failed";
+	else if (status->needs_check)
+		reason = "metadata needs check";
+	else if (status->read_only)
+		reason = "metadata read-only";
+	else
+		return 0;
+
+	snprintf(h->reason, sizeof h->reason, "%s", reason);
+	health_trip(h, status);
+
+	return 1;
+}
+
+static void health_probe(struct zc_health *const h)
+{
+	struct health_arg *arg;
+
+	if (h->probing || health_fd < 0)
+		return;
+
+	arg = health_arg_new(h->uuid, 1,
+			     zc_asprintf("/dev/mapper/%s", h->cache_name));
+
+	h->probing = (health_thread(health_prober, arg) == 0);
+}
+
+static double ns_avg(const uint64_t ms, const uint64_t ios)
+{
+	return (ios == 0) ? 0.0 : ms * 1e6 / ios;
+}
+
+/* Called every ZC_CTL_INTERVAL seconds */
+int zc_health_tick(struct zc_health *const h)
+{
+	struct zc_disk_stat origin, cache;
+	struct zc_cache_status status;
+	uint64_t ios;
+	int ret;
+
+	if (h->action == ZC_HEALTH_OFF)
+		return 0;
+
+	if (		zc_disk_stat_read(h->origin_name, &origin) < 0	||
+
+			zc_disk_stat_read(h->cache_name, &cache) < 0	||
+
+			zc_dm_cache_status(h->dev_name, &status) < 0	)
+		return 0;
+
+	ret = 0;
+
+	if (health_state(h, &status) || !h->primed)
+		goto save;
+
+	if (origin.ios - h->origin.ios >= HEALTH_MIN_IOS) {
+		h->last_origin = ns_avg(origin.ticks - h->origin.ticks,
+					origin.ios - h->origin.ios);
+	}
+
+	ios = cache.ios - h->cache.ios;
+
+	if (ios >= HEALTH_MIN_IOS) {
+		h->last_cache = ns_avg(cache.ticks - h->cache.ticks, ios);
+		ret = health_sample(h, h->last_cache, &status);
+	}
+	else if (ios == 0 && cache.in_flight != 0 && h->cache.in_flight != 0) {
+		ret = health_sample(h, UINT64_MAX, &status);
+	}
+	else if (h->tripped) {
+		health_probe(h);
+	}
+
+	/* Moves on to passthrough once the cache is clean */
+	if (ret == 0)
+		health_bypass(h, &status);
+
+save:
+	h->origin = origin;
+	h->cache = cache;
+	h->primed = 1;
+
+	return ret;
+}
+
+/* Handles a message from the event or probe thread */
+int zc_health_event(struct zc_health *const h,
+		    const struct zc_health_msg *const msg)
+{
+	struct zc_cache_status status;
+
+	if (msg->probe)
+		h->probing = 0;
+
+	if (h->action == ZC_HEALTH_OFF ||
+			zc_dm_cache_status(h->dev_name, &status) < 0)
+		return 0;
+
+	if (health_state(h, &status))
+		return 0;
+
+	if (msg->probe && h->tripped) {
+		if (msg->latency != UINT64_MAX)
+			h->last_cache = msg->latency;
+		return health_sample(h, msg->latency, &status);
+	}
+
+	return 0;
+}
+
+/*
+ * Picks up changed settings.  A bypass is reapplied at the next tick, in case
+ * something else (e.g. zcctl zones) changed the cache mode in the meantime.
+ */
+int zc_health_configure(struct zc_health *const h,
+			const struct zc_sb_ext *const ext)
+{
+	h->action = ext->health_action;
+	h->limit = ext->health_latency;
+	h->trip = ext->health_trip ?: ZC_HEALTH_DEFAULT_TRIP;
+	h->recover = ext->health_recover ?: ZC_HEALTH_DEFAULT_RECOVER;
+	h->mode = UINT64_MAX;
+
+	if (h->action >= ZC_HEALTH_PASSTHROUGH)
+		return 0;
+
+	if (h->action == ZC_HEALTH_OFF) {
+		h->tripped = 0;
+		h->bad = h->good = 0;
+	}
+
+	return health_restore(h);
+}
+
+struct zc_health *zc_health_new(const char *const uuid,
+				const struct zc_sb_ext *const ext,
+				const struct zc_sb_v0 *const sb,
+				const dev_t md_devno)
+{
+	char limit[32];
+	struct zc_health *h;
+
+	h = calloc(1, sizeof *h);
+	if (h == NULL) {
+		zc_err(LOG_CRIT, "Memory allocation failure. Aborting.\n");
+		abort();
+	}
+
+	strcpy(h->uuid, uuid);
+	h->dev_name = zc_cache_target(uuid);
+	h->origin_name = zc_asprintf("zodcache-origin-%s", uuid);
+	h->cache_name = zc_asprintf("zodcache-cache-%s", uuid);
+	h->md_devno = md_devno;
+	h->cache_mode = sb->cache_mode;
+
+	/* Still unhealthy until shown otherwise; the policy isn't recorded */
+	if (ext->flags & ZC_SB_EXT_BYPASSED) {
+		h->tripped = 1;
+		h->bypassed = 1;
+		h->cleaner = 1;
+		strcpy(h->reason, "bypassed before restart");
+	}
+
+	zc_health_configure(h, ext);
+
+	if (health_fd >= 0) {
+		health_thread(health_waiter, health_arg_new(uuid, 0,
+					zc_asprintf("%s", h->dev_name)));
+	}
+
+	if (h->limit == 0)
+		strcpy(limit, "origin");
+	else
+		snprintf(limit, sizeof limit, "%.2fms", h->limit / 1e6);
+
+	zc_err(LOG_INFO, "%s: health monitor enabled: cache latency limit "
+	       "%s, action %s\n", uuid, limit, health_actions[h->action]);
+
+	return h;
+}
+
+void zc_health_free(struct zc_health *const h)
+{
+	free(h->cache_name);
+	free(h->origin_name);
+	free(h->dev_name);
+	free(h);
+}
+
+_Bool zc_health_bypassed(const struct zc_health *const h)
+{
+	return h->bypassed;
+}
+
+/* "key: value" lines for the daemon's status command */
+void zc_health_report(const struct zc_health *const h, FILE *const fp)
+{
+	if (h->action == ZC_HEALTH_OFF)
+		return;
+
+	if (h->tripped) {
+		fprintf(fp, "monitor: tripped (%s), %s, %" PRIu64 "/%" PRIu64
+			" good intervals\n", h->reason,
+			h->bypassed && h->mode != UINT64_MAX ?
+				zc_cache_mode_format(h->mode, 1) :
+				health_actions[h->action],
+			h->good, h->recover);
+	}
+	else {
+		fprintf(fp, "monitor: ok, %" PRIu64 "/%" PRIu64
+			" bad intervals\n", h->bad, h->trip);
+	}
+
+	fprintf(fp, "cache_latency: %.2fms (limit %.2fms)\n",
+		h->last_cache / 1e6, health_limit(h) / 1e6);
+}
@@ -16,7 +16,11 @@
 
 #define _GNU_SOURCE
 
+#include <sys/sysmacros.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
@@ -24,6 +28,7 @@
 #include <string.h>
 #include <limits.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
@@ -44,21 +49,105 @@
 /* Bytes reserved for superblock at beginning of each component device */
 #define ZC_SB_RSVD_SIZE		4096
 
-static void zc_err_stderr(int priority __attribute__((unused)),
+/* Space available for the superblock extension */
+#define ZC_SB_EXT_MAX_SIZE	(ZC_SB_RSVD_SIZE - ZC_SB_EXT_OFFSET)
+
+/* Index of checksum in uint64_t[] representation of extension */
+#define ZC_SB_EXT_CKSUM_IDX	\
+			(offsetof(struct zc_sb_ext, cksum) / sizeof(uint64_t))
+
+/* Smallest valid extension (magic, checksum & size) */
+#define ZC_SB_EXT_MIN_SIZE	(3 * sizeof(uint64_t))
+
+/*
+ * Library context.  Holds everything that would otherwise be process-global,
+ * so independent users of the library (and threads) don't interfere with each
+ * other.  A context may be shared between threads once it has been set up.
+ */
+struct zc_ctx {
+	zc_log_fn_t	log_fn;
+	void		*userdata;
+	/* Only used by the default context; see zc_err_set_fn() */
+	void		(*err_fn)(int priority, const char *format, va_list ap);
+};
+
+static void zc_log_stderr(struct zc_ctx *const ctx __attribute__((unused)),
+			  const int priority __attribute__((unused)),
 			  const char *const format, va_list ap)
 {
 	vfprintf(stderr, format, ap);
 }
 
-static void (*zc_err_fn)(int priority, const char *format, va_list ap) =
-								zc_err_stderr;
+static void zc_log_err_fn(struct zc_ctx *const ctx, const int priority,
+			  const char *const format, va_list ap)
+{
+	ctx->err_fn(priority, format, ap);
+}
+
+/* Used by the functions that don't take a context */
+static struct zc_ctx zc_default_ctx = { .log_fn = zc_log_stderr };
+
+struct zc_ctx *zc_ctx_new(void)
+{
+	struct zc_ctx *ctx;
+
+	ctx = calloc(1, sizeof *ctx);
+	if (ctx == NULL)
+		return NULL;
+
+	ctx->log_fn = zc_log_stderr;
+
+	return ctx;
+}
+
+void zc_ctx_free(struct zc_ctx *const ctx)
+{
+	free(ctx);
+}
+
+/* A NULL log_fn discards all messages */
+void zc_ctx_set_log_fn(struct zc_ctx *const ctx, const zc_log_fn_t log_fn)
+{
+	ctx->log_fn = log_fn;
+}
+
+void zc_ctx_set_userdata(struct zc_ctx *const ctx, void *const userdata)
+{
+	ctx->userdata = userdata;
+}
+
+void *zc_ctx_get_userdata(const struct zc_ctx *const ctx)
+{
+	return ctx->userdata;
+}
+
+static void zc_log(struct zc_ctx *const ctx, const int priority,
+		   const char *const format, ...)
+				__attribute__((format(printf, 3, 4)));
+
+static void zc_log(struct zc_ctx *const ctx, const int priority,
+		   const char *const format, ...)
+{
+	va_list ap;
+
+	if (ctx == NULL || ctx->log_fn == 0)
+		return;
+
+	va_start(ap, format);
+	ctx->log_fn(ctx, priority, format, ap);
+	va_end(ap);
+}
 
+/* Not thread-safe; call before starting any threads that use the library */
 void zc_err_set_fn(void (*err_fn)(int priority, const char *format, va_list ap))
 {
-	if (err_fn == 0)
-		zc_err_fn = zc_err_stderr;
-	else
-		zc_err_fn = err_fn;
+	if (err_fn == 0) {
+		zc_default_ctx.log_fn = zc_log_stderr;
+	}
+	else {
+		zc_default_ctx.err_fn = err_fn;
+		zc_default_ctx.log_fn = zc_log_err_fn;
+	}
 }
 
 void zc_err(int priority, const char *format, ...)
@@ -66,20 +155,20 @@ void zc_err(int priority, const char *format, ...)
 	va_list ap;
 
 	va_start(ap, format);
-	zc_err_fn(priority, format, ap);
+	zc_default_ctx.log_fn(&zc_default_ctx, priority, format, ap);
 	va_end(ap);
 }
 
-uint64_t zc_sb_v0_cksum(const struct zc_sb_v0 *const sb)
+static uint64_t zc_cksum(const uint64_t *const a, const unsigned nelem,
+			 const unsigned cksum_idx)
 {
-	uint64_t *const a = (uint64_t *)sb;
 	uint64_t s1, s2, cksum;
 	uint32_t block;
 	unsigned i;
 
-	for (i = 0, s1 = 0, s2 = 0; i < ZC_SB_V0_NELEM; ++i) {
+	for (i = 0, s1 = 0, s2 = 0; i < nelem; ++i) {
 
-		if (i != ZC_SB_V0_CKSUM_IDX) {
+		if (i != cksum_idx) {
 			block = a[i] & 0xffffffff;
 			s1 += block;
 			s1 %= 4294967291;	/* largest uint32_t prime */
@@ -88,7 +177,7 @@ uint64_t zc_sb_v0_cksum(const struct zc_sb_v0 *const sb)
 		s2 += s1;
 		s2 %= 4294967291;
 
-		if (i != ZC_SB_V0_CKSUM_IDX) {
+		if (i != cksum_idx) {
 			block = a[i] >> 32;
 			s1 += block;
 			s1 %= 4294967291;
@@ -105,6 +194,12 @@ uint64_t zc_sb_v0_cksum(const struct zc_sb_v0 *const sb)
 	return cksum;
 }
 
+uint64_t zc_sb_v0_cksum(const struct zc_sb_v0 *const sb)
+{
+	return zc_cksum((const uint64_t *)sb, ZC_SB_V0_NELEM,
+			ZC_SB_V0_CKSUM_IDX);
+}
+
 static void zc_sb_v0_byteswap(struct zc_sb_v0 *const sb __attribute__((unused)))
 {
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
@@ -116,55 +211,225 @@ static void zc_sb_v0_byteswap(struct zc_sb_v0 *const sb __attribute__((unused)))
 #endif
 }
 
-int zc_sb_v0_write(const int fd, struct zc_sb_v0 *const sb)
+/*
+ * Common I/O wrapper.  A negative offset means "use (and advance) the file
+ * offset", which the original zc_sb_v0_read() & zc_sb_v0_write() did; other
+ * callers use explicit offsets, so they can share a file descriptor between
+ * threads.
+ */
+static int zc_io(struct zc_ctx *const ctx, const int fd, void *const buf,
+		 const size_t size, const off_t offset, const _Bool wr,
+		 const char *const what)
 {
 	ssize_t ret;
 
-	zc_sb_v0_byteswap(sb);
+	if (wr)
+		ret = (offset < 0) ? write(fd, buf, size) :
+						pwrite(fd, buf, size, offset);
+	else
+		ret = (offset < 0) ? read(fd, buf, size) :
+						pread(fd, buf, size, offset);
 
-	ret = write(fd, sb, sizeof *sb);
 	if (ret < 0) {
-		zc_err(LOG_ERR,
-		       "Failed to write component device superblock: %m\n");
-		ret = -1;
-	}
-	else if (ret != sizeof *sb) {
-		zc_err(LOG_ERR, "Failed to write component device superblock: "
-		       "Incorrect write size (wrote %zd bytes; expected %zu)\n",
-		       ret, sizeof *sb);
-		ret = -1;
+		zc_log(ctx, LOG_ERR, "Failed to %s %s: %m\n",
+		       wr ? "write" : "read", what);
+		return -1;
 	}
-	else {
-		ret = 0;
+
+	if ((size_t)ret != size) {
+		zc_log(ctx, LOG_ERR, "Failed to %s %s: Incorrect %s size "
+		       "(%s %zd bytes; expected %zu)\n", wr ? "write" : "read",
+		       what, wr ? "write" : "read", wr ? "wrote" : "read", ret,
+		       size);
+		return -1;
 	}
 
+	return 0;
+}
+
+static int zc_sb_v0_io_write(struct zc_ctx *const ctx, const int fd,
+			     struct zc_sb_v0 *const sb, const off_t offset)
+{
+	int ret;
+
+	zc_sb_v0_byteswap(sb);
+	ret = zc_io(ctx, fd, sb, sizeof *sb, offset, 1,
+		    "component device superblock");
 	zc_sb_v0_byteswap(sb);
 
 	return ret;
 }
 
+static int zc_sb_v0_io_read(struct zc_ctx *const ctx, const int fd,
+			    struct zc_sb_v0 *const sb, const off_t offset)
+{
+	if (zc_io(ctx, fd, sb, sizeof *sb, offset, 0,
+		  "component device superblock") < 0)
+		return -1;
+
+	zc_sb_v0_byteswap(sb);
+
+	return 0;
+}
+
+/* Reads/writes at the current file offset */
+int zc_sb_v0_write(const int fd, struct zc_sb_v0 *const sb)
+{
+	return zc_sb_v0_io_write(&zc_default_ctx, fd, sb, -1);
+}
+
 int zc_sb_v0_read(const int fd, struct zc_sb_v0 *const sb)
 {
-	ssize_t ret;
+	return zc_sb_v0_io_read(&zc_default_ctx, fd, sb, -1);
+}
 
-	ret = read(fd, sb, sizeof *sb);
-	if (ret < 0) {
-		zc_err(LOG_ERR,
-		       "Failed to read component device superblock: %m\n");
+/* Always read/write at offset 0; safe for concurrent use of the same fd */
+int zc_sb_v0_pwrite(struct zc_ctx *const ctx, const int fd,
+		    struct zc_sb_v0 *const sb)
+{
+	return zc_sb_v0_io_write(ctx, fd, sb, 0);
+}
+
+int zc_sb_v0_pread(struct zc_ctx *const ctx, const int fd,
+		   struct zc_sb_v0 *const sb)
+{
+	return zc_sb_v0_io_read(ctx, fd, sb, 0);
+}
+
+static void zc_u64_byteswap(uint64_t *const a __attribute__((unused)),
+			    const unsigned nelem __attribute__((unused)))
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	unsigned i;
+
+	for (i = 0; i < nelem; ++i)
+		a[i] = bswap_64(a[i]);
+#endif
+}
+
+/*
+ * Undoes zc_u64_byteswap() for the strings, which are stored as they are.  They
+ * run from crypt_cipher to the end of the extension.
+ */
+static void zc_sb_ext_strings(uint64_t *const buf, const unsigned nelem)
+{
+	static const unsigned first =
+		offsetof(struct zc_sb_ext, crypt_cipher) / sizeof(uint64_t);
+	static const unsigned end = sizeof(struct zc_sb_ext) / sizeof(uint64_t);
+
+	if (nelem > first)
+		zc_u64_byteswap(buf + first,
+				(nelem < end ? nelem : end) - first);
+}
+
+void zc_sb_ext_init(struct zc_sb_ext *const ext)
+{
+	memset(ext, 0, sizeof *ext);
+	ext->magic = ZC_SB_EXT_MAGIC;
+	ext->size = sizeof *ext;
+}
+
+uint64_t zc_sb_ext_cksum(const struct zc_sb_ext *const ext)
+{
+	return zc_cksum((const uint64_t *)ext, sizeof *ext / sizeof(uint64_t),
+			ZC_SB_EXT_CKSUM_IDX);
+}
+
+/*
+ * Writes the extension in the current format.  An extension that was read
+ * from a device formatted by a newer version of zodcache (with fields that
+ * this version doesn't know about) is never written back.
+ */
+int zc_sb_ext_pwrite(struct zc_ctx *const ctx, const int fd,
+		     struct zc_sb_ext *const ext)
+{
+	int ret;
+
+	if (ext->size > sizeof *ext) {
+		zc_log(ctx, LOG_ERR, "Refusing to overwrite superblock "
+		       "extension written by a newer version of zodcache\n");
 		return -1;
 	}
-	else if (ret != sizeof *sb) {
-		zc_err(LOG_ERR, "Failed to read component device superblock: "
-		       "Incorrect read size (read %zd bytes; expected %zu)\n",
-		       ret, sizeof *sb);
-		return -1;
+
+	ext->magic = ZC_SB_EXT_MAGIC;
+	ext->size = sizeof *ext;
+	ext->cksum = zc_sb_ext_cksum(ext);
+
+	zc_u64_byteswap((uint64_t *)ext, sizeof *ext / sizeof(uint64_t));
+	zc_sb_ext_strings((uint64_t *)ext, sizeof *ext / sizeof(uint64_t));
+	ret = zc_io(ctx, fd, ext, sizeof *ext, ZC_SB_EXT_OFFSET, 1,
+		    "superblock extension");
+	zc_sb_ext_strings((uint64_t *)ext, sizeof *ext / sizeof(uint64_t));
+	zc_u64_byteswap((uint64_t *)ext, sizeof *ext / sizeof(uint64_t));
+
+	return ret;
+}
+
+/* Converts a raw (on-disk) extension; returns a static issue string on error */
+static const char *zc_sb_ext_decode(uint64_t *const buf,
+				    struct zc_sb_ext *const ext)
+{
+	unsigned nelem;
+
+	zc_u64_byteswap(buf, ZC_SB_EXT_MIN_SIZE / sizeof(uint64_t));
+
+	/* No extension (formatted by an older version) */
+	if (buf[0] != ZC_SB_EXT_MAGIC) {
+		memset(ext, 0, sizeof *ext);
+		return NULL;
 	}
 
-	zc_sb_v0_byteswap(sb);
+	if (buf[2] < ZC_SB_EXT_MIN_SIZE || buf[2] > ZC_SB_EXT_MAX_SIZE ||
+						buf[2] % sizeof(uint64_t) != 0)
+		return "Invalid superblock extension size";
+
+	nelem = buf[2] / sizeof(uint64_t);
+	zc_u64_byteswap(buf + ZC_SB_EXT_MIN_SIZE / sizeof(uint64_t),
+			nelem - ZC_SB_EXT_MIN_SIZE / sizeof(uint64_t));
+	zc_sb_ext_strings(buf, nelem);
+
+	if (buf[ZC_SB_EXT_CKSUM_IDX] !=
+				zc_cksum(buf, nelem, ZC_SB_EXT_CKSUM_IDX))
+		return "Incorrect superblock extension checksum";
+
+	memset(ext, 0, sizeof *ext);
+	memcpy(ext, buf, nelem < sizeof *ext / sizeof(uint64_t) ?
+					nelem * sizeof(uint64_t) : sizeof *ext);
+	ext->crypt_cipher[sizeof ext->crypt_cipher - 1] = 0;
+	ext->crypt_key[sizeof ext->crypt_key - 1] = 0;
+	ext->o_thin_pool[sizeof ext->o_thin_pool - 1] = 0;
+
+	return NULL;
+}
+
+int zc_sb_ext_pread(struct zc_ctx *const ctx, const int fd,
+		    struct zc_sb_ext *const ext)
+{
+	uint64_t buf[ZC_SB_EXT_MAX_SIZE / sizeof(uint64_t)];
+	const char *issue;
+
+	if (zc_io(ctx, fd, buf, sizeof buf, ZC_SB_EXT_OFFSET, 0,
+		  "superblock extension") < 0)
+		return -1;
+
+	if ((issue = zc_sb_ext_decode(buf, ext)) != NULL) {
+		zc_log(ctx, LOG_ERR, "%s\n", issue);
+		return -1;
+	}
 
 	return 0;
 }
 
+int zc_sb_ext_write(const int fd, struct zc_sb_ext *const ext)
+{
+	return zc_sb_ext_pwrite(&zc_default_ctx, fd, ext);
+}
+
+int zc_sb_ext_read(const int fd, struct zc_sb_ext *const ext)
+{
+	return zc_sb_ext_pread(&zc_default_ctx, fd, ext);
+}
+
 void zc_sb_v0_uuid_set(const uint8_t *const uuid, struct zc_sb_v0 *const sb)
 {
 	uint64_t lo, hi;
@@ -197,31 +462,10 @@ void zc_sb_v0_uuid_get(uint8_t *const uuid, const struct zc_sb_v0 *const sb)
 	memcpy(uuid + 8, &hi, 8);
 }
 
-static void *zc_malloc(size_t size)
-{
-	void *p;
-
-	p = malloc(size);
-	if (p == NULL) {
-		zc_err(LOG_CRIT, "Memory allocation failure. Aborting.\n");
-		abort();
-	}
-
-	return p;
-}
-
-static char *zc_strdup(const char *const s)
-{
-	size_t size;
-	char *p;
-
-	size = strlen(s) + 1;
-	p = zc_malloc(size);
-	memcpy(p, s, size);
-
-	return p;
-}
-
+/*
+ * Convenience for the zodcache programs; aborts if the allocation fails.  No
+ * other library function uses it.
+ */
 char *zc_asprintf(const char *const fmt, ...)
 {
 	va_list ap;
@@ -248,20 +492,20 @@ _Bool zc_block_size_check(const uint64_t block_size, const issue_cb_t issue_cb,
 
 	if (block_size < 32768) {
 		i = "Block size smaller than 32 KiB (32768 bytes)";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 
 	if (block_size > 1073741824) {
 		i = "Block size larger than 1 GiB (1073741824 bytes)";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (block_size % 32768 != 0) {
 		i = "Block size not a multiple of 32 KiB (32768 bytes)";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
@@ -281,37 +525,37 @@ static  _Bool zc_sb_v0_origin_dev_check(const struct zc_sb_v0 *const sb,
 
 	if (sb->o_offset == 0) {
 		i = "Origin offset not set for origin device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->o_size == 0) {
 		i = "Origin size not set for origin device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->c_offset != 0) {
 		i = "Non-zero cache offset for origin device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->c_size != 0) {
 		i = "Non-zero cache size for origin device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->md_offset != 0) {
 		i = "Non-zero metadata offset for origin device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->md_size != 0) {
 		i = "Non-zero metadata size for origin device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
@@ -326,37 +570,37 @@ static _Bool zc_sb_v0_cache_dev_check(const struct zc_sb_v0 *const sb,
 
 	if (sb->o_offset != 0) {
 		i = "Non-zero origin offset for cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->o_size != 0) {
 		i = "Non-zero origin size for cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->c_offset == 0) {
 		i = "Cache offset not set for cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->c_size == 0) {
 		i = "Cache size not set for cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->md_offset != 0) {
 		i = "Non-zero metadata offset for (non-combined) cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->md_size != 0) {
 		i = "Non-zero metadata size for (non-combined) cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
@@ -371,37 +615,37 @@ static _Bool zc_sb_v0_metadata_dev_check(const struct zc_sb_v0 *const sb,
 
 	if (sb->o_offset != 0) {
 		i = "Non-zero origin offset for metadata device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->o_size != 0) {
 		i = "Non-zero origin size for metadata device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->c_offset != 0) {
 		i = "Non-zero cache offset for (non-combined) metadata device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->c_size != 0) {
 		i = "Non-zero cache size for (non-combined) metadata device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->md_offset == 0) {
 		i = "Metadata offset not set for metadata device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->md_size == 0) {
 		i = "Metadata size not set for metadata device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
@@ -416,37 +660,37 @@ static _Bool zc_sb_v0_combined_dev_check(const struct zc_sb_v0 *const sb,
 
 	if (sb->o_offset != 0) {
 		i = "Non-zero origin offset for combined cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->o_size != 0) {
 		i = "Non-zero origin size for combined cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->c_offset == 0) {
 		i = "Cache offset not set for combined cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->c_size == 0) {
 		i = "Cache size not set for combined cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->md_offset == 0) {
 		i = "Metadata offset not set for combined cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->md_size == 0) {
 		i = "Metadata size not set for combined cache device";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
@@ -460,25 +704,25 @@ _Bool zc_sb_v0_check(const struct zc_sb_v0 *const sb, const issue_cb_t issue_cb,
 
 	if (sb->magic != ZC_SB_MAGIC) {
 		i = "Incorrect magic number";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->cksum != zc_sb_v0_cksum(sb)) {
 		i = "Incorrect superblock checksum";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->version != 0) {
 		i = "Incorrect superblock version";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
 	if (sb->size != sizeof *sb) {
 		i = "Incorrect superblock size";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
@@ -487,7 +731,7 @@ _Bool zc_sb_v0_check(const struct zc_sb_v0 *const sb, const issue_cb_t issue_cb,
 
 	if (sb->cache_mode > ZC_SB_MODE_PASSTHROUGH) {
 		i = "Invalid cache mode";
-		if (issue_cb == 0 || issue_cb(zc_strdup(i), context) == 0)
+		if (issue_cb == 0 || issue_cb(i, context) == 0)
 			return 0;
 	}
 
@@ -506,7 +750,7 @@ _Bool zc_sb_v0_check(const struct zc_sb_v0 *const sb, const issue_cb_t issue_cb,
 	if (issue_cb == 0)
 		return 0;
 
-	return issue_cb(zc_strdup("Invalid device type"), context);
+	return issue_cb("Invalid device type", context);
 }
 
 _Bool zc_sb_v0_is_valid(const struct zc_sb_v0 *const sb)
@@ -514,7 +758,9 @@ _Bool zc_sb_v0_is_valid(const struct zc_sb_v0 *const sb)
 	return zc_sb_v0_check(sb, 0, NULL);
 }
 
-char *zc_size_format(const uint64_t size, const _Bool verbose)
+/* Allocation-free version of zc_size_format(); returns buf */
+char *zc_size_format_r(const uint64_t size, const _Bool verbose,
+		       char buf[ZC_SIZE_BUF_SIZE])
 {
 	static const char *const fmts[][2] = {
 		[0]	= { "%" PRIu64 "G",	"%'" PRIu64 " GiB" },
@@ -525,28 +771,49 @@ char *zc_size_format(const uint64_t size, const _Bool verbose)
 
 	if (size != 0) {
 
-		if (size % 1073741824 == 0)
-			return zc_asprintf(fmts[0][verbose], size / 1073741824);
+		if (size % 1073741824 == 0) {
+			snprintf(buf, ZC_SIZE_BUF_SIZE, fmts[0][verbose],
+				 size / 1073741824);
+			return buf;
+		}
 
-		if (size % 1048576 == 0)
-			return zc_asprintf(fmts[1][verbose], size / 1048576);
+		if (size % 1048576 == 0) {
+			snprintf(buf, ZC_SIZE_BUF_SIZE, fmts[1][verbose],
+				 size / 1048576);
+			return buf;
+		}
 
-		if (size % 1024 == 0)
-			return zc_asprintf(fmts[2][verbose], size / 1024);
+		if (size % 1024 == 0) {
+			snprintf(buf, ZC_SIZE_BUF_SIZE, fmts[2][verbose],
+				 size / 1024);
+			return buf;
+		}
 	}
 
-	return zc_asprintf(fmts[3][verbose], size);
+	snprintf(buf, ZC_SIZE_BUF_SIZE, fmts[3][verbose], size);
+	return buf;
+}
+
+/* Returns NULL if memory can't be allocated */
+char *zc_size_format(const uint64_t size, const _Bool verbose)
+{
+	char buf[ZC_SIZE_BUF_SIZE];
+
+	return strdup(zc_size_format_r(size, verbose, buf));
 }
 
-static _Bool zc_block_size_parse_cb(char *const issue, void *const context)
+static _Bool zc_block_size_parse_cb(const char *const issue,
+				    void *const context)
 {
-	char **const i = context;
+	const char **const i = context;
 	*i = issue;
 	return 0;
 }
 
-int zc_size_parse(const char *const s, uint64_t *const out)
+static int zc_size_parse_ctx(struct zc_ctx *const ctx, const char *const s,
+			     uint64_t *const out)
 {
+	const char *issue;
 	long size, unit;
 	char *p;
 
@@ -556,7 +823,7 @@ int zc_size_parse(const char *const s, uint64_t *const out)
 		goto parse_error;
 
 	if (size < 0) {
-		p = zc_strdup("Negative block size");
+		issue = "Negative block size";
 		goto invalid_size;
 	}
 
@@ -572,8 +839,7 @@ int zc_size_parse(const char *const s, uint64_t *const out)
 		goto parse_error;
 
 	if (size >= LONG_MAX / unit) {
-		p = "Block size too large";
-		p = zc_strdup(p);
+		issue = "Block size too large";
 		goto invalid_size;
 	}
 
@@ -583,25 +849,28 @@ int zc_size_parse(const char *const s, uint64_t *const out)
 	return 0;
 
 invalid_size:
-	zc_err(LOG_WARNING, "Invalid block size: %s: %s\n", s, p);
-	free(p);
+	zc_log(ctx, LOG_WARNING, "Invalid block size: %s: %s\n", s, issue);
 	return -1;
 
 parse_error:
-	zc_err(LOG_WARNING, "Invalid block size: %s\n", s);
+	zc_log(ctx, LOG_WARNING, "Invalid block size: %s\n", s);
 	return -1;
 }
 
+int zc_size_parse(const char *const s, uint64_t *const out)
+{
+	return zc_size_parse_ctx(&zc_default_ctx, s, out);
+}
+
 int zc_block_size_parse(const char *const s, uint64_t *const block_size)
 {
-	char *p;
+	const char *issue;
 
 	if (zc_size_parse(s, block_size) < 0)
 		return -1;
 
-	if (!zc_block_size_check(*block_size, zc_block_size_parse_cb, &p)) {
-		zc_err(LOG_WARNING, "Invalid block size: %s: %s\n", s, p);
-		free(p);
+	if (!zc_block_size_check(*block_size, zc_block_size_parse_cb, &issue)) {
+		zc_err(LOG_WARNING, "Invalid block size: %s: %s\n", s, issue);
 		return -1;
 	}
 
@@ -657,6 +926,310 @@ const char *zc_dev_type_format(const uint64_t dev_type, const _Bool quiet)
 	return zc_dev_types[dev_type];
 }
 
+/*
+ * Parses an uncached zone specification (START:LEN, in bytes with optional
+ * K/M/G suffixes) into sectors.  A NULL context means the default, here and
+ * in the zone & pin functions below.
+ */
+int zc_zone_parse(struct zc_ctx *ctx, const char *const s,
+		  uint64_t *const start, uint64_t *const len)
+{
+	const char *colon;
+	char *buf;
+	int ret;
+
+	if (ctx == NULL)
+		ctx = &zc_default_ctx;
+
+	if ((colon = strchr(s, ':')) == NULL) {
+		zc_log(ctx, LOG_WARNING,
+		       "Invalid zone (expected START:LEN): %s\n", s);
+		return -1;
+	}
+
+	if ((buf = strndup(s, colon - s)) == NULL) {
+		zc_log(ctx, LOG_ERR, "%m\n");
+		return -1;
+	}
+
+	ret = zc_size_parse_ctx(ctx, buf, start);
+	free(buf);
+
+	if (ret < 0 || zc_size_parse_ctx(ctx, colon + 1, len) < 0)
+		return -1;
+
+	if (*start % 512 != 0 || *len % 512 != 0 || *len == 0) {
+		zc_log(ctx, LOG_WARNING, "Invalid zone: %s: not a multiple of "
+		       "512 bytes\n", s);
+		return -1;
+	}
+
+	*start /= 512;
+	*len /= 512;
+	return 0;
+}
+
+static _Bool zc_overlaps(const uint64_t a_start, const uint64_t a_len,
+			 const uint64_t b_start, const uint64_t b_len)
+{
+	return a_start < b_start + b_len && b_start < a_start + a_len;
+}
+
+/* Checks a new zone or pin against the existing zones and pins */
+static int zc_range_check(struct zc_ctx *const ctx,
+			  const struct zc_sb_ext *const ext,
+			  const uint64_t start, const uint64_t len,
+			  const uint64_t o_sectors, const uint64_t block_sectors)
+{
+	uint64_t i;
+
+	if (start % block_sectors != 0 || len % block_sectors != 0) {
+		zc_log(ctx, LOG_ERR, "Range not aligned to cache block size\n");
+		return -1;
+	}
+
+	if (len == 0 || start >= o_sectors || len > o_sectors - start) {
+		zc_log(ctx, LOG_ERR,
+		       "Range extends beyond end of origin device\n");
+		return -1;
+	}
+
+	for (i = 0; i < ext->zones_count && i < ZC_SB_EXT_MAX_ZONES; ++i) {
+		if (zc_overlaps(start, len, ext->zones[i].start,
+				ext->zones[i].len)) {
+			zc_log(ctx, LOG_ERR,
+			       "Range overlaps an uncached zone\n");
+			return -1;
+		}
+	}
+
+	for (i = 0; i < ext->pins_count && i < ZC_SB_EXT_MAX_PINS; ++i) {
+		if (zc_overlaps(start, len, ext->pins[i].start,
+				ext->pins[i].len)) {
+			zc_log(ctx, LOG_ERR, "Range overlaps a pinned extent\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Adds an uncached zone to the extension, keeping the zones sorted.  The zone
+ * must be aligned to the cache block size, lie within the origin, and not
+ * overlap an existing zone or pin.  All values are in sectors.
+ */
+int zc_zone_add(struct zc_ctx *ctx, struct zc_sb_ext *const ext,
+		const uint64_t start, const uint64_t len,
+		const uint64_t o_sectors, const uint64_t block_sectors)
+{
+	uint64_t i;
+
+	if (ctx == NULL)
+		ctx = &zc_default_ctx;
+
+	if (ext->zones_count >= ZC_SB_EXT_MAX_ZONES) {
+		zc_log(ctx, LOG_ERR, "Too many zones (maximum is %d)\n",
+		       ZC_SB_EXT_MAX_ZONES);
+		return -1;
+	}
+
+	if (zc_range_check(ctx, ext, start, len, o_sectors,
+			   block_sectors) < 0)
+		return -1;
+
+	for (i = 0; i < ext->zones_count; ++i) {
+		if (start < ext->zones[i].start)
+			break;
+	}
+
+	memmove(ext->zones + i + 1, ext->zones + i,
+		(ext->zones_count - i) * sizeof *ext->zones);
+	ext->zones[i].start = start;
+	ext->zones[i].len = len;
+	++ext->zones_count;
+
+	return 0;
+}
+
+/* Removes the zone that exactly matches start & len */
+int zc_zone_remove(struct zc_ctx *ctx, struct zc_sb_ext *const ext,
+		   const uint64_t start, const uint64_t len)
+{
+	uint64_t i;
+
+	if (ctx == NULL)
+		ctx = &zc_default_ctx;
+
+	for (i = 0; i < ext->zones_count; ++i) {
+
+		if (ext->zones[i].start != start || ext->zones[i].len != len)
+			continue;
+
+		memmove(ext->zones + i, ext->zones + i + 1,
+			(ext->zones_count - i - 1) * sizeof *ext->zones);
+		--ext->zones_count;
+		memset(ext->zones + ext->zones_count, 0, sizeof *ext->zones);
+		return 0;
+	}
+
+	zc_log(ctx, LOG_ERR, "No such zone\n");
+	return -1;
+}
+
+/*
+ * Adds a pinned extent (in the PENDING state), allocating space for it in the
+ * pin area (first fit).  Same rules as zc_zone_add().
+ */
+int zc_pin_add(struct zc_ctx *ctx, struct zc_sb_ext *const ext,
+	       const uint64_t start, const uint64_t len,
+	       const uint64_t o_sectors, const uint64_t block_sectors)
+{
+	uint64_t i, j, offset;
+
+	if (ctx == NULL)
+		ctx = &zc_default_ctx;
+
+	if (ext->pin_size == 0) {
+		zc_log(ctx, LOG_ERR, "Set has no pin area\n");
+		return -1;
+	}
+
+	if (ext->pins_count >= ZC_SB_EXT_MAX_PINS) {
+		zc_log(ctx, LOG_ERR,
+		       "Too many pinned extents (maximum is %d)\n",
+		       ZC_SB_EXT_MAX_PINS);
+		return -1;
+	}
+
+	if (zc_range_check(ctx, ext, start, len, o_sectors,
+			   block_sectors) < 0)
+		return -1;
+
+	/* Candidates are the start of the area and the end of each pin */
+	for (offset = 0, i = 0; i <= ext->pins_count; ++i) {
+
+		if (i > 0)
+			offset = ext->pins[i - 1].offset + ext->pins[i - 1].len;
+
+		if (offset + len > ext->pin_size)
+			continue;
+
+		for (j = 0; j < ext->pins_count; ++j) {
+			if (zc_overlaps(offset, len, ext->pins[j].offset,
+					ext->pins[j].len))
+				break;
+		}
+
+		if (j == ext->pins_count)
+			break;
+	}
+
+	if (i > ext->pins_count) {
+		zc_log(ctx, LOG_ERR, "Not enough free space in pin area\n");
+		return -1;
+	}
+
+	for (i = 0; i < ext->pins_count; ++i) {
+		if (start < ext->pins[i].start)
+			break;
+	}
+
+	memmove(ext->pins + i + 1, ext->pins + i,
+		(ext->pins_count - i) * sizeof *ext->pins);
+	ext->pins[i].start = start;
+	ext->pins[i].len = len;
+	ext->pins[i].offset = offset;
+	ext->pins[i].state = ZC_PIN_PENDING;
+	++ext->pins_count;
+
+	return 0;
+}
+
+/* Returns the index of the pin that exactly matches start & len, or -1 */
+int zc_pin_find(const struct zc_sb_ext *const ext, const uint64_t start,
+		const uint64_t len)
+{
+	uint64_t i;
+
+	for (i = 0; i < ext->pins_count && i < ZC_SB_EXT_MAX_PINS; ++i) {
+		if (ext->pins[i].start == start && ext->pins[i].len == len)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Returns the index of the pin that is being copied, or -1 */
+int zc_pin_in_flight(const struct zc_sb_ext *const ext)
+{
+	uint64_t i;
+
+	for (i = 0; i < ext->pins_count && i < ZC_SB_EXT_MAX_PINS; ++i) {
+		if (ext->pins[i].state != ZC_PIN_RESIDENT)
+			return i;
+	}
+
+	return -1;
+}
+
+void zc_pin_delete(struct zc_sb_ext *const ext, const unsigned i)
+{
+	memmove(ext->pins + i, ext->pins + i + 1,
+		(ext->pins_count - i - 1) * sizeof *ext->pins);
+	--ext->pins_count;
+	memset(ext->pins + ext->pins_count, 0, sizeof *ext->pins);
+}
+
+/*
+ * Records a set's dm-crypt cipher (e.g. aes-xts-plain64) and key source: the
+ * absolute path of a key file, or a kernel keyring key (TYPE:DESCRIPTION, where
+ * TYPE is logon, user, encrypted or trusted).  Either may be the extension's
+ * current value.  A NULL context means the default.
+ */
+int zc_crypt_parse(struct zc_ctx *ctx, struct zc_sb_ext *const ext,
+		   const char *const cipher, const char *const key)
+{
+	static const char *const types[] = {
+		"logon:", "user:", "encrypted:", "trusted:"
+	};
+	char c[sizeof ext->crypt_cipher], k[sizeof ext->crypt_key];
+	size_t len;
+	_Bool ok;
+	unsigned i;
+
+	if (ctx == NULL)
+		ctx = &zc_default_ctx;
+
+	if (*cipher == 0 || strlen(cipher) >= sizeof c ||
+					strpbrk(cipher, " \t\n") != NULL) {
+		zc_log(ctx, LOG_ERR, "Invalid cipher: %s\n", cipher);
+		return -1;
+	}
+
+	ok = (key[0] == '/');
+
+	for (i = 0; !ok && i < sizeof types / sizeof types[0]; ++i) {
+		len = strlen(types[i]);
+		ok = strncmp(key, types[i], len) == 0 && key[len] != 0;
+	}
+
+	if (!ok || strlen(key) >= sizeof k || strpbrk(key, " \t\n") != NULL) {
+		zc_log(ctx, LOG_ERR, "Invalid key (expected a key file path "
+		       "or TYPE:DESCRIPTION): %s\n", key);
+		return -1;
+	}
+
+	memset(c, 0, sizeof c);
+	strcpy(c, cipher);
+	memset(k, 0, sizeof k);
+	strcpy(k, key);
+	memcpy(ext->crypt_cipher, c, sizeof c);
+	memcpy(ext->crypt_key, k, sizeof k);
+
+	return 0;
+}
+
 const char *zc_uuid_format(const uint8_t *const uuid, char *const buf)
 {
 	unsigned i;
@@ -695,3 +1268,510 @@ const char *zc_sb_uuid_format(const struct zc_sb_v0 *const sb, char *const buf)
 	zc_sb_v0_uuid_get(uuid, sb);
 	return zc_uuid_format(uuid, buf);
 }
+
+/* Records the first problem found by zc_sb_v0_check() */
+static _Bool zc_probe_issue_cb(const char *const issue, void *const context)
+{
+	const char **const i = context;
+	*i = issue;
+	return 0;
+}
+
+static void zc_probe_one(struct zc_probe *const p)
+{
+	uint64_t buf[ZC_SB_EXT_MAX_SIZE / sizeof(uint64_t)];
+	struct stat st;
+	int fd;
+
+	p->issue = NULL;
+	p->error = 0;
+
+	fd = open(p->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto error;
+
+	if (fstat(fd, &st) < 0)
+		goto error_close;
+
+	if (!S_ISBLK(st.st_mode)) {
+		p->status = ZC_PROBE_INVALID;
+		p->issue = "Not a block device";
+		goto out;
+	}
+
+	p->devno = st.st_rdev;
+	errno = 0;
+
+	/* Logging is left to the caller */
+	if (zc_sb_v0_io_read(NULL, fd, &p->sb, 0) < 0)
+		goto error_close;
+
+	if (p->sb.magic != ZC_SB_MAGIC) {
+		p->status = ZC_PROBE_NONE;
+		goto out;
+	}
+
+	if (!zc_sb_v0_check(&p->sb, zc_probe_issue_cb, &p->issue)) {
+		p->status = ZC_PROBE_INVALID;
+		goto out;
+	}
+
+	if (p->sb.dev_major != major(st.st_rdev)) {
+		p->status = ZC_PROBE_INVALID;
+		p->issue = "Device major number mismatch";
+		goto out;
+	}
+
+	if (pread(fd, buf, sizeof buf, ZC_SB_EXT_OFFSET) != sizeof buf)
+		goto error_close;
+
+	if ((p->issue = zc_sb_ext_decode(buf, &p->ext)) != NULL) {
+		p->status = ZC_PROBE_INVALID;
+		goto out;
+	}
+
+	p->status = ZC_PROBE_MEMBER;
+
+out:
+	close(fd);
+	return;
+
+error_close:
+	p->error = (errno != 0) ? errno : EIO;
+	close(fd);
+	p->status = ZC_PROBE_ERROR;
+	return;
+
+error:
+	p->error = errno;
+	p->status = ZC_PROBE_ERROR;
+}
+
+struct zc_probe_work {
+	struct zc_probe		*probes;
+	size_t			count;
+	size_t			next;		/* updated atomically */
+};
+
+static void *zc_probe_thread(void *const arg)
+{
+	struct zc_probe_work *const work = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED))
+							< work->count) {
+		zc_probe_one(&work->probes[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads and validates the superblocks (and extensions) of many devices,
+ * using up to nr_threads threads.  Per-device results are stored in the
+ * array; nothing is logged for individual devices.  If threads can't be
+ * started, the calling thread does the rest of the work itself.  Returns the
+ * number of valid component devices found.
+ */
+ssize_t zc_probe_devices(struct zc_ctx *const ctx, struct zc_probe *const probes,
+			 const size_t count, unsigned nr_threads)
+{
+	struct zc_probe_work work = { .probes = probes, .count = count };
+	pthread_t threads[ZC_PROBE_MAX_THREADS];
+	unsigned i, started;
+	ssize_t members;
+	int err;
+
+	if (nr_threads > ZC_PROBE_MAX_THREADS)
+		nr_threads = ZC_PROBE_MAX_THREADS;
+	if (nr_threads > count)
+		nr_threads = count;
+
+	/* The calling thread does its share of the work */
+	for (started = 0; started + 1 < nr_threads; ++started) {
+		err = pthread_create(&threads[started], NULL, zc_probe_thread,
+				     &work);
+		if (err != 0) {
+			zc_log(ctx, LOG_WARNING, "Failed to start probe thread: "
+			       "%s\n", strerror(err));
+			break;
+		}
+	}
+
+	zc_probe_thread(&work);
+
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0, members = 0; i < count; ++i)
+		members += (probes[i].status == ZC_PROBE_MEMBER);
+
+	return members;
+}
+
+/*
+ * Layout planning.  The metadata sizes are counted in 4 KiB metadata blocks,
+ * from the on-disk structures of dm-cache (drivers/md/persistent-data): a
+ * dm-array is a btree of array blocks, each with a 24-byte header, and a btree
+ * node has room for 252 keys & values (64 bits each).  Btree nodes can be only
+ * half full after splits.
+ */
+#define ZC_MD_BLOCK_SIZE	4096
+#define ZC_MD_ARRAY_HDR		24
+#define ZC_MD_BTREE_MIN_FILL	126
+#define ZC_MD_BITMAP_BLOCKS	16320		/* blocks per space map bitmap */
+#define ZC_MD_MAX_BLOCKS	(255 * ZC_MD_BITMAP_BLOCKS)
+#define ZC_MD_MIN_SIZE		8388608		/* from lvmcache(7) */
+
+/* Reserve for transactions, in addition to one shadow of each live block */
+#define ZC_MD_XACTION_BLOCKS	256
+
+/* dm-cache limits the discard bitset to 16K bits */
+#define ZC_DISCARD_MAX_BLOCKS	16384
+
+static uint64_t zc_div_up(const uint64_t n, const uint64_t d)
+{
+	return (n + d - 1) / d;
+}
+
+static uint64_t zc_pow2_up(const uint64_t n)
+{
+	uint64_t p;
+
+	for (p = 1; p < n; p <<= 1);
+
+	return p;
+}
+
+static uint64_t zc_md_btree_blocks(uint64_t nr_values)
+{
+	uint64_t blocks;
+
+	for (blocks = 1; nr_values > ZC_MD_BTREE_MIN_FILL; blocks += nr_values)
+		nr_values = zc_div_up(nr_values, ZC_MD_BTREE_MIN_FILL);
+
+	return blocks;
+}
+
+static uint64_t zc_md_array_blocks(const uint64_t nr_entries,
+				   const uint64_t entry_size)
+{
+	uint64_t nr_blocks;
+
+	nr_blocks = zc_div_up(nr_entries,
+			(ZC_MD_BLOCK_SIZE - ZC_MD_ARRAY_HDR) / entry_size);
+
+	return nr_blocks + zc_md_btree_blocks(nr_blocks);
+}
+
+/* Bitsets are dm-arrays of 64-bit words */
+static uint64_t zc_md_bitset_blocks(const uint64_t nr_bits)
+{
+	return zc_md_array_blocks(zc_div_up(nr_bits, 64), 8);
+}
+
+/* Kernel bitsets are arrays of longs */
+static uint64_t zc_kmem_bitset(const uint64_t nr_bits)
+{
+	return zc_div_up(nr_bits, 64) * 8;
+}
+
+static uint64_t zc_plan_discard_blocks(const struct zc_plan *const plan)
+{
+	uint64_t dblock_size;
+
+	if (plan->origin_size == 0)
+		return 0;
+
+	dblock_size = plan->block_size;
+	while (plan->origin_size / dblock_size > ZC_DISCARD_MAX_BLOCKS)
+		dblock_size *= 2;
+
+	return zc_div_up(plan->origin_size, dblock_size);
+}
+
+/* Metadata space needed for nr_blocks cache blocks, in bytes */
+static uint64_t zc_plan_md_needed(const struct zc_plan *const plan,
+				  const uint64_t nr_blocks)
+{
+	uint64_t live, total;
+
+	live = 1;					/* superblock */
+	live += zc_md_array_blocks(nr_blocks, 8);	/* mappings */
+	live += zc_md_bitset_blocks(zc_plan_discard_blocks(plan));
+
+	if (plan->hint_size != 0)
+		live += zc_md_array_blocks(nr_blocks, plan->hint_size);
+
+	/* Version 2 moves the dirty flags out of the mappings */
+	if (plan->md_version == 2)
+		live += zc_md_bitset_blocks(nr_blocks);
+
+	total = 2 * live + ZC_MD_XACTION_BLOCKS;
+	total += 1 + zc_div_up(total, ZC_MD_BITMAP_BLOCKS);	/* space map */
+	total *= ZC_MD_BLOCK_SIZE;
+
+	return total < ZC_MD_MIN_SIZE ? ZC_MD_MIN_SIZE : total;
+}
+
+/*
+ * Estimated kernel memory for nr_blocks cache blocks: the dm-cache dirty &
+ * discard bitsets, and the smq policy's entries (one per cache block and per
+ * hotspot block, plus sentinels), hash tables, and hit bitsets.
+ */
+static void zc_plan_kmem(struct zc_plan *const plan)
+{
+	uint64_t nr_hotspots;
+
+	plan->kmem_cache = zc_kmem_bitset(plan->nr_blocks) +
+			zc_kmem_bitset(zc_plan_discard_blocks(plan));
+
+	nr_hotspots = plan->nr_blocks / 4;
+	if (nr_hotspots < 1024)
+		nr_hotspots = 1024;
+
+	plan->kmem_policy = 24 * (256 + nr_hotspots + plan->nr_blocks) +
+		4 * zc_pow2_up(plan->nr_blocks / 4 < 16 ?
+						16 : plan->nr_blocks / 4) +
+		4 * zc_pow2_up(nr_hotspots / 4) +
+		zc_kmem_bitset(plan->nr_blocks) + zc_kmem_bitset(nr_hotspots);
+}
+
+/*
+ * Fills in the outputs of a plan.  With no separate metadata area (md_avail
+ * is 0), the cache area (rounded up to the alignment) and the metadata share
+ * cache_size, and the largest number of cache blocks that fits is used.
+ * Returns -1 if the plan isn't possible.  A NULL context means the default.
+ */
+int zc_plan(struct zc_ctx *ctx, struct zc_plan *const plan)
+{
+	const char *issue;
+	uint64_t lo, hi, mid;
+
+	if (ctx == NULL)
+		ctx = &zc_default_ctx;
+
+	if (!zc_block_size_check(plan->block_size, zc_block_size_parse_cb,
+				 &issue)) {
+		zc_log(ctx, LOG_ERR, "Invalid block size: %s\n", issue);
+		return -1;
+	}
+
+	if (plan->alignment < 4096 ||
+			(plan->alignment & (plan->alignment - 1)) != 0) {
+		zc_log(ctx, LOG_ERR, "Invalid alignment: %" PRIu64 "\n",
+		       plan->alignment);
+		return -1;
+	}
+
+	if (plan->md_version != 1 && plan->md_version != 2) {
+		zc_log(ctx, LOG_ERR, "Invalid metadata version: %u\n",
+		       plan->md_version);
+		return -1;
+	}
+
+	if (plan->md_avail == 0) {
+
+		/* Largest nr_blocks that fits; md_needed() only grows */
+		lo = 0;
+		hi = plan->cache_size / plan->block_size;
+
+		while (lo < hi) {
+			mid = hi - (hi - lo) / 2;
+			plan->c_size = zc_div_up(mid * plan->block_size,
+					plan->alignment) * plan->alignment;
+			if (plan->c_size + zc_plan_md_needed(plan, mid) <=
+							plan->cache_size)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+
+		plan->nr_blocks = lo;
+		plan->c_size = zc_div_up(lo * plan->block_size,
+					 plan->alignment) * plan->alignment;
+		plan->md_size = plan->cache_size - plan->c_size;
+	}
+	else {
+		plan->nr_blocks = plan->cache_size / plan->block_size;
+		plan->c_size = plan->cache_size;
+		plan->md_size = plan->md_avail;
+	}
+
+	if (plan->nr_blocks == 0) {
+		zc_log(ctx, LOG_ERR, "Cache device too small\n");
+		return -1;
+	}
+
+	plan->md_needed = zc_plan_md_needed(plan, plan->nr_blocks);
+
+	if (plan->md_needed > (uint64_t)ZC_MD_MAX_BLOCKS * ZC_MD_BLOCK_SIZE) {
+		zc_log(ctx, LOG_ERR, "Too many cache blocks (%" PRIu64 ") for "
+		       "dm-cache metadata; use a larger block size\n",
+		       plan->nr_blocks);
+		return -1;
+	}
+
+	if (plan->md_size < plan->md_needed) {
+		zc_log(ctx, LOG_ERR, "Metadata device too small\n");
+		return -1;
+	}
+
+	plan->md_wasted = plan->md_size - plan->md_needed;
+	zc_plan_kmem(plan);
+
+	return 0;
+}
+
+/*
+ * I/O trace logs (see zctrace.c)
+ */
+
+/* Maps a trace log, which may still be growing.  NULL context = default. */
+int zc_trace_open(struct zc_ctx *ctx, const char *const path,
+		  struct zc_trace *const t)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (ctx == NULL)
+		ctx = &zc_default_ctx;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		zc_log(ctx, LOG_ERR, "%s: %m\n", path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		zc_log(ctx, LOG_ERR, "%s: %m\n", path);
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size < ZC_TRACE_HDR_SIZE) {
+		zc_log(ctx, LOG_ERR, "%s: not a trace log\n", path);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		zc_log(ctx, LOG_ERR, "%s: %m\n", path);
+		return -1;
+	}
+
+	memset(t, 0, sizeof *t);
+	t->ctx = ctx;
+	t->map = map;
+	t->size = st.st_size;
+	t->hdr = map;
+
+	if (t->hdr->magic != ZC_TRACE_MAGIC ||
+			t->hdr->version != ZC_TRACE_VERSION ||
+			t->hdr->frame_size <= sizeof(struct zc_trace_frame) ||
+			t->hdr->frame_size > 1 << 24) {
+		zc_log(ctx, LOG_ERR, "%s: not a (version %d) trace log\n",
+		       path, ZC_TRACE_VERSION);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	/* A frame that is still being written is ignored */
+	t->nr_frames = (t->size - ZC_TRACE_HDR_SIZE) / t->hdr->frame_size;
+
+	return 0;
+}
+
+void zc_trace_close(struct zc_trace *const t)
+{
+	munmap((void *)t->map, t->size);
+}
+
+/* The next call to zc_trace_next() returns the first record of a frame */
+int zc_trace_seek(struct zc_trace *const t, const uint64_t frame)
+{
+	if (frame > t->nr_frames) {
+		zc_log(t->ctx, LOG_ERR, "Trace frame %" PRIu64 " out of range\n",
+		       frame);
+		return -1;
+	}
+
+	t->frame = frame;
+	t->left = 0;
+	return 0;
+}
+
+static int zc_varint_get(const uint8_t **const pos, const uint8_t *const end,
+			 uint64_t *const value)
+{
+	const uint8_t *p;
+	unsigned shift;
+
+	for (*value = 0, shift = 0, p = *pos; p < end && shift < 64;
+								shift += 7) {
+		*value |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pos = p;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static uint64_t zc_zigzag_add(const uint64_t base, const uint64_t zz)
+{
+	return base + ((zz >> 1) ^ -(zz & 1));
+}
+
+/* Returns 1 if a record was decoded, 0 at the end of the log */
+int zc_trace_next(struct zc_trace *const t, struct zc_trace_rec *const rec)
+{
+	const struct zc_trace_frame *frame;
+	uint64_t v[4];
+	unsigned i;
+
+	while (t->left == 0) {
+
+		if (t->frame >= t->nr_frames)
+			return 0;
+
+		frame = (const void *)(t->map + ZC_TRACE_HDR_SIZE +
+				       t->frame++ * t->hdr->frame_size);
+
+		if (frame->size > t->hdr->frame_size - sizeof *frame)
+			goto corrupt;
+
+		t->pos = (const uint8_t *)(frame + 1);
+		t->end = t->pos + frame->size;
+		t->left = frame->nr_records;
+		t->time = frame->time;
+		t->sector = frame->sector;
+	}
+
+	for (i = 0; i < 4; ++i) {
+		if (zc_varint_get(&t->pos, t->end, v + i) < 0)
+			goto corrupt;
+	}
+
+	t->time = zc_zigzag_add(t->time, v[0]);
+	rec->time = t->time;
+	rec->sector = zc_zigzag_add(t->sector, v[1]);
+	rec->sectors = v[2] >> 4;
+	rec->cache = (v[2] >> 2) & 3;
+	rec->op = v[2] & 3;
+	rec->latency = v[3];
+	t->sector = rec->sector + rec->sectors;
+	--t->left;
+
+	return 1;
+
+corrupt:
+	zc_log(t->ctx, LOG_ERR, "Corrupt trace frame %" PRIu64 "\n",
+	       t->frame - 1);
+	t->left = 0;
+	return -1;
+}
@@ -14,15 +14,21 @@
  *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
  */
 
+#define _GNU_SOURCE
+
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <linux/fs.h>
 #include <sys/stat.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <uuid/uuid.h>
 
@@ -38,6 +44,24 @@ struct component_dev {
 static uint64_t block_size = 256 * 1024;
 static uint64_t cache_mode = ZC_SB_MODE_WRITEBACK;
 static uint64_t alignment = 4 * 1024;
+static uint64_t pin_area = 0;
+static uint64_t era_block_size = 0;
+static uint64_t mem_limit = 0;
+static _Bool dry_run = 0;
+static _Bool discard = 0;
+
+/* Conversion of existing origin data in place (see zcconvert) */
+static uint64_t origin_offset = 0;	/* -O: data starts here */
+static uint64_t origin_reloc = 0;	/* -R: data's head was copied here */
+
+/* dm-crypt layer on top of the set's device (see zodcache.h) */
+static const char *crypt_cipher = NULL;	/* -E */
+static const char *crypt_key = NULL;		/* -k */
+static uint64_t crypt_key_size = 0;		/* -K */
+static uint64_t crypt_sector_size = 0;		/* -S */
+
+/* LVM thin pool (VG/LV) whose data device is on the set's device (-T) */
+static const char *thin_pool = NULL;
 
 static struct component_dev origin_dev = { .path = NULL };
 static struct component_dev cache_dev = { .path = NULL };
@@ -47,6 +71,13 @@ static struct zc_sb_v0 origin_sb;
 static struct zc_sb_v0 cache_sb;
 static struct zc_sb_v0 metadata_sb;
 
+static struct zc_sb_ext ext;
+static struct zc_sb_ext origin_ext;
+
+/* Uncached zones (-x), in sectors; validated once the origin size is known */
+static struct zc_sb_zone zones[ZC_SB_EXT_MAX_ZONES];
+static unsigned nr_zones;
+
 static _Bool is_pow2(const uint64_t num)
 {
 	return (num != 0) && ((num & (num - 1)) == 0);
@@ -63,66 +94,66 @@ static uint64_t to_blocks(const uint64_t num, const uint64_t block_size)
 	return (num + mask) & ~mask;
 }
 
-/*
- * From cache_metadata_size.cc in
- * https://github.com/jthornber/thin-provisioning-tools
- */
+/* From cache_metadata_size.cc in thin-provisioning-tools & lvmcache(7) */
 #define DM_CACHE_XACTION_OVERHEAD	4194304
-#define DM_CACHE_BYTES_PER_BLOCK	16
-#define DM_CACHE_HINT_OHEAD_PER_BLOCK	8
-#define DM_CACHE_MAX_HINT_WIDTH		4
-
-#define TOTAL_BYTES_PER_BLOCK	(DM_CACHE_BYTES_PER_BLOCK + \
-					DM_CACHE_HINT_OHEAD_PER_BLOCK + \
-					DM_CACHE_MAX_HINT_WIDTH)
-
-
-/* 8 MiB minimum from lvmcache(7) */
 #define DM_CACHE_METADATA_MIN		8388608
 
-static uint64_t metadata_size(const uint64_t num_cache_blocks)
-{
-	uint64_t size;
-
-	size = num_cache_blocks * TOTAL_BYTES_PER_BLOCK +
-						DM_CACHE_XACTION_OVERHEAD;
+/*
+ * dm-era keeps a 32-bit era per block and a bitset per archived era, in
+ * btrees; there is no tool to calculate this, so be generous.
+ */
+#define DM_ERA_BYTES_PER_BLOCK		16
 
-	/* Round up to 512-byte sectors, if necessary */
-	size = to_blocks(size, 512);
+static uint64_t era_metadata_size(void)
+{
+	uint64_t nr_blocks, size;
 
-	if (size < DM_CACHE_METADATA_MIN)
-		size = DM_CACHE_METADATA_MIN;
+	nr_blocks = (origin_dev.size + era_block_size - 1) / era_block_size;
+	size = nr_blocks * DM_ERA_BYTES_PER_BLOCK + DM_CACHE_XACTION_OVERHEAD;
+	size = to_blocks(size, alignment);
 
-	return size;
+	return size < DM_CACHE_METADATA_MIN ? DM_CACHE_METADATA_MIN : size;
 }
 
-static uint64_t combined_cache_size(uint64_t available, uint64_t block_size)
+/*
+ * Sizes the cache (and, for a combined device, metadata) area.  With a kernel
+ * memory limit (-L), the block size is doubled until the set's estimated
+ * usage fits.  The tables use version 1 metadata and the default (smq) policy.
+ */
+static void plan_layout(struct zc_plan *const plan)
 {
-	uint64_t cache_blocks, cache_bytes, combined_bytes, excess_blocks;
-
-	assert(block_size % 32768 == 0);	/* must be a multiple of 32KB */
-	assert(block_size >= 32768);		/* min block size 32KB */
-	assert(block_size <= 1073741824);	/* max block size 1GB */
+	char buf[ZC_SIZE_BUF_SIZE];
 
-	cache_blocks = available / block_size;
+	memset(plan, 0, sizeof *plan);
+	plan->origin_size = origin_dev.size;
+	plan->cache_size = cache_dev.size;
+	plan->md_avail = metadata_dev.path ? metadata_dev.size - alignment : 0;
+	plan->alignment = alignment;
+	plan->md_version = 1;
+	plan->hint_size = ZC_PLAN_SMQ_HINT;
 
 	while (1) {
 
-		cache_bytes = to_blocks(cache_blocks * block_size, alignment);
-		combined_bytes = cache_bytes + metadata_size(cache_blocks);
+		plan->block_size = block_size;
+		if (zc_plan(NULL, plan) < 0)
+			exit(EXIT_FAILURE);
 
-		if (combined_bytes <= available)
+		if (mem_limit == 0 ||
+			    plan->kmem_cache + plan->kmem_policy <= mem_limit)
 			break;
 
-		excess_blocks = (combined_bytes - available + block_size - 1) /
-								block_size;
-		if (excess_blocks > 1)
-			--excess_blocks;
+		if (block_size * 2 > 1073741824) {
+			fputs("Kernel memory limit (-L) too low\n", stderr);
+			exit(EXIT_FAILURE);
+		}
 
-		cache_blocks -= excess_blocks;
+		block_size *= 2;
 	}
 
-	return cache_bytes;
+	if (mem_limit != 0) {
+		fprintf(stderr, "Block size: %s\n",
+			zc_size_format_r(block_size, 1, buf));
+	}
 }
 
 static int parse_dev(int argc, char *argv[], int i, const char *type,
@@ -234,6 +265,242 @@ static int parse_cache_mode(int argc, char *argv[], int i)
 	return i;
 }
 
+static int parse_pin_area(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Pin area size (%s) value missing\n",
+			argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_size_parse(argv[i], &pin_area) < 0)
+		exit(EXIT_FAILURE);
+
+	return i;
+}
+
+static int parse_era_block_size(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Era block size (%s) value missing\n",
+			argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_size_parse(argv[i], &era_block_size) < 0)
+		exit(EXIT_FAILURE);
+
+	if (era_block_size < 4096 || !is_pow2(era_block_size)) {
+		fprintf(stderr, "Era block size (%s) must be a power of 2 "
+			"(4KiB or more)\n", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+
+	return i;
+}
+
+static int parse_mem_limit(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Memory limit (%s) value missing\n",
+			argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_size_parse(argv[i], &mem_limit) < 0)
+		exit(EXIT_FAILURE);
+
+	return i;
+}
+
+static int parse_dry_run(int argc __attribute__((unused)),
+			 char *argv[] __attribute__((unused)), int i)
+{
+	dry_run = 1;
+	return i;
+}
+
+static int parse_discard(int argc __attribute__((unused)),
+			 char *argv[] __attribute__((unused)), int i)
+{
+	discard = 1;
+	return i;
+}
+
+static int parse_origin_offset(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Origin offset (%s) value missing\n",
+			argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_size_parse(argv[i], &origin_offset) < 0)
+		exit(EXIT_FAILURE);
+
+	/* Room for the superblock & extension */
+	if (origin_offset < 4096 || origin_offset % 512 != 0) {
+		fprintf(stderr, "Origin offset (%s) must be a multiple of 512 "
+			"(4KiB or more)\n", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+
+	return i;
+}
+
+static int parse_origin_reloc(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Relocation offset (%s) value missing\n",
+			argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_size_parse(argv[i], &origin_reloc) < 0)
+		exit(EXIT_FAILURE);
+
+	if (origin_reloc == 0 || origin_reloc % 512 != 0) {
+		fprintf(stderr, "Relocation offset (%s) must be a non-zero "
+			"multiple of 512\n", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+
+	return i;
+}
+
+static int parse_crypt_cipher(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Cipher (%s) value missing\n", argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	crypt_cipher = argv[i];
+
+	return i;
+}
+
+static int parse_crypt_key(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Key (%s) value missing\n", argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	crypt_key = argv[i];
+
+	return i;
+}
+
+static int parse_crypt_key_size(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Key size (%s) value missing\n", argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_size_parse(argv[i], &crypt_key_size) < 0)
+		exit(EXIT_FAILURE);
+
+	if (crypt_key_size == 0 || crypt_key_size > ZC_CRYPT_MAX_KEY_SIZE) {
+		fprintf(stderr, "Key size (%s) must be 1 - %d bytes\n",
+			argv[i], ZC_CRYPT_MAX_KEY_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	return i;
+}
+
+static int parse_crypt_sector_size(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Encryption sector size (%s) value missing\n",
+			argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_size_parse(argv[i], &crypt_sector_size) < 0)
+		exit(EXIT_FAILURE);
+
+	if (crypt_sector_size < 512 || crypt_sector_size > 4096 ||
+						!is_pow2(crypt_sector_size)) {
+		fprintf(stderr, "Encryption sector size (%s) must be a power "
+			"of 2 (512 - 4KiB)\n", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+
+	return i;
+}
+
+static int parse_thin_pool(int argc, char *argv[], int i)
+{
+	const char *slash;
+
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Thin pool (%s) value missing\n", argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	slash = strchr(argv[i], '/');
+
+	if (slash == NULL || slash == argv[i] || slash[1] == 0 ||
+			strchr(slash + 1, '/') != NULL ||
+			strpbrk(argv[i], " \t\n") != NULL ||
+			strlen(argv[i]) >= sizeof origin_ext.o_thin_pool) {
+		fprintf(stderr, "Invalid thin pool (expected VG/LV): %s\n",
+			argv[i]);
+		exit(EXIT_FAILURE);
+	}
+
+	thin_pool = argv[i];
+
+	return i;
+}
+
+static int parse_zone(int argc, char *argv[], int i)
+{
+	++i;
+
+	if (i >= argc) {
+		fprintf(stderr, "Zone (%s) value missing\n", argv[i - 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (nr_zones >= ZC_SB_EXT_MAX_ZONES) {
+		fprintf(stderr, "Too many zones (maximum is %d)\n",
+			ZC_SB_EXT_MAX_ZONES);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_zone_parse(NULL, argv[i], &zones[nr_zones].start,
+			  &zones[nr_zones].len) < 0)
+		exit(EXIT_FAILURE);
+
+	++nr_zones;
+
+	return i;
+}
+
 static void parse_args(int argc, char *argv[])
 {
 	static const struct {
@@ -247,6 +514,19 @@ static void parse_args(int argc, char *argv[])
 		{ "-b", parse_block_size },
 		{ "-M", parse_cache_mode },
 		{ "-a", parse_alignment },
+		{ "-x", parse_zone },
+		{ "-p", parse_pin_area },
+		{ "-e", parse_era_block_size },
+		{ "-L", parse_mem_limit },
+		{ "-n", parse_dry_run },
+		{ "-D", parse_discard },
+		{ "-O", parse_origin_offset },
+		{ "-R", parse_origin_reloc },
+		{ "-E", parse_crypt_cipher },
+		{ "-k", parse_crypt_key },
+		{ "-K", parse_crypt_key_size },
+		{ "-S", parse_crypt_sector_size },
+		{ "-T", parse_thin_pool },
 		{ NULL, 0 }
 	};
 
@@ -277,6 +557,97 @@ continue_outer_loop: ;
 		fputs("No cache device (-c) specified\n", stderr);
 		exit(EXIT_FAILURE);
 	}
+
+	if (origin_offset != 0 && origin_reloc != 0) {
+		fputs("Origin offset (-O) and relocation (-R) are mutually "
+		      "exclusive\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (crypt_key == NULL && (crypt_cipher != NULL ||
+			crypt_key_size != 0 || crypt_sector_size != 0)) {
+		fputs("Encryption options (-E, -K, -S) require a key (-k)\n",
+		      stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Normally, the origin data starts at the alignment.  Converted devices keep
+ * their data where it is: either it already starts far enough into the device
+ * (-O), or the part of it that the superblock displaces has been copied to
+ * the end of the device (-R), which the origin's own superblock extension
+ * records (see do_origin() in assemble.c).
+ */
+static void set_origin_layout(void)
+{
+	if (origin_offset != 0) {
+		if (origin_offset >= origin_dev.size) {
+			fputs("Origin offset beyond end of origin device\n",
+			      stderr);
+			exit(EXIT_FAILURE);
+		}
+		origin_dev.size -= origin_offset;
+	}
+	else if (origin_reloc != 0) {
+		if (origin_reloc > origin_dev.size - alignment) {
+			fputs("No room for relocated data on origin device\n",
+			      stderr);
+			exit(EXIT_FAILURE);
+		}
+		origin_offset = alignment;
+		origin_dev.size = origin_reloc;
+	}
+	else {
+		origin_offset = alignment;
+		origin_dev.size -= alignment;
+	}
+
+	zc_sb_ext_init(&origin_ext);
+	origin_ext.o_reloc = origin_reloc;
+
+	if (thin_pool != NULL) {
+		strcpy(origin_ext.o_thin_pool, thin_pool);
+		origin_ext.flags = ZC_SB_EXT_THIN;
+	}
+}
+
+/*
+ * The superblock and extension of a relocated origin replace the head of its
+ * data, so they are written together, in a single (4KiB) write.
+ */
+static int write_origin_sb(void)
+{
+	char buf[4096];
+	int fd, ret;
+
+	if ((fd = memfd_create("zc_sb", MFD_CLOEXEC)) < 0 ||
+			ftruncate(fd, sizeof buf) < 0) {
+		perror("memfd_create");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = -1;
+
+	if (		zc_sb_v0_write(fd, &origin_sb) < 0		||
+
+			zc_sb_ext_write(fd, &origin_ext) < 0		) {
+
+		goto out;
+	}
+
+	if (pread(fd, buf, sizeof buf, 0) != sizeof buf ||
+			pwrite(origin_dev.fd, buf, sizeof buf, 0) != sizeof buf ||
+			fsync(origin_dev.fd) < 0) {
+		perror(origin_dev.path);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	close(fd);
+	return ret;
 }
 
 static void set_origin_sb(const uint8_t *const uuid)
@@ -291,7 +662,7 @@ static void set_origin_sb(const uint8_t *const uuid)
 	zc_sb_v0_uuid_set(uuid, &origin_sb);
 	origin_sb.block_size = block_size;
 	origin_sb.cache_mode = cache_mode;
-	origin_sb.o_offset = alignment;
+	origin_sb.o_offset = origin_offset;
 	origin_sb.o_size = origin_dev.size;
 
 	origin_sb.cksum = zc_sb_v0_cksum(&origin_sb);
@@ -355,42 +726,189 @@ static void set_cache_sb_combined(const uuid_t uuid)
 	cache_sb.cksum = zc_sb_v0_cksum(&cache_sb);
 }
 
-int main(int argc, char *argv[])
+/* Dry run (-n) output */
+static void print_plan(const struct zc_plan *const plan)
+{
+	char bs[ZC_SIZE_BUF_SIZE], md[ZC_SIZE_BUF_SIZE],
+						needed[ZC_SIZE_BUF_SIZE];
+
+	printf("%s: %" PRIu64 " x %s cache blocks on %s, %s metadata (%s "
+	       "needed)\n", origin_dev.path, plan->nr_blocks,
+	       zc_size_format_r(block_size, 0, bs), cache_dev.path,
+	       zc_size_format_r(plan->md_size, 0, md),
+	       zc_size_format_r(plan->md_needed, 0, needed));
+}
+
+/* A new set's cache holds nothing, so the SSD can have it back (-D) */
+static void discard_cache(void)
+{
+	uint64_t range[2];
+
+	range[0] = alignment;
+	range[1] = cache_dev.size & ~(alignment - 1);
+
+	if (ioctl(cache_dev.fd, BLKDISCARD, range) < 0 &&
+						errno != EOPNOTSUPP) {
+		fprintf(stderr, "%s: discard failed: %m\n", cache_dev.path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Records the dm-crypt layer, if any.  A key file is checked now, rather than
+ * when the set is first started; its size is the key size.  A keyring key need
+ * not exist yet.
+ */
+static void set_crypt(void)
+{
+	struct stat st;
+
+	if (crypt_key == NULL)
+		return;
+
+	if (zc_crypt_parse(NULL, &ext, crypt_cipher ? crypt_cipher :
+			   ZC_CRYPT_DEFAULT_CIPHER, crypt_key) < 0)
+		exit(EXIT_FAILURE);
+
+	if (crypt_key[0] == '/') {
+
+		if (stat(crypt_key, &st) < 0) {
+			fprintf(stderr, "%s: %m\n", crypt_key);
+			exit(EXIT_FAILURE);
+		}
+
+		if (!S_ISREG(st.st_mode) || st.st_size == 0 ||
+				st.st_size > ZC_CRYPT_MAX_KEY_SIZE ||
+				(crypt_key_size != 0 &&
+				 crypt_key_size != (uint64_t)st.st_size)) {
+			fprintf(stderr, "%s: not a valid key file\n",
+				crypt_key);
+			exit(EXIT_FAILURE);
+		}
+
+		crypt_key_size = st.st_size;
+	}
+	else if (crypt_key_size == 0) {
+		crypt_key_size = 64;	/* aes-xts-plain64 with AES-256 */
+	}
+
+	ext.crypt_key_size = crypt_key_size;
+	ext.crypt_sector_size = crypt_sector_size;
+}
+
+/* Formats one set; see main() */
+static int mkzc(int argc, char *argv[])
 {
 	char buf[ZC_UUID_BUF_SIZE];
+	static const char zeroes[4096];
+	struct zc_sb_ext cache_ext;
+	struct zc_plan plan;
+	uint64_t era_size;
+	unsigned i;
 	uuid_t uuid;
+	int md_fd;
 
 	parse_args(argc, argv);
 	uuid_generate(uuid);
 
-	origin_dev.size -= alignment;
-	set_origin_sb(uuid);
+	set_origin_layout();
+
+	zc_sb_ext_init(&ext);
+	set_crypt();
 
 	cache_dev.size -= alignment;
 
-	if (metadata_dev.path == NULL) {
+	/* The pin area (if any) is at the end of the cache device */
+	if (pin_area != 0) {
 
-		metadata_dev.size = cache_dev.size;
-		cache_dev.size = combined_cache_size(cache_dev.size,
-						     block_size);
-		metadata_dev.size -= cache_dev.size;
+		pin_area = to_blocks(pin_area, alignment);
 
-		set_cache_sb_combined(uuid);
-	}
-	else {
-		uint64_t nr_blocks = cache_dev.size / block_size;
-		metadata_dev.size -= alignment;
-		if (metadata_dev.size <	metadata_size(nr_blocks)) {
-			fputs("Metadata device too small\n", stderr);
+		if (pin_area >= cache_dev.size) {
+			fputs("Pin area too large for cache device\n", stderr);
 			exit(EXIT_FAILURE);
 		}
 
+		ext.pin_offset = (alignment + cache_dev.size - pin_area) &
+							~(alignment - 1);
+		ext.pin_size = pin_area / 512;
+		cache_dev.size = ext.pin_offset - alignment;
+		ext.pin_offset /= 512;
+	}
+
+	/* dm-era metadata (if any) is at the end of the metadata area */
+	if (era_block_size != 0) {
+
+		era_size = era_metadata_size();
+		ext.era_block_size = era_block_size / 512;
+		ext.era_size = era_size / 512;
+
+		if (metadata_dev.path == NULL) {
+			if (era_size >= cache_dev.size) {
+				fputs("Cache device too small for era metadata\n",
+				      stderr);
+				exit(EXIT_FAILURE);
+			}
+			ext.era_offset = (alignment + cache_dev.size -
+						era_size) & ~(alignment - 1);
+			cache_dev.size = ext.era_offset - alignment;
+		}
+		else {
+			if (era_size + alignment >= metadata_dev.size) {
+				fputs("Metadata device too small\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			ext.era_offset = (metadata_dev.size - era_size) &
+							~(alignment - 1);
+			metadata_dev.size = ext.era_offset;
+		}
+
+		ext.era_offset /= 512;
+	}
+
+	plan_layout(&plan);
+
+	/* Zones must be aligned to the (possibly enlarged) block size */
+	for (i = 0; i < nr_zones; ++i) {
+		if (zc_zone_add(NULL, &ext, zones[i].start, zones[i].len,
+				origin_dev.size / 512, block_size / 512) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	set_origin_sb(uuid);
+
+	cache_dev.size = plan.c_size;
+	metadata_dev.size = plan.md_size;
+
+	if (metadata_dev.path == NULL) {
+		set_cache_sb_combined(uuid);
+	}
+	else {
 		set_cache_sb_separate(uuid);
 		set_metadata_sb(uuid);
 	}
 
-	if (zc_sb_v0_write(origin_dev.fd, &origin_sb) < 0)
+	if (dry_run) {
+		print_plan(&plan);
+		return 0;
+	}
+
+	if (discard)
+		discard_cache();
+
+	md_fd = (metadata_dev.path != NULL) ? metadata_dev.fd : cache_dev.fd;
+
+	/*
+	 * The set is marked clean (below), so zcstart won't check the metadata;
+	 * a dm-cache superblock left over from an earlier set must not survive.
+	 * (Discarded blocks don't necessarily read back as zeroes.)
+	 */
+	if (pwrite(md_fd, zeroes, sizeof zeroes, metadata_dev.path != NULL ?
+			metadata_sb.md_offset : cache_sb.md_offset) !=
+							sizeof zeroes ||
+			fsync(md_fd) < 0) {
+		perror(metadata_dev.path ?: cache_dev.path);
 		exit(EXIT_FAILURE);
+	}
 
 	if (zc_sb_v0_write(cache_dev.fd, &cache_sb) < 0)
 		exit(EXIT_FAILURE);
@@ -400,8 +918,517 @@ int main(int argc, char *argv[])
 			exit(EXIT_FAILURE);
 	}
 
+	/* Every member says whether the set is thin; see zodcache.h */
+	if (metadata_dev.path != NULL && thin_pool != NULL) {
+		zc_sb_ext_init(&cache_ext);
+		cache_ext.flags = ZC_SB_EXT_THIN;
+		if (zc_sb_ext_write(cache_dev.fd, &cache_ext) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	/* A new set has nothing to check; see zcstart & zcstop */
+	ext.flags = ZC_SB_EXT_CLEAN;
+	if (thin_pool != NULL)
+		ext.flags |= ZC_SB_EXT_THIN;
+
+	if (zc_sb_ext_write(md_fd, &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	/* dm-era formats metadata whose superblock is all zeroes */
+	if (ext.era_block_size != 0 && pwrite(md_fd, zeroes, sizeof zeroes,
+				ext.era_offset * 512) != sizeof zeroes) {
+		perror(metadata_dev.path ?: cache_dev.path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Last; for a relocated origin, there's no going back after this */
+	if (write_origin_sb() < 0)
+		exit(EXIT_FAILURE);
+
 	uuid_unparse(uuid, buf);
 	puts(buf);
 
 	return 0;
 }
+
+/*
+ * Batch mode (mkzc --config FILE) formats many sets at once.  Each line of the
+ * file is a directive; '#' starts a comment.
+ *
+ *   distribute equal|proportional|weighted
+ *   options MKZC_OPTION...	(for every set, e.g. -b 512K -D)
+ *   cache DEVICE
+ *   origin DEVICE [weight=N] [cache=DEVICE] [metadata=DEVICE]
+ *
+ * Every set needs a cache device (partition) of its own, so the distribution
+ * rule decides which cache goes with which origin: the origins that are due
+ * the biggest share of the total (by origin size or weight) get the biggest
+ * caches.  Origins that name their cache keep it.  All of the sets are checked
+ * with a dry run (-n) before any of them is formatted; both passes run the
+ * sets concurrently.  The manifest (UUID, origin, cache) goes to stdout.
+ */
+
+#define DISTRIBUTE_EQUAL	0
+#define DISTRIBUTE_PROPORTIONAL	1
+#define DISTRIBUTE_WEIGHTED	2
+
+struct batch_set {
+	char		*origin;
+	char		*cache;
+	char		*metadata;
+	uint64_t	weight;
+	unsigned	line;
+	pid_t		pid;
+	FILE		*out;
+	char		result[256];
+};
+
+struct batch_cache {
+	char		*path;
+	uint64_t	size;
+	_Bool		used;
+};
+
+struct batch {
+	struct batch_set	*sets;
+	size_t			nr_sets;
+	struct batch_cache	*caches;
+	size_t			nr_caches;
+	char			**options;
+	size_t			nr_options;
+	int			distribute;
+};
+
+static void *batch_grow(void *array, const size_t count, const size_t size)
+{
+	if ((array = realloc(array, (count + 1) * size)) == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+
+	memset((char *)array + count * size, 0, size);
+	return array;
+}
+
+static char *batch_strdup(const char *const s)
+{
+	char *dup;
+
+	if ((dup = strdup(s)) == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+
+	return dup;
+}
+
+static void batch_error(const char *const file, const unsigned line,
+			const char *const msg, const char *const arg)
+{
+	fprintf(stderr, "%s:%u: %s%s%s\n", file, line, msg, arg ? ": " : "",
+		arg ?: "");
+	exit(EXIT_FAILURE);
+}
+
+static void batch_parse_origin(struct batch *const b, const char *const file,
+			       const unsigned line, char *word, char **save)
+{
+	struct batch_set *set;
+	char *end;
+
+	b->sets = batch_grow(b->sets, b->nr_sets, sizeof *b->sets);
+	set = b->sets + b->nr_sets++;
+	set->origin = batch_strdup(word);
+	set->weight = 1;
+	set->line = line;
+
+	while ((word = strtok_r(NULL, " \t\n", save)) != NULL) {
+
+		if (strncmp(word, "weight=", 7) == 0) {
+			errno = 0;
+			set->weight = strtoull(word + 7, &end, 10);
+			if (errno != 0 || *end != 0 || set->weight == 0)
+				batch_error(file, line, "Invalid weight", word);
+		}
+		else if (strncmp(word, "cache=", 6) == 0) {
+			set->cache = batch_strdup(word + 6);
+		}
+		else if (strncmp(word, "metadata=", 9) == 0) {
+			set->metadata = batch_strdup(word + 9);
+		}
+		else {
+			batch_error(file, line, "Unknown origin option", word);
+		}
+	}
+}
+
+static void batch_parse(struct batch *const b, const char *const file)
+{
+	static const char *const rules[] = {
+		[DISTRIBUTE_EQUAL]		= "equal",
+		[DISTRIBUTE_PROPORTIONAL]	= "proportional",
+		[DISTRIBUTE_WEIGHTED]		= "weighted",
+	};
+
+	char *buf, *word, *save;
+	unsigned line, i;
+	size_t size;
+	FILE *fp;
+
+	if ((fp = fopen(file, "re")) == NULL) {
+		perror(file);
+		exit(EXIT_FAILURE);
+	}
+
+	buf = NULL;
+	size = 0;
+
+	for (line = 1; getline(&buf, &size, fp) >= 0; ++line) {
+
+		buf[strcspn(buf, "#")] = 0;
+
+		if ((word = strtok_r(buf, " \t\n", &save)) == NULL)
+			continue;
+
+		if (strcmp(word, "distribute") == 0) {
+
+			word = strtok_r(NULL, " \t\n", &save);
+
+			for (i = 0; i < sizeof rules / sizeof rules[0]; ++i) {
+				if (word != NULL && strcmp(word, rules[i]) == 0)
+					break;
+			}
+
+			if (i == sizeof rules / sizeof rules[0])
+				batch_error(file, line, "Invalid rule", word);
+
+			b->distribute = i;
+		}
+		else if (strcmp(word, "options") == 0) {
+
+			while ((word = strtok_r(NULL, " \t\n", &save)) != NULL) {
+
+				if (strcmp(word, "-o") == 0 ||
+						strcmp(word, "-c") == 0 ||
+						strcmp(word, "-m") == 0 ||
+						strcmp(word, "-n") == 0) {
+					batch_error(file, line, "Option not "
+						    "allowed here", word);
+				}
+
+				b->options = batch_grow(b->options,
+							b->nr_options,
+							sizeof *b->options);
+				b->options[b->nr_options++] =
+							batch_strdup(word);
+			}
+		}
+		else if (strcmp(word, "cache") == 0) {
+
+			if ((word = strtok_r(NULL, " \t\n", &save)) == NULL)
+				batch_error(file, line, "Missing device", NULL);
+
+			b->caches = batch_grow(b->caches, b->nr_caches,
+					       sizeof *b->caches);
+			b->caches[b->nr_caches++].path = batch_strdup(word);
+		}
+		else if (strcmp(word, "origin") == 0) {
+
+			if ((word = strtok_r(NULL, " \t\n", &save)) == NULL)
+				batch_error(file, line, "Missing device", NULL);
+
+			batch_parse_origin(b, file, line, word, &save);
+		}
+		else {
+			batch_error(file, line, "Unknown directive", word);
+		}
+	}
+
+	if (ferror(fp)) {
+		perror(file);
+		exit(EXIT_FAILURE);
+	}
+
+	free(buf);
+	fclose(fp);
+
+	if (b->nr_sets == 0) {
+		fprintf(stderr, "%s: no origins\n", file);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static uint64_t batch_dev_size(const char *const path, dev_t *const rdev)
+{
+	struct stat st;
+	uint64_t size;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ||
+			fstat(fd, &st) < 0 ||
+			ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!S_ISBLK(st.st_mode)) {
+		fprintf(stderr, "%s: not a block device\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	*rdev = st.st_rdev;
+	return size;
+}
+
+/* Catches the same device listed twice, possibly under different names */
+static void batch_check_dev(const char *const path, dev_t **const seen,
+			    const char ***const names, size_t *const nr_seen)
+{
+	size_t i;
+	dev_t rdev;
+
+	batch_dev_size(path, &rdev);
+
+	for (i = 0; i < *nr_seen; ++i) {
+		if ((*seen)[i] == rdev) {
+			fprintf(stderr, "%s and %s are the same device\n",
+				(*names)[i], path);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	*seen = batch_grow(*seen, *nr_seen, sizeof **seen);
+	*names = batch_grow(*names, *nr_seen, sizeof **names);
+	(*seen)[*nr_seen] = rdev;
+	(*names)[(*nr_seen)++] = path;
+}
+
+/* Pairs each origin without an explicit cache with one of the leftovers */
+static void batch_pair(struct batch *const b)
+{
+	struct batch_set *set, *best_set;
+	struct batch_cache *cache, *best_cache;
+	const char **names;
+	size_t i, j, nr_seen;
+	dev_t *seen, rdev;
+
+	seen = NULL;
+	names = NULL;
+	nr_seen = 0;
+
+	for (i = 0; i < b->nr_caches; ++i) {
+		batch_check_dev(b->caches[i].path, &seen, &names, &nr_seen);
+		b->caches[i].size = batch_dev_size(b->caches[i].path, &rdev);
+	}
+
+	for (i = 0, set = b->sets; i < b->nr_sets; ++i, ++set) {
+
+		batch_check_dev(set->origin, &seen, &names, &nr_seen);
+		if (set->metadata != NULL)
+			batch_check_dev(set->metadata, &seen, &names, &nr_seen);
+
+		if (b->distribute == DISTRIBUTE_PROPORTIONAL)
+			set->weight = batch_dev_size(set->origin, &rdev);
+		else if (b->distribute == DISTRIBUTE_EQUAL)
+			set->weight = 1;
+
+		if (set->cache == NULL)
+			continue;
+
+		for (j = 0; j < b->nr_caches; ++j) {
+			if (strcmp(b->caches[j].path, set->cache) == 0)
+				break;
+		}
+
+		if (j < b->nr_caches) {
+			if (b->caches[j].used) {
+				fprintf(stderr, "%s: cache %s is already "
+					"taken\n", set->origin, set->cache);
+				exit(EXIT_FAILURE);
+			}
+			b->caches[j].used = 1;
+		}
+		else {
+			batch_check_dev(set->cache, &seen, &names, &nr_seen);
+		}
+	}
+
+	/* Biggest remaining share gets the biggest remaining cache */
+	while (1) {
+
+		best_set = NULL;
+		for (i = 0, set = b->sets; i < b->nr_sets; ++i, ++set) {
+			if (set->cache == NULL && (best_set == NULL ||
+					set->weight > best_set->weight))
+				best_set = set;
+		}
+
+		best_cache = NULL;
+		for (i = 0, cache = b->caches; i < b->nr_caches; ++i, ++cache) {
+			if (!cache->used && (best_cache == NULL ||
+					cache->size > best_cache->size))
+				best_cache = cache;
+		}
+
+		if (best_set == NULL || best_cache == NULL)
+			break;
+
+		best_set->cache = best_cache->path;
+		best_cache->used = 1;
+	}
+
+	if (best_set != NULL) {
+		fprintf(stderr, "%s: no cache device left\n", best_set->origin);
+		exit(EXIT_FAILURE);
+	}
+
+	if (best_cache != NULL) {
+		fprintf(stderr, "%s: no origin device left\n",
+			best_cache->path);
+		exit(EXIT_FAILURE);
+	}
+
+	free(names);
+	free(seen);
+}
+
+static void batch_start(const struct batch *const b,
+			struct batch_set *const set)
+{
+	char **argv;
+	int pipefd[2];
+	size_t argc;
+
+	argv = calloc(b->nr_options + 9, sizeof *argv);
+	if (argv == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	argc = 0;
+	argv[argc++] = "mkzc";
+	memcpy(argv + argc, b->options, b->nr_options * sizeof *argv);
+	argc += b->nr_options;
+	argv[argc++] = "-o";
+	argv[argc++] = set->origin;
+	argv[argc++] = "-c";
+	argv[argc++] = set->cache;
+
+	if (set->metadata != NULL) {
+		argv[argc++] = "-m";
+		argv[argc++] = set->metadata;
+	}
+
+	if (dry_run)
+		argv[argc++] = "-n";
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	fflush(NULL);
+
+	if ((set->pid = fork()) < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (set->pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		exit(mkzc(argc, argv));
+	}
+
+	close(pipefd[1]);
+	free(argv);
+
+	if ((set->out = fdopen(pipefd[0], "r")) == NULL) {
+		perror("fdopen");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Returns the number of sets that failed */
+static unsigned batch_wait(struct batch *const b)
+{
+	struct batch_set *set;
+	unsigned failed;
+	int status;
+	size_t i;
+
+	for (failed = 0, i = 0, set = b->sets; i < b->nr_sets; ++i, ++set) {
+
+		if (fgets(set->result, sizeof set->result, set->out) == NULL)
+			set->result[0] = 0;
+		set->result[strcspn(set->result, "\n")] = 0;
+		fclose(set->out);
+
+		while (waitpid(set->pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				perror("waitpid");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s: failed\n", set->origin);
+			++failed;
+		}
+	}
+
+	return failed;
+}
+
+static int batch(const char *const file)
+{
+	struct batch b = { .sets = NULL };
+	struct batch_set *set;
+	unsigned failed;
+	size_t i;
+
+	batch_parse(&b, file);
+	batch_pair(&b);
+
+	/* Nothing is written unless every set can be formatted */
+	dry_run = 1;
+
+	for (i = 0; i < b.nr_sets; ++i)
+		batch_start(&b, b.sets + i);
+
+	if (batch_wait(&b) != 0) {
+		fputs("Dry run failed; no sets formatted\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0, set = b.sets; i < b.nr_sets; ++i, ++set)
+		fprintf(stderr, "%s\n", set->result);
+
+	dry_run = 0;
+
+	for (i = 0; i < b.nr_sets; ++i)
+		batch_start(&b, b.sets + i);
+
+	failed = batch_wait(&b);
+
+	for (i = 0, set = b.sets; i < b.nr_sets; ++i, ++set) {
+		printf("%s %s %s%s%s\n", set->result[0] ? set->result : "-",
+		       set->origin, set->cache, set->metadata ? " " : "",
+		       set->metadata ?: "");
+	}
+
+	if (failed != 0) {
+		fprintf(stderr, "%u of %zu sets failed\n", failed, b.nr_sets);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 3 && strcmp(argv[1], "--config") == 0)
+		return batch(argv[2]);
+
+	return mkzc(argc, argv);
+}
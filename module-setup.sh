@@ -18,10 +18,18 @@ depends () {
 }
 
 installkernel () {
-    hostonly='' instmods dm_cache_smq
+    hostonly='' instmods dm_cache_smq dm_raid dm_era dm_crypt
 }
 
 install () {
     inst /usr/sbin/zcstart
+    inst /usr/sbin/zcstop
+    inst_multiple -o cache_check cache_repair era_check
     inst_rules 69-zodcache.rules
+    inst_hook shutdown 30 "$moddir/zodcache-shutdown.sh"
+
+    # Only needed (at boot) if a thin pool is cached here now
+    if grep -qsx thin /run/zodcache/*.members; then
+        inst_hook initqueue/finished 30 "$moddir/zodcache-thin.sh"
+    fi
 }
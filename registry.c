@@ -0,0 +1,256 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/sysmacros.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+/*
+ * Registry file format -- one line per member that has arrived, followed by
+ * "assembled" once the set has been assembled, or "degraded" if a member of
+ * the assembled set has gone but the set couldn't be torn down:
+ *
+ *	origin 8:16
+ *	cache 8:32
+ *	metadata 8:32
+ *	thin
+ *	assembled
+ *
+ * (A combined cache device is registered as both cache and metadata.)  "thin"
+ * is recorded as soon as any member arrives, if the set's origin holds a thin
+ * pool's data device; the dracut module waits for such sets to be assembled.
+ * A degraded set's devices still exist; the teardown is retried whenever one
+ * of its members (re)appears.
+ */
+
+static const char *const zc_registry_types[] = {
+	[ZC_SB_TYPE_ORIGIN]	= "origin",
+	[ZC_SB_TYPE_CACHE]	= "cache",
+	[ZC_SB_TYPE_METADATA]	= "metadata"
+};
+
+#define ZC_REGISTRY_NTYPES \
+		(sizeof zc_registry_types / sizeof zc_registry_types[0])
+
+static char *zc_registry_path(const char *const uuid, const char *const suffix)
+{
+	return zc_asprintf(ZC_RUN_DIR "/%s.%s", uuid, suffix);
+}
+
+static int zc_registry_read(struct zc_registry *const reg)
+{
+	unsigned maj, min, i;
+	char type[16];
+	char *path;
+	FILE *fp;
+	int ret;
+
+	path = zc_registry_path(reg->uuid, "members");
+
+	fp = fopen(path, "re");
+	if (fp == NULL) {
+		ret = (errno == ENOENT) ? 0 : -1;
+		if (ret < 0)
+			zc_err(LOG_ERR, "%s: %m\n", path);
+		free(path);
+		return ret;
+	}
+
+	while ((ret = fscanf(fp, "%15s", type)) == 1) {
+
+		if (strcmp(type, "assembled") == 0) {
+			reg->assembled = 1;
+			continue;
+		}
+
+		if (strcmp(type, "degraded") == 0) {
+			reg->degraded = 1;
+			continue;
+		}
+
+		if (strcmp(type, "thin") == 0) {
+			reg->thin = 1;
+			continue;
+		}
+
+		for (i = 0; i < ZC_REGISTRY_NTYPES; ++i) {
+			if (strcmp(type, zc_registry_types[i]) == 0)
+				break;
+		}
+
+		if (i == ZC_REGISTRY_NTYPES ||
+				fscanf(fp, " %u:%u", &maj, &min) != 2) {
+			zc_err(LOG_ERR, "%s: invalid registry entry\n", path);
+			fclose(fp);
+			free(path);
+			return -1;
+		}
+
+		reg->members[i] = makedev(maj, min);
+	}
+
+	ret = ferror(fp) ? -1 : 0;
+	if (ret < 0)
+		zc_err(LOG_ERR, "%s: %m\n", path);
+
+	fclose(fp);
+	free(path);
+	return ret;
+}
+
+int zc_registry_open(struct zc_registry *const reg, const char *const uuid)
+{
+	char *path;
+
+	memset(reg, 0, sizeof *reg);
+	strncpy(reg->uuid, uuid, sizeof reg->uuid - 1);
+
+	if (mkdir(ZC_RUN_DIR, 0755) < 0 && errno != EEXIST) {
+		zc_err(LOG_ERR, "%s: %m\n", ZC_RUN_DIR);
+		return -1;
+	}
+
+	/* The lock file is never removed, so it can't be unlinked under us */
+	path = zc_registry_path(uuid, "lock");
+
+	reg->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (reg->lock_fd < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", path);
+		free(path);
+		return -1;
+	}
+
+	while (flock(reg->lock_fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			zc_err(LOG_ERR, "%s: %m\n", path);
+			close(reg->lock_fd);
+			free(path);
+			return -1;
+		}
+	}
+
+	free(path);
+
+	if (zc_registry_read(reg) < 0) {
+		zc_registry_close(reg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Atomically replaces the registry file */
+int zc_registry_commit(const struct zc_registry *const reg)
+{
+	char *path, *tmp;
+	unsigned i;
+	FILE *fp;
+	int ret;
+
+	path = zc_registry_path(reg->uuid, "members");
+	tmp = zc_registry_path(reg->uuid, "members.tmp");
+	ret = -1;
+
+	fp = fopen(tmp, "we");
+	if (fp == NULL) {
+		zc_err(LOG_ERR, "%s: %m\n", tmp);
+		goto out;
+	}
+
+	for (i = 0; i < ZC_REGISTRY_NTYPES; ++i) {
+		if (reg->members[i] != 0) {
+			fprintf(fp, "%s %u:%u\n", zc_registry_types[i],
+				major(reg->members[i]),
+				minor(reg->members[i]));
+		}
+	}
+
+	if (reg->thin)
+		fputs("thin\n", fp);
+
+	if (reg->assembled)
+		fputs("assembled\n", fp);
+
+	if (reg->degraded)
+		fputs("degraded\n", fp);
+
+	if (fclose(fp) != 0) {
+		zc_err(LOG_ERR, "%s: %m\n", tmp);
+		unlink(tmp);
+		goto out;
+	}
+
+	if (rename(tmp, path) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", path);
+		unlink(tmp);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	free(tmp);
+	free(path);
+	return ret;
+}
+
+int zc_registry_remove(const struct zc_registry *const reg)
+{
+	char *path;
+	int ret;
+
+	path = zc_registry_path(reg->uuid, "members");
+
+	ret = unlink(path);
+	if (ret < 0 && errno == ENOENT)
+		ret = 0;
+	else if (ret < 0)
+		zc_err(LOG_ERR, "%s: %m\n", path);
+
+	free(path);
+	return ret;
+}
+
+void zc_registry_close(struct zc_registry *const reg)
+{
+	/* Closing the file releases the lock */
+	close(reg->lock_fd);
+	reg->lock_fd = -1;
+}
+
+_Bool zc_registry_is_complete(const struct zc_registry *const reg)
+{
+	unsigned i;
+
+	for (i = 0; i < ZC_REGISTRY_NTYPES; ++i) {
+		if (reg->members[i] == 0)
+			return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * dm-stats regions on the top-level and component devices of a set.  Regions
+ * are tagged with ZC_STATS_PROGRAM_ID, so they don't interfere with regions
+ * created by dmstats or other programs.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+const char *const zc_stats_dev_types[ZC_STATS_NR_DEVS] = {
+	"device", "origin", "cache", "metadata"
+};
+
+/* Returns a dm_stats handle bound to the device, with our regions listed */
+static struct dm_stats *stats_open(const char *const name)
+{
+	struct dm_stats *dms;
+
+	if (		!(dms = dm_stats_create(ZC_STATS_PROGRAM_ID))	||
+
+			!dm_stats_bind_name(dms, name)			||
+
+			!dm_stats_list(dms, ZC_STATS_PROGRAM_ID)	) {
+
+		zc_err(LOG_ERR, "%s: failed to list dm-stats regions\n", name);
+		if (dms != NULL)
+			dm_stats_destroy(dms);
+		return NULL;
+	}
+
+	return dms;
+}
+
+/* Formats the histogram boundaries for dm_histogram_bounds_from_string() */
+static char *stats_bounds_format(const struct zc_sb_ext *const ext)
+{
+	char buf[ZC_SB_EXT_STATS_BOUNDS * 24];
+	unsigned i;
+	size_t len;
+
+	buf[0] = 0;
+
+	for (len = 0, i = 0; i < ZC_SB_EXT_STATS_BOUNDS; ++i) {
+
+		if (ext->stats_bounds[i] == 0)
+			break;
+
+		len += snprintf(buf + len, sizeof buf - len, "%s%" PRIu64 "ns",
+				i == 0 ? "" : ",", ext->stats_bounds[i]);
+	}
+
+	return (len == 0) ? NULL : zc_asprintf("%s", buf);
+}
+
+/*
+ * Creates a region that covers the whole device, split into ext->stats_areas
+ * areas.  Does nothing if the device already has a zodcache region.
+ */
+int zc_stats_create(const char *const name, const struct zc_sb_ext *const ext)
+{
+	struct dm_histogram *bounds;
+	struct dm_stats *dms;
+	uint64_t region_id;
+	char *bounds_str;
+	int ret;
+
+	if ((dms = stats_open(name)) == NULL)
+		return -1;
+
+	if (dm_stats_get_nr_regions(dms) != 0) {
+		dm_stats_destroy(dms);
+		return 0;
+	}
+
+	bounds = NULL;
+	ret = -1;
+
+	if ((bounds_str = stats_bounds_format(ext)) != NULL) {
+		bounds = dm_histogram_bounds_from_string(bounds_str);
+		free(bounds_str);
+		if (bounds == NULL) {
+			zc_err(LOG_ERR, "%s: invalid histogram boundaries\n",
+			       name);
+			goto out;
+		}
+	}
+
+	/* A length of 0 means the whole device; a negative step, # of areas */
+	if (!dm_stats_create_region(dms, &region_id, 0, 0,
+				    -(int64_t)ext->stats_areas,
+				    !!(ext->flags & ZC_SB_EXT_STATS_PRECISE),
+				    bounds, ZC_STATS_PROGRAM_ID, NULL)) {
+		zc_err(LOG_ERR, "%s: failed to create dm-stats region\n",
+		       name);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (bounds != NULL)
+		dm_histogram_bounds_destroy(bounds);
+	dm_stats_destroy(dms);
+	return ret;
+}
+
+/* Deletes the device's zodcache regions */
+int zc_stats_delete(const char *const name)
+{
+	struct dm_stats *dms;
+	uint64_t id, found, nr_regions;
+	int ret;
+
+	if ((dms = stats_open(name)) == NULL)
+		return -1;
+
+	nr_regions = dm_stats_get_nr_regions(dms);
+
+	/* Region IDs are allocated by the kernel and may have gaps */
+	for (ret = 0, id = 0, found = 0; found < nr_regions; ++id) {
+
+		if (!dm_stats_region_present(dms, id))
+			continue;
+
+		++found;
+
+		if (!dm_stats_delete_region(dms, id)) {
+			zc_err(LOG_ERR, "%s: failed to delete dm-stats region %"
+			       PRIu64 "\n", name, id);
+			ret = -1;
+		}
+	}
+
+	dm_stats_destroy(dms);
+	return ret;
+}
+
+/* Creates regions on the top-level device and all component devices */
+int zc_stats_setup(const char *const uuid, const struct zc_sb_ext *const ext)
+{
+	unsigned i;
+	char *name;
+	int ret;
+
+	for (ret = 0, i = 0; i < ZC_STATS_NR_DEVS; ++i) {
+		name = zc_asprintf("zodcache-%s-%s", zc_stats_dev_types[i], uuid);
+		if (zc_stats_create(name, ext) < 0)
+			ret = -1;
+		free(name);
+	}
+
+	return ret;
+}
+
+int zc_stats_remove(const char *const uuid)
+{
+	unsigned i;
+	char *name;
+	int ret;
+
+	for (ret = 0, i = 0; i < ZC_STATS_NR_DEVS; ++i) {
+		name = zc_asprintf("zodcache-%s-%s", zc_stats_dev_types[i], uuid);
+		if (zc_stats_delete(name) < 0)
+			ret = -1;
+		free(name);
+	}
+
+	return ret;
+}
+
+/*
+ * Reads the current counters of all areas of the device's zodcache region.
+ * Counters are cumulative; callers compute rates from the difference between
+ * two samples (see zc_stats_delta()).
+ */
+int zc_stats_sample(const char *const name, struct zc_stats_sample *const s)
+{
+	uint64_t id, found, nr_regions, start, len, area_len, a;
+	const struct dm_histogram *hist;
+	struct zc_stats_area *area;
+	struct dm_stats *dms;
+	int i, nr_bins;
+
+	memset(s, 0, sizeof *s);
+
+	if ((dms = stats_open(name)) == NULL)
+		return -1;
+
+	nr_regions = dm_stats_get_nr_regions(dms);
+	if (nr_regions == 0) {
+		zc_err(LOG_ERR, "%s: no dm-stats region\n", name);
+		goto error;
+	}
+
+	for (id = 0, found = 0; found < nr_regions; ++id) {
+		if (dm_stats_region_present(dms, id))
+			++found;
+	}
+
+	--id;
+
+	if (		!dm_stats_populate(dms, ZC_STATS_PROGRAM_ID, id)	||
+
+			!dm_stats_get_region_start(dms, &start, id)		||
+
+			!dm_stats_get_region_len(dms, &len, id)			||
+
+			!dm_stats_get_region_area_len(dms, &area_len, id)	) {
+
+		zc_err(LOG_ERR, "%s: failed to read dm-stats region\n", name);
+		goto error;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &s->time);
+
+	s->nr_areas = dm_stats_get_region_nr_areas(dms, id);
+	s->areas = calloc(s->nr_areas, sizeof *s->areas);
+	if (s->areas == NULL) {
+		zc_err(LOG_ERR, "%s: %m\n", name);
+		goto error;
+	}
+
+	for (a = 0; a < s->nr_areas; ++a) {
+
+		area = s->areas + a;
+
+		area->start = start + a * area_len;
+		area->len = (area->start + area_len > start + len) ?
+					start + len - area->start : area_len;
+
+		area->reads = dm_stats_get_reads(dms, id, a);
+		area->writes = dm_stats_get_writes(dms, id, a);
+		area->read_sectors = dm_stats_get_read_sectors(dms, id, a);
+		area->write_sectors = dm_stats_get_write_sectors(dms, id, a);
+		area->read_nsecs = dm_stats_get_read_nsecs(dms, id, a);
+		area->write_nsecs = dm_stats_get_write_nsecs(dms, id, a);
+
+		if ((hist = dm_stats_get_histogram(dms, id, a)) == NULL)
+			continue;
+
+		nr_bins = dm_histogram_get_nr_bins(hist);
+		if (nr_bins > ZC_SB_EXT_STATS_BOUNDS + 1)
+			nr_bins = ZC_SB_EXT_STATS_BOUNDS + 1;
+
+		s->nr_bins = nr_bins;
+
+		for (i = 0; i < nr_bins; ++i) {
+			s->bin_lower[i] = dm_histogram_get_bin_lower(hist, i);
+			area->bins[i] = dm_histogram_get_bin_count(hist, i);
+		}
+	}
+
+	dm_stats_destroy(dms);
+	return 0;
+
+error:
+	dm_stats_destroy(dms);
+	return -1;
+}
+
+void zc_stats_sample_free(struct zc_stats_sample *const s)
+{
+	free(s->areas);
+	s->areas = NULL;
+	s->nr_areas = 0;
+}
+
+/*
+ * Subtracts an earlier sample's counters from a later sample (in place).  The
+ * samples must be of the same region; returns the elapsed time in seconds.
+ */
+double zc_stats_delta(struct zc_stats_sample *const later,
+		      const struct zc_stats_sample *const earlier)
+{
+	struct zc_stats_area *l;
+	const struct zc_stats_area *e;
+	uint64_t a;
+	unsigned i;
+
+	for (a = 0; a < later->nr_areas && a < earlier->nr_areas; ++a) {
+
+		l = later->areas + a;
+		e = earlier->areas + a;
+
+		l->reads -= e->reads;
+		l->writes -= e->writes;
+		l->read_sectors -= e->read_sectors;
+		l->write_sectors -= e->write_sectors;
+		l->read_nsecs -= e->read_nsecs;
+		l->write_nsecs -= e->write_nsecs;
+
+		for (i = 0; i < later->nr_bins; ++i)
+			l->bins[i] -= e->bins[i];
+	}
+
+	return (later->time.tv_sec - earlier->time.tv_sec) +
+			(later->time.tv_nsec - earlier->time.tv_nsec) / 1e9;
+}
+
+/*
+ * Estimates a latency percentile (0 < fraction < 1) from the histograms of
+ * all areas, interpolating linearly within the bin.  Values in the last
+ * (unbounded) bin are reported as its lower boundary.  Returns 0 if there is
+ * no histogram or no I/O.
+ */
+uint64_t zc_stats_percentile(const struct zc_stats_sample *const s,
+			     const double fraction)
+{
+	uint64_t bins[ZC_SB_EXT_STATS_BOUNDS + 1], total, seen, a;
+	double rank;
+	unsigned i;
+
+	memset(bins, 0, sizeof bins);
+
+	for (total = 0, a = 0; a < s->nr_areas; ++a) {
+		for (i = 0; i < s->nr_bins; ++i) {
+			bins[i] += s->areas[a].bins[i];
+			total += s->areas[a].bins[i];
+		}
+	}
+
+	if (total == 0)
+		return 0;
+
+	rank = fraction * total;
+
+	for (seen = 0, i = 0; i + 1 < s->nr_bins; seen += bins[i], ++i) {
+
+		if (seen + bins[i] < rank)
+			continue;
+
+		return s->bin_lower[i] + (s->bin_lower[i + 1] - s->bin_lower[i])
+					* ((rank - seen) / bins[i]);
+	}
+
+	return s->bin_lower[s->nr_bins - 1];
+}
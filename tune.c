@@ -0,0 +1,592 @@
+/*
+ * Copyright 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Queue tuning.  The set's device gets the read-ahead; the request queues of
+ * the origin and cache devices (the disks, for partitions) get everything
+ * else, since the zodcache components are bio-based and have no scheduler.
+ *
+ * Automatic settings: read-ahead of one cache block (but no less than the
+ * kernel's default), max_sectors_kb raised to the block size (if the hardware
+ * allows it), deadline for rotational devices and no scheduler for the rest.
+ *
+ * The settings are applied all-or-nothing; if one can't be written, the ones
+ * that already were are put back.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/sysmacros.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "zcdm.h"
+
+#define TUNE_SET		0
+#define TUNE_ORIGIN		1
+#define TUNE_CACHE		2
+
+#define TUNE_DEFAULT_READ_AHEAD	128	/* KiB */
+
+#define TUNE_VALUE_SIZE		256
+
+struct tune_key {
+	const char	*name;
+	int		dev;		/* TUNE_* */
+	const char	*attr;		/* in the queue directory */
+	size_t		offset;		/* in struct zc_sb_ext */
+};
+
+/* A scheduler change resets nr_requests, so the scheduler comes first */
+static const struct tune_key tune_keys[] = {
+	{ "read_ahead_kb", TUNE_SET, "read_ahead_kb",
+		offsetof(struct zc_sb_ext, tune_read_ahead) },
+	{ "origin_max_sectors_kb", TUNE_ORIGIN, "max_sectors_kb",
+		offsetof(struct zc_sb_ext, tune_max_sectors[0]) },
+	{ "origin_scheduler", TUNE_ORIGIN, "scheduler",
+		offsetof(struct zc_sb_ext, tune_scheduler[0]) },
+	{ "origin_nr_requests", TUNE_ORIGIN, "nr_requests",
+		offsetof(struct zc_sb_ext, tune_nr_requests[0]) },
+	{ "cache_max_sectors_kb", TUNE_CACHE, "max_sectors_kb",
+		offsetof(struct zc_sb_ext, tune_max_sectors[1]) },
+	{ "cache_scheduler", TUNE_CACHE, "scheduler",
+		offsetof(struct zc_sb_ext, tune_scheduler[1]) },
+	{ "cache_nr_requests", TUNE_CACHE, "nr_requests",
+		offsetof(struct zc_sb_ext, tune_nr_requests[1]) },
+};
+
+#define TUNE_NR_KEYS	(sizeof tune_keys / sizeof tune_keys[0])
+
+/* Each ZC_SCHED_* value, in order of preference */
+static const char *const tune_schedulers[][2] = {
+	[ZC_SCHED_NONE]		= { "none", "noop" },
+	[ZC_SCHED_DEADLINE]	= { "mq-deadline", "deadline" },
+	[ZC_SCHED_BFQ]		= { "bfq", NULL },
+	[ZC_SCHED_KYBER]	= { "kyber", NULL },
+	[ZC_SCHED_CFQ]		= { "cfq", NULL },
+};
+
+#define TUNE_NR_SCHEDS	(sizeof tune_schedulers / sizeof tune_schedulers[0])
+
+/* The set's devices; see tune_devs() */
+struct tune_devs {
+	char		*queue[3];	/* TUNE_* */
+	uint64_t	block_size;	/* KiB */
+};
+
+struct tune_change {
+	char		*path;
+	char		old[TUNE_VALUE_SIZE];
+};
+
+static uint64_t *tune_setting(const struct zc_sb_ext *const ext,
+			      const struct tune_key *const key)
+{
+	return (uint64_t *)((char *)ext + key->offset);
+}
+
+static int tune_read(const char *const path, char *const buf)
+{
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", path);
+		return -1;
+	}
+
+	len = read(fd, buf, TUNE_VALUE_SIZE - 1);
+	if (len < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", path);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	buf[len] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+static int tune_write(const char *const path, const char *const value)
+{
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", path);
+		return -1;
+	}
+
+	len = strlen(value);
+
+	if (write(fd, value, len) != len) {
+		zc_err(LOG_ERR, "%s: failed to write %s: %m\n", path, value);
+		close(fd);
+		return -1;
+	}
+
+	if (close(fd) < 0) {
+		zc_err(LOG_ERR, "%s: failed to write %s: %m\n", path, value);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tune_read_u64(const char *const dir, const char *const attr,
+			 uint64_t *const value)
+{
+	char *path, buf[TUNE_VALUE_SIZE];
+	int ret;
+
+	path = zc_asprintf("%s/%s", dir, attr);
+	ret = tune_read(path, buf);
+	free(path);
+
+	if (ret == 0 && sscanf(buf, "%" SCNu64, value) != 1) {
+		zc_err(LOG_ERR, "%s/%s: unexpected value: %s\n", dir, attr,
+		       buf);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* The current scheduler is in brackets: "noop [deadline] cfq" */
+static void tune_sched_current(const char *const buf, char *const sched)
+{
+	if (sscanf(buf, "%*[^[][%255[^]]", sched) != 1 &&
+			sscanf(buf, "[%255[^]]", sched) != 1)
+		strcpy(sched, "none");
+}
+
+/* The current value of an attribute, as it would be written */
+static void tune_current(const struct tune_key *const key,
+			 const char *const buf, char *const value)
+{
+	if (strcmp(key->attr, "scheduler") == 0)
+		tune_sched_current(buf, value);
+	else
+		strcpy(value, buf);
+}
+
+static _Bool tune_sched_available(const char *const buf, const char *const name)
+{
+	const char *p;
+	size_t len;
+
+	len = strlen(name);
+
+	for (p = buf; (p = strstr(p, name)) != NULL; p += len) {
+		if ((p == buf || p[-1] == ' ' || p[-1] == '[') &&
+				(p[len] == 0 || p[len] == ' ' || p[len] == ']'))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Works out the value to write for one key, given the current contents of the
+ * attribute.  Returns 1 if there's nothing to do.
+ */
+static int tune_value(const struct tune_key *const key, const uint64_t setting,
+		      const struct tune_devs *const devs, const char *const cur,
+		      char *const value)
+{
+	uint64_t sched, hw, n;
+	unsigned i;
+
+	if (setting == ZC_TUNE_KEEP)
+		return 1;
+
+	if (strcmp(key->attr, "scheduler") == 0) {
+
+		sched = setting;
+		if (sched == ZC_TUNE_AUTO) {
+			if (tune_read_u64(devs->queue[key->dev], "rotational",
+					  &n) < 0)
+				return -1;
+			sched = n ? ZC_SCHED_DEADLINE : ZC_SCHED_NONE;
+		}
+
+		if (sched == 0 || sched >= TUNE_NR_SCHEDS)
+			goto invalid;
+
+		for (i = 0; i < 2 && tune_schedulers[sched][i] != NULL; ++i) {
+			if (tune_sched_available(cur,
+						 tune_schedulers[sched][i])) {
+				strcpy(value, tune_schedulers[sched][i]);
+				return 0;
+			}
+		}
+
+		/* Missing from the kernel is only an error if asked for */
+		if (setting == ZC_TUNE_AUTO)
+			return 1;
+
+		zc_err(LOG_ERR, "%s: %s scheduler not available\n",
+		       devs->queue[key->dev], tune_schedulers[sched][0]);
+		return -1;
+	}
+
+	if (setting != ZC_TUNE_AUTO) {
+		sprintf(value, "%" PRIu64, setting);
+		return 0;
+	}
+
+	if (strcmp(key->attr, "read_ahead_kb") == 0) {
+		n = devs->block_size;
+		if (n < TUNE_DEFAULT_READ_AHEAD)
+			n = TUNE_DEFAULT_READ_AHEAD;
+		sprintf(value, "%" PRIu64, n);
+		return 0;
+	}
+
+	if (strcmp(key->attr, "max_sectors_kb") == 0) {
+
+		if (sscanf(cur, "%" SCNu64, &n) != 1 ||
+				tune_read_u64(devs->queue[key->dev],
+					      "max_hw_sectors_kb", &hw) < 0)
+			goto invalid;
+
+		if (n >= devs->block_size || n >= hw)
+			return 1;
+
+		sprintf(value, "%" PRIu64,
+			devs->block_size < hw ? devs->block_size : hw);
+		return 0;
+	}
+
+	/* Automatic nr_requests is the kernel's default */
+	return 1;
+
+invalid:
+	zc_err(LOG_ERR, "%s: invalid %s setting\n", devs->queue[key->dev],
+	       key->name);
+	return -1;
+}
+
+/* The queue directory of a disk, or of the disk that holds a partition */
+static char *tune_queue(const unsigned maj, const unsigned min)
+{
+	char *path;
+
+	path = zc_asprintf("/sys/dev/block/%u:%u/partition", maj, min);
+
+	if (access(path, F_OK) == 0) {
+		free(path);
+		return zc_asprintf("/sys/dev/block/%u:%u/../queue", maj, min);
+	}
+
+	free(path);
+	return zc_asprintf("/sys/dev/block/%u:%u/queue", maj, min);
+}
+
+static int tune_devs(const char *const uuid, const uint64_t block_size,
+		     const dev_t o_devno, const dev_t c_devno,
+		     struct tune_devs *const devs)
+{
+	struct dm_info info;
+	char *name;
+	int ret;
+
+	name = zc_asprintf("zodcache-device-%s", uuid);
+	ret = zc_dm_info(name, &info);
+	free(name);
+
+	if (ret < 0 || !info.exists)
+		return -1;
+
+	devs->queue[TUNE_SET] = tune_queue(info.major, info.minor);
+	devs->queue[TUNE_ORIGIN] = tune_queue(major(o_devno), minor(o_devno));
+	devs->queue[TUNE_CACHE] = tune_queue(major(c_devno), minor(c_devno));
+	devs->block_size = block_size / 1024;
+
+	return 0;
+}
+
+static void tune_devs_free(struct tune_devs *const devs)
+{
+	unsigned i;
+
+	for (i = 0; i < 3; ++i)
+		free(devs->queue[i]);
+}
+
+/*
+ * Applies a set's queue settings.  The set's device must exist; the members
+ * are the origin & cache (or combined) devices.  Fails without changing
+ * anything, if possible.
+ */
+int zc_tune_apply(const char *const uuid, const struct zc_sb_ext *const ext,
+		  const uint64_t block_size, const dev_t o_devno,
+		  const dev_t c_devno)
+{
+	char cur[TUNE_VALUE_SIZE], old[TUNE_VALUE_SIZE], value[TUNE_VALUE_SIZE];
+	struct tune_change changes[TUNE_NR_KEYS + 2];
+	const struct tune_key *key;
+	struct tune_devs devs;
+	unsigned i, nr_changes;
+	char *path, *nr_path;
+	int ret;
+
+	if (tune_devs(uuid, block_size, o_devno, c_devno, &devs) < 0)
+		return -1;
+
+	nr_changes = 0;
+	ret = 0;
+
+	for (i = 0, key = tune_keys; i < TUNE_NR_KEYS; ++i, ++key) {
+
+		path = zc_asprintf("%s/%s", devs.queue[key->dev], key->attr);
+
+		if (tune_read(path, cur) < 0 ||
+				(ret = tune_value(key, *tune_setting(ext, key),
+						  &devs, cur, value)) < 0) {
+			free(path);
+			ret = -1;
+			break;
+		}
+
+		tune_current(key, cur, old);
+
+		if (ret == 1 || strcmp(value, old) == 0) {
+			free(path);
+			ret = 0;
+			continue;
+		}
+
+		/* Undone after the scheduler, which resets it */
+		if (strcmp(key->attr, "scheduler") == 0) {
+
+			nr_path = zc_asprintf("%s/nr_requests",
+					      devs.queue[key->dev]);
+
+			if (tune_read(nr_path, changes[nr_changes].old) < 0) {
+				free(nr_path);
+				free(path);
+				ret = -1;
+				break;
+			}
+
+			changes[nr_changes++].path = nr_path;
+		}
+
+		if (tune_write(path, value) < 0) {
+			free(path);
+			ret = -1;
+			break;
+		}
+
+		changes[nr_changes].path = path;
+		strcpy(changes[nr_changes++].old, old);
+	}
+
+	while (nr_changes-- > 0) {
+		if (ret < 0)
+			tune_write(changes[nr_changes].path,
+				   changes[nr_changes].old);
+		free(changes[nr_changes].path);
+	}
+
+	tune_devs_free(&devs);
+
+	if (ret < 0)
+		zc_err(LOG_WARNING, "%s: queue settings not applied\n", uuid);
+	else
+		ret = zc_tune_crypt(uuid, ext);
+
+	return ret;
+}
+
+/* A device-mapper device's queue directory, or NULL if it doesn't exist */
+static char *tune_dm_queue(const char *const name)
+{
+	struct dm_info info;
+
+	if (zc_dm_info(name, &info) < 0 || !info.exists)
+		return NULL;
+
+	return tune_queue(info.major, info.minor);
+}
+
+/*
+ * Gives the set's dm-crypt device, if it has one, the read-ahead of the set's
+ * device; the filesystem reads through the former.
+ */
+int zc_tune_crypt(const char *const uuid, const struct zc_sb_ext *const ext)
+{
+	char *name, *set_queue, *crypt_queue, *path, value[TUNE_VALUE_SIZE];
+	int ret;
+
+	if (ext->crypt_cipher[0] == 0 || ext->tune_read_ahead == ZC_TUNE_KEEP)
+		return 0;
+
+	name = zc_asprintf(ZC_CRYPT_PREFIX "%s", uuid);
+	crypt_queue = tune_dm_queue(name);
+	free(name);
+
+	if (crypt_queue == NULL)
+		return 0;
+
+	name = zc_asprintf("zodcache-device-%s", uuid);
+	set_queue = tune_dm_queue(name);
+	free(name);
+
+	ret = -1;
+
+	if (set_queue != NULL) {
+		path = zc_asprintf("%s/read_ahead_kb", set_queue);
+		ret = tune_read(path, value);
+		free(path);
+	}
+
+	if (ret == 0) {
+		path = zc_asprintf("%s/read_ahead_kb", crypt_queue);
+		ret = tune_write(path, value);
+		free(path);
+	}
+
+	if (ret < 0) {
+		zc_err(LOG_WARNING, "%s: read-ahead not applied to %s%s\n",
+		       uuid, ZC_CRYPT_PREFIX, uuid);
+	}
+
+	free(set_queue);
+	free(crypt_queue);
+	return ret;
+}
+
+/* Parses KEY=VALUE into the extension; VALUE may be "auto" or "keep" */
+int zc_tune_parse(struct zc_sb_ext *const ext, const char *const arg)
+{
+	const struct tune_key *key;
+	unsigned long long n;
+	uint64_t *setting;
+	const char *value;
+	char *end;
+	size_t len;
+	unsigned i;
+
+	if ((value = strchr(arg, '=')) == NULL)
+		goto invalid;
+
+	len = value++ - arg;
+
+	for (i = 0, key = tune_keys; i < TUNE_NR_KEYS; ++i, ++key) {
+		if (strlen(key->name) == len &&
+				strncmp(key->name, arg, len) == 0)
+			break;
+	}
+
+	if (i == TUNE_NR_KEYS)
+		goto invalid;
+
+	setting = tune_setting(ext, key);
+
+	if (strcmp(value, "auto") == 0) {
+		*setting = ZC_TUNE_AUTO;
+		return 0;
+	}
+
+	if (strcmp(value, "keep") == 0) {
+		*setting = ZC_TUNE_KEEP;
+		return 0;
+	}
+
+	if (strcmp(key->attr, "scheduler") == 0) {
+
+		for (i = 1; i < TUNE_NR_SCHEDS; ++i) {
+			if (strcmp(value, tune_schedulers[i][0]) == 0 ||
+					(tune_schedulers[i][1] != NULL &&
+					 strcmp(value,
+						tune_schedulers[i][1]) == 0)) {
+				*setting = i;
+				return 0;
+			}
+		}
+
+		goto invalid;
+	}
+
+	errno = 0;
+	n = strtoull(value, &end, 10);
+	if (errno != 0 || end == value || *end != 0 || n == 0 ||
+							n >= UINT32_MAX)
+		goto invalid;
+
+	*setting = n;
+	return 0;
+
+invalid:
+	zc_err(LOG_ERR, "Invalid queue setting: %s\n", arg);
+	return -1;
+}
+
+/* Lists each setting, with the current value if the set is assembled */
+void zc_tune_report(const char *const uuid, const struct zc_sb_ext *const ext,
+		    const uint64_t block_size, const dev_t o_devno,
+		    const dev_t c_devno, FILE *const fp)
+{
+	char cur[TUNE_VALUE_SIZE], now[TUNE_VALUE_SIZE], *path;
+	const struct tune_key *key;
+	struct tune_devs devs;
+	uint64_t setting;
+	_Bool active;
+	unsigned i;
+
+	active = (tune_devs(uuid, block_size, o_devno, c_devno, &devs) == 0);
+
+	for (i = 0, key = tune_keys; i < TUNE_NR_KEYS; ++i, ++key) {
+
+		setting = *tune_setting(ext, key);
+		fprintf(fp, "%s:\t", key->name);
+
+		if (setting == ZC_TUNE_AUTO)
+			fputs("auto", fp);
+		else if (setting == ZC_TUNE_KEEP)
+			fputs("keep", fp);
+		else if (strcmp(key->attr, "scheduler") != 0)
+			fprintf(fp, "%" PRIu64, setting);
+		else if (setting < TUNE_NR_SCHEDS)
+			fputs(tune_schedulers[setting][0], fp);
+		else
+			fprintf(fp, "invalid (%" PRIu64 ")", setting);
+
+		if (active) {
+			path = zc_asprintf("%s/%s", devs.queue[key->dev],
+					   key->attr);
+			if (tune_read(path, cur) == 0) {
+				tune_current(key, cur, now);
+				fprintf(fp, " (now %s)", now);
+			}
+			free(path);
+		}
+
+		fputc('\n', fp);
+	}
+
+	if (active)
+		tune_devs_free(&devs);
+}
@@ -0,0 +1,714 @@
+/*
+ * Copyright 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Measures how long zcstart takes to assemble many sets at once, without a
+ * shelf of disks.  Each set's members are sparse files on loop devices,
+ * formatted by mkzc, so they carry real superblocks.  The members "arrive" in
+ * random order, and zcstart is run once per member (as udev would), with up
+ * to JOBS runs at a time, against the stand-in libdevmapper in zcfakedm.c.
+ *
+ * With -d, zodcached is measured instead: it is started once all of the
+ * members exist, and starts every member (through zcstart children) while it
+ * scans the existing devices (coldplug).  Its socket only appears once those
+ * have all finished.
+ * (Without udevd, there are no events to feed it one member at a time.)
+ *
+ *   gcc -O2 -Wall -Wextra -pthread -o zcbench zcbench.c lib.c
+ *
+ * zcstart, zodcached and mkzc are run from PATH.  DIR must not exist; it ends
+ * up holding the stand-in device-mapper state and the output of mkzc and
+ * zcstart (or zodcached).  The loop devices are detached, and their backing
+ * files deleted, on exit.
+ *
+ * Must be run as root, and refuses to run if udev or zodcached would react
+ * to the new loop devices by assembling the sets for real.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/ioctl.h>
+#include <linux/loop.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "zodcache.h"
+
+#define BENCH_ORIGIN_SIZE	(256 * 1024 * 1024)
+#define BENCH_CACHE_SIZE	(64 * 1024 * 1024)
+#define BENCH_METADATA_SIZE	(16 * 1024 * 1024)
+#define BENCH_MAX_OPS		32
+
+/* How long zodcached may take to assemble the sets */
+#define BENCH_DAEMON_TIMEOUT	600	/* seconds */
+
+static const char *const rules_files[] = {
+	"/etc/udev/rules.d/69-zodcache.rules",
+	"/run/udev/rules.d/69-zodcache.rules",
+	"/usr/lib/udev/rules.d/69-zodcache.rules",
+	"/lib/udev/rules.d/69-zodcache.rules",
+};
+
+struct bench_set {
+	char		uuid[ZC_UUID_BUF_SIZE];
+	char		*members[3];
+	double		first;
+	double		last;
+	double		assembled;
+};
+
+struct bench_job {
+	char		*argv[8];
+	struct bench_set *set;
+	pid_t		pid;
+	double		start;
+	double		end;
+	int		status;
+};
+
+struct bench_op {
+	char		name[32];
+	unsigned	count;
+	unsigned	failed;
+	unsigned	dups;
+};
+
+static const char *progname;
+
+static void usage_error(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-n SETS] [-j JOBS] [-u UDEV_US] [-i IOCTL_US] "
+							"[-s SEED] [-p SHIM]\n"
+		"       %*s [-m] [-U | -d] [-v] [-f] DIR\n",
+		progname, (int)strlen(progname), "");
+	exit(EXIT_FAILURE);
+}
+
+static const char *option_value(const int argc, char *argv[], const int i)
+{
+	if (i + 1 >= argc) {
+		fprintf(stderr, "Option %s requires a value\n", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+
+	return argv[i + 1];
+}
+
+static unsigned parse_unsigned(const char *const s, const char *const what,
+			       const unsigned min, const unsigned max)
+{
+	unsigned long value;
+	char *endptr;
+
+	errno = 0;
+	value = strtoul(s, &endptr, 10);
+	if (errno != 0 || endptr == s || *endptr != 0 || *s == '-' ||
+						value < min || value > max) {
+		fprintf(stderr, "Invalid %s: %s (must be %u-%u)\n", what, s,
+			min, max);
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The new loop device would be assembled for real */
+static void check_safe(void)
+{
+	unsigned i;
+
+	if (access(ZC_DAEMON_SOCKET, F_OK) == 0) {
+		fprintf(stderr, "%s: zodcached is running\n", ZC_DAEMON_SOCKET);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < sizeof rules_files / sizeof rules_files[0]; ++i) {
+		if (access(rules_files[i], F_OK) == 0) {
+			fprintf(stderr, "%s: udev would run zcstart\n",
+				rules_files[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Creates a sparse file and attaches it to a free loop device.  The file is
+ * deleted at once, and the device is detached when this process exits.
+ */
+static char *loop_create(const char *const dir, const uint64_t size)
+{
+	struct loop_info64 info;
+	int ctl, img, fd, nr;
+	char *img_path, *path;
+
+	img_path = zc_asprintf("%s/image-XXXXXX", dir);
+
+	if ((img = mkostemp(img_path, O_CLOEXEC)) < 0 ||
+			ftruncate(img, size) < 0 || unlink(img_path) < 0) {
+		perror(img_path);
+		exit(EXIT_FAILURE);
+	}
+
+	if ((ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC)) < 0) {
+		perror("/dev/loop-control");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Another process can grab the same free device */
+	while (1) {
+
+		if ((nr = ioctl(ctl, LOOP_CTL_GET_FREE)) < 0) {
+			perror("LOOP_CTL_GET_FREE");
+			exit(EXIT_FAILURE);
+		}
+
+		path = zc_asprintf("/dev/loop%d", nr);
+
+		if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+
+		if (ioctl(fd, LOOP_SET_FD, img) == 0)
+			break;
+
+		if (errno != EBUSY) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+
+		close(fd);
+		free(path);
+	}
+
+	memset(&info, 0, sizeof info);
+	info.lo_flags = LO_FLAGS_AUTOCLEAR;
+	snprintf((char *)info.lo_file_name, sizeof info.lo_file_name,
+		 "zcbench");
+
+	if (ioctl(fd, LOOP_SET_STATUS64, &info) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* fd stays open; the device goes away when it's closed */
+	close(img);
+	close(ctl);
+	free(img_path);
+	return path;
+}
+
+static void set_uuid(struct bench_set *const set)
+{
+	struct zc_sb_v0 sb;
+	int fd;
+
+	if ((fd = open(set->members[0], O_RDONLY | O_CLOEXEC)) < 0) {
+		perror(set->members[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_sb_v0_read(fd, &sb) < 0 || !zc_sb_v0_is_valid(&sb)) {
+		fprintf(stderr, "%s: mkzc failed (see mkzc.log)\n",
+			set->members[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	zc_sb_uuid_format(&sb, set->uuid);
+	close(fd);
+}
+
+static void job_start(struct bench_job *const job, const int out_fd,
+		      char *const env[])
+{
+	job->start = now();
+
+	if ((job->pid = fork()) < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (job->pid == 0) {
+		for (; *env != NULL; env += 2)
+			setenv(env[0], env[1], 1);
+		dup2(out_fd, STDOUT_FILENO);
+		dup2(out_fd, STDERR_FILENO);
+		execvp(job->argv[0], job->argv);
+		fprintf(stderr, "%s: %m\n", job->argv[0]);
+		_exit(127);
+	}
+}
+
+/* Runs the jobs, in order, with at most nr_slots running at a time */
+static void jobs_run(struct bench_job *const jobs, const unsigned nr_jobs,
+		     const unsigned nr_slots, const char *const log,
+		     char *const env[])
+{
+	struct bench_job **slots;
+	unsigned next, running, i;
+	int out_fd, status;
+	pid_t pid;
+
+	if ((out_fd = open(log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+			   0644)) < 0) {
+		perror(log);
+		exit(EXIT_FAILURE);
+	}
+
+	slots = calloc(nr_slots, sizeof *slots);
+	next = running = 0;
+
+	while (next < nr_jobs || running > 0) {
+
+		for (i = 0; i < nr_slots && next < nr_jobs; ++i) {
+			if (slots[i] == NULL) {
+				slots[i] = jobs + next++;
+				job_start(slots[i], out_fd, env);
+				++running;
+			}
+		}
+
+		if ((pid = wait(&status)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("wait");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < nr_slots; ++i) {
+			if (slots[i] != NULL && slots[i]->pid == pid) {
+				slots[i]->end = now();
+				slots[i]->status = status;
+				slots[i] = NULL;
+				--running;
+				break;
+			}
+		}
+	}
+
+	free(slots);
+	close(out_fd);
+}
+
+/*
+ * Runs zodcached until its socket appears (in the stand-in ZC_RUN_DIR), then
+ * stops it.  Returns the time at which the socket appeared, or 0 if zodcached
+ * exited or timed out first.
+ */
+static double daemon_run(const char *const dm_dir, const char *const log,
+			 char *const env[])
+{
+	struct bench_job job;
+	double started, ready;
+	int out_fd, status;
+	char *sock;
+
+	if ((out_fd = open(log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+			   0644)) < 0) {
+		perror(log);
+		exit(EXIT_FAILURE);
+	}
+
+	sock = zc_asprintf("%s/run%s", dm_dir,
+			   ZC_DAEMON_SOCKET + sizeof ZC_RUN_DIR - 1);
+
+	memset(&job, 0, sizeof job);
+	memcpy(job.argv, (char *[]){ "zodcached", "-f", NULL },
+	       3 * sizeof *job.argv);
+	job_start(&job, out_fd, env);
+	started = job.start;
+	ready = 0;
+
+	while (access(sock, F_OK) < 0) {
+
+		if (waitpid(job.pid, &status, WNOHANG) == job.pid) {
+			fputs("zodcached exited early (see zodcached.log)\n",
+			      stderr);
+			goto out;
+		}
+
+		if (now() - started > BENCH_DAEMON_TIMEOUT) {
+			fputs("zodcached timed out\n", stderr);
+			kill(job.pid, SIGTERM);
+			waitpid(job.pid, &status, 0);
+			goto out;
+		}
+
+		usleep(1000);
+	}
+
+	ready = now();
+	kill(job.pid, SIGTERM);
+	waitpid(job.pid, &status, 0);
+
+out:
+	close(out_fd);
+	free(sock);
+	return ready;
+}
+
+static _Bool job_failed(const struct bench_job *const job)
+{
+	return !WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0;
+}
+
+static int set_cmp(const void *const a, const void *const b)
+{
+	return strcmp(((const struct bench_set *)a)->uuid,
+		      ((const struct bench_set *)b)->uuid);
+}
+
+static int double_cmp(const void *const a, const void *const b)
+{
+	const double *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static struct bench_op *op_find(struct bench_op *const ops,
+				unsigned *const nr_ops, const char *const name)
+{
+	unsigned i;
+
+	for (i = 0; i < *nr_ops; ++i) {
+		if (strcmp(ops[i].name, name) == 0)
+			return ops + i;
+	}
+
+	if (*nr_ops == BENCH_MAX_OPS)
+		return NULL;
+
+	memset(ops + i, 0, sizeof ops[i]);
+	snprintf(ops[i].name, sizeof ops[i].name, "%s", name);
+	++*nr_ops;
+	return ops + i;
+}
+
+/* Counts operations and finds when each set's top-level device appeared */
+static unsigned log_read(const char *const log, struct bench_set *const sets,
+			 const unsigned nr_sets, struct bench_op *const ops)
+{
+	struct bench_set key, *set;
+	char op[32], name[NAME_MAX + 1];
+	struct bench_op *o;
+	unsigned nr_ops;
+	double when;
+	int pid, err;
+	FILE *fp;
+
+	if ((fp = fopen(log, "re")) == NULL) {
+		perror(log);
+		exit(EXIT_FAILURE);
+	}
+
+	nr_ops = 0;
+
+	while (fscanf(fp, "%lf %d %31s %255s %d", &when, &pid, op, name,
+		      &err) == 5) {
+
+		if ((o = op_find(ops, &nr_ops, op)) != NULL) {
+			++o->count;
+			if (err == EEXIST && strcmp(op, "create") == 0)
+				++o->dups;
+			else if (err != 0)
+				++o->failed;
+		}
+
+		if (err != 0 || strcmp(op, "create") != 0 ||
+				strncmp(name, "zodcache-device-", 16) != 0)
+			continue;
+
+		if (strlen(name + 16) >= sizeof key.uuid)
+			continue;
+
+		strcpy(key.uuid, name + 16);
+		set = bsearch(&key, sets, nr_sets, sizeof *sets, set_cmp);
+		if (set != NULL && set->assembled == 0)
+			set->assembled = when;
+	}
+
+	fclose(fp);
+	return nr_ops;
+}
+
+static void print_latency(const char *const what, double *const ms,
+			  const unsigned n)
+{
+	if (n == 0)
+		return;
+
+	qsort(ms, n, sizeof *ms, double_cmp);
+	printf("%-26s %10.3f %10.3f %10.3f %10.3f %10.3f\n", what, ms[0],
+	       ms[n / 2], ms[(n * 95) / 100], ms[(n * 99) / 100], ms[n - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned nr_sets, nr_jobs, nr_members, udev_us, ioctl_us, seed;
+	unsigned i, j, nr_ops, assembled, failed;
+	_Bool separate_md, udev, daemon, verbose, force;
+	char *dir, *dm_dir, *log, *shim, *env[9], udev_buf[16], ioctl_buf[16];
+	struct bench_job *jobs, tmp;
+	struct bench_op ops[BENCH_MAX_OPS];
+	struct bench_set *sets, *set;
+	double start, end, *first, *last;
+	const char *shim_arg;
+
+	progname = argv[0];
+	nr_sets = 100;
+	nr_jobs = 16;
+	udev_us = 5000;
+	ioctl_us = 100;
+	seed = time(NULL);
+	shim_arg = "./zcfakedm.so";
+	separate_md = udev = daemon = verbose = force = 0;
+
+	for (i = 1; i < (unsigned)argc - 1; ++i) {
+
+		if (strcmp(argv[i], "-n") == 0) {
+			nr_sets = parse_unsigned(option_value(argc, argv, i++),
+						 "set count", 1, 100000);
+		}
+		else if (strcmp(argv[i], "-j") == 0) {
+			nr_jobs = parse_unsigned(option_value(argc, argv, i++),
+						 "job count", 1, 4096);
+		}
+		else if (strcmp(argv[i], "-u") == 0) {
+			udev_us = parse_unsigned(option_value(argc, argv, i++),
+						 "udev latency", 0, 10000000);
+		}
+		else if (strcmp(argv[i], "-i") == 0) {
+			ioctl_us = parse_unsigned(option_value(argc, argv, i++),
+						  "ioctl latency", 0, 10000000);
+		}
+		else if (strcmp(argv[i], "-s") == 0) {
+			seed = parse_unsigned(option_value(argc, argv, i++),
+					      "seed", 0, UINT_MAX);
+		}
+		else if (strcmp(argv[i], "-p") == 0) {
+			shim_arg = option_value(argc, argv, i++);
+		}
+		else if (strcmp(argv[i], "-m") == 0) {
+			separate_md = 1;
+		}
+		else if (strcmp(argv[i], "-U") == 0) {
+			udev = 1;
+		}
+		else if (strcmp(argv[i], "-d") == 0) {
+			daemon = 1;
+		}
+		else if (strcmp(argv[i], "-v") == 0) {
+			verbose = 1;
+		}
+		else if (strcmp(argv[i], "-f") == 0) {
+			force = 1;
+		}
+		else {
+			usage_error();
+		}
+	}
+
+	if (i != (unsigned)argc - 1 || (udev && daemon))
+		usage_error();
+
+	if (!force)
+		check_safe();
+
+	if ((shim = realpath(shim_arg, NULL)) == NULL) {
+		perror(shim_arg);
+		exit(EXIT_FAILURE);
+	}
+
+	dir = argv[i];
+	dm_dir = zc_asprintf("%s/dm", dir);
+
+	if (mkdir(dir, 0755) < 0 || mkdir(dm_dir, 0755) < 0) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Create and format the sets */
+
+	nr_members = separate_md ? 3 : 2;
+	sets = calloc(nr_sets, sizeof *sets);
+	jobs = calloc(nr_sets * nr_members, sizeof *jobs);
+
+	for (i = 0; i < nr_sets; ++i) {
+
+		set = sets + i;
+		set->members[0] = loop_create(dir, BENCH_ORIGIN_SIZE);
+		set->members[1] = loop_create(dir, BENCH_CACHE_SIZE);
+		if (separate_md)
+			set->members[2] = loop_create(dir, BENCH_METADATA_SIZE);
+
+		memcpy(jobs[i].argv, (char *[]){ "mkzc", "-o", set->members[0],
+			"-c", set->members[1], separate_md ? "-m" : NULL,
+			set->members[2], NULL }, sizeof jobs[i].argv);
+	}
+
+	log = zc_asprintf("%s/mkzc.log", dir);
+	jobs_run(jobs, nr_sets, nr_jobs, log, (char *[]){ NULL });
+	free(log);
+
+	for (i = 0; i < nr_sets; ++i)
+		set_uuid(sets + i);
+
+	/* Randomize the arrival order */
+
+	memset(jobs, 0, nr_sets * nr_members * sizeof *jobs);
+
+	for (i = 0; i < nr_sets * nr_members; ++i) {
+		jobs[i].set = sets + i / nr_members;
+		jobs[i].argv[0] = "zcstart";
+		jobs[i].argv[1] = udev ? "--udev" : jobs[i].set->members[
+							i % nr_members];
+		jobs[i].argv[2] = udev ? jobs[i].set->members[i % nr_members]
+				       : NULL;
+	}
+
+	srand48(seed);
+
+	for (i = nr_sets * nr_members - 1; i > 0; --i) {
+		j = lrand48() % (i + 1);
+		tmp = jobs[i];
+		jobs[i] = jobs[j];
+		jobs[j] = tmp;
+	}
+
+	snprintf(udev_buf, sizeof udev_buf, "%u", udev_us);
+	snprintf(ioctl_buf, sizeof ioctl_buf, "%u", ioctl_us);
+	memcpy(env, (char *[]){ "LD_PRELOAD", shim, "ZC_FAKEDM_DIR", dm_dir,
+		"ZC_FAKEDM_UDEV_US", udev_buf, "ZC_FAKEDM_IOCTL_US", ioctl_buf,
+		NULL }, sizeof env);
+
+	if (daemon) {
+
+		/* Every member is present from the start */
+		log = zc_asprintf("%s/zodcached.log", dir);
+		start = now();
+		end = daemon_run(dm_dir, log, env);
+		failed = (end == 0);
+		if (end == 0)
+			end = now();
+		free(log);
+
+		for (i = 0; i < nr_sets; ++i)
+			sets[i].first = sets[i].last = start;
+	}
+	else {
+		failed = 0;
+		log = zc_asprintf("%s/zcstart.log", dir);
+		start = now();
+		jobs_run(jobs, nr_sets * nr_members, nr_jobs, log, env);
+		end = now();
+		free(log);
+	}
+
+	/* Results */
+
+	for (i = 0; !daemon && i < nr_sets * nr_members; ++i) {
+
+		set = jobs[i].set;
+
+		if (set->first == 0 || jobs[i].start < set->first)
+			set->first = jobs[i].start;
+		if (jobs[i].start > set->last)
+			set->last = jobs[i].start;
+		if (job_failed(jobs + i))
+			++failed;
+	}
+
+	qsort(sets, nr_sets, sizeof *sets, set_cmp);
+	log = zc_asprintf("%s/log", dm_dir);
+	nr_ops = log_read(log, sets, nr_sets, ops);
+	free(log);
+
+	first = calloc(nr_sets, sizeof *first);
+	last = calloc(nr_sets, sizeof *last);
+
+	for (assembled = 0, i = 0; i < nr_sets; ++i) {
+
+		set = sets + i;
+
+		if (verbose) {
+			printf("%s %10.3f %10.3f ", set->uuid,
+			       (set->first - start) * 1000,
+			       (set->last - start) * 1000);
+			if (set->assembled != 0)
+				printf("%10.3f\n",
+				       (set->assembled - start) * 1000);
+			else
+				puts("       (not assembled)");
+		}
+
+		if (set->assembled == 0)
+			continue;
+
+		first[assembled] = (set->assembled - set->first) * 1000;
+		last[assembled] = (set->assembled - set->last) * 1000;
+		++assembled;
+	}
+
+	if (verbose)
+		putchar('\n');
+
+	printf("sets: %u (%u members each), jobs: %u, seed: %u\n", nr_sets,
+	       nr_members, nr_jobs, seed);
+	printf("udev latency: %u us, ioctl latency: %u us\n", udev_us,
+	       ioctl_us);
+	printf("total: %.3f s, assembled: %u, %s failures: %u\n\n",
+	       end - start, assembled, daemon ? "zodcached" : "zcstart",
+	       failed);
+
+	printf("%-26s %10s %10s %10s %10s %10s\n", "assembly latency (ms)",
+	       "MIN", "P50", "P95", "P99", "MAX");
+	if (daemon) {
+		print_latency("  from daemon start", first, assembled);
+	}
+	else {
+		print_latency("  from first member", first, assembled);
+		print_latency("  from last member", last, assembled);
+	}
+
+	printf("\n%-26s %10s %10s %10s\n", "dm operations", "COUNT", "FAILED",
+	       "DUPLICATE");
+	for (i = 0; i < nr_ops; ++i) {
+		printf("  %-24s %10u %10u %10u\n", ops[i].name, ops[i].count,
+		       ops[i].failed, ops[i].dups);
+	}
+
+	return (assembled == nr_sets && failed == 0) ? EXIT_SUCCESS
+						     : EXIT_FAILURE;
+}
@@ -0,0 +1,545 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Converts an existing bcache or lvmcache setup to zodcache without copying
+ * the origin data.
+ *
+ * A bcache backing device doesn't use its first 4KiB, and its data starts at
+ * data_offset, so the origin superblock simply records that offset (mkzc -O).
+ *
+ * A logical volume is uncached (LVM writes back any dirty blocks) and extended
+ * by ZC_CONVERT_HEAD bytes (or the alignment, if larger).  The head of its
+ * data, which the superblock displaces, is copied to the new space at the end
+ * (mkzc -R); the rest of the data stays where it is.  The head is big enough
+ * to cover the signatures of common filesystems, so that nothing mistakes the
+ * converted LV for a filesystem.
+ *
+ * The cache itself can't be reused; the new set starts with an empty cache.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "zodcache.h"
+
+#define ZC_CONVERT_HEAD		1048576
+
+/* See include/uapi/linux/bcache.h */
+#define BCACHE_SB_OFFSET	4096
+#define BCACHE_SB_SIZE		4096
+#define BCACHE_VERSION_BDEV	1
+#define BCACHE_VERSION_BDEV_OFF	4
+#define BCACHE_VERSION_BDEV_FT	6
+#define BCACHE_DATA_START	16	/* sectors; version 1 */
+#define BCACHE_STATE_DIRTY	2
+
+static const uint8_t bcache_magic[16] = {
+	0xc6, 0x85, 0x73, 0xf6, 0x4e, 0x1a, 0x45, 0xca,
+	0x82, 0x65, 0xf5, 0x7f, 0x48, 0xba, 0x6d, 0x81
+};
+
+struct bcache_info {
+	uint64_t	version;
+	uint64_t	flags;
+	uint64_t	data_offset;		/* sectors; backing devices */
+	uint8_t		set_uuid[16];
+};
+
+static const char *progname;
+
+/* mkzc options that don't take a value */
+static _Bool is_flag(const char *const opt)
+{
+	return strcmp(opt, "-n") == 0 || strcmp(opt, "-D") == 0;
+}
+
+static void usage_error(void)
+{
+	fprintf(stderr,
+		"Usage: %s -o ORIGIN -c CACHE [MKZC_OPTION]...\n"
+		"  ORIGIN is a bcache backing device or an LVM logical volume "
+								"(VG/LV)\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t le64(const uint8_t *const p)
+{
+	uint64_t value;
+
+	memcpy(&value, p, sizeof value);
+	return le64toh(value);
+}
+
+/* Returns 1 if the device has a bcache superblock, -1 if it can't be read */
+static int bcache_read(const char *const dev, struct bcache_info *const info)
+{
+	uint8_t buf[BCACHE_SB_SIZE];
+	int fd;
+
+	if ((fd = open(dev, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (pread(fd, buf, sizeof buf, BCACHE_SB_OFFSET) != sizeof buf) {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	if (memcmp(buf + 24, bcache_magic, sizeof bcache_magic) != 0)
+		return 0;
+
+	info->version = le64(buf + 16);
+	info->flags = le64(buf + 104);
+	memcpy(info->set_uuid, buf + 56, sizeof info->set_uuid);
+
+	info->data_offset = (info->version == BCACHE_VERSION_BDEV) ?
+				BCACHE_DATA_START : le64(buf + 184);
+
+	return 1;
+}
+
+static int bcache_probe(const char *const dev, struct bcache_info *const info)
+{
+	int ret;
+
+	if ((ret = bcache_read(dev, info)) < 0) {
+		perror(dev);
+		exit(EXIT_FAILURE);
+	}
+
+	return ret;
+}
+
+static _Bool bcache_is_backing(const struct bcache_info *const info)
+{
+	return info->version == BCACHE_VERSION_BDEV ||
+		info->version == BCACHE_VERSION_BDEV_OFF ||
+		info->version == BCACHE_VERSION_BDEV_FT;
+}
+
+/*
+ * Looks for another backing device (than the origin) attached to the cache
+ * set.  Its dirty data, if any, is only in the cache, so the cache mustn't be
+ * wiped.  Only devices that are present can be found, of course.
+ */
+static void bcache_check_set(const char *const origin,
+			     const struct bcache_info *const set)
+{
+	struct bcache_info info;
+	struct stat st, o_st;
+	struct dirent *d;
+	char path[PATH_MAX];
+	DIR *dir;
+
+	if (stat(origin, &o_st) < 0 || (dir = opendir("/sys/class/block")) ==
+								NULL) {
+		perror(origin);
+		exit(EXIT_FAILURE);
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+
+		if (d->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof path, "/dev/%s", d->d_name);
+
+		if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode) ||
+				st.st_rdev == o_st.st_rdev)
+			continue;
+
+		if (bcache_read(path, &info) != 1 || !bcache_is_backing(&info)
+				|| memcmp(info.set_uuid, set->set_uuid,
+					  sizeof info.set_uuid) != 0)
+			continue;
+
+		fprintf(stderr, "%s: also attached to the bcache cache set; "
+			"detach it (or convert it) first\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	closedir(dir);
+}
+
+/* So that udev doesn't register the device with bcache */
+static void bcache_wipe(const char *const dev)
+{
+	static const uint8_t zeroes[BCACHE_SB_SIZE];
+	int fd;
+
+	if ((fd = open(dev, O_WRONLY | O_CLOEXEC)) < 0 ||
+			pwrite(fd, zeroes, sizeof zeroes, BCACHE_SB_OFFSET) !=
+							sizeof zeroes ||
+			fsync(fd) < 0) {
+		perror(dev);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+}
+
+/*
+ * Runs a program and returns its exit status.  If out is not NULL, its
+ * standard output is captured there (truncated to size).
+ */
+static int run(char *const argv[], char *const out, const size_t size)
+{
+	int pipefd[2], status;
+	size_t len;
+	ssize_t count;
+	pid_t pid;
+
+	if (out != NULL && pipe2(pipefd, O_CLOEXEC) < 0) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0) {
+		if (out != NULL)
+			dup2(pipefd[1], STDOUT_FILENO);
+		execvp(argv[0], argv);
+		fprintf(stderr, "%s: %m\n", argv[0]);
+		_exit(127);
+	}
+
+	if (out != NULL) {
+
+		close(pipefd[1]);
+
+		for (len = 0; (count = read(pipefd[0], out + len,
+					    size - 1 - len)) > 0; )
+			len += count;
+
+		out[len] = 0;
+		close(pipefd[0]);
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror("waitpid");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void run_or_die(char *const argv[])
+{
+	if (run(argv, NULL, 0) != 0) {
+		fprintf(stderr, "%s failed\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Returns 1 (and the LV's size, segment type and path) if dev is an LV */
+static int lvm_probe(const char *const dev, uint64_t *const size,
+		     char *const segtype, char *const path)
+{
+	char out[4096];
+
+	if (run((char *[]){ "lvs", "--noheadings", "--nosuffix", "--units",
+			    "b", "-o", "lv_size,segtype,lv_path",
+			    (char *)dev, NULL }, out, sizeof out) != 0)
+		return 0;
+
+	if (sscanf(out, "%" SCNu64 " %31s %255s", size, segtype, path) != 3) {
+		fprintf(stderr, "lvs: unexpected output: %s", out);
+		exit(EXIT_FAILURE);
+	}
+
+	return 1;
+}
+
+static uint64_t dev_size(const int fd, const char *const dev)
+{
+	uint64_t size;
+
+	if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		perror(dev);
+		exit(EXIT_FAILURE);
+	}
+
+	return size;
+}
+
+/* Fails if the device is in use (mounted, or held by bcache or dm) */
+static int open_excl(const char *const dev)
+{
+	int fd;
+
+	if ((fd = open(dev, O_RDWR | O_EXCL | O_CLOEXEC)) < 0) {
+		if (errno == EBUSY)
+			fprintf(stderr, "%s: device is in use (unmount it, or "
+				"stop the bcache device)\n", dev);
+		else
+			perror(dev);
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+/* Don't relocate the head of a device that already has a zodcache superblock */
+static void check_not_zodcache(const int fd, const char *const dev)
+{
+	struct zc_sb_ext ext;
+	struct zc_sb_v0 sb;
+
+	if (zc_sb_v0_read(fd, &sb) < 0)
+		exit(EXIT_FAILURE);
+
+	if (sb.magic != ZC_SB_MAGIC)
+		return;
+
+	fprintf(stderr, "%s: already has a zodcache superblock\n", dev);
+
+	if (zc_sb_ext_read(fd, &ext) == 0 && ext.o_reloc != 0) {
+		fprintf(stderr, "Its data was relocated; to format it again, "
+			"run mkzc with -R %" PRIu64 " -a %" PRIu64 "\n",
+			ext.o_reloc, sb.o_offset);
+	}
+
+	exit(EXIT_FAILURE);
+}
+
+/* Copies the first head bytes of the device to offset reloc, and verifies */
+static void copy_head(const int fd, const char *const dev, const uint64_t head,
+		      const uint64_t reloc)
+{
+	char *buf, *check;
+
+	if ((buf = malloc(head)) == NULL || (check = malloc(head)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pread(fd, buf, head, 0) != (ssize_t)head ||
+			pwrite(fd, buf, head, reloc) != (ssize_t)head ||
+			fsync(fd) < 0 ||
+			pread(fd, check, head, reloc) != (ssize_t)head) {
+		perror(dev);
+		exit(EXIT_FAILURE);
+	}
+
+	if (memcmp(buf, check, head) != 0) {
+		fprintf(stderr, "%s: relocated data doesn't match\n", dev);
+		exit(EXIT_FAILURE);
+	}
+
+	free(check);
+	free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	char **mkzc_argv, segtype[32], path[256], reloc_arg[32], head_arg[32];
+	struct bcache_info bcache, cache_bcache;
+	uint64_t alignment, head, size;
+	const char *origin, *cache;
+	_Bool lvm;
+	int i, n, fd;
+
+	progname = argv[0];
+	origin = cache = NULL;
+	alignment = 0;
+	lvm = 0;
+	memset(&bcache, 0, sizeof bcache);
+
+	/* Everything except -o is passed to mkzc; -a is needed here too */
+	for (i = 1; i < argc; ++i) {
+
+		/* The origin (and cache) are changed before mkzc runs */
+		if (strcmp(argv[i], "-n") == 0) {
+			fprintf(stderr, "%s: dry run (-n) not supported\n",
+				progname);
+			exit(EXIT_FAILURE);
+		}
+
+		if (is_flag(argv[i]))
+			continue;
+
+		if (i + 1 >= argc)
+			usage_error();
+
+		if (strcmp(argv[i], "-o") == 0)
+			origin = argv[i + 1];
+		else if (strcmp(argv[i], "-c") == 0)
+			cache = argv[i + 1];
+		else if (strcmp(argv[i], "-a") == 0 &&
+				zc_size_parse(argv[i + 1], &alignment) < 0)
+			exit(EXIT_FAILURE);
+		else if (strcmp(argv[i], "-O") == 0 ||
+				strcmp(argv[i], "-R") == 0)
+			usage_error();
+
+		++i;
+	}
+
+	if (origin == NULL || cache == NULL)
+		usage_error();
+
+	/* mkzc ORIGIN_OPTIONS [ARG]... NULL */
+	mkzc_argv = malloc((argc + 8) * sizeof *mkzc_argv);
+	if (mkzc_argv == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	n = 0;
+	mkzc_argv[n++] = "mkzc";
+
+	if (bcache_probe(origin, &bcache)) {
+
+		if (!bcache_is_backing(&bcache)) {
+			fprintf(stderr, "%s: bcache cache device; use it as "
+				"the cache (-c)\n", origin);
+			exit(EXIT_FAILURE);
+		}
+
+		if (((bcache.flags >> 61) & 3) == BCACHE_STATE_DIRTY) {
+			fprintf(stderr, "%s: bcache has dirty data; detach the "
+				"cache first\n", origin);
+			exit(EXIT_FAILURE);
+		}
+
+		close(open_excl(origin));
+
+		snprintf(reloc_arg, sizeof reloc_arg, "%" PRIu64,
+			 bcache.data_offset * 512);
+		mkzc_argv[n++] = "-o";
+		mkzc_argv[n++] = (char *)origin;
+		mkzc_argv[n++] = "-O";
+		mkzc_argv[n++] = reloc_arg;
+	}
+	else if ((lvm = lvm_probe(origin, &size, segtype, path))) {
+
+		if (strcmp(segtype, "cache") == 0 ||
+				strcmp(segtype, "writecache") == 0) {
+			printf("Uncaching %s (writing back dirty blocks)\n",
+			       origin);
+			run_or_die((char *[]){ "lvconvert", "--yes",
+					       "--uncache", path, NULL });
+			if (!lvm_probe(path, &size, segtype, path)) {
+				fprintf(stderr, "%s: LV disappeared\n", path);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		fd = open_excl(path);
+		check_not_zodcache(fd, path);
+		close(fd);
+
+		head = (alignment > ZC_CONVERT_HEAD) ? alignment :
+							ZC_CONVERT_HEAD;
+		snprintf(head_arg, sizeof head_arg, "+%" PRIu64 "b", head);
+
+		run_or_die((char *[]){ "lvextend", "--yes", "-L", head_arg,
+				       path, NULL });
+
+		fd = open_excl(path);
+		if (dev_size(fd, path) < size + head) {
+			fprintf(stderr, "%s: extension failed\n", path);
+			exit(EXIT_FAILURE);
+		}
+
+		copy_head(fd, path, head, size);
+		close(fd);
+
+		snprintf(reloc_arg, sizeof reloc_arg, "%" PRIu64, size);
+		snprintf(head_arg, sizeof head_arg, "%" PRIu64, head);
+		mkzc_argv[n++] = "-o";
+		mkzc_argv[n++] = path;
+		mkzc_argv[n++] = "-R";
+		mkzc_argv[n++] = reloc_arg;
+		mkzc_argv[n++] = "-a";
+		mkzc_argv[n++] = head_arg;
+	}
+	else {
+		fprintf(stderr, "%s: not a bcache backing device or an LVM "
+			"logical volume\n", origin);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The old cache's contents are discarded */
+	if (bcache_probe(cache, &cache_bcache)) {
+		if (bcache_is_backing(&cache_bcache)) {
+			fprintf(stderr, "%s: bcache backing device\n", cache);
+			exit(EXIT_FAILURE);
+		}
+		if (!bcache_is_backing(&bcache)) {
+			fprintf(stderr, "%s: bcache cache device, but %s isn't "
+				"a bcache backing device\n", cache, origin);
+			exit(EXIT_FAILURE);
+		}
+		if (memcmp(bcache.set_uuid, cache_bcache.set_uuid,
+			   sizeof bcache.set_uuid) != 0) {
+			fprintf(stderr, "%s: not the cache set that %s is "
+				"attached to\n", cache, origin);
+			exit(EXIT_FAILURE);
+		}
+		bcache_check_set(origin, &cache_bcache);
+		close(open_excl(cache));
+		bcache_wipe(cache);
+	}
+
+	/* The alignment of a relocated LV is the size of the head */
+	for (i = 1; i < argc; ++i) {
+
+		if (is_flag(argv[i])) {
+			mkzc_argv[n++] = argv[i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "-o") != 0 &&
+				(!lvm || strcmp(argv[i], "-a") != 0)) {
+			mkzc_argv[n++] = argv[i];
+			mkzc_argv[n++] = argv[i + 1];
+		}
+
+		++i;
+	}
+	mkzc_argv[n] = NULL;
+
+	run_or_die(mkzc_argv);
+
+	if (bcache_is_backing(&bcache))
+		bcache_wipe(origin);
+
+	return 0;
+}
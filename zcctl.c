@@ -0,0 +1,3171 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+#define STATS_DEFAULT_AREAS	16
+#define STATS_MAX_AREAS		4096
+
+static const uint64_t stats_default_bounds[ZC_SB_EXT_STATS_BOUNDS] = {
+	50000, 100000, 250000, 500000, 1000000, 5000000, 20000000, 100000000
+};
+
+static const char *progname;
+
+static void usage_error(void)
+{
+	fprintf(stderr,
+		"Usage: %s stats enable [-a AREAS] [-b BOUNDS] [--imprecise] "
+								"UUID\n"
+		"       %s stats disable UUID\n"
+		"       %s stats show [-i SECONDS] UUID\n"
+		"       %s controller enable [-m MIN] [-M MAX] UUID TARGET\n"
+		"       %s controller disable UUID\n"
+		"       %s budget enable -d DAILY [-t TBW] "
+				"[-f {writethrough|passthrough}] UUID\n"
+		"       %s budget {disable|show} UUID\n"
+		"       %s health enable [-l LATENCY] [-t TRIP] [-r RECOVER] "
+				"UUID {alert|passthrough|uncache}\n"
+		"       %s health {disable|show} UUID\n"
+		"       %s zones list UUID\n"
+		"       %s zones {add|remove} UUID START:LEN\n"
+		"       %s pins {list|wait} UUID\n"
+		"       %s pins {add|remove} UUID START:LEN\n"
+		"       %s pins rate UUID KIB_PER_SEC\n"
+		"       %s backup-read [-q DEPTH] UUID > IMAGE\n"
+		"       %s backup-read {--map|--unmap} UUID\n"
+		"       %s scrub [-j THREADS] [-r RATE] [-t SECONDS] [-i] "
+						"[--restart] UUID\n"
+		"       %s era {show|checkpoint} UUID\n"
+		"       %s changed-since UUID ERA\n"
+		"       %s tune show UUID\n"
+		"       %s tune set UUID KEY={VALUE|auto|keep}...\n"
+		"       %s reblock [-j THREADS] [-n] UUID BLOCK_SIZE\n"
+		"       %s crypt {show|open|close} UUID\n"
+		"       %s crypt key UUID KEY\n",
+		progname, progname, progname, progname, progname, progname,
+		progname, progname, progname, progname, progname, progname,
+		progname, progname, progname, progname, progname, progname,
+		progname, progname, progname, progname, progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+static const char *option_value(const int argc, char *argv[], const int i)
+{
+	if (i + 1 >= argc) {
+		fprintf(stderr, "Option %s requires a value\n", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+
+	return argv[i + 1];
+}
+
+static uint64_t parse_u64(const char *const s, const char *const what,
+			  const uint64_t min, const uint64_t max)
+{
+	unsigned long long value;
+	char *endptr;
+
+	errno = 0;
+	value = strtoull(s, &endptr, 10);
+	if (errno != 0 || endptr == s || *endptr != 0 || *s == '-' ||
+						value < min || value > max) {
+		fprintf(stderr, "Invalid %s: %s (must be %" PRIu64 "-%" PRIu64
+			")\n", what, s, min, max);
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
+/* Parses a latency like "500us" into nanoseconds */
+static uint64_t parse_latency(const char *const s, const char **const end)
+{
+	static const struct { const char *suffix; uint64_t mult; } units[] = {
+		{ "ns", 1 },
+		{ "us", 1000 },
+		{ "ms", 1000000 },
+		{ "s",	1000000000 },
+	};
+
+	unsigned long long value;
+	char *endptr;
+	unsigned i;
+	size_t len;
+
+	errno = 0;
+	value = strtoull(s, &endptr, 10);
+	if (errno != 0 || endptr == s || *s == '-')
+		return 0;
+
+	for (i = 0; i < sizeof units / sizeof units[0]; ++i) {
+
+		len = strlen(units[i].suffix);
+
+		if (strncmp(endptr, units[i].suffix, len) == 0 &&
+				(endptr[len] == ',' || endptr[len] == 0)) {
+
+			if (value > UINT64_MAX / units[i].mult)
+				return 0;
+
+			*end = endptr + len;
+			return value * units[i].mult;
+		}
+	}
+
+	return 0;
+}
+
+static void parse_bounds(const char *const s, uint64_t *const bounds)
+{
+	const char *p;
+	unsigned i;
+
+	memset(bounds, 0, ZC_SB_EXT_STATS_BOUNDS * sizeof *bounds);
+
+	for (p = s, i = 0; *p != 0; ++i) {
+
+		if (i == ZC_SB_EXT_STATS_BOUNDS) {
+			fprintf(stderr, "Too many histogram boundaries (max %d): "
+				"%s\n", ZC_SB_EXT_STATS_BOUNDS, s);
+			exit(EXIT_FAILURE);
+		}
+
+		bounds[i] = parse_latency(p, &p);
+
+		if (bounds[i] == 0 || (i > 0 && bounds[i] <= bounds[i - 1])) {
+			fprintf(stderr, "Invalid histogram boundaries: %s\n", s);
+			exit(EXIT_FAILURE);
+		}
+
+		if (*p == ',' && *++p == 0) {
+			fprintf(stderr, "Invalid histogram boundaries: %s\n", s);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Opens the set's registry and the superblock extension of its metadata
+ * member.  The set must be (at least partially) active.
+ */
+static int open_set_ext(const char *const uuid, struct zc_registry *const reg,
+			struct zc_sb_ext *const ext)
+{
+	int fd;
+
+	if (zc_registry_open(reg, uuid) < 0)
+		exit(EXIT_FAILURE);
+
+	if (reg->members[ZC_SB_TYPE_METADATA] == 0) {
+		fprintf(stderr, "%s: metadata device not present\n", uuid);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = zc_member_ext_open(reg->members[ZC_SB_TYPE_METADATA], ext);
+	if (fd < 0)
+		exit(EXIT_FAILURE);
+
+	return fd;
+}
+
+static int stats_enable(int argc, char *argv[])
+{
+	uint64_t areas, bounds[ZC_SB_EXT_STATS_BOUNDS];
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	_Bool precise;
+	int i, j, fd;
+
+	areas = STATS_DEFAULT_AREAS;
+	memcpy(bounds, stats_default_bounds, sizeof bounds);
+	precise = 1;
+
+	for (i = 0; i < argc - 1; ++i) {
+
+		if (strcmp(argv[i], "-a") == 0) {
+			areas = parse_u64(option_value(argc, argv, i),
+					  "number of areas", 1,
+					  STATS_MAX_AREAS);
+			++i;
+		}
+		else if (strcmp(argv[i], "-b") == 0) {
+			parse_bounds(option_value(argc, argv, i), bounds);
+			++i;
+		}
+		else if (strcmp(argv[i], "--imprecise") == 0) {
+			precise = 0;
+		}
+		else {
+			usage_error();
+		}
+	}
+
+	if (i != argc - 1)
+		usage_error();
+
+	/* Without precise timestamps, dm-stats measures in milliseconds */
+	for (j = 0; !precise && j < ZC_SB_EXT_STATS_BOUNDS; ++j) {
+		if (bounds[j] % 1000000 != 0) {
+			fputs("Sub-millisecond histogram boundaries require "
+			      "precise timestamps\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fd = open_set_ext(argv[i], &reg, &ext);
+
+	ext.stats_areas = areas;
+	memcpy(ext.stats_bounds, bounds, sizeof ext.stats_bounds);
+	if (precise)
+		ext.flags |= ZC_SB_EXT_STATS_PRECISE;
+	else
+		ext.flags &= ~ZC_SB_EXT_STATS_PRECISE;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	/* Replace any existing regions, which may have a different layout */
+	if (reg.assembled &&
+		(zc_stats_remove(reg.uuid) < 0 ||
+				zc_stats_setup(reg.uuid, &ext) < 0))
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+	return 0;
+}
+
+static int stats_disable(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int fd;
+
+	if (argc != 1)
+		usage_error();
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+
+	ext.stats_areas = 0;
+	memset(ext.stats_bounds, 0, sizeof ext.stats_bounds);
+	ext.flags &= ~ZC_SB_EXT_STATS_PRECISE;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	if (reg.assembled && zc_stats_remove(reg.uuid) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+	return 0;
+}
+
+static const char *format_ns(const uint64_t ns, char *const buf,
+			     const size_t size)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%" PRIu64 "ns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.3gus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.3gms", ns / 1e6);
+	else
+		snprintf(buf, size, "%.3gs", ns / 1e9);
+
+	return buf;
+}
+
+static void print_histogram(const struct zc_stats_sample *const s)
+{
+	uint64_t bins[ZC_SB_EXT_STATS_BOUNDS + 1], total, a;
+	char lower[16], upper[16];
+	unsigned i;
+
+	memset(bins, 0, sizeof bins);
+
+	for (total = 0, a = 0; a < s->nr_areas; ++a) {
+		for (i = 0; i < s->nr_bins; ++i) {
+			bins[i] += s->areas[a].bins[i];
+			total += s->areas[a].bins[i];
+		}
+	}
+
+	if (total == 0)
+		return;
+
+	puts("  latency:");
+
+	for (i = 0; i < s->nr_bins; ++i) {
+
+		format_ns(s->bin_lower[i], lower, sizeof lower);
+
+		if (i + 1 < s->nr_bins) {
+			printf("    %8s - %-8s %6.2f%%  %" PRIu64 "\n", lower,
+			       format_ns(s->bin_lower[i + 1], upper,
+					 sizeof upper),
+			       100.0 * bins[i] / total, bins[i]);
+		}
+		else {
+			printf("    %8s +          %6.2f%%  %" PRIu64 "\n", lower,
+			       100.0 * bins[i] / total, bins[i]);
+		}
+	}
+}
+
+/* Per-area rates (IOPS, throughput, average latency) */
+static void print_areas(const struct zc_stats_sample *const s,
+			const double secs)
+{
+	const struct zc_stats_area *area;
+	char offset[ZC_SIZE_BUF_SIZE], r_lat[16], w_lat[16];
+	uint64_t a;
+
+	printf("  %-12s %9s %9s %9s %9s %9s %9s\n", "offset", "r/s", "w/s",
+	       "rMiB/s", "wMiB/s", "r_await", "w_await");
+
+	for (a = 0; a < s->nr_areas; ++a) {
+
+		area = s->areas + a;
+
+		printf("  %-12s %9.1f %9.1f %9.2f %9.2f %9s %9s\n",
+		       zc_size_format_r(area->start * 512, 0, offset),
+		       area->reads / secs, area->writes / secs,
+		       area->read_sectors / 2048.0 / secs,
+		       area->write_sectors / 2048.0 / secs,
+		       area->reads == 0 ? "-" :
+				format_ns(area->read_nsecs / area->reads,
+					  r_lat, sizeof r_lat),
+		       area->writes == 0 ? "-" :
+				format_ns(area->write_nsecs / area->writes,
+					  w_lat, sizeof w_lat));
+	}
+}
+
+static uint64_t total_sectors(const struct zc_stats_sample *const s)
+{
+	uint64_t a, sectors;
+
+	for (sectors = 0, a = 0; a < s->nr_areas; ++a)
+		sectors += s->areas[a].read_sectors + s->areas[a].write_sectors;
+
+	return sectors;
+}
+
+static double ratio(const uint64_t n, const uint64_t d)
+{
+	return (d == 0) ? 0.0 : 100.0 * n / d;
+}
+
+/* How much of the set's I/O was served by the cache */
+static void print_split(const struct zc_stats_sample *const samples,
+			const struct zc_cache_status *const before,
+			const struct zc_cache_status *const after)
+{
+	uint64_t o_sectors, c_sectors, rh, rm, wh, wm;
+
+	o_sectors = total_sectors(&samples[1]);
+	c_sectors = total_sectors(&samples[2]);
+
+	rh = after->read_hits - before->read_hits;
+	rm = after->read_misses - before->read_misses;
+	wh = after->write_hits - before->write_hits;
+	wm = after->write_misses - before->write_misses;
+
+	puts("cache/origin split:");
+	printf("  component I/O:  cache %.1f%%, origin %.1f%%\n",
+	       ratio(c_sectors, c_sectors + o_sectors),
+	       ratio(o_sectors, c_sectors + o_sectors));
+	printf("  read hits:      %.1f%% (%" PRIu64 "/%" PRIu64 ")\n",
+	       ratio(rh, rh + rm), rh, rh + rm);
+	printf("  write hits:     %.1f%% (%" PRIu64 "/%" PRIu64 ")\n",
+	       ratio(wh, wh + wm), wh, wh + wm);
+	printf("  promotions:     %" PRIu64 "\n",
+	       after->promotions - before->promotions);
+	printf("  demotions:      %" PRIu64 "\n",
+	       after->demotions - before->demotions);
+	printf("  dirty blocks:   %" PRIu64 "\n", after->dirty);
+}
+
+static void take_samples(char *const names[], const char *const cache_target,
+			 struct zc_stats_sample *const samples,
+			 struct zc_cache_status *const status)
+{
+	unsigned i;
+
+	for (i = 0; i < ZC_STATS_NR_DEVS; ++i) {
+		if (zc_stats_sample(names[i], &samples[i]) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	if (zc_dm_cache_status(cache_target, status) < 0)
+		exit(EXIT_FAILURE);
+}
+
+static int stats_show(int argc, char *argv[])
+{
+	struct zc_stats_sample before[ZC_STATS_NR_DEVS], after[ZC_STATS_NR_DEVS];
+	struct zc_cache_status st_before, st_after;
+	char *names[ZC_STATS_NR_DEVS], *cache_target;
+	unsigned interval, i;
+	double secs;
+
+	interval = 1;
+
+	if (argc == 3 && strcmp(argv[0], "-i") == 0) {
+		interval = parse_u64(argv[1], "interval", 1, 3600);
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc != 1)
+		usage_error();
+
+	for (i = 0; i < ZC_STATS_NR_DEVS; ++i) {
+		names[i] = zc_asprintf("zodcache-%s-%s", zc_stats_dev_types[i],
+				       argv[0]);
+	}
+
+	cache_target = zc_cache_target(argv[0]);
+
+	take_samples(names, cache_target, before, &st_before);
+	sleep(interval);
+	take_samples(names, cache_target, after, &st_after);
+
+	for (i = 0; i < ZC_STATS_NR_DEVS; ++i) {
+
+		secs = zc_stats_delta(&after[i], &before[i]);
+
+		printf("%s (%.1fs)\n", names[i], secs);
+		print_areas(&after[i], secs);
+		print_histogram(&after[i]);
+		putchar('\n');
+	}
+
+	print_split(after, &st_before, &st_after);
+
+	for (i = 0; i < ZC_STATS_NR_DEVS; ++i) {
+		zc_stats_sample_free(&before[i]);
+		zc_stats_sample_free(&after[i]);
+		free(names[i]);
+	}
+
+	free(cache_target);
+	return 0;
+}
+
+/*
+ * Asks zodcached (if it is running) to pick up new settings.  Returns 0 if the
+ * daemon isn't running.
+ */
+static int notify_daemon(const char *const uuid)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char line[128];
+	FILE *fp;
+	int fd;
+
+	strcpy(addr.sun_path, ZC_DAEMON_SOCKET);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		close(fd);
+		if (errno == ENOENT || errno == ECONNREFUSED)
+			return 0;
+		perror(ZC_DAEMON_SOCKET);
+		return -1;
+	}
+
+	if ((fp = fdopen(fd, "r+")) == NULL) {
+		perror("fdopen");
+		close(fd);
+		return -1;
+	}
+
+	fprintf(fp, "reload %s\n", uuid);
+	fflush(fp);
+
+	if (fgets(line, sizeof line, fp) == NULL || strcmp(line, "OK\n") != 0) {
+		fprintf(stderr, "zodcached: %s", ferror(fp) || feof(fp) ?
+						"no response\n" : line);
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static uint64_t parse_threshold(const char *const s)
+{
+	uint64_t size;
+
+	if (zc_size_parse(s, &size) < 0)
+		exit(EXIT_FAILURE);
+
+	if (size < 512 || size % 512 != 0) {
+		fprintf(stderr, "Invalid migration threshold: %s (must be a "
+			"multiple of 512 bytes)\n", s);
+		exit(EXIT_FAILURE);
+	}
+
+	return size / 512;
+}
+
+static int controller_enable(int argc, char *argv[])
+{
+	uint64_t target, min, max;
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	const char *end;
+	int i, fd;
+
+	min = max = 0;
+
+	for (i = 0; i < argc - 2; ++i) {
+
+		if (strcmp(argv[i], "-m") == 0)
+			min = parse_threshold(option_value(argc, argv, i++));
+		else if (strcmp(argv[i], "-M") == 0)
+			max = parse_threshold(option_value(argc, argv, i++));
+		else
+			usage_error();
+	}
+
+	if (i != argc - 2)
+		usage_error();
+
+	if ((target = parse_latency(argv[i + 1], &end)) == 0 || *end != 0) {
+		fprintf(stderr, "Invalid latency target: %s\n", argv[i + 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (min != 0 && max != 0 && max < min) {
+		fputs("Maximum migration threshold is less than minimum\n",
+		      stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open_set_ext(argv[i], &reg, &ext);
+
+	ext.ctl_target = target;
+	ext.ctl_min_threshold = min;
+	ext.ctl_max_threshold = max;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+
+	return notify_daemon(argv[i]);
+}
+
+static int controller_disable(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int fd;
+
+	if (argc != 1)
+		usage_error();
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+
+	ext.ctl_target = 0;
+	ext.ctl_min_threshold = 0;
+	ext.ctl_max_threshold = 0;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+
+	/* The last threshold set by the controller stays in effect */
+	return notify_daemon(argv[0]);
+}
+
+static int cmd_controller(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage_error();
+
+	if (strcmp(argv[1], "enable") == 0)
+		return controller_enable(argc - 2, argv + 2);
+	if (strcmp(argv[1], "disable") == 0)
+		return controller_disable(argc - 2, argv + 2);
+
+	usage_error();
+	return -1;
+}
+
+static uint64_t parse_bytes(const char *const s)
+{
+	uint64_t size;
+
+	if (zc_size_parse(s, &size) < 0 || size == 0) {
+		fprintf(stderr, "Invalid size: %s\n", s);
+		exit(EXIT_FAILURE);
+	}
+
+	return size;
+}
+
+static int budget_enable(int argc, char *argv[])
+{
+	uint64_t daily, tbw, fallback, today;
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int i, fd;
+
+	daily = tbw = 0;
+	fallback = UINT64_MAX;
+
+	for (i = 0; i < argc - 1; ++i) {
+
+		if (strcmp(argv[i], "-d") == 0) {
+			daily = parse_bytes(option_value(argc, argv, i++));
+		}
+		else if (strcmp(argv[i], "-t") == 0) {
+			tbw = parse_bytes(option_value(argc, argv, i++));
+		}
+		else if (strcmp(argv[i], "-f") == 0) {
+			if (strcmp(argv[++i], "writethrough") == 0)
+				fallback = ZC_SB_MODE_WRITETHROUGH;
+			else if (strcmp(argv[i], "passthrough") == 0)
+				fallback = ZC_SB_MODE_PASSTHROUGH;
+			else
+				usage_error();
+		}
+		else {
+			usage_error();
+		}
+	}
+
+	if (i != argc - 1 || daily == 0)
+		usage_error();
+
+	fd = open_set_ext(argv[i], &reg, &ext);
+
+	today = time(NULL) / 86400;
+
+	/* Keep the counters if the budget is just being changed */
+	if (ext.budget_daily == 0) {
+		ext.budget_start = today;
+		ext.budget_day = today;
+		ext.budget_used = 0;
+		ext.budget_total = 0;
+	}
+
+	ext.budget_daily = daily;
+	ext.budget_tbw = tbw;
+
+	if (fallback != UINT64_MAX) {
+		ext.budget_fallback = fallback;
+		ext.flags |= ZC_SB_EXT_FALLBACK;
+	}
+	else {
+		ext.budget_fallback = 0;
+		ext.flags &= ~ZC_SB_EXT_FALLBACK;
+	}
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+
+	return notify_daemon(argv[i]);
+}
+
+static int budget_disable(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int fd;
+
+	if (argc != 1)
+		usage_error();
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+
+	ext.budget_daily = 0;
+	ext.budget_tbw = 0;
+	ext.budget_fallback = 0;
+	ext.budget_start = 0;
+	ext.budget_day = 0;
+	ext.budget_used = 0;
+	ext.budget_total = 0;
+	ext.flags &= ~ZC_SB_EXT_FALLBACK;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+
+	/* The daemon restores the normal cache mode when it reloads */
+	return notify_daemon(argv[0]);
+}
+
+/*
+ * Shows the counters saved by zodcached, which may be up to 10 minutes old
+ * (the daemon's status command has the current values).
+ */
+static int budget_show(int argc, char *argv[])
+{
+	char buf[ZC_SIZE_BUF_SIZE];
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	uint64_t days, rate;
+
+	if (argc != 1)
+		usage_error();
+
+	close(open_set_ext(argv[0], &reg, &ext));
+	zc_registry_close(&reg);
+
+	if (ext.budget_daily == 0) {
+		puts("No write budget");
+		return 0;
+	}
+
+	printf("daily budget:   %s\n",
+	       zc_size_format_r(ext.budget_daily, 0, buf));
+	printf("fallback mode:  %s\n", (ext.flags & ZC_SB_EXT_FALLBACK) ?
+			zc_cache_mode_format(ext.budget_fallback, 1) : "none");
+
+	if (ext.budget_day == (uint64_t)time(NULL) / 86400) {
+		printf("used today:     %s (%" PRIu64 "%%)\n",
+		       zc_size_format_r(ext.budget_used, 0, buf),
+		       ext.budget_used * 100 / ext.budget_daily);
+	}
+
+	days = ext.budget_day - ext.budget_start + 1;
+	rate = ext.budget_total / days;
+
+	printf("total written:  %s in %" PRIu64 " day(s)\n",
+	       zc_size_format_r(ext.budget_total, 0, buf), days);
+	printf("average:        %s/day\n", zc_size_format_r(rate, 0, buf));
+
+	if (ext.budget_tbw == 0)
+		return 0;
+
+	printf("rated TBW:      %s\n", zc_size_format_r(ext.budget_tbw, 0, buf));
+	printf("lifetime:       %" PRIu64 " days at budget",
+	       ext.budget_tbw / ext.budget_daily);
+
+	if (rate != 0) {
+		printf(", %" PRIu64 " days remaining at average rate",
+		       ext.budget_total >= ext.budget_tbw ? 0 :
+				(ext.budget_tbw - ext.budget_total) / rate);
+	}
+
+	putchar('\n');
+	return 0;
+}
+
+static int cmd_budget(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage_error();
+
+	if (strcmp(argv[1], "enable") == 0)
+		return budget_enable(argc - 2, argv + 2);
+	if (strcmp(argv[1], "disable") == 0)
+		return budget_disable(argc - 2, argv + 2);
+	if (strcmp(argv[1], "show") == 0)
+		return budget_show(argc - 2, argv + 2);
+
+	usage_error();
+	return -1;
+}
+
+static const char *const health_actions[] = {
+	[ZC_HEALTH_ALERT]	= "alert",
+	[ZC_HEALTH_PASSTHROUGH]	= "passthrough",
+	[ZC_HEALTH_UNCACHE]	= "uncache",
+};
+
+/* Without a latency limit, the cache is compared with the origin */
+static int health_enable(int argc, char *argv[])
+{
+	uint64_t limit, trip, recover, action;
+	const char *end, *value;
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int i, fd;
+
+	limit = trip = recover = 0;
+
+	for (i = 0; i < argc - 2; ++i) {
+
+		if (strcmp(argv[i], "-l") == 0) {
+			value = option_value(argc, argv, i++);
+			limit = parse_latency(value, &end);
+			if (limit == 0 || *end != 0) {
+				fprintf(stderr, "Invalid latency limit: %s\n",
+					value);
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(argv[i], "-t") == 0) {
+			trip = parse_u64(option_value(argc, argv, i++),
+					 "trip intervals", 1, 1000);
+		}
+		else if (strcmp(argv[i], "-r") == 0) {
+			recover = parse_u64(option_value(argc, argv, i++),
+					    "recovery intervals", 1, 100000);
+		}
+		else {
+			usage_error();
+		}
+	}
+
+	if (i != argc - 2)
+		usage_error();
+
+	for (action = ZC_HEALTH_ALERT; action <= ZC_HEALTH_UNCACHE; ++action) {
+		if (strcmp(argv[i + 1], health_actions[action]) == 0)
+			break;
+	}
+
+	if (action > ZC_HEALTH_UNCACHE)
+		usage_error();
+
+	fd = open_set_ext(argv[i], &reg, &ext);
+
+	ext.health_action = action;
+	ext.health_latency = limit;
+	ext.health_trip = trip;
+	ext.health_recover = recover;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+
+	return notify_daemon(argv[i]);
+}
+
+static int health_disable(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int fd;
+
+	if (argc != 1)
+		usage_error();
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+
+	ext.health_action = ZC_HEALTH_OFF;
+	ext.health_latency = 0;
+	ext.health_trip = 0;
+	ext.health_recover = 0;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+
+	/* The daemon restores the normal cache mode if it was bypassed */
+	return notify_daemon(argv[0]);
+}
+
+/* The daemon's status command shows the live state */
+static int health_show(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+
+	if (argc != 1)
+		usage_error();
+
+	close(open_set_ext(argv[0], &reg, &ext));
+	zc_registry_close(&reg);
+
+	if (ext.health_action == ZC_HEALTH_OFF) {
+		puts("No health monitor");
+		return 0;
+	}
+
+	printf("action:         %s\n", ext.health_action <= ZC_HEALTH_UNCACHE ?
+				health_actions[ext.health_action] : "unknown");
+
+	if (ext.health_latency == 0)
+		puts("latency limit:  origin latency");
+	else
+		printf("latency limit:  %.2fms\n", ext.health_latency / 1e6);
+
+	printf("trip after:     %" PRIu64 " intervals\n",
+	       ext.health_trip ?: ZC_HEALTH_DEFAULT_TRIP);
+	printf("recover after:  %" PRIu64 " intervals\n",
+	       ext.health_recover ?: ZC_HEALTH_DEFAULT_RECOVER);
+	printf("cache bypassed: %s\n",
+	       (ext.flags & ZC_SB_EXT_BYPASSED) ? "yes" : "no");
+
+	return 0;
+}
+
+static int cmd_health(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage_error();
+
+	if (strcmp(argv[1], "enable") == 0)
+		return health_enable(argc - 2, argv + 2);
+	if (strcmp(argv[1], "disable") == 0)
+		return health_disable(argc - 2, argv + 2);
+	if (strcmp(argv[1], "show") == 0)
+		return health_show(argc - 2, argv + 2);
+
+	usage_error();
+	return -1;
+}
+
+static int zones_list(int argc, char *argv[])
+{
+	char start[ZC_SIZE_BUF_SIZE], len[ZC_SIZE_BUF_SIZE];
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	uint64_t i;
+
+	if (argc != 1)
+		usage_error();
+
+	close(open_set_ext(argv[0], &reg, &ext));
+	zc_registry_close(&reg);
+
+	if (ext.zones_count == 0) {
+		puts("No uncached zones");
+		return 0;
+	}
+
+	for (i = 0; i < ext.zones_count; ++i) {
+		printf("%s:%s\n",
+		       zc_size_format_r(ext.zones[i].start * 512, 0, start),
+		       zc_size_format_r(ext.zones[i].len * 512, 0, len));
+	}
+
+	return 0;
+}
+
+static uint64_t origin_sectors(const char *const uuid)
+{
+	uint64_t size;
+	char *dev;
+	int fd;
+
+	dev = zc_asprintf("/dev/mapper/zodcache-origin-%s", uuid);
+
+	if ((fd = open(dev, O_RDONLY | O_CLOEXEC)) < 0 ||
+					ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		perror(dev);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	free(dev);
+	return size / 512;
+}
+
+/* Writes back all dirty blocks; leaves the cache in writethrough mode */
+static void clean_cache(const char *const target)
+{
+	struct zc_cache_status status;
+
+	if (zc_dm_cache_reload(target, ZC_SB_MODE_WRITETHROUGH,
+			       "cleaner 0") < 0)
+		exit(EXIT_FAILURE);
+
+	for (;;) {
+
+		if (zc_dm_cache_status(target, &status) < 0)
+			exit(EXIT_FAILURE);
+
+		if (status.dirty == 0)
+			break;
+
+		fprintf(stderr, "\rWriting back %" PRIu64 " dirty blocks...   ",
+			status.dirty);
+		sleep(1);
+	}
+
+	fputs("\r", stderr);
+}
+
+static int zone_apply(struct zc_sb_ext *const ext, const _Bool add,
+		      const uint64_t start, const uint64_t len,
+		      const uint64_t o_sectors, const struct zc_sb_v0 *const sb)
+{
+	return add ? zc_zone_add(NULL, ext, start, len, o_sectors,
+				 sb->block_size / 512) :
+		     zc_zone_remove(NULL, ext, start, len);
+}
+
+/*
+ * Finds the cache blocks that hold origin blocks in a zone that is about to be
+ * removed.  Nothing in the zone can be promoted while it still bypasses the
+ * cache, so the snapshot has all of them.
+ */
+static uint64_t zone_cblocks(const char *const uuid, const uint64_t start,
+			     const uint64_t len, uint64_t **const cblocks)
+{
+	struct zc_cmeta_mapping *m;
+	struct zc_cmeta cm;
+	uint64_t i, n;
+	char *snapshot;
+
+	if ((snapshot = zc_cmeta_snapshot(uuid)) == NULL)
+		exit(EXIT_FAILURE);
+
+	if (zc_cmeta_read(snapshot, &cm) < 0) {
+		unlink(snapshot);
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(snapshot);
+	free(snapshot);
+
+	if ((*cblocks = malloc((cm.nr_mappings + 1) * sizeof **cblocks))
+								== NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (n = 0, i = 0; i < cm.nr_mappings; ++i) {
+		m = cm.mappings + i;
+		if (m->oblock >= start / cm.block_size &&
+				m->oblock < (start + len) / cm.block_size)
+			(*cblocks)[n++] = m->cblock;
+	}
+
+	zc_cmeta_free(&cm);
+	return n;
+}
+
+/*
+ * Zones can only be changed while the set is running, so that the cache can
+ * be cleaned first; no range may change its mapping while the cache holds
+ * dirty blocks for it.  Removing a zone also invalidates the (clean) cache
+ * blocks in it, which may be stale copies of blocks that were written while
+ * the zone bypassed the cache.
+ *
+ * A set that was started without zones has no composite device; zones added
+ * to it take effect when it is next started, and the cache stays in
+ * writethrough mode until then.
+ */
+static int zones_edit(int argc, char *argv[], const _Bool add)
+{
+	uint64_t start, len, o_sectors, n, *cblocks;
+	struct zc_cache_status status;
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	struct zc_sb_v0 sb;
+	_Bool composite;
+	char *target;
+	int fd;
+
+	if (argc != 2)
+		usage_error();
+
+	if (zc_zone_parse(NULL, argv[1], &start, &len) < 0)
+		exit(EXIT_FAILURE);
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+
+	if (zc_sb_v0_read(fd, &sb) < 0)
+		exit(EXIT_FAILURE);
+
+	if (!reg.assembled) {
+		fprintf(stderr, "%s: set is not running\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	zc_registry_close(&reg);
+
+	/* Check the change before spending time on cleaning the cache */
+	o_sectors = origin_sectors(argv[0]);
+	if (zone_apply(&ext, add, start, len, o_sectors, &sb) < 0)
+		exit(EXIT_FAILURE);
+
+	target = zc_cache_target(argv[0]);
+	composite = (strncmp(target, ZC_CACHED_PREFIX,
+			     sizeof ZC_CACHED_PREFIX - 1) == 0);
+
+	if (add || composite)
+		clean_cache(target);
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+
+	if (zone_apply(&ext, add, start, len, o_sectors, &sb) < 0)
+		exit(EXIT_FAILURE);
+
+	if (add || composite) {
+
+		if (zc_dm_cache_status(target, &status) < 0)
+			exit(EXIT_FAILURE);
+
+		/* e.g. zodcached changed the cache mode */
+		if (status.dirty != 0) {
+			fprintf(stderr, "%s: cache was written to while "
+				"cleaning; try again\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!add && composite) {
+
+		n = zone_cblocks(argv[0], start, len, &cblocks);
+
+		/* The kernel only invalidates blocks in passthrough mode */
+		if (zc_dm_cache_set_mode(target, ZC_SB_MODE_PASSTHROUGH) < 0)
+			exit(EXIT_FAILURE);
+
+		if (zc_dm_cache_invalidate(target, cblocks, n) < 0)
+			exit(EXIT_FAILURE);
+		free(cblocks);
+
+		printf("%s: %" PRIu64 " cache blocks invalidated\n", argv[0], n);
+	}
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	if (composite && zc_set_overlay_reload(argv[0], &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+
+	if (zc_dm_cache_reload(target, (composite || ext.zones_count == 0) ?
+				sb.cache_mode : ZC_SB_MODE_WRITETHROUGH,
+			       "default 0") < 0)
+		exit(EXIT_FAILURE);
+
+	if (!composite && ext.zones_count != 0) {
+		printf("%s: zones take effect when the set is next started\n",
+		       argv[0]);
+	}
+
+	free(target);
+
+	/* Lets zodcached reapply any write budget fallback mode */
+	return notify_daemon(argv[0]);
+}
+
+static int cmd_zones(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage_error();
+
+	if (strcmp(argv[1], "list") == 0)
+		return zones_list(argc - 2, argv + 2);
+	if (strcmp(argv[1], "add") == 0)
+		return zones_edit(argc - 2, argv + 2, 1);
+	if (strcmp(argv[1], "remove") == 0)
+		return zones_edit(argc - 2, argv + 2, 0);
+
+	usage_error();
+	return -1;
+}
+
+static const char *const pin_states[] = {
+	[ZC_PIN_PENDING]	= "pinning",
+	[ZC_PIN_RESIDENT]	= "resident",
+	[ZC_PIN_UNPINNING]	= "unpinning",
+};
+
+static int pins_list(int argc, char *argv[])
+{
+	char start[ZC_SIZE_BUF_SIZE], len[ZC_SIZE_BUF_SIZE];
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	uint64_t i, done, total;
+	char *copy;
+
+	if (argc != 1)
+		usage_error();
+
+	/* Finishes a completed copy, if zodcached hasn't already done so */
+	if (zc_set_pins_update(argv[0]) < 0)
+		exit(EXIT_FAILURE);
+
+	close(open_set_ext(argv[0], &reg, &ext));
+	zc_registry_close(&reg);
+
+	if (ext.pin_size == 0) {
+		puts("No pin area");
+		return 0;
+	}
+
+	printf("pin area: %s, copy rate: ",
+	       zc_size_format_r(ext.pin_size * 512, 0, start));
+	if (ext.pin_rate != 0)
+		printf("%" PRIu64 " KiB/s\n", ext.pin_rate);
+	else
+		puts("unlimited");
+
+	copy = zc_asprintf("zodcache-copy-%s", argv[0]);
+
+	for (i = 0; i < ext.pins_count && i < ZC_SB_EXT_MAX_PINS; ++i) {
+
+		printf("%s:%s\t%s",
+		       zc_size_format_r(ext.pins[i].start * 512, 0, start),
+		       zc_size_format_r(ext.pins[i].len * 512, 0, len),
+		       ext.pins[i].state <= ZC_PIN_UNPINNING ?
+				pin_states[ext.pins[i].state] : "invalid");
+
+		if (ext.pins[i].state != ZC_PIN_RESIDENT &&
+				zc_dm_raid_sync(copy, &done, &total) >= 0 &&
+				total != 0)
+			printf(" (%" PRIu64 "%%)", done * 100 / total);
+
+		putchar('\n');
+	}
+
+	free(copy);
+	return 0;
+}
+
+/* Waits for the current copy (if any) to finish */
+static int pins_wait(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc != 1)
+		usage_error();
+
+	while ((ret = zc_set_pins_update(argv[0])) > 0)
+		sleep(ZC_CTL_INTERVAL);
+
+	return ret;
+}
+
+static int pins_edit(int argc, char *argv[], const _Bool add)
+{
+	uint64_t start, len;
+
+	if (argc != 2)
+		usage_error();
+
+	if (zc_zone_parse(NULL, argv[1], &start, &len) < 0)
+		exit(EXIT_FAILURE);
+
+	if ((add ? zc_set_pin(argv[0], start, len) :
+			zc_set_unpin(argv[0], start, len)) < 0)
+		exit(EXIT_FAILURE);
+
+	/* zodcached finishes the copy; see also "pins wait" */
+	return notify_daemon(argv[0]);
+}
+
+/* Takes effect at the start of the next copy */
+static int pins_rate(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	uint64_t rate;
+	int fd;
+
+	if (argc != 2)
+		usage_error();
+
+	rate = parse_u64(argv[1], "copy rate", 0, UINT32_MAX);
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+	ext.pin_rate = rate;
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+	return 0;
+}
+
+static int cmd_pins(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage_error();
+
+	if (strcmp(argv[1], "list") == 0)
+		return pins_list(argc - 2, argv + 2);
+	if (strcmp(argv[1], "wait") == 0)
+		return pins_wait(argc - 2, argv + 2);
+	if (strcmp(argv[1], "add") == 0)
+		return pins_edit(argc - 2, argv + 2, 1);
+	if (strcmp(argv[1], "remove") == 0)
+		return pins_edit(argc - 2, argv + 2, 0);
+	if (strcmp(argv[1], "rate") == 0)
+		return pins_rate(argc - 2, argv + 2);
+
+	usage_error();
+	return -1;
+}
+
+/*
+ * backup-read streams a consistent image of the set to stdout (or maps it as
+ * a read-only device) without going through dm-cache, so that the policy
+ * doesn't see the reads and the hot set isn't evicted.  Clean blocks are read
+ * straight from the origin component; only blocks that were dirty when the
+ * cache metadata was snapshotted (and pinned extents, which may exist only in
+ * the pin area) are read through the set's device.
+ */
+
+#define BACKUP_CHUNK		1048576
+#define BACKUP_DEFAULT_DEPTH	16
+#define BACKUP_MAX_DEPTH	256
+
+static void *backup_alloc(const size_t size)
+{
+	void *p;
+
+	if ((p = malloc(size)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	return p;
+}
+
+static uint64_t min_u64(const uint64_t a, const uint64_t b)
+{
+	return a < b ? a : b;
+}
+
+struct backup_run {
+	uint64_t	start;			/* sectors */
+	uint64_t	len;
+	_Bool		via_device;
+};
+
+struct backup_slot {
+	void		*buf;
+	uint64_t	chunk;
+	size_t		len;
+	_Bool		ready;
+};
+
+struct backup {
+	int			fds[2];		/* origin, set device */
+	uint64_t		size;		/* bytes */
+	uint64_t		nr_chunks;
+	const struct backup_run	*runs;
+	size_t			nr_runs;
+	unsigned		depth;
+	struct backup_slot	*slots;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	uint64_t		next;		/* next chunk to read */
+	uint64_t		written;	/* chunks written so far */
+	_Bool			error;
+};
+
+static int backup_range_cmp(const void *const a, const void *const b)
+{
+	const uint64_t *const x = a, *const y = b;
+
+	return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+/*
+ * Splits [0, o_sectors) into alternating runs that are read from the origin
+ * or through the set's device.
+ */
+static struct backup_run *backup_runs(const struct zc_cmeta *const cm,
+				      const struct zc_sb_ext *const ext,
+				      const uint64_t o_sectors,
+				      size_t *const nr_runs)
+{
+	uint64_t (*ranges)[2], pos, end;
+	struct backup_run *runs;
+	size_t i, nr_ranges, n;
+
+	ranges = backup_alloc((cm->nr_mappings + ZC_SB_EXT_MAX_PINS) *
+								sizeof *ranges);
+	nr_ranges = 0;
+
+	for (i = 0; i < cm->nr_mappings; ++i) {
+		if (!cm->mappings[i].dirty)
+			continue;
+		ranges[nr_ranges][0] = cm->mappings[i].oblock * cm->block_size;
+		ranges[nr_ranges][1] = ranges[nr_ranges][0] + cm->block_size;
+		++nr_ranges;
+	}
+
+	for (i = 0; i < ext->pins_count && i < ZC_SB_EXT_MAX_PINS; ++i) {
+		if (ext->pins[i].state == ZC_PIN_PENDING)
+			continue;
+		ranges[nr_ranges][0] = ext->pins[i].start;
+		ranges[nr_ranges][1] = ext->pins[i].start + ext->pins[i].len;
+		++nr_ranges;
+	}
+
+	qsort(ranges, nr_ranges, sizeof *ranges, backup_range_cmp);
+
+	/* At most one origin run before each range, plus one at the end */
+	runs = backup_alloc((2 * nr_ranges + 1) * sizeof *runs);
+	n = 0;
+	pos = 0;
+
+	for (i = 0; i < nr_ranges && pos < o_sectors; ++i) {
+
+		if (ranges[i][1] <= pos)
+			continue;
+
+		if (ranges[i][0] > pos) {
+			runs[n].start = pos;
+			runs[n].len = min_u64(ranges[i][0], o_sectors) - pos;
+			runs[n++].via_device = 0;
+			pos = runs[n - 1].start + runs[n - 1].len;
+			if (pos >= o_sectors)
+				break;
+		}
+
+		end = min_u64(ranges[i][1], o_sectors);
+
+		if (n > 0 && runs[n - 1].via_device) {
+			runs[n - 1].len = end - runs[n - 1].start;
+		}
+		else {
+			runs[n].start = pos;
+			runs[n].len = end - pos;
+			runs[n++].via_device = 1;
+		}
+
+		pos = end;
+	}
+
+	if (pos < o_sectors) {
+		runs[n].start = pos;
+		runs[n].len = o_sectors - pos;
+		runs[n++].via_device = 0;
+	}
+
+	free(ranges);
+	*nr_runs = n;
+	return runs;
+}
+
+static struct backup_run *backup_prepare(const char *const uuid,
+					 uint64_t *const o_sectors,
+					 size_t *const nr_runs)
+{
+	struct zc_registry reg;
+	struct backup_run *runs;
+	struct zc_sb_ext ext;
+	struct zc_cmeta cm;
+	char *snapshot;
+	size_t i, dev_runs;
+	uint64_t dirty;
+
+	close(open_set_ext(uuid, &reg, &ext));
+	zc_registry_close(&reg);
+
+	*o_sectors = origin_sectors(uuid);
+
+	if ((snapshot = zc_cmeta_snapshot(uuid)) == NULL)
+		exit(EXIT_FAILURE);
+
+	if (zc_cmeta_read(snapshot, &cm) < 0) {
+		unlink(snapshot);
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(snapshot);
+	free(snapshot);
+
+	runs = backup_runs(&cm, &ext, *o_sectors, nr_runs);
+
+	for (dirty = 0, i = 0; i < cm.nr_mappings; ++i)
+		dirty += cm.mappings[i].dirty;
+
+	for (dev_runs = 0, i = 0; i < *nr_runs; ++i)
+		dev_runs += runs[i].via_device;
+
+	fprintf(stderr, "%s: %" PRIu64 " dirty blocks, %zu of %zu runs read "
+		"through the cache\n", uuid, dirty, dev_runs, *nr_runs);
+
+	zc_cmeta_free(&cm);
+	return runs;
+}
+
+static const struct backup_run *backup_find_run(const struct backup *const b,
+						const uint64_t sector)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = b->nr_runs;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (b->runs[mid].start <= sector)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return b->runs + lo;
+}
+
+static int backup_read_chunk(const struct backup *const b,
+			     struct backup_slot *const slot)
+{
+	const struct backup_run *run;
+	uint64_t offset, end, run_end;
+	size_t len;
+	ssize_t count;
+	char *p;
+
+	offset = slot->chunk * BACKUP_CHUNK;
+	end = min_u64(offset + BACKUP_CHUNK, b->size);
+	slot->len = end - offset;
+	p = slot->buf;
+
+	while (offset < end) {
+
+		run = backup_find_run(b, offset / 512);
+		run_end = (run->start + run->len) * 512;
+		len = min_u64(end, run_end) - offset;
+
+		count = pread(b->fds[run->via_device], p, len, offset);
+		if (count <= 0) {
+			if (count == 0)
+				errno = EIO;
+			fprintf(stderr, "Read at offset %" PRIu64 " failed: "
+				"%m\n", offset);
+			return -1;
+		}
+
+		offset += count;
+		p += count;
+	}
+
+	return 0;
+}
+
+static void *backup_reader(void *const arg)
+{
+	struct backup *const b = arg;
+	struct backup_slot *slot;
+	int ret;
+
+	pthread_mutex_lock(&b->lock);
+
+	for (;;) {
+
+		/* A chunk's slot is free once the chunk depth back is written */
+		while (!b->error && b->next < b->nr_chunks &&
+					b->next - b->written >= b->depth)
+			pthread_cond_wait(&b->cond, &b->lock);
+
+		if (b->error || b->next >= b->nr_chunks)
+			break;
+
+		slot = b->slots + b->next % b->depth;
+		slot->chunk = b->next++;
+		pthread_mutex_unlock(&b->lock);
+
+		ret = backup_read_chunk(b, slot);
+
+		pthread_mutex_lock(&b->lock);
+		if (ret < 0)
+			b->error = 1;
+		else
+			slot->ready = 1;
+		pthread_cond_broadcast(&b->cond);
+	}
+
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+static int backup_write(const void *buf, size_t len)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		if ((count = write(STDOUT_FILENO, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("stdout");
+			return -1;
+		}
+		buf = (const char *)buf + count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+/* Readers fill a ring of buffers; chunks are written to stdout in order */
+static int backup_stream(const char *const uuid, const unsigned depth)
+{
+	struct backup_slot *slot;
+	pthread_t *threads;
+	struct backup b;
+	uint64_t o_sectors;
+	unsigned i;
+	char *dev;
+	int ret;
+
+	if (isatty(STDOUT_FILENO)) {
+		fputs("Refusing to write a device image to a terminal\n",
+		      stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	b.runs = backup_prepare(uuid, &o_sectors, &b.nr_runs);
+	b.size = o_sectors * 512;
+	b.nr_chunks = (b.size + BACKUP_CHUNK - 1) / BACKUP_CHUNK;
+	b.depth = depth;
+	b.next = b.written = 0;
+	b.error = 0;
+
+	for (i = 0; i < 2; ++i) {
+		dev = zc_asprintf("/dev/mapper/zodcache-%s-%s",
+				  i == 0 ? "origin" : "device", uuid);
+		if ((b.fds[i] = open(dev, O_RDONLY | O_DIRECT |
+							O_CLOEXEC)) < 0) {
+			perror(dev);
+			exit(EXIT_FAILURE);
+		}
+		free(dev);
+	}
+
+	b.slots = backup_alloc(depth * sizeof *b.slots);
+	threads = backup_alloc(depth * sizeof *threads);
+
+	for (i = 0; i < depth; ++i) {
+		b.slots[i].ready = 0;
+		if (posix_memalign(&b.slots[i].buf, 4096, BACKUP_CHUNK) != 0) {
+			perror("posix_memalign");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.cond, NULL);
+
+	for (i = 0; i < depth; ++i) {
+		if ((errno = pthread_create(threads + i, NULL, backup_reader,
+					    &b)) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_mutex_lock(&b.lock);
+
+	while (b.written < b.nr_chunks) {
+
+		slot = b.slots + b.written % depth;
+
+		while (!b.error && !(slot->ready && slot->chunk == b.written))
+			pthread_cond_wait(&b.cond, &b.lock);
+
+		if (b.error)
+			break;
+
+		pthread_mutex_unlock(&b.lock);
+		ret = backup_write(slot->buf, slot->len);
+		pthread_mutex_lock(&b.lock);
+
+		if (ret < 0) {
+			b.error = 1;
+		}
+		else {
+			slot->ready = 0;
+			++b.written;
+		}
+
+		pthread_cond_broadcast(&b.cond);
+	}
+
+	pthread_mutex_unlock(&b.lock);
+
+	for (i = 0; i < depth; ++i) {
+		pthread_join(threads[i], NULL);
+		free(b.slots[i].buf);
+	}
+
+	close(b.fds[0]);
+	close(b.fds[1]);
+	free(threads);
+	free(b.slots);
+	free((void *)b.runs);
+
+	return b.error ? -1 : 0;
+}
+
+/*
+ * The mapped view is a read-only device with the same layout, which can be
+ * mounted (read-only, e.g. with -o ro,norecovery) or read by backup software
+ * that wants a block device.  Blocks that are written after the snapshot may
+ * show either their old or their new contents.
+ */
+static int backup_map(const char *const uuid)
+{
+	struct backup_run *runs;
+	struct dm_task *task;
+	uint64_t o_sectors;
+	char *name, *params;
+	size_t i, nr_runs;
+	int ret;
+
+	runs = backup_prepare(uuid, &o_sectors, &nr_runs);
+	name = zc_asprintf("zodcache-backup-%s", uuid);
+	ret = 0;
+
+	if (		!(task = dm_task_create(DM_DEVICE_CREATE))	||
+
+			!dm_task_enable_checks(task)			||
+
+			!dm_task_set_name(task, name)			||
+
+			!dm_task_set_ro(task)				) {
+
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nr_runs; ++i) {
+
+		params = zc_asprintf("/dev/mapper/zodcache-%s-%s %" PRIu64,
+				     runs[i].via_device ? "device" : "origin",
+				     uuid, runs[i].start);
+
+		if (!dm_task_add_target(task, runs[i].start, runs[i].len,
+					"linear", params))
+			ret = -1;
+
+		free(params);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (		!dm_task_set_add_node(task, DM_ADD_NODE_ON_RESUME) ||
+
+			!zc_dm_task_run_sync(task, ZC_DEV_UDEV_FLAGS)	) {
+
+		ret = -1;
+	}
+
+out:
+	if (ret < 0)
+		fprintf(stderr, "%s: failed to create device\n", name);
+	else
+		printf("/dev/mapper/%s\n", name);
+
+	if (task != NULL)
+		dm_task_destroy(task);
+	free(name);
+	free(runs);
+	return ret;
+}
+
+static int backup_unmap(const char *const uuid)
+{
+	char *name;
+	int ret;
+
+	name = zc_asprintf("zodcache-backup-%s", uuid);
+	ret = zc_dm_remove(name, ZC_DEV_UDEV_FLAGS);
+	free(name);
+	return ret;
+}
+
+static int cmd_backup_read(int argc, char *argv[])
+{
+	unsigned depth;
+
+	depth = BACKUP_DEFAULT_DEPTH;
+
+	if (argc == 3 && strcmp(argv[1], "-q") == 0)
+		depth = parse_u64(option_value(argc, argv, 1), "queue depth",
+				  1, BACKUP_MAX_DEPTH);
+	else if (argc == 3 && strcmp(argv[1], "--map") == 0)
+		return backup_map(argv[2]);
+	else if (argc == 3 && strcmp(argv[1], "--unmap") == 0)
+		return backup_unmap(argv[2]);
+	else if (argc != 2 || argv[1][0] == '-')
+		usage_error();
+
+	return backup_stream(argv[argc - 1], depth);
+}
+
+/*
+ * The eras reported to users are the dm-era target's eras plus era_base, and
+ * the highest one reported is recorded, so that eras reported after the era
+ * metadata is reset (see prepare_era() in assemble.c) are all newer.  A backup
+ * tool records the era from "era checkpoint" when it starts a backup, and
+ * passes it to changed-since when it starts the next one.
+ */
+static int era_open(const char *const uuid, struct zc_registry *const reg,
+		    struct zc_sb_ext *const ext)
+{
+	int fd;
+
+	fd = open_set_ext(uuid, reg, ext);
+
+	if (ext->era_block_size == 0) {
+		fprintf(stderr, "%s: changed-block tracking not enabled "
+			"(mkzc -e)\n", uuid);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!reg->assembled) {
+		fprintf(stderr, "%s: set is not running\n", uuid);
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static int era_report(int argc, char *argv[], const _Bool checkpoint)
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	uint64_t era;
+	char *name;
+	int fd;
+
+	if (argc != 1)
+		usage_error();
+
+	fd = era_open(argv[0], &reg, &ext);
+	name = zc_asprintf("zodcache-device-%s", argv[0]);
+
+	/* The kernel may decide not to start a new era */
+	if (checkpoint && zc_dm_message(name, "checkpoint") < 0)
+		exit(EXIT_FAILURE);
+
+	if (zc_dm_era_status(name, &era) < 0)
+		exit(EXIT_FAILURE);
+
+	era += ext.era_base;
+
+	if (era > ext.era_issued) {
+		ext.era_issued = era;
+		if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+					 &ext) < 0)
+			exit(EXIT_FAILURE);
+	}
+	else {
+		close(fd);
+	}
+
+	zc_registry_close(&reg);
+	free(name);
+
+	printf("%" PRIu64 "\n", era);
+	return 0;
+}
+
+/*
+ * scrub compares the clean blocks in the cache with their copies on the
+ * origin, which should be identical.  The mappings come from a metadata
+ * snapshot, and blocks are checked in cache block order, so that a scrub that
+ * is interrupted (or reaches its time limit) can resume where it left off;
+ * the position is saved in the superblock extension.  A block that is written
+ * or demoted while it is being checked can look like a mismatch, so any
+ * mismatches are checked again against a second snapshot at the end, and only
+ * blocks that are still clean & mapped to the same origin block are reported.
+ *
+ * The kernel only invalidates blocks in passthrough mode, so invalidating
+ * them (-i) writes back the cache first, as zones does.
+ */
+
+#define SCRUB_CHUNK		1048576
+#define SCRUB_DEFAULT_THREADS	4
+#define SCRUB_MAX_THREADS	64
+#define SCRUB_DEFAULT_RATE	(100 * 1048576)	/* bytes/s, both devices */
+#define SCRUB_SAVE_INTERVAL	60		/* seconds */
+
+struct scrub {
+	int				fds[2];		/* origin, cache */
+	uint64_t			block_size;	/* bytes */
+	uint64_t			o_size;
+	const struct zc_cmeta_mapping	*blocks;	/* clean, by cblock */
+	uint64_t			nr_blocks;
+	uint64_t			rate;		/* bytes/s; 0 = none */
+	uint64_t			pace;		/* ns; next read */
+	pthread_mutex_t			lock;
+	uint64_t			next;		/* index in blocks */
+	uint64_t			*busy;		/* or UINT64_MAX */
+	uint64_t			*mismatches;	/* indexes */
+	uint64_t			nr_mismatches;
+	_Bool				error;
+};
+
+struct scrub_thread {
+	struct scrub	*s;
+	unsigned	id;
+	void		*bufs[2];
+};
+
+static volatile sig_atomic_t scrub_stop;
+
+static void scrub_stop_handler(const int signum __attribute__((unused)))
+{
+	scrub_stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Spaces the reads of all threads out to the rate limit */
+static void scrub_throttle(struct scrub *const s, const uint64_t bytes)
+{
+	struct timespec ts;
+	uint64_t now, when;
+
+	if (s->rate == 0)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	now = now_ns();
+	if (s->pace < now)
+		s->pace = now;
+	when = s->pace;
+	s->pace += bytes * UINT64_C(1000000000) / s->rate;
+	pthread_mutex_unlock(&s->lock);
+
+	ts.tv_sec = when / 1000000000;
+	ts.tv_nsec = when % 1000000000;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR);
+}
+
+static int scrub_read(const int fd, const char *const dev, void *buf,
+		      uint64_t len, uint64_t offset)
+{
+	ssize_t count;
+
+	while (len > 0) {
+
+		count = pread(fd, buf, len, offset);
+		if (count <= 0) {
+			if (count == 0)
+				errno = EIO;
+			fprintf(stderr, "%s: read at offset %" PRIu64
+				" failed: %m\n", dev, offset);
+			return -1;
+		}
+
+		buf = (char *)buf + count;
+		len -= count;
+		offset += count;
+	}
+
+	return 0;
+}
+
+/* Returns 1 if the copies differ (glibc's memcmp() is vectorized) */
+static int scrub_compare(struct scrub *const s, void *const bufs[2],
+			 const struct zc_cmeta_mapping *const m)
+{
+	uint64_t o_offset, c_offset, end, pos, len;
+
+	o_offset = m->oblock * s->block_size;
+	c_offset = m->cblock * s->block_size;
+
+	/* The origin's last block may be partial */
+	if (o_offset >= s->o_size)
+		return 0;
+	end = min_u64(s->block_size, s->o_size - o_offset);
+
+	for (pos = 0; pos < end; pos += len) {
+
+		len = min_u64(SCRUB_CHUNK, end - pos);
+		scrub_throttle(s, 2 * len);
+
+		if (scrub_read(s->fds[0], "origin", bufs[0], len,
+			       o_offset + pos) < 0 ||
+				scrub_read(s->fds[1], "cache", bufs[1], len,
+					   c_offset + pos) < 0)
+			return -1;
+
+		if (memcmp(bufs[0], bufs[1], len) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void *scrub_worker(void *const arg)
+{
+	struct scrub_thread *const t = arg;
+	struct scrub *const s = t->s;
+	uint64_t i;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+
+	while (!s->error && !scrub_stop && s->next < s->nr_blocks) {
+
+		i = s->next++;
+		s->busy[t->id] = i;
+		pthread_mutex_unlock(&s->lock);
+
+		ret = scrub_compare(s, t->bufs, s->blocks + i);
+
+		pthread_mutex_lock(&s->lock);
+		s->busy[t->id] = UINT64_MAX;
+
+		if (ret < 0)
+			s->error = 1;
+		else if (ret > 0)
+			s->mismatches[s->nr_mismatches++] = i;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static int scrub_mapping_cmp(const void *const a, const void *const b)
+{
+	const struct zc_cmeta_mapping *const x = a, *const y = b;
+
+	return x->cblock < y->cblock ? -1 : x->cblock > y->cblock;
+}
+
+/* Reads a metadata snapshot, with the mappings in cache block order */
+static void scrub_snapshot(const char *const uuid, struct zc_cmeta *const cm)
+{
+	char *snapshot;
+
+	if ((snapshot = zc_cmeta_snapshot(uuid)) == NULL)
+		exit(EXIT_FAILURE);
+
+	if (zc_cmeta_read(snapshot, cm) < 0) {
+		unlink(snapshot);
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(snapshot);
+	free(snapshot);
+
+	qsort(cm->mappings, cm->nr_mappings, sizeof *cm->mappings,
+	      scrub_mapping_cmp);
+}
+
+/* Index of the first block at or after pos, which won't need checking again */
+static uint64_t scrub_position(struct scrub *const s, const unsigned nr_threads)
+{
+	uint64_t pos;
+	unsigned i;
+
+	pthread_mutex_lock(&s->lock);
+
+	for (pos = s->next, i = 0; i < nr_threads; ++i)
+		pos = min_u64(pos, s->busy[i]);
+
+	pthread_mutex_unlock(&s->lock);
+
+	return pos;
+}
+
+static void scrub_save(const char *const uuid, const uint64_t next,
+		       const uint64_t found, const _Bool pass_done)
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	int fd;
+
+	fd = open_set_ext(uuid, &reg, &ext);
+
+	ext.scrub_next = next;
+	ext.scrub_found += found;
+	if (pass_done)
+		ext.scrub_done = time(NULL);
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+}
+
+/*
+ * Checks the mismatches against a new snapshot, and again against the origin.
+ * Returns the number that are real; their cache blocks are left in cblocks.
+ */
+static uint64_t scrub_confirm(const char *const uuid, struct scrub *const s,
+			      void *const bufs[2], uint64_t *const cblocks)
+{
+	const struct zc_cmeta_mapping *m, *old;
+	char offset[ZC_SIZE_BUF_SIZE];
+	struct zc_cmeta cm;
+	uint64_t i, n;
+	int ret;
+
+	scrub_snapshot(uuid, &cm);
+	s->rate = 0;
+
+	for (n = 0, i = 0; i < s->nr_mismatches; ++i) {
+
+		old = s->blocks + s->mismatches[i];
+		m = bsearch(old, cm.mappings, cm.nr_mappings,
+			    sizeof *cm.mappings, scrub_mapping_cmp);
+
+		if (m == NULL || m->dirty || m->oblock != old->oblock)
+			continue;
+
+		if ((ret = scrub_compare(s, bufs, m)) < 0)
+			exit(EXIT_FAILURE);
+
+		if (ret == 0)
+			continue;
+
+		printf("mismatch: cache block %" PRIu64 ", origin offset %s\n",
+		       m->cblock, zc_size_format_r(m->oblock * s->block_size,
+						   0, offset));
+		cblocks[n++] = m->cblock;
+	}
+
+	zc_cmeta_free(&cm);
+	return n;
+}
+
+static void scrub_invalidate(const char *const uuid,
+			     const uint64_t *const cblocks, const uint64_t n)
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	struct zc_sb_v0 sb;
+	char *target;
+	int fd;
+
+	fd = open_set_ext(uuid, &reg, &ext);
+	if (zc_sb_v0_read(fd, &sb) < 0)
+		exit(EXIT_FAILURE);
+	close(fd);
+	zc_registry_close(&reg);
+
+	target = zc_cache_target(uuid);
+	clean_cache(target);
+
+	if (zc_dm_cache_set_mode(target, ZC_SB_MODE_PASSTHROUGH) < 0)
+		exit(EXIT_FAILURE);
+
+	if (zc_dm_cache_invalidate(target, cblocks, n) < 0)
+		exit(EXIT_FAILURE);
+
+	if (zc_dm_cache_reload(target, sb.cache_mode, "default 0") < 0)
+		exit(EXIT_FAILURE);
+
+	free(target);
+	printf("%s: %" PRIu64 " cache blocks invalidated\n", uuid, n);
+}
+
+static int cmd_scrub(int argc, char *argv[])
+{
+	struct sigaction sa = { .sa_handler = scrub_stop_handler };
+	uint64_t start, pos, found, *cblocks, limit;
+	struct scrub_thread *threads;
+	pthread_t *tids;
+	time_t deadline, save;
+	_Bool invalidate, restart;
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	struct zc_cmeta cm;
+	unsigned nr_threads;
+	struct scrub s;
+	uint64_t i, j;
+	char *dev;
+	int k, fd;
+
+	nr_threads = SCRUB_DEFAULT_THREADS;
+	s.rate = SCRUB_DEFAULT_RATE;
+	limit = 0;
+	invalidate = restart = 0;
+
+	for (k = 1; k < argc - 1; ++k) {
+
+		if (strcmp(argv[k], "-j") == 0) {
+			nr_threads = parse_u64(option_value(argc, argv, k++),
+					       "thread count", 1,
+					       SCRUB_MAX_THREADS);
+		}
+		else if (strcmp(argv[k], "-r") == 0) {
+			if (zc_size_parse(option_value(argc, argv, k++),
+					  &s.rate) < 0)
+				exit(EXIT_FAILURE);
+		}
+		else if (strcmp(argv[k], "-t") == 0) {
+			limit = parse_u64(option_value(argc, argv, k++),
+					  "time limit", 1, UINT32_MAX);
+		}
+		else if (strcmp(argv[k], "-i") == 0) {
+			invalidate = 1;
+		}
+		else if (strcmp(argv[k], "--restart") == 0) {
+			restart = 1;
+		}
+		else {
+			usage_error();
+		}
+	}
+
+	if (k != argc - 1)
+		usage_error();
+
+	fd = open_set_ext(argv[k], &reg, &ext);
+
+	if (!reg.assembled) {
+		fprintf(stderr, "%s: set is not running\n", argv[k]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* A new pass */
+	if (restart || ext.scrub_next == 0) {
+		ext.scrub_next = 0;
+		ext.scrub_found = 0;
+		if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+					 &ext) < 0)
+			exit(EXIT_FAILURE);
+	}
+	else {
+		close(fd);
+	}
+
+	zc_registry_close(&reg);
+
+	scrub_snapshot(argv[k], &cm);
+
+	/* Only clean blocks can be checked */
+	for (s.nr_blocks = 0, i = 0; i < cm.nr_mappings; ++i) {
+		if (!cm.mappings[i].dirty)
+			cm.mappings[s.nr_blocks++] = cm.mappings[i];
+	}
+
+	s.blocks = cm.mappings;
+	s.block_size = cm.block_size * 512;
+	s.o_size = origin_sectors(argv[k]) * 512;
+
+	start = restart ? 0 : ext.scrub_next;
+
+	for (s.next = 0; s.next < s.nr_blocks &&
+				s.blocks[s.next].cblock < start; ++s.next);
+
+	fprintf(stderr, "%s: %" PRIu64 " of %" PRIu64 " mapped blocks are "
+		"clean; %s at cache block %" PRIu64 "\n", argv[k],
+		s.nr_blocks, cm.nr_mappings, start ? "resuming" : "starting",
+		start);
+
+	for (i = 0; i < 2; ++i) {
+		dev = zc_asprintf("/dev/mapper/zodcache-%s-%s",
+				  i == 0 ? "origin" : "cache", argv[k]);
+		if ((s.fds[i] = open(dev, O_RDONLY | O_DIRECT |
+							O_CLOEXEC)) < 0) {
+			perror(dev);
+			exit(EXIT_FAILURE);
+		}
+		free(dev);
+	}
+
+	s.pace = 0;
+	s.nr_mismatches = 0;
+	s.error = 0;
+	s.busy = backup_alloc(nr_threads * sizeof *s.busy);
+	s.mismatches = backup_alloc((s.nr_blocks ?: 1) * sizeof *s.mismatches);
+	threads = backup_alloc(nr_threads * sizeof *threads);
+	tids = backup_alloc(nr_threads * sizeof *tids);
+	pthread_mutex_init(&s.lock, NULL);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (i = 0; i < nr_threads; ++i) {
+
+		s.busy[i] = UINT64_MAX;
+		threads[i].s = &s;
+		threads[i].id = i;
+
+		for (j = 0; j < 2; ++j) {
+			if (posix_memalign(&threads[i].bufs[j], 4096,
+					   SCRUB_CHUNK) != 0) {
+				perror("posix_memalign");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if ((errno = pthread_create(tids + i, NULL, scrub_worker,
+					    threads + i)) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	deadline = limit ? time(NULL) + limit : 0;
+	save = time(NULL) + SCRUB_SAVE_INTERVAL;
+
+	/* Progress & checkpoints; the workers stop at the limit or a signal */
+	for (;;) {
+
+		sleep(1);
+
+		pthread_mutex_lock(&s.lock);
+		pos = s.next;
+		found = s.nr_mismatches;
+		pthread_mutex_unlock(&s.lock);
+
+		if (pos >= s.nr_blocks || s.error || scrub_stop)
+			break;
+
+		fprintf(stderr, "\rChecked %" PRIu64 " of %" PRIu64 " blocks, "
+			"%" PRIu64 " suspect...   ", pos, s.nr_blocks, found);
+
+		if (deadline != 0 && time(NULL) >= deadline) {
+			scrub_stop = 1;
+			break;
+		}
+
+		if (time(NULL) >= save) {
+			pos = scrub_position(&s, nr_threads);
+			scrub_save(argv[k], pos < s.nr_blocks ?
+				   s.blocks[pos].cblock : cm.nr_cache_blocks,
+				   0, 0);
+			save = time(NULL) + SCRUB_SAVE_INTERVAL;
+		}
+	}
+
+	for (i = 0; i < nr_threads; ++i)
+		pthread_join(tids[i], NULL);
+
+	fputs("\r", stderr);
+
+	if (s.error)
+		exit(EXIT_FAILURE);
+
+	/* Every block before next has been checked */
+	cblocks = backup_alloc((s.nr_mismatches ?: 1) * sizeof *cblocks);
+	found = s.nr_mismatches ?
+		scrub_confirm(argv[k], &s, threads[0].bufs, cblocks) : 0;
+
+	if (s.next < s.nr_blocks) {
+		scrub_save(argv[k], s.blocks[s.next].cblock, found, 0);
+		fprintf(stderr, "%s: stopped at cache block %" PRIu64 " (%"
+			PRIu64 " of %" PRIu64 " blocks left)\n", argv[k],
+			s.blocks[s.next].cblock, s.nr_blocks - s.next,
+			s.nr_blocks);
+	}
+	else {
+		scrub_save(argv[k], 0, found, 1);
+	}
+
+	fprintf(stderr, "%s: %" PRIu64 " mismatched blocks\n", argv[k], found);
+
+	if (invalidate && found != 0)
+		scrub_invalidate(argv[k], cblocks, found);
+
+	for (i = 0; i < nr_threads; ++i) {
+		free(threads[i].bufs[0]);
+		free(threads[i].bufs[1]);
+	}
+
+	close(s.fds[0]);
+	close(s.fds[1]);
+	free(cblocks);
+	free(tids);
+	free(threads);
+	free(s.mismatches);
+	free(s.busy);
+	zc_cmeta_free(&cm);
+
+	/* Mismatches that are left in the cache are a failure */
+	if (invalidate && found != 0)
+		return notify_daemon(argv[k]);
+
+	return found != 0 ? -1 : 0;
+}
+
+static int cmd_era(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage_error();
+
+	if (strcmp(argv[1], "show") == 0)
+		return era_report(argc - 2, argv + 2, 0);
+	if (strcmp(argv[1], "checkpoint") == 0)
+		return era_report(argc - 2, argv + 2, 1);
+
+	usage_error();
+	return -1;
+}
+
+/* Adjacent ranges are merged; output is START:LEN, in bytes */
+struct changed {
+	uint64_t	block_size;		/* sectors */
+	uint64_t	o_sectors;
+	uint64_t	begin;			/* era blocks */
+	uint64_t	end;
+};
+
+static void changed_flush(struct changed *const c)
+{
+	uint64_t start, end;
+
+	if (c->begin == c->end)
+		return;
+
+	start = c->begin * c->block_size;
+	end = c->end * c->block_size;
+	if (end > c->o_sectors)
+		end = c->o_sectors;
+
+	if (start < end)
+		printf("%" PRIu64 ":%" PRIu64 "\n", start * 512,
+		       (end - start) * 512);
+}
+
+static void changed_cb(const uint64_t begin, const uint64_t end,
+		       void *const context)
+{
+	struct changed *const c = context;
+
+	if (begin != c->end) {
+		changed_flush(c);
+		c->begin = begin;
+	}
+
+	c->end = end;
+}
+
+static int cmd_changed_since(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	struct changed c;
+	uint64_t since, era;
+	char *name;
+
+	if (argc != 3)
+		usage_error();
+
+	since = parse_u64(argv[2], "era", 0, UINT64_MAX);
+
+	close(era_open(argv[1], &reg, &ext));
+
+	name = zc_asprintf("zodcache-device-%s", argv[1]);
+	if (zc_dm_era_status(name, &era) < 0)
+		exit(EXIT_FAILURE);
+	free(name);
+
+	if (since > era + ext.era_base) {
+		fprintf(stderr, "%s: era %" PRIu64 " hasn't started (current "
+			"era is %" PRIu64 ")\n", argv[1], since,
+			era + ext.era_base);
+		exit(EXIT_FAILURE);
+	}
+
+	c.block_size = ext.era_block_size;
+	c.o_sectors = origin_sectors(argv[1]);
+	c.begin = c.end = 0;
+
+	/* Everything has changed since an era from before a reset */
+	if (since < ext.era_base) {
+		fprintf(stderr, "%s: era %" PRIu64 " predates the current era "
+			"metadata\n", argv[1], since);
+		printf("0:%" PRIu64 "\n", c.o_sectors * 512);
+	}
+	else {
+		if (zc_era_changed(argv[1], since - ext.era_base, changed_cb,
+				   &c) < 0)
+			exit(EXIT_FAILURE);
+		changed_flush(&c);
+	}
+
+	zc_registry_close(&reg);
+	return 0;
+}
+
+/* The block size (bytes) of an assembled set, or 0 if it isn't assembled */
+static uint64_t tune_block_size(const char *const uuid)
+{
+	struct zc_cache_status status;
+	struct dm_info info;
+	char *name;
+	int ret;
+
+	name = zc_asprintf("zodcache-device-%s", uuid);
+	ret = zc_dm_info(name, &info);
+	free(name);
+
+	if (ret < 0 || !info.exists)
+		return 0;
+
+	name = zc_cache_target(uuid);
+	ret = zc_dm_cache_status(name, &status);
+	free(name);
+
+	return ret < 0 ? 0 : status.block_size * 512;
+}
+
+static int tune_show(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+
+	if (argc != 1)
+		usage_error();
+
+	close(open_set_ext(argv[0], &reg, &ext));
+	zc_registry_close(&reg);
+
+	zc_tune_report(argv[0], &ext, tune_block_size(argv[0]),
+		       reg.members[ZC_SB_TYPE_ORIGIN],
+		       reg.members[ZC_SB_TYPE_CACHE], stdout);
+	return 0;
+}
+
+/* Saves the settings, then applies them if the set is assembled */
+static int tune_set(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	uint64_t block_size;
+	int i, fd, ret;
+
+	if (argc < 2)
+		usage_error();
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+
+	for (i = 1; i < argc; ++i) {
+		if (zc_tune_parse(&ext, argv[i]) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	ret = 0;
+
+	if ((block_size = tune_block_size(argv[0])) != 0) {
+		ret = zc_tune_apply(argv[0], &ext, block_size,
+				    reg.members[ZC_SB_TYPE_ORIGIN],
+				    reg.members[ZC_SB_TYPE_CACHE]);
+	}
+
+	zc_registry_close(&reg);
+	return ret;
+}
+
+static int cmd_tune(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage_error();
+
+	if (strcmp(argv[1], "show") == 0)
+		return tune_show(argc - 2, argv + 2);
+	if (strcmp(argv[1], "set") == 0)
+		return tune_set(argc - 2, argv + 2);
+
+	usage_error();
+	return -1;
+}
+
+/*
+ * Block size changes.  The old cache's mappings and smq hints are read before
+ * the cache is cleaned and reformatted (see zc_set_reblock()); the hot set is
+ * then rebuilt by reading the origin ranges of its hottest blocks through the
+ * set's device.  smq only promotes a block once its hotspot has been hit in
+ * enough hotspot periods (a second each), so the hot set is read in several
+ * passes, until a pass promotes nothing more.
+ */
+#define REBLOCK_CHUNK		1048576
+#define REBLOCK_DEFAULT_THREADS	8
+#define REBLOCK_MAX_THREADS	64
+#define REBLOCK_MIN_PASSES	3
+#define REBLOCK_MAX_PASSES	8
+
+struct reblock_block {
+	uint64_t	oblock;			/* in new blocks */
+	uint32_t	hint;
+};
+
+struct warm {
+	int				fd;
+	const char			*dev;
+	uint64_t			block_size;	/* bytes */
+	uint64_t			o_size;
+	struct reblock_block		*blocks;
+	uint64_t			nr_blocks;
+	pthread_mutex_t			lock;
+	uint64_t			next;
+	_Bool				error;
+};
+
+static volatile sig_atomic_t warm_stop;
+
+static void warm_stop_handler(const int signum __attribute__((unused)))
+{
+	warm_stop = 1;
+}
+
+static int reblock_oblock_cmp(const void *const a, const void *const b)
+{
+	const struct reblock_block *const x = a, *const y = b;
+
+	return x->oblock < y->oblock ? -1 : x->oblock > y->oblock;
+}
+
+/* Hottest first */
+static int reblock_hint_cmp(const void *const a, const void *const b)
+{
+	const struct reblock_block *const x = a, *const y = b;
+
+	if (x->hint != y->hint)
+		return x->hint > y->hint ? -1 : 1;
+
+	return reblock_oblock_cmp(a, b);
+}
+
+/*
+ * Maps the old cache's blocks onto blocks of the new size, each as hot as the
+ * hottest old block that it overlaps, and keeps as many of the hottest as fit
+ * in the new cache.  Returns them in origin order.
+ */
+static struct reblock_block *reblock_hot_set(const struct zc_cmeta *const cm,
+					     const uint64_t block_sectors,
+					     const uint64_t o_sectors,
+					     const uint64_t max,
+					     uint64_t *const count)
+{
+	const struct zc_cmeta_mapping *m;
+	uint64_t i, j, n, size, start, end, b;
+	struct reblock_block *blocks;
+	uint32_t hint;
+
+	blocks = NULL;
+	n = size = 0;
+
+	for (i = 0, m = cm->mappings; i < cm->nr_mappings; ++i, ++m) {
+
+		start = m->oblock * cm->block_size;
+		end = min_u64(start + cm->block_size, o_sectors);
+		if (start >= end)
+			continue;
+
+		hint = (cm->hints != NULL && m->cblock < cm->nr_cache_blocks) ?
+						cm->hints[m->cblock] : 0;
+
+		for (b = start / block_sectors; b * block_sectors < end; ++b) {
+
+			if (n == size) {
+				size = size ? size * 2 : 1024;
+				blocks = realloc(blocks, size * sizeof *blocks);
+				if (blocks == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			blocks[n].oblock = b;
+			blocks[n++].hint = hint;
+		}
+	}
+
+	if (n != 0) {
+
+		qsort(blocks, n, sizeof *blocks, reblock_oblock_cmp);
+
+		for (i = 0, j = 1; j < n; ++j) {
+			if (blocks[j].oblock != blocks[i].oblock)
+				blocks[++i] = blocks[j];
+			else if (blocks[j].hint > blocks[i].hint)
+				blocks[i].hint = blocks[j].hint;
+		}
+
+		n = i + 1;
+	}
+
+	if (n > max) {
+		qsort(blocks, n, sizeof *blocks, reblock_hint_cmp);
+		n = max;
+		qsort(blocks, n, sizeof *blocks, reblock_oblock_cmp);
+	}
+
+	*count = n;
+	return blocks;
+}
+
+static void *warm_worker(void *const arg)
+{
+	struct warm *const w = arg;
+	uint64_t i, offset, end, len;
+	void *buf;
+	int ret;
+
+	if (posix_memalign(&buf, 4096, REBLOCK_CHUNK) != 0) {
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&w->lock);
+
+	while (!w->error && !warm_stop && w->next < w->nr_blocks) {
+
+		i = w->next++;
+		pthread_mutex_unlock(&w->lock);
+
+		/* The origin's last block may be partial */
+		offset = w->blocks[i].oblock * w->block_size;
+		end = min_u64(offset + w->block_size, w->o_size);
+
+		for (ret = 0; ret == 0 && offset < end; offset += len) {
+			len = min_u64(REBLOCK_CHUNK, end - offset);
+			ret = scrub_read(w->fd, w->dev, buf, len, offset);
+		}
+
+		pthread_mutex_lock(&w->lock);
+
+		if (ret < 0)
+			w->error = 1;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	free(buf);
+	return NULL;
+}
+
+/* Reads the hot set once, in parallel */
+static void reblock_warm_pass(struct warm *const w, pthread_t *const tids,
+			      const unsigned nr_threads, const unsigned pass)
+{
+	uint64_t pos;
+	unsigned i;
+
+	w->next = 0;
+
+	for (i = 0; i < nr_threads; ++i) {
+		if ((errno = pthread_create(tids + i, NULL, warm_worker,
+					    w)) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (;;) {
+
+		sleep(1);
+
+		pthread_mutex_lock(&w->lock);
+		pos = w->next;
+		pthread_mutex_unlock(&w->lock);
+
+		if (pos >= w->nr_blocks || w->error || warm_stop)
+			break;
+
+		fprintf(stderr, "\rWarming (pass %u) %" PRIu64 " of %" PRIu64
+			" blocks...   ", pass, pos, w->nr_blocks);
+	}
+
+	for (i = 0; i < nr_threads; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+/*
+ * Reads the hot set until a pass promotes no more blocks (or the cache is
+ * full); returns the number of passes.  Each pass takes at least a second,
+ * so every one falls in a new hotspot period.
+ */
+static unsigned reblock_warm(const char *const uuid, const char *const target,
+			     struct warm *const w, const unsigned nr_threads)
+{
+	struct sigaction sa = { .sa_handler = warm_stop_handler };
+	struct zc_cache_status status;
+	uint64_t used;
+	pthread_t *tids;
+	unsigned pass;
+	char *dev;
+
+	dev = zc_asprintf("/dev/mapper/zodcache-device-%s", uuid);
+
+	if ((w->fd = open(dev, O_RDONLY | O_DIRECT | O_CLOEXEC)) < 0) {
+		perror(dev);
+		exit(EXIT_FAILURE);
+	}
+
+	w->dev = dev;
+	w->error = 0;
+	tids = backup_alloc(nr_threads * sizeof *tids);
+	pthread_mutex_init(&w->lock, NULL);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (pass = 1, used = 0; pass <= REBLOCK_MAX_PASSES; ++pass) {
+
+		reblock_warm_pass(w, tids, nr_threads, pass);
+
+		if (w->error || warm_stop)
+			break;
+
+		/* Promotions are queued as migrations; give them a moment */
+		sleep(1);
+
+		if (zc_dm_cache_status(target, &status) < 0)
+			exit(EXIT_FAILURE);
+
+		if (status.used >= w->nr_blocks || status.used >= status.total)
+			break;
+
+		/* The first passes may only have heated up the hotspots */
+		if (pass >= REBLOCK_MIN_PASSES && status.used <= used)
+			break;
+
+		used = status.used;
+	}
+
+	fputs("\r", stderr);
+
+	close(w->fd);
+	free(tids);
+	free(dev);
+	return pass > REBLOCK_MAX_PASSES ? REBLOCK_MAX_PASSES : pass;
+}
+
+static int cmd_reblock(int argc, char *argv[])
+{
+	char old_bs[ZC_SIZE_BUF_SIZE], new_bs[ZC_SIZE_BUF_SIZE], *target, *msg;
+	uint64_t block_size, threshold;
+	struct zc_cache_status status;
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	struct zc_plan plan;
+	struct zc_cmeta cm;
+	struct zc_sb_v0 sb;
+	unsigned nr_threads, passes;
+	_Bool dry_run;
+	struct warm w;
+	int k, fd;
+
+	nr_threads = REBLOCK_DEFAULT_THREADS;
+	dry_run = 0;
+
+	for (k = 1; k < argc - 2; ++k) {
+
+		if (strcmp(argv[k], "-j") == 0) {
+			nr_threads = parse_u64(option_value(argc, argv, k++),
+					       "thread count", 1,
+					       REBLOCK_MAX_THREADS);
+		}
+		else if (strcmp(argv[k], "-n") == 0) {
+			dry_run = 1;
+		}
+		else {
+			usage_error();
+		}
+	}
+
+	if (k != argc - 2)
+		usage_error();
+
+	if (zc_block_size_parse(argv[k + 1], &block_size) < 0)
+		exit(EXIT_FAILURE);
+
+	fd = open_set_ext(argv[k], &reg, &ext);
+
+	if (zc_sb_v0_pread(NULL, fd, &sb) < 0)
+		exit(EXIT_FAILURE);
+
+	if (!reg.assembled) {
+		fprintf(stderr, "%s: set is not running\n", argv[k]);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	zc_registry_close(&reg);
+
+	zc_size_format_r(sb.block_size, 0, old_bs);
+	zc_size_format_r(block_size, 0, new_bs);
+
+	if (block_size == sb.block_size) {
+		printf("%s: block size is already %s\n", argv[k], new_bs);
+		return 0;
+	}
+
+	/* Check the change before spending time on cleaning the cache */
+	if (zc_set_reblock(argv[k], block_size, 1, &plan) < 0)
+		exit(EXIT_FAILURE);
+
+	target = zc_cache_target(argv[k]);
+
+	if (zc_dm_cache_status(target, &status) < 0)
+		exit(EXIT_FAILURE);
+
+	threshold = status.migration_threshold;
+
+	scrub_snapshot(argv[k], &cm);
+
+	w.block_size = block_size;
+	w.o_size = origin_sectors(argv[k]) * 512;
+	w.blocks = reblock_hot_set(&cm, block_size / 512, w.o_size / 512,
+				   plan.nr_blocks, &w.nr_blocks);
+
+	printf("%s: %" PRIu64 " x %s cache blocks (was %" PRIu64 " x %s); %"
+	       PRIu64 " hot blocks to warm\n", argv[k], plan.nr_blocks, new_bs,
+	       cm.nr_cache_blocks, old_bs, w.nr_blocks);
+	fflush(stdout);
+
+	zc_cmeta_free(&cm);
+
+	if (dry_run) {
+		free(w.blocks);
+		free(target);
+		return 0;
+	}
+
+	clean_cache(target);
+
+	if (zc_set_reblock(argv[k], block_size, 0, &plan) < 0)
+		exit(EXIT_FAILURE);
+
+	if (zc_dm_cache_set_mode(target, sb.cache_mode) < 0)
+		exit(EXIT_FAILURE);
+
+	/* Don't let the migration throttle skip the promotions */
+	if (threshold < 2 * nr_threads * block_size / 512) {
+		msg = zc_asprintf("migration_threshold %" PRIu64,
+				  2 * nr_threads * block_size / 512);
+		if (zc_dm_message(target, msg) < 0)
+			exit(EXIT_FAILURE);
+		free(msg);
+	}
+
+	passes = reblock_warm(argv[k], target, &w, nr_threads);
+
+	msg = zc_asprintf("migration_threshold %" PRIu64, threshold);
+	if (zc_dm_message(target, msg) < 0)
+		exit(EXIT_FAILURE);
+	free(msg);
+
+	if (w.error)
+		exit(EXIT_FAILURE);
+
+	if (zc_dm_cache_status(target, &status) < 0)
+		exit(EXIT_FAILURE);
+
+	fprintf(stderr, "%s: %u warming pass(es) over %" PRIu64 " blocks%s; %"
+		PRIu64 " of %" PRIu64 " cache blocks in use\n", argv[k],
+		passes, w.nr_blocks, warm_stop ? " (interrupted)" : "",
+		status.used, status.total);
+
+	free(w.blocks);
+	free(target);
+
+	/* Lets zodcached pick up the new block size */
+	return notify_daemon(argv[k]);
+}
+
+/*
+ * Encrypted sets (see zodcache.h)
+ */
+
+static int crypt_show(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	struct dm_info info;
+	char *name;
+
+	if (argc != 1)
+		usage_error();
+
+	close(open_set_ext(argv[0], &reg, &ext));
+	zc_registry_close(&reg);
+
+	if (ext.crypt_cipher[0] == 0) {
+		printf("%s: not encrypted\n", argv[0]);
+		return 0;
+	}
+
+	name = zc_asprintf(ZC_CRYPT_PREFIX "%s", argv[0]);
+	if (zc_dm_info(name, &info) < 0)
+		exit(EXIT_FAILURE);
+
+	printf("cipher:\t\t%s\n", ext.crypt_cipher);
+	printf("key:\t\t%s (%" PRIu64 " bytes)\n", ext.crypt_key,
+	       ext.crypt_key_size);
+	printf("sector size:\t%" PRIu64 "\n",
+	       ext.crypt_sector_size ? ext.crypt_sector_size : 512);
+	printf("device:\t\t/dev/mapper/%s%s\n", name,
+	       info.exists ? "" : " (not open)");
+
+	free(name);
+	return 0;
+}
+
+/* Changes the key source; the key itself must be the same */
+static int crypt_set_key(int argc, char *argv[])
+{
+	struct zc_registry reg;
+	struct zc_sb_ext ext;
+	struct stat st;
+	int fd;
+
+	if (argc != 2)
+		usage_error();
+
+	fd = open_set_ext(argv[0], &reg, &ext);
+
+	if (ext.crypt_cipher[0] == 0) {
+		fprintf(stderr, "%s: not encrypted\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (zc_crypt_parse(NULL, &ext, ext.crypt_cipher, argv[1]) < 0)
+		exit(EXIT_FAILURE);
+
+	if (argv[1][0] == '/') {
+
+		if (stat(argv[1], &st) < 0) {
+			fprintf(stderr, "%s: %m\n", argv[1]);
+			exit(EXIT_FAILURE);
+		}
+
+		if ((uint64_t)st.st_size != ext.crypt_key_size) {
+			fprintf(stderr, "%s: key file is not %" PRIu64
+				" bytes\n", argv[1], ext.crypt_key_size);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (zc_member_ext_commit(fd, reg.members[ZC_SB_TYPE_METADATA],
+				 &ext) < 0)
+		exit(EXIT_FAILURE);
+
+	zc_registry_close(&reg);
+	return 0;
+}
+
+static int cmd_crypt(int argc, char *argv[])
+{
+	if (argc < 3)
+		usage_error();
+
+	if (strcmp(argv[1], "show") == 0)
+		return crypt_show(argc - 2, argv + 2);
+	if (strcmp(argv[1], "open") == 0 && argc == 3)
+		return zc_set_crypt_open(argv[2]) < 0 ? -1 : 0;
+	if (strcmp(argv[1], "close") == 0 && argc == 3)
+		return zc_set_crypt_close(argv[2]) < 0 ? -1 : 0;
+	if (strcmp(argv[1], "key") == 0)
+		return crypt_set_key(argc - 2, argv + 2);
+
+	usage_error();
+	return -1;
+}
+
+static int cmd_stats(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage_error();
+
+	if (strcmp(argv[1], "enable") == 0)
+		return stats_enable(argc - 2, argv + 2);
+	if (strcmp(argv[1], "disable") == 0)
+		return stats_disable(argc - 2, argv + 2);
+	if (strcmp(argv[1], "show") == 0)
+		return stats_show(argc - 2, argv + 2);
+
+	usage_error();
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct {
+		const char	*cmd;
+		int		(*cmd_fn)(int, char **);
+	}
+	commands[] = {
+		{ "stats", cmd_stats },
+		{ "controller", cmd_controller },
+		{ "budget", cmd_budget },
+		{ "health", cmd_health },
+		{ "zones", cmd_zones },
+		{ "pins", cmd_pins },
+		{ "backup-read", cmd_backup_read },
+		{ "scrub", cmd_scrub },
+		{ "era", cmd_era },
+		{ "changed-since", cmd_changed_since },
+		{ "tune", cmd_tune },
+		{ "reblock", cmd_reblock },
+		{ "crypt", cmd_crypt },
+		{ NULL, 0 }
+	};
+
+	int i;
+
+	progname = argv[0];
+
+	if (argc < 2)
+		usage_error();
+
+	dm_udev_set_sync_support(1);
+
+	for (i = 0; commands[i].cmd != NULL; ++i) {
+		if (strcmp(commands[i].cmd, argv[1]) == 0)
+			return commands[i].cmd_fn(argc - 1, argv + 1) < 0 ?
+						EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	usage_error();
+	return EXIT_FAILURE;
+}
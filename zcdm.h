@@ -0,0 +1,254 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#ifndef ZC_ZCDM_H
+#define ZC_ZCDM_H
+
+/*
+ * Internal helpers shared by the zodcache programs that link with libdevmapper
+ * (everything except mkzc and zcdump).  Not part of libzodcache.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <libdevmapper.h>
+
+#include "zodcache.h"
+
+/*
+ * Set membership registry (registry.c)
+ *
+ * Records which members of a set have arrived (and had their component
+ * devices created), so that exactly one zcstart invocation assembles each set.
+ * Kept in ZC_RUN_DIR and protected by a per-UUID lock, which is held from
+ * zc_registry_open() until zc_registry_close().
+ */
+struct zc_registry {
+	int		lock_fd;
+	char		uuid[ZC_UUID_BUF_SIZE];
+	dev_t		members[ZC_SB_TYPE_METADATA + 1];   /* 0 = not arrived */
+	_Bool		thin;		/* origin holds a thin pool's data */
+	_Bool		assembled;
+	_Bool		degraded;	/* member gone, but still in use */
+};
+
+#define ZC_COMPONENT_UDEV_FLAGS	(DM_UDEV_DISABLE_LIBRARY_FALLBACK |	\
+					DM_UDEV_DISABLE_OTHER_RULES_FLAG)
+
+#define ZC_DEV_UDEV_FLAGS	DM_UDEV_DISABLE_LIBRARY_FALLBACK
+
+/* Name prefix of the cache target under a composite device */
+#define ZC_CACHED_PREFIX	"zodcache-cached-"
+
+/* Name prefix of the (hidden) device under a set's dm-era target */
+#define ZC_TRACKED_PREFIX	"zodcache-tracked-"
+
+/* Name prefix of a set's dm-crypt device, if it is encrypted */
+#define ZC_CRYPT_PREFIX		"zodcache-crypt-"
+
+/* Parsed dm-cache status line (see Documentation/device-mapper/cache.txt) */
+struct zc_cache_status {
+	uint64_t	md_block_size;		/* sectors */
+	uint64_t	md_used;		/* metadata blocks */
+	uint64_t	md_total;
+	uint64_t	block_size;		/* sectors */
+	uint64_t	used;			/* cache blocks */
+	uint64_t	total;
+	uint64_t	read_hits;
+	uint64_t	read_misses;
+	uint64_t	write_hits;
+	uint64_t	write_misses;
+	uint64_t	demotions;
+	uint64_t	promotions;
+	uint64_t	dirty;
+	uint64_t	migration_threshold;	/* sectors */
+	_Bool		failed;
+	_Bool		read_only;
+	_Bool		needs_check;
+};
+
+int zc_dm_task_run_sync(struct dm_task *task, uint16_t udev_flags);
+int zc_dm_info(const char *name, struct dm_info *info);
+int zc_dm_suspend(const char *name);
+int zc_dm_resume(const char *name, uint16_t udev_flags);
+int zc_dm_remove(const char *name, uint16_t udev_flags);
+int zc_dm_component_devno(const char *name, dev_t *devno);
+int zc_dm_cache_status(const char *name, struct zc_cache_status *status);
+int zc_dm_message(const char *name, const char *message);
+int zc_dm_cache_invalidate(const char *name, const uint64_t *cblocks,
+			   uint64_t n);
+int zc_dm_cache_reload(const char *name, uint64_t mode, const char *policy);
+int zc_dm_cache_set_mode(const char *name, uint64_t mode);
+int zc_dm_raid_sync(const char *name, uint64_t *done, uint64_t *total);
+uint16_t zc_dm_udev_flags(const char *name);
+int zc_dm_era_status(const char *name, uint64_t *era);
+
+/*
+ * dm-stats (stats.c)
+ *
+ * Each device of an assembled set (the top-level device, then the origin,
+ * cache and metadata components) gets one region, split into areas.
+ */
+#define ZC_STATS_PROGRAM_ID	"zodcache"
+#define ZC_STATS_NR_DEVS	4
+
+extern const char *const zc_stats_dev_types[ZC_STATS_NR_DEVS];
+
+struct zc_stats_area {
+	uint64_t	start;			/* sectors */
+	uint64_t	len;
+	uint64_t	reads;
+	uint64_t	writes;
+	uint64_t	read_sectors;
+	uint64_t	write_sectors;
+	uint64_t	read_nsecs;
+	uint64_t	write_nsecs;
+	uint64_t	bins[ZC_SB_EXT_STATS_BOUNDS + 1];
+};
+
+struct zc_stats_sample {
+	struct timespec		time;		/* CLOCK_MONOTONIC */
+	uint64_t		nr_areas;
+	unsigned		nr_bins;	/* 0 = no histogram */
+	uint64_t		bin_lower[ZC_SB_EXT_STATS_BOUNDS + 1];	/* ns */
+	struct zc_stats_area	*areas;
+};
+
+int zc_stats_create(const char *name, const struct zc_sb_ext *ext);
+int zc_stats_delete(const char *name);
+int zc_stats_setup(const char *uuid, const struct zc_sb_ext *ext);
+int zc_stats_remove(const char *uuid);
+int zc_stats_sample(const char *name, struct zc_stats_sample *s);
+void zc_stats_sample_free(struct zc_stats_sample *s);
+double zc_stats_delta(struct zc_stats_sample *later,
+		      const struct zc_stats_sample *earlier);
+uint64_t zc_stats_percentile(const struct zc_stats_sample *s, double fraction);
+
+/*
+ * migration_threshold controller & write budget (controller.c, zodcached only)
+ */
+#define ZC_CTL_INTERVAL		5	/* seconds */
+
+struct zc_ctl;
+
+/* Fields of /sys/block/<dev>/stat (see Documentation/block/stat.txt) */
+struct zc_disk_stat {
+	uint64_t	ios;			/* reads + writes */
+	uint64_t	ticks;			/* ms spent on completed I/O */
+	uint64_t	in_flight;
+	uint64_t	time_in_queue;		/* ms, weighted by queue depth */
+	uint64_t	write_sectors;
+};
+
+struct zc_ctl *zc_ctl_new(const char *uuid, const struct zc_sb_ext *ext,
+			  const struct zc_sb_v0 *sb, dev_t md_devno);
+void zc_ctl_free(struct zc_ctl *ctl);
+void zc_ctl_tick(struct zc_ctl *ctl);
+void zc_ctl_report(const struct zc_ctl *ctl, FILE *fp);
+int zc_disk_stat_read(const char *name, struct zc_disk_stat *ds);
+
+/*
+ * Cache health monitor (health.c, zodcached only).  The event and probe
+ * threads report to the daemon through the pipe from zc_health_pipe().
+ */
+#define ZC_HEALTH_DEFAULT_TRIP		3	/* intervals */
+#define ZC_HEALTH_DEFAULT_RECOVER	12
+
+struct zc_health;
+
+struct zc_health_msg {
+	char		uuid[ZC_UUID_BUF_SIZE];
+	_Bool		probe;			/* else a device-mapper event */
+	uint64_t	latency;		/* probe (ns); UINT64_MAX = error */
+};
+
+int zc_health_pipe(void);
+struct zc_health *zc_health_new(const char *uuid, const struct zc_sb_ext *ext,
+				const struct zc_sb_v0 *sb, dev_t md_devno);
+void zc_health_free(struct zc_health *h);
+int zc_health_configure(struct zc_health *h, const struct zc_sb_ext *ext);
+int zc_health_tick(struct zc_health *h);
+int zc_health_event(struct zc_health *h, const struct zc_health_msg *msg);
+_Bool zc_health_bypassed(const struct zc_health *h);
+void zc_health_report(const struct zc_health *h, FILE *fp);
+
+/*
+ * dm-cache metadata snapshots (cmeta.c, zcctl only); requires cache_dump
+ */
+struct zc_cmeta_mapping {
+	uint64_t	cblock;
+	uint64_t	oblock;
+	_Bool		dirty;
+};
+
+struct zc_cmeta {
+	uint64_t		block_size;		/* sectors */
+	uint64_t		nr_cache_blocks;
+	char			policy[32];
+	uint64_t		nr_mappings;
+	uint64_t		size;			/* allocated */
+	struct zc_cmeta_mapping	*mappings;
+	uint32_t		*hints;			/* by cache block */
+};
+
+char *zc_cmeta_snapshot(const char *uuid);
+int zc_cmeta_read(const char *path, struct zc_cmeta *cm);
+void zc_cmeta_free(struct zc_cmeta *cm);
+
+/* dm-era changed blocks (also cmeta.c); requires era_invalidate */
+typedef void (*zc_era_cb_t)(uint64_t begin, uint64_t end, void *context);
+
+int zc_era_changed(const char *uuid, uint64_t since, zc_era_cb_t cb,
+		   void *context);
+
+/* Queue tuning (tune.c) */
+int zc_tune_apply(const char *uuid, const struct zc_sb_ext *ext,
+		  uint64_t block_size, dev_t o_devno, dev_t c_devno);
+int zc_tune_crypt(const char *uuid, const struct zc_sb_ext *ext);
+int zc_tune_parse(struct zc_sb_ext *ext, const char *arg);
+void zc_tune_report(const char *uuid, const struct zc_sb_ext *ext,
+		    uint64_t block_size, dev_t o_devno, dev_t c_devno,
+		    FILE *fp);
+
+/* registry.c */
+int zc_registry_open(struct zc_registry *reg, const char *uuid);
+int zc_registry_commit(const struct zc_registry *reg);
+int zc_registry_remove(const struct zc_registry *reg);
+void zc_registry_close(struct zc_registry *reg);
+_Bool zc_registry_is_complete(const struct zc_registry *reg);
+
+/* assemble.c */
+int zc_member_probe(const char *dev, struct zc_sb_v0 *sb, dev_t *devno,
+		    _Bool quiet);
+int zc_member_start(const char *dev, const struct zc_sb_v0 *sb, dev_t devno);
+int zc_member_gone(const char *uuid, dev_t devno);
+int zc_set_stop(const char *uuid, _Bool mark_clean);
+int zc_member_ext_open(dev_t devno, struct zc_sb_ext *ext);
+int zc_member_ext_commit(int fd, dev_t devno, struct zc_sb_ext *ext);
+char *zc_cache_target(const char *uuid);
+int zc_set_overlay_reload(const char *uuid, const struct zc_sb_ext *ext);
+int zc_set_pins_update(const char *uuid);
+int zc_set_pin(const char *uuid, uint64_t start, uint64_t len);
+int zc_set_unpin(const char *uuid, uint64_t start, uint64_t len);
+int zc_set_reblock(const char *uuid, uint64_t block_size, _Bool dry_run,
+		   struct zc_plan *plan);
+int zc_set_crypt_open(const char *uuid);
+int zc_set_crypt_close(const char *uuid);
+
+#endif	/* ZC_ZCDM_H */
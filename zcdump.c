@@ -23,24 +23,217 @@
 
 #include "zodcache.h"
 
-static _Bool sb_check_cb(char *issue, void *context __attribute__((unused)))
+static _Bool sb_check_cb(const char *issue,
+			 void *context __attribute__((unused)))
 {
 	printf("\t%s\n", issue);
-	free(issue);
 	return 1;
 }
 
 static void print_size(const char *const format, uint64_t size)
 {
-	char *const s = zc_size_format(size, /* verbose = */ 1);
-	printf(format, s);
-	free(s);
+	char buf[ZC_SIZE_BUF_SIZE];
+
+	printf(format, zc_size_format_r(size, /* verbose = */ 1, buf));
+}
+
+static void print_ext_flags(const uint64_t flags)
+{
+	static const struct { uint64_t flag; const char *name; } names[] = {
+		{ ZC_SB_EXT_CLEAN,		"clean" },
+		{ ZC_SB_EXT_STATS_PRECISE,	"precise" },
+		{ ZC_SB_EXT_FALLBACK,		"fallback" },
+		{ ZC_SB_EXT_BYPASSED,		"bypassed" },
+		{ ZC_SB_EXT_THIN,		"thin" },
+	};
+
+	const char *sep;
+	unsigned i;
+
+	fputs("ext_flags:\t", stdout);
+
+	for (sep = "", i = 0; i < sizeof names / sizeof names[0]; ++i) {
+		if (flags & names[i].flag) {
+			printf("%s%s", sep, names[i].name);
+			sep = " ";
+		}
+	}
+
+	puts(*sep == 0 ? "-" : "");
+}
+
+static void print_stats(const struct zc_sb_ext *const ext)
+{
+	unsigned i;
+
+	if (ext->stats_areas == 0) {
+		puts("stats_areas:\t-");
+		return;
+	}
+
+	printf("stats_areas:\t%" PRIu64 "\n", ext->stats_areas);
+	fputs("stats_bounds:\t", stdout);
+
+	for (i = 0; i < ZC_SB_EXT_STATS_BOUNDS && ext->stats_bounds[i] != 0;
+									++i) {
+		printf("%s%" PRIu64 "ns", i == 0 ? "" : ",",
+		       ext->stats_bounds[i]);
+	}
+
+	puts(i == 0 ? "-" : "");
+}
+
+static void print_ctl(const struct zc_sb_ext *const ext)
+{
+	if (ext->ctl_target == 0) {
+		puts("ctl_target:\t-");
+		return;
+	}
+
+	printf("ctl_target:\t%" PRIu64 "ns\n", ext->ctl_target);
+	print_size("ctl_min:\t%s\n", ext->ctl_min_threshold * 512);
+	print_size("ctl_max:\t%s\n", ext->ctl_max_threshold * 512);
+}
+
+static void print_budget(const struct zc_sb_ext *const ext)
+{
+	if (ext->budget_daily == 0) {
+		puts("budget_daily:\t-");
+		return;
+	}
+
+	print_size("budget_daily:\t%s\n", ext->budget_daily);
+	print_size("budget_tbw:\t%s\n", ext->budget_tbw);
+	printf("budget_mode:\t%s\n", (ext->flags & ZC_SB_EXT_FALLBACK) ?
+			zc_cache_mode_format(ext->budget_fallback, 1) : "-");
+	printf("budget_start:\t%" PRIu64 "\n", ext->budget_start);
+	printf("budget_day:\t%" PRIu64 "\n", ext->budget_day);
+	print_size("budget_used:\t%s\n", ext->budget_used);
+	print_size("budget_total:\t%s\n", ext->budget_total);
+}
+
+static void print_zones(const struct zc_sb_ext *const ext)
+{
+	char start[ZC_SIZE_BUF_SIZE], len[ZC_SIZE_BUF_SIZE];
+	uint64_t i;
+
+	if (ext->zones_count == 0) {
+		puts("zones:\t\t-");
+		return;
+	}
+
+	for (i = 0; i < ext->zones_count && i < ZC_SB_EXT_MAX_ZONES; ++i) {
+		printf("%s%s:%s\n", i == 0 ? "zones:\t\t" : "\t\t",
+		       zc_size_format_r(ext->zones[i].start * 512, 0, start),
+		       zc_size_format_r(ext->zones[i].len * 512, 0, len));
+	}
+}
+
+static void print_pins(const struct zc_sb_ext *const ext)
+{
+	char start[ZC_SIZE_BUF_SIZE], len[ZC_SIZE_BUF_SIZE],
+						offset[ZC_SIZE_BUF_SIZE];
+	uint64_t i;
+
+	if (ext->pin_size == 0) {
+		puts("pin_area:\t-");
+		return;
+	}
+
+	print_size("pin_offset:\t%s\n", ext->pin_offset * 512);
+	print_size("pin_size:\t%s\n", ext->pin_size * 512);
+	printf("pin_rate:\t%" PRIu64 "\n", ext->pin_rate);
+
+	for (i = 0; i < ext->pins_count && i < ZC_SB_EXT_MAX_PINS; ++i) {
+		printf("%s%s:%s @%s (state %" PRIu64 ")\n",
+		       i == 0 ? "pins:\t\t" : "\t\t",
+		       zc_size_format_r(ext->pins[i].start * 512, 0, start),
+		       zc_size_format_r(ext->pins[i].len * 512, 0, len),
+		       zc_size_format_r(ext->pins[i].offset * 512, 0, offset),
+		       ext->pins[i].state);
+	}
+}
+
+static void print_era(const struct zc_sb_ext *const ext)
+{
+	if (ext->era_block_size == 0) {
+		puts("era_block_size:\t-");
+		return;
+	}
+
+	print_size("era_block_size:\t%s\n", ext->era_block_size * 512);
+	print_size("era_offset:\t%s\n", ext->era_offset * 512);
+	print_size("era_size:\t%s\n", ext->era_size * 512);
+	printf("era_base:\t%" PRIu64 "\n", ext->era_base);
+	printf("era_issued:\t%" PRIu64 "\n", ext->era_issued);
+}
+
+static void print_tune_value(const char *const name, const uint64_t value)
+{
+	if (value == ZC_TUNE_AUTO)
+		printf("%s\tauto\n", name);
+	else if (value == ZC_TUNE_KEEP)
+		printf("%s\tkeep\n", name);
+	else
+		printf("%s\t%" PRIu64 "\n", name, value);
+}
+
+static void print_tune(const struct zc_sb_ext *const ext)
+{
+	print_tune_value("tune_ra_kb:", ext->tune_read_ahead);
+	print_tune_value("tune_o_max_kb:", ext->tune_max_sectors[0]);
+	print_tune_value("tune_o_nr_req:", ext->tune_nr_requests[0]);
+	print_tune_value("tune_o_sched:", ext->tune_scheduler[0]);
+	print_tune_value("tune_c_max_kb:", ext->tune_max_sectors[1]);
+	print_tune_value("tune_c_nr_req:", ext->tune_nr_requests[1]);
+	print_tune_value("tune_c_sched:", ext->tune_scheduler[1]);
+}
+
+static void print_health(const struct zc_sb_ext *const ext)
+{
+	static const char *const actions[] = {
+		"-", "alert", "passthrough", "uncache"
+	};
+
+	if (ext->health_action < sizeof actions / sizeof actions[0])
+		printf("health_action:\t%s\n", actions[ext->health_action]);
+	else
+		printf("health_action:\tinvalid (%" PRIu64 ")\n",
+		       ext->health_action);
+
+	if (ext->health_action == ZC_HEALTH_OFF)
+		return;
+
+	printf("health_latency:\t%" PRIu64 "ns\n", ext->health_latency);
+	printf("health_trip:\t%" PRIu64 "\n", ext->health_trip);
+	printf("health_recover:\t%" PRIu64 "\n", ext->health_recover);
+}
+
+static void print_scrub(const struct zc_sb_ext *const ext)
+{
+	printf("scrub_next:\t%" PRIu64 "\n", ext->scrub_next);
+	printf("scrub_done:\t%" PRIu64 "\n", ext->scrub_done);
+	printf("scrub_found:\t%" PRIu64 "\n", ext->scrub_found);
+}
+
+static void print_crypt(const struct zc_sb_ext *const ext)
+{
+	if (ext->crypt_cipher[0] == 0) {
+		puts("crypt_cipher:\t-");
+		return;
+	}
+
+	printf("crypt_cipher:\t%s\n", ext->crypt_cipher);
+	printf("crypt_key:\t%s\n", ext->crypt_key);
+	printf("crypt_key_size:\t%" PRIu64 "\n", ext->crypt_key_size);
+	printf("crypt_sector:\t%" PRIu64 "\n", ext->crypt_sector_size);
 }
 
 int main(int argc, char *argv[])
 {
 	const char *dev_type, *cache_mode;
 	char uuid[ZC_UUID_BUF_SIZE];
+	struct zc_sb_ext ext;
 	struct zc_sb_v0 sb;
 	int fd;
 
@@ -60,6 +253,9 @@ int main(int argc, char *argv[])
 	if (zc_sb_v0_read(fd, &sb) < 0)
 		exit(EXIT_FAILURE);
 
+	if (zc_sb_ext_read(fd, &ext) < 0)
+		exit(EXIT_FAILURE);
+
 	if (close(fd) < 0) {
 		perror(argv[1]);
 		exit(EXIT_FAILURE);
@@ -89,11 +285,31 @@ int main(int argc, char *argv[])
 
 	print_size("o_offset:\t%s\n", sb.o_offset);
 	print_size("o_size:\t\t%s\n", sb.o_size);
+	if (ext.o_reloc != 0)
+		print_size("o_reloc:\t%s\n", ext.o_reloc);
+	if (ext.o_thin_pool[0] != 0)
+		printf("o_thin_pool:\t%s\n", ext.o_thin_pool);
 	print_size("c_offset:\t%s\n", sb.c_offset);
 	print_size("c_size:\t\t%s\n", sb.c_size);
 	print_size("md_offset:\t%s\n", sb.md_offset);
 	print_size("md_size:\t%s\n", sb.md_size);
 
+	if (ext.size != 0) {
+		printf("\next_size:\t%" PRIu64 "\n", ext.size);
+		print_ext_flags(ext.flags);
+		printf("generation:\t%" PRIu64 "\n", ext.generation);
+		print_stats(&ext);
+		print_ctl(&ext);
+		print_budget(&ext);
+		print_zones(&ext);
+		print_pins(&ext);
+		print_era(&ext);
+		print_tune(&ext);
+		print_health(&ext);
+		print_scrub(&ext);
+		print_crypt(&ext);
+	}
+
 	if (!zc_sb_v0_is_valid(&sb)) {
 		puts("\nProblems:");
 		zc_sb_v0_check(&sb, sb_check_cb, NULL);
@@ -0,0 +1,825 @@
+/*
+ * Copyright 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * A stand-in for the parts of libdevmapper that zcstart and zcstop use, for
+ * benchmarking assembly (see zcbench.c) without touching the kernel.  It is
+ * loaded with LD_PRELOAD; nothing else in the tree links against it.
+ *
+ *   gcc -O2 -Wall -Wextra -fPIC -shared -pthread -o zcfakedm.so \
+ *	zcfakedm.c lib.c -ldl
+ *
+ * All state lives in $ZC_FAKEDM_DIR, so that any number of processes can
+ * share it:
+ *
+ *   dev/NAME	the device's table; created with O_EXCL, so a second create of
+ *		the same name fails with EEXIST, as it would in the kernel
+ *   mapper/NAME	a sparse file of the device's size, which stands in for
+ *		/dev/mapper/NAME (all zeroes, so metadata always looks new)
+ *   run/	stands in for ZC_RUN_DIR (the member registry and, when
+ *		zodcached is benchmarked, its socket)
+ *   log	one line per operation: "SECONDS PID OP NAME ERRNO"
+ *
+ * Opens of /dev/mapper/ and ZC_RUN_DIR paths (and binds of Unix sockets in
+ * ZC_RUN_DIR) are redirected into the state directory.  Opens of
+ * /dev/block/MAJ:MIN fall back to the kernel's name for the device, for
+ * systems without udev's links.
+ *
+ * Every dm_task_run() sleeps for $ZC_FAKEDM_IOCTL_US microseconds, and every
+ * dm_udev_wait() on a cookie for $ZC_FAKEDM_UDEV_US.  Device numbers have
+ * major 0 and are only unique within the state directory.  Tables are live
+ * as soon as they are loaded, and status is just the table.  Statistics are
+ * never available.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <inttypes.h>
+#include <libdevmapper.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zodcache.h"
+
+#define FAKEDM_MAX_TARGETS	64
+
+static const char *const op_names[] = {
+	[DM_DEVICE_CREATE]	= "create",
+	[DM_DEVICE_RELOAD]	= "reload",
+	[DM_DEVICE_REMOVE]	= "remove",
+	[DM_DEVICE_REMOVE_ALL]	= "remove_all",
+	[DM_DEVICE_SUSPEND]	= "suspend",
+	[DM_DEVICE_RESUME]	= "resume",
+	[DM_DEVICE_INFO]	= "info",
+	[DM_DEVICE_DEPS]	= "deps",
+	[DM_DEVICE_RENAME]	= "rename",
+	[DM_DEVICE_VERSION]	= "version",
+	[DM_DEVICE_STATUS]	= "status",
+	[DM_DEVICE_TABLE]	= "table",
+	[DM_DEVICE_WAITEVENT]	= "waitevent",
+	[DM_DEVICE_LIST]	= "list",
+	[DM_DEVICE_CLEAR]	= "clear",
+	[DM_DEVICE_MKNODES]	= "mknodes",
+	[DM_DEVICE_LIST_VERSIONS] = "list_versions",
+	[DM_DEVICE_TARGET_MSG]	= "message",
+	[DM_DEVICE_SET_GEOMETRY] = "set_geometry",
+};
+
+struct fake_target {
+	uint64_t	start;
+	uint64_t	len;
+	char		*type;
+	char		*params;
+};
+
+struct dm_task {
+	int			type;
+	char			name[NAME_MAX + 1];
+	unsigned		nr_targets;
+	struct fake_target	targets[FAKEDM_MAX_TARGETS];
+	uint32_t		*cookie;
+	struct dm_info		info;
+	void			*result;
+};
+
+static int (*real_open)(const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+static int (*real_mkdir)(const char *, mode_t);
+static int (*real_rename)(const char *, const char *);
+static int (*real_unlink)(const char *);
+static int (*real_ioctl)(int, unsigned long, ...);
+static int (*real_bind)(int, const struct sockaddr *, socklen_t);
+
+static const char *state_dir;
+static unsigned ioctl_us, udev_us;
+static int log_fd = -1;
+
+static unsigned env_us(const char *const name)
+{
+	const char *value;
+
+	value = getenv(name);
+	return value == NULL ? 0 : strtoul(value, NULL, 10);
+}
+
+static void dir_create(const char *const dir)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof path, "%s/%s", state_dir, dir);
+	if (real_mkdir(path, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "zcfakedm: %s: %m\n", path);
+		abort();
+	}
+}
+
+/* Other libraries' constructors may get here first */
+static void fakedm_init(void)
+{
+	char path[PATH_MAX];
+
+	if (real_open != NULL)
+		return;
+
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_fopen = dlsym(RTLD_NEXT, "fopen");
+	real_mkdir = dlsym(RTLD_NEXT, "mkdir");
+	real_rename = dlsym(RTLD_NEXT, "rename");
+	real_unlink = dlsym(RTLD_NEXT, "unlink");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	real_bind = dlsym(RTLD_NEXT, "bind");
+
+	if ((state_dir = getenv("ZC_FAKEDM_DIR")) == NULL) {
+		fputs("zcfakedm: ZC_FAKEDM_DIR not set\n", stderr);
+		abort();
+	}
+
+	ioctl_us = env_us("ZC_FAKEDM_IOCTL_US");
+	udev_us = env_us("ZC_FAKEDM_UDEV_US");
+
+	dir_create("dev");
+	dir_create("mapper");
+	dir_create("run");
+
+	snprintf(path, sizeof path, "%s/log", state_dir);
+	log_fd = real_open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			   0644);
+	if (log_fd < 0) {
+		fprintf(stderr, "zcfakedm: %s: %m\n", path);
+		abort();
+	}
+}
+
+__attribute__((constructor))
+static void fakedm_ctor(void)
+{
+	fakedm_init();
+}
+
+/* A single write, so lines from different processes don't interleave */
+static void fakedm_log(const char *const op, const char *const name,
+		       const int err)
+{
+	struct timespec ts;
+	char buf[NAME_MAX + 128];
+	int len;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	len = snprintf(buf, sizeof buf, "%ld.%09ld %d %s %s %d\n",
+		       (long)ts.tv_sec, ts.tv_nsec, (int)getpid(), op,
+		       name[0] != 0 ? name : "-", err);
+	if (write(log_fd, buf, len) < 0)
+		return;
+}
+
+static void usleep_env(const unsigned us)
+{
+	if (us != 0)
+		usleep(us);
+}
+
+/*
+ * Path redirection
+ */
+
+static const char *redirect(const char *const path, char *const buf)
+{
+	static const char mapper[] = "/dev/mapper/";
+	static const char block[] = "/dev/block/";
+	static const char run[] = ZC_RUN_DIR;
+
+	char uevent[PATH_MAX], line[128];
+	struct stat st;
+	FILE *fp;
+
+	if (path == NULL)
+		return path;
+
+	if (strncmp(path, mapper, sizeof mapper - 1) == 0) {
+		snprintf(buf, PATH_MAX, "%s/mapper/%s", state_dir,
+			 path + sizeof mapper - 1);
+		return buf;
+	}
+
+	if (strncmp(path, run, sizeof run - 1) == 0 &&
+			(path[sizeof run - 1] == 0 ||
+			 path[sizeof run - 1] == '/')) {
+		snprintf(buf, PATH_MAX, "%s/run%s", state_dir,
+			 path + sizeof run - 1);
+		return buf;
+	}
+
+	if (strncmp(path, block, sizeof block - 1) != 0 || stat(path, &st) == 0)
+		return path;
+
+	snprintf(uevent, sizeof uevent, "/sys/dev/block/%s/uevent",
+		 path + sizeof block - 1);
+	if ((fp = real_fopen(uevent, "re")) == NULL)
+		return path;
+
+	while (fgets(line, sizeof line, fp) != NULL) {
+		if (strncmp(line, "DEVNAME=", 8) == 0) {
+			line[strcspn(line, "\n")] = 0;
+			snprintf(buf, PATH_MAX, "/dev/%s", line + 8);
+			fclose(fp);
+			return buf;
+		}
+	}
+
+	fclose(fp);
+	return path;
+}
+
+int open(const char *const path, const int flags, ...)
+{
+	char buf[PATH_MAX];
+	mode_t mode;
+	va_list ap;
+
+	fakedm_init();
+
+	mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+
+	return real_open(redirect(path, buf), flags, mode);
+}
+
+int open64(const char *const path, const int flags, ...)
+	__attribute__((alias("open")));
+
+FILE *fopen(const char *const path, const char *const mode)
+{
+	char buf[PATH_MAX];
+
+	fakedm_init();
+	return real_fopen(redirect(path, buf), mode);
+}
+
+FILE *fopen64(const char *const path, const char *const mode)
+	__attribute__((alias("fopen")));
+
+int mkdir(const char *const path, const mode_t mode)
+{
+	char buf[PATH_MAX];
+
+	fakedm_init();
+	return real_mkdir(redirect(path, buf), mode);
+}
+
+int rename(const char *const old, const char *const new)
+{
+	char buf1[PATH_MAX], buf2[PATH_MAX];
+
+	fakedm_init();
+	return real_rename(redirect(old, buf1), redirect(new, buf2));
+}
+
+int unlink(const char *const path)
+{
+	char buf[PATH_MAX];
+
+	fakedm_init();
+	return real_unlink(redirect(path, buf));
+}
+
+/* zodcached's socket */
+int bind(const int fd, const struct sockaddr *const addr, const socklen_t len)
+{
+	char buf[PATH_MAX];
+	struct sockaddr_un un;
+	const char *path;
+
+	fakedm_init();
+
+	if (addr->sa_family != AF_UNIX || len > sizeof un)
+		return real_bind(fd, addr, len);
+
+	memset(&un, 0, sizeof un);
+	memcpy(&un, addr, len);
+
+	if ((path = redirect(un.sun_path, buf)) == un.sun_path)
+		return real_bind(fd, addr, len);
+
+	if (strlen(path) >= sizeof un.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(un.sun_path, path);
+	return real_bind(fd, (const struct sockaddr *)&un, sizeof un);
+}
+
+/* The stand-in /dev/mapper nodes are regular files */
+int ioctl(const int fd, const unsigned long request, ...)
+{
+	struct stat st;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	fakedm_init();
+
+	if (request == BLKGETSIZE64 && fstat(fd, &st) == 0 &&
+			S_ISREG(st.st_mode)) {
+		*(uint64_t *)arg = st.st_size;
+		return 0;
+	}
+
+	return real_ioctl(fd, request, arg);
+}
+
+/*
+ * Tables
+ */
+
+static char *state_path(const char *const dir, const char *const name)
+{
+	return zc_asprintf("%s/%s/%s", state_dir, dir, name);
+}
+
+static void targets_free(struct dm_task *const task)
+{
+	unsigned i;
+
+	for (i = 0; i < task->nr_targets; ++i) {
+		free(task->targets[i].type);
+		free(task->targets[i].params);
+	}
+
+	task->nr_targets = 0;
+}
+
+static int table_write(const struct dm_task *const task, const int flags)
+{
+	const struct fake_target *t;
+	uint64_t sectors;
+	char *path;
+	unsigned i;
+	FILE *fp;
+	int fd;
+
+	path = state_path("dev", task->name);
+	fd = real_open(path, O_WRONLY | O_CLOEXEC | flags, 0644);
+	free(path);
+
+	if (fd < 0)
+		return -1;
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	for (sectors = 0, i = 0; i < task->nr_targets; ++i) {
+		t = task->targets + i;
+		fprintf(fp, "%" PRIu64 " %" PRIu64 " %s %s\n", t->start, t->len,
+			t->type, t->params);
+		if (t->start + t->len > sectors)
+			sectors = t->start + t->len;
+	}
+
+	if (fclose(fp) == EOF)
+		return -1;
+
+	path = state_path("mapper", task->name);
+	fd = real_open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	free(path);
+
+	if (fd < 0 || ftruncate(fd, sectors * 512) < 0)
+		return -1;
+
+	return close(fd);
+}
+
+static int table_read(struct dm_task *const task)
+{
+	struct fake_target *t;
+	char line[4096];
+	char *path;
+	FILE *fp;
+	int pos;
+
+	path = state_path("dev", task->name);
+	fp = real_fopen(path, "re");
+	free(path);
+
+	if (fp == NULL)
+		return -1;
+
+	targets_free(task);
+
+	while (task->nr_targets < FAKEDM_MAX_TARGETS &&
+			fgets(line, sizeof line, fp) != NULL) {
+
+		t = task->targets + task->nr_targets;
+		line[strcspn(line, "\n")] = 0;
+
+		if (sscanf(line, "%" SCNu64 " %" SCNu64 " %ms %n", &t->start,
+			   &t->len, &t->type, &pos) != 3)
+			continue;
+
+		t->params = zc_asprintf("%s", line + pos);
+		++task->nr_targets;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static int dev_stat(const char *const name, struct stat *const st)
+{
+	char *path;
+	int ret;
+
+	path = state_path("dev", name);
+	ret = stat(path, st);
+	free(path);
+	return ret;
+}
+
+static dev_t dev_number(const struct stat *const st)
+{
+	return makedev(0, st->st_ino & 0xfffff);
+}
+
+/* Component devices show up as /dev/block/MAJ:MIN or /dev/mapper/NAME */
+static void deps_build(struct dm_task *const task)
+{
+	uint64_t devs[FAKEDM_MAX_TARGETS * 2];
+	unsigned i, major, minor, count;
+	struct dm_deps *deps;
+	struct stat st;
+	char *p, *tok;
+	char name[NAME_MAX + 1];
+
+	for (count = 0, i = 0; i < task->nr_targets; ++i) {
+
+		p = task->targets[i].params;
+
+		while (count < sizeof devs / sizeof devs[0] &&
+				(tok = strstr(p, "/dev/")) != NULL) {
+
+			if (sscanf(tok, "/dev/block/%u:%u", &major,
+				   &minor) == 2)
+				devs[count++] = makedev(major, minor);
+			else if (sscanf(tok, "/dev/mapper/%255s", name) == 1 &&
+					dev_stat(name, &st) == 0)
+				devs[count++] = dev_number(&st);
+
+			p = tok + 5;
+		}
+	}
+
+	deps = malloc(sizeof *deps + count * sizeof devs[0]);
+	deps->count = count;
+	deps->filler = 0;
+	memcpy(deps->device, devs, count * sizeof devs[0]);
+	task->result = deps;
+}
+
+static int names_build(struct dm_task *const task)
+{
+	struct dm_names *names, *entry;
+	size_t size, len, last;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	char *path;
+
+	path = zc_asprintf("%s/dev", state_dir);
+	dir = opendir(path);
+	free(path);
+
+	if (dir == NULL)
+		return -1;
+
+	/* An empty list is a single entry with dev == 0 */
+	names = calloc(1, sizeof *names);
+	size = last = 0;
+
+	while ((de = readdir(dir)) != NULL) {
+
+		if (de->d_name[0] == '.' || dev_stat(de->d_name, &st) < 0)
+			continue;
+
+		len = (sizeof *names + strlen(de->d_name) + 8) & ~(size_t)7;
+		names = realloc(names, size + len);
+
+		if (size != 0) {
+			entry = (struct dm_names *)((char *)names + last);
+			entry->next = size - last;
+		}
+
+		entry = (struct dm_names *)((char *)names + size);
+		entry->dev = dev_number(&st);
+		entry->next = 0;
+		strcpy(entry->name, de->d_name);
+
+		last = size;
+		size += len;
+	}
+
+	closedir(dir);
+	task->result = names;
+	return 0;
+}
+
+static int task_do(struct dm_task *const task)
+{
+	struct stat st;
+	char *path;
+
+	switch (task->type) {
+
+		case DM_DEVICE_CREATE:
+
+			return table_write(task, O_CREAT | O_EXCL);
+
+		case DM_DEVICE_RELOAD:
+
+			if (dev_stat(task->name, &st) < 0)
+				return -1;
+			return table_write(task, O_TRUNC);
+
+		case DM_DEVICE_REMOVE:
+
+			path = state_path("mapper", task->name);
+			real_unlink(path);
+			free(path);
+			path = state_path("dev", task->name);
+			if (real_unlink(path) < 0) {
+				free(path);
+				return -1;
+			}
+			free(path);
+			return 0;
+
+		case DM_DEVICE_INFO:
+
+			memset(&task->info, 0, sizeof task->info);
+			if (dev_stat(task->name, &st) < 0)
+				return errno == ENOENT ? 0 : -1;
+			task->info.exists = 1;
+			task->info.live_table = 1;
+			task->info.major = major(dev_number(&st));
+			task->info.minor = minor(dev_number(&st));
+			if (table_read(task) == 0)
+				task->info.target_count = task->nr_targets;
+			return 0;
+
+		case DM_DEVICE_DEPS:
+
+			if (table_read(task) < 0)
+				return -1;
+			deps_build(task);
+			return 0;
+
+		case DM_DEVICE_STATUS:
+		case DM_DEVICE_TABLE:
+
+			return table_read(task);
+
+		case DM_DEVICE_LIST:
+
+			return names_build(task);
+
+		default:
+
+			/* Succeeds if the device exists (and does nothing) */
+			return dev_stat(task->name, &st);
+	}
+}
+
+/*
+ * libdevmapper API
+ */
+
+struct dm_task *dm_task_create(const int type)
+{
+	struct dm_task *task;
+
+	if ((task = calloc(1, sizeof *task)) != NULL)
+		task->type = type;
+	return task;
+}
+
+void dm_task_destroy(struct dm_task *const task)
+{
+	targets_free(task);
+	free(task->result);
+	free(task);
+}
+
+int dm_task_set_name(struct dm_task *const task, const char *const name)
+{
+	if (strlen(name) >= sizeof task->name)
+		return 0;
+	strcpy(task->name, name);
+	return 1;
+}
+
+int dm_task_add_target(struct dm_task *const task, const uint64_t start,
+		       const uint64_t size, const char *const ttype,
+		       const char *const params)
+{
+	struct fake_target *t;
+
+	if (task->nr_targets == FAKEDM_MAX_TARGETS)
+		return 0;
+
+	t = task->targets + task->nr_targets++;
+	t->start = start;
+	t->len = size;
+	t->type = zc_asprintf("%s", ttype);
+	t->params = zc_asprintf("%s", params);
+	return 1;
+}
+
+int dm_task_set_cookie(struct dm_task *const task, uint32_t *const cookie,
+		       const uint16_t udev_flags __attribute__((unused)))
+{
+	task->cookie = cookie;
+	return 1;
+}
+
+int dm_task_run(struct dm_task *const task)
+{
+	const char *op;
+	int ret, err;
+
+	usleep_env(ioctl_us);
+
+	ret = task_do(task);
+	err = (ret < 0) ? errno : 0;
+
+	op = (task->type >= 0 &&
+	      (unsigned)task->type < sizeof op_names / sizeof op_names[0] &&
+	      op_names[task->type] != NULL) ? op_names[task->type] : "other";
+	fakedm_log(op, task->name, err);
+
+	/* A cookie is only issued for operations that generate uevents */
+	if (ret == 0 && task->cookie != NULL &&
+			(task->type == DM_DEVICE_CREATE ||
+			 task->type == DM_DEVICE_REMOVE ||
+			 task->type == DM_DEVICE_RESUME))
+		*task->cookie = 1;
+
+	errno = err;
+	return ret == 0;
+}
+
+int dm_udev_wait(const uint32_t cookie)
+{
+	if (cookie != 0) {
+		usleep_env(udev_us);
+		fakedm_log("udev_wait", "", 0);
+	}
+
+	return 1;
+}
+
+int dm_task_get_info(struct dm_task *const task, struct dm_info *const info)
+{
+	*info = task->info;
+	return 1;
+}
+
+const char *dm_task_get_name(const struct dm_task *const task)
+{
+	return task->name;
+}
+
+struct dm_deps *dm_task_get_deps(struct dm_task *const task)
+{
+	return task->result;
+}
+
+struct dm_names *dm_task_get_names(struct dm_task *const task)
+{
+	return task->result;
+}
+
+void *dm_get_next_target(struct dm_task *const task, void *const next,
+			 uint64_t *const start, uint64_t *const length,
+			 char **const target_type, char **const params)
+{
+	const struct fake_target *t;
+	uintptr_t i;
+
+	i = (uintptr_t)next;
+
+	if (i >= task->nr_targets) {
+		*start = *length = 0;
+		*target_type = *params = NULL;
+		return NULL;
+	}
+
+	t = task->targets + i;
+	*start = t->start;
+	*length = t->len;
+	*target_type = t->type;
+	*params = t->params;
+
+	return (i + 1 < task->nr_targets) ? (void *)(i + 1) : NULL;
+}
+
+/* Options that make no difference here */
+
+int dm_task_enable_checks(struct dm_task *const task __attribute__((unused)))
+{
+	return 1;
+}
+
+int dm_task_set_add_node(struct dm_task *const task __attribute__((unused)),
+			 const dm_add_node_t add_node __attribute__((unused)))
+{
+	return 1;
+}
+
+int dm_task_retry_remove(struct dm_task *const task __attribute__((unused)))
+{
+	return 1;
+}
+
+int dm_task_set_sector(struct dm_task *const task __attribute__((unused)),
+		       const uint64_t sector __attribute__((unused)))
+{
+	return 1;
+}
+
+int dm_task_set_message(struct dm_task *const task __attribute__((unused)),
+			const char *const msg __attribute__((unused)))
+{
+	return 1;
+}
+
+int dm_task_no_flush(struct dm_task *const task __attribute__((unused)))
+{
+	return 1;
+}
+
+int dm_task_skip_lockfs(struct dm_task *const task __attribute__((unused)))
+{
+	return 1;
+}
+
+int dm_task_no_open_count(struct dm_task *const task __attribute__((unused)))
+{
+	return 1;
+}
+
+void dm_udev_set_sync_support(const int sync __attribute__((unused)))
+{
+}
+
+void dm_log_with_errno_init(const dm_log_with_errno_fn fn
+						__attribute__((unused)))
+{
+}
+
+struct dm_stats *dm_stats_create(const char *const program_id
+						__attribute__((unused)))
+{
+	fakedm_log("stats_create", "", ENOTSUP);
+	errno = ENOTSUP;
+	return NULL;
+}
+
+void dm_stats_destroy(struct dm_stats *const dms __attribute__((unused)))
+{
+}
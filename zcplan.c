@@ -0,0 +1,178 @@
+/*
+ * Copyright 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Shows the layout that mkzc would create for a range of block sizes, with
+ * the metadata space and kernel memory that each needs.  Sizes can be given
+ * as numbers or as devices; either way, they are the sizes of whole devices,
+ * including the superblock area.  Pin areas and dm-era metadata (mkzc -p and
+ * -e) aren't included.
+ */
+
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <locale.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "zodcache.h"
+
+#define ZC_PLAN_MAX_BLOCK_SIZES	16
+
+static const char *progname;
+
+static void usage_error(void)
+{
+	fprintf(stderr,
+		"Usage: %s -c CACHE [-m METADATA] [-o ORIGIN] [-a ALIGNMENT] "
+							"[-b BLOCK_SIZE]...\n"
+		"  CACHE, METADATA, and ORIGIN are sizes or devices\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t parse_size_or_dev(const char *const arg)
+{
+	uint64_t size;
+	int fd;
+
+	if (arg[0] != '/') {
+		if (zc_size_parse(arg, &size) < 0)
+			exit(EXIT_FAILURE);
+		return size;
+	}
+
+	if ((fd = open(arg, O_RDONLY | O_CLOEXEC)) < 0 ||
+			ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		perror(arg);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	return size;
+}
+
+/* Rounded up */
+static void print_kib(const uint64_t size)
+{
+	printf(" %'14" PRIu64, (size + 1023) / 1024);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t cache, metadata, origin, alignment;
+	uint64_t block_sizes[ZC_PLAN_MAX_BLOCK_SIZES];
+	struct zc_plan plan;
+	unsigned i, nr_block_sizes, version;
+	struct zc_ctx *ctx;
+
+	progname = argv[0];
+	cache = metadata = origin = 0;
+	alignment = 4096;
+	nr_block_sizes = 0;
+
+	for (i = 1; i < (unsigned)argc; i += 2) {
+
+		if (i + 1 >= (unsigned)argc)
+			usage_error();
+
+		if (strcmp(argv[i], "-c") == 0) {
+			cache = parse_size_or_dev(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "-m") == 0) {
+			metadata = parse_size_or_dev(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "-o") == 0) {
+			origin = parse_size_or_dev(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "-a") == 0) {
+			if (zc_size_parse(argv[i + 1], &alignment) < 0)
+				exit(EXIT_FAILURE);
+		}
+		else if (strcmp(argv[i], "-b") == 0 &&
+				nr_block_sizes < ZC_PLAN_MAX_BLOCK_SIZES) {
+			if (zc_block_size_parse(argv[i + 1],
+					&block_sizes[nr_block_sizes++]) < 0)
+				exit(EXIT_FAILURE);
+		}
+		else {
+			usage_error();
+		}
+	}
+
+	if (cache <= alignment || (metadata != 0 && metadata <= alignment) ||
+			(origin != 0 && origin <= alignment))
+		usage_error();
+
+	/* Default candidates: 32KiB - 2MiB */
+	if (nr_block_sizes == 0) {
+		for (; nr_block_sizes < 7; ++nr_block_sizes)
+			block_sizes[nr_block_sizes] = 32768 << nr_block_sizes;
+	}
+
+	/* Errors just mean that a candidate doesn't work */
+	if ((ctx = zc_ctx_new()) == NULL) {
+		perror("zc_ctx_new");
+		exit(EXIT_FAILURE);
+	}
+
+	zc_ctx_set_log_fn(ctx, 0);
+	setlocale(LC_NUMERIC, "");
+
+	printf("%-10s %2s %14s %14s %14s %14s %14s\n", "BLOCK_SIZE", "MD",
+	       "BLOCKS", "CACHE_KiB", "MD_NEEDED_KiB", "MD_UNUSED_KiB",
+	       "KERNEL_KiB");
+
+	for (i = 0; i < nr_block_sizes; ++i) {
+
+		for (version = 1; version <= 2; ++version) {
+
+			char buf[ZC_SIZE_BUF_SIZE];
+
+			memset(&plan, 0, sizeof plan);
+			plan.origin_size = origin ? origin - alignment : 0;
+			plan.cache_size = cache - alignment;
+			plan.md_avail = metadata ? metadata - alignment : 0;
+			plan.block_size = block_sizes[i];
+			plan.alignment = alignment;
+			plan.md_version = version;
+			plan.hint_size = ZC_PLAN_SMQ_HINT;
+
+			printf("%-10s %2u", zc_size_format_r(block_sizes[i], 0,
+							     buf), version);
+
+			if (zc_plan(ctx, &plan) < 0) {
+				puts("    (not possible)");
+				continue;
+			}
+
+			printf(" %'14" PRIu64, plan.nr_blocks);
+			print_kib(plan.c_size);
+			print_kib(plan.md_needed);
+			print_kib(plan.md_wasted);
+			print_kib(plan.kmem_cache + plan.kmem_policy);
+			putchar('\n');
+		}
+	}
+
+	zc_ctx_free(ctx);
+
+	return 0;
+}
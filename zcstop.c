@@ -0,0 +1,110 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+#define DEVICE_PREFIX	"zodcache-device-"
+
+static int stop_all(void)
+{
+	struct dm_names *names;
+	struct dm_task *task;
+	unsigned next;
+	int ret;
+
+	if (		!(task = dm_task_create(DM_DEVICE_LIST))	||
+
+			!dm_task_run(task)				||
+
+			!(names = dm_task_get_names(task))		) {
+
+		zc_err(LOG_ERR, "Failed to list device mapper devices\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = 0;
+
+	if (names->dev == 0) {
+		dm_task_destroy(task);
+		return 0;
+	}
+
+	do {
+		if (strncmp(names->name, DEVICE_PREFIX,
+			    sizeof DEVICE_PREFIX - 1) == 0) {
+
+			if (zc_set_stop(names->name + sizeof DEVICE_PREFIX - 1,
+						/* mark_clean = */ 1) < 0)
+				ret = -1;
+		}
+
+		next = names->next;
+		names = (struct dm_names *)((char *)names + next);
+
+	} while (next != 0);
+
+	dm_task_destroy(task);
+	return ret;
+}
+
+static void libdm_log_fn(const int level __attribute__((unused)),
+			 const char *const file __attribute__((unused)),
+			 const int line __attribute__((unused)),
+			 const int dm_errno_or_class __attribute__((unused)),
+			 const char *const format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vsyslog(LOG_PRI(level), format, ap);
+	va_end(ap);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s {--all | UUID ...}\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Usually run from a shutdown hook, with no one watching stderr */
+	openlog("zcstop", LOG_PID | LOG_PERROR, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_INFO));
+	zc_err_set_fn(vsyslog);
+	dm_log_with_errno_init(libdm_log_fn);
+	dm_udev_set_sync_support(1);
+
+	if (argc == 2 && strcmp(argv[1], "--all") == 0)
+		return stop_all() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	for (ret = EXIT_SUCCESS, i = 1; i < argc; ++i) {
+		if (zc_set_stop(argv[i], /* mark_clean = */ 1) < 0)
+			ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
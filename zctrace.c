@@ -0,0 +1,836 @@
+/*
+ * Copyright 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Captures the I/O on a set's device into a compact trace log (see
+ * zc_trace_hdr in zodcache.h), using the kernel's blktrace interface.
+ *
+ * Only queue and completion events are traced, for the set's device and its
+ * origin component, so the kernel does little work per I/O.  A thread per CPU
+ * drains that CPU's relay buffers into a bounded ring; the main thread merges
+ * the rings every TRACE_TICK_MS, matches completions to queued I/Os and
+ * writes the records.  Anything that doesn't fit in a ring (or in the table
+ * of in-flight I/Os) is counted as lost, rather than slowing the I/O down.
+ *
+ * An I/O is a miss if the origin saw I/O to the same cache block while it was
+ * in flight (a promotion or a remapped read/write), otherwise a hit.
+ *
+ * Requires debugfs at /sys/kernel/debug.
+ */
+
+#define _GNU_SOURCE
+
+#include <linux/blktrace_api.h>
+#include <sys/sysinfo.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <poll.h>
+#include <time.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+#define TRACE_DEV_SET		0
+#define TRACE_DEV_ORIGIN	1
+#define TRACE_NR_DEVS		2
+
+#define TRACE_RING_SIZE		16384		/* events per CPU */
+#define TRACE_READ_SIZE		65536
+#define TRACE_TICK_MS		100
+#define TRACE_FLUSH_TICKS	10
+#define TRACE_INFLIGHT_MAX	65536
+#define TRACE_BUCKETS		16384
+#define TRACE_EXPIRE_NS		60000000000ull	/* completion never seen */
+#define TRACE_DEFAULT_BUF_SIZE	(512 * 1024)
+#define TRACE_DEFAULT_NR_BUFS	4
+
+#define TRACE_EV_QUEUE		0
+#define TRACE_EV_COMPLETE	1
+
+struct trace_event {
+	uint64_t		time;
+	uint64_t		sector;
+	uint32_t		sectors;
+	uint8_t			dev;
+	uint8_t			type;
+	uint8_t			op;
+};
+
+/* Single producer (the CPU's reader thread), single consumer */
+struct trace_cpu {
+	pthread_t		tid;
+	unsigned		cpu;
+	int			fds[TRACE_NR_DEVS];
+	struct trace_event	ring[TRACE_RING_SIZE];
+	unsigned		head;		/* written by reader */
+	unsigned		tail;		/* written by main thread */
+	uint64_t		lost;
+};
+
+struct trace_io {
+	uint64_t		time;
+	uint64_t		sector;
+	uint32_t		sectors;
+	uint8_t			op;
+	_Bool			miss;
+	int			next;
+};
+
+struct trace_dev {
+	const char		*type;
+	char			*path;
+	int			fd;
+	char			name[BLKTRACE_BDEV_SIZE];
+};
+
+static const char *progname;
+static volatile sig_atomic_t stop;
+static volatile int readers_stop;
+
+static struct trace_dev devs[TRACE_NR_DEVS] = {
+	{ .type = "device", .fd = -1 },
+	{ .type = "origin", .fd = -1 },
+};
+
+/* In-flight I/Os on the set's device, hashed by cache block */
+static struct trace_io ios[TRACE_INFLIGHT_MAX];
+static int buckets[TRACE_BUCKETS];
+static int free_ios;
+static uint64_t block_size, ios_lost, ring_lost;
+
+/* The log */
+static struct zc_trace_hdr hdr;
+static uint8_t frame_buf[ZC_TRACE_FRAME_SIZE] __attribute__((aligned(8)));
+static struct zc_trace_frame *const frame = (void *)frame_buf;
+static uint64_t frame_nr, prev_time, prev_sector, base_time;
+static int out_fd;
+
+static void usage_error(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-o FILE] [-t SECONDS] [-b BUF_SIZE] [-n NR_BUFS] "
+								"UUID\n"
+		"       %s --dump FILE [FRAME]\n",
+		progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+static void stop_handler(const int signum __attribute__((unused)))
+{
+	stop = 1;
+}
+
+static const char *option_value(const int argc, char *argv[], const int i)
+{
+	if (i + 1 >= argc) {
+		fprintf(stderr, "Option %s requires a value\n", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+
+	return argv[i + 1];
+}
+
+static uint64_t parse_u64(const char *const s, const char *const what,
+			  const uint64_t min, const uint64_t max)
+{
+	unsigned long long value;
+	char *endptr;
+
+	errno = 0;
+	value = strtoull(s, &endptr, 10);
+	if (errno != 0 || endptr == s || *endptr != 0 || *s == '-' ||
+						value < min || value > max) {
+		fprintf(stderr, "Invalid %s: %s (must be %" PRIu64 "-%" PRIu64
+			")\n", what, s, min, max);
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
+static uint64_t clock_ns(const clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Log output
+ */
+
+static void out_write(const void *const buf, const size_t size,
+		      const off_t offset)
+{
+	if (pwrite(out_fd, buf, size, offset) != (ssize_t)size) {
+		perror("write");
+		stop = 1;
+	}
+}
+
+static void frame_reset(void)
+{
+	memset(frame_buf, 0, sizeof frame_buf);
+	frame->time = prev_time;
+	frame->sector = prev_sector;
+}
+
+/* A partial frame is rewritten in place until it is full */
+static void frame_flush(void)
+{
+	out_write(frame_buf, sizeof frame_buf,
+		  ZC_TRACE_HDR_SIZE + frame_nr * ZC_TRACE_FRAME_SIZE);
+	hdr.lost = ios_lost + ring_lost;
+	out_write(&hdr, sizeof hdr, 0);
+}
+
+static uint8_t *varint_put(uint8_t *p, uint64_t value)
+{
+	while (value >= 0x80) {
+		*p++ = value | 0x80;
+		value >>= 7;
+	}
+
+	*p++ = value;
+	return p;
+}
+
+static uint64_t zigzag(const uint64_t value, const uint64_t base)
+{
+	int64_t d = value - base;
+
+	return ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+}
+
+static void record_write(const struct trace_io *const io,
+			 const uint64_t latency)
+{
+	uint8_t buf[40], *p;
+	unsigned cache;
+	uint64_t time;
+
+	if (io->miss)
+		cache = ZC_TRACE_MISS;
+	else if (io->op == ZC_TRACE_OP_READ || io->op == ZC_TRACE_OP_WRITE)
+		cache = ZC_TRACE_HIT;
+	else
+		cache = ZC_TRACE_UNKNOWN;
+
+	time = io->time - base_time;
+
+	p = varint_put(buf, zigzag(time, prev_time));
+	p = varint_put(p, zigzag(io->sector, prev_sector));
+	p = varint_put(p, (uint64_t)io->sectors << 4 | cache << 2 | io->op);
+	p = varint_put(p, latency / 1000);
+
+	if (sizeof *frame + frame->size + (p - buf) > sizeof frame_buf) {
+		frame_flush();
+		++frame_nr;
+		frame_reset();
+	}
+
+	memcpy(frame_buf + sizeof *frame + frame->size, buf, p - buf);
+	frame->size += p - buf;
+	++frame->nr_records;
+
+	prev_time = time;
+	prev_sector = io->sector + io->sectors;
+}
+
+/*
+ * In-flight I/Os
+ */
+
+static void ios_init(void)
+{
+	int i;
+
+	for (i = 0; i < TRACE_BUCKETS; ++i)
+		buckets[i] = -1;
+
+	for (i = 0; i < TRACE_INFLIGHT_MAX; ++i)
+		ios[i].next = i + 1 < TRACE_INFLIGHT_MAX ? i + 1 : -1;
+
+	free_ios = 0;
+}
+
+static int *bucket(const uint64_t sector)
+{
+	return buckets + (sector / block_size) % TRACE_BUCKETS;
+}
+
+static void io_queued(const struct trace_event *const ev)
+{
+	struct trace_io *io;
+	int *b;
+
+	if (free_ios < 0) {
+		++ios_lost;
+		return;
+	}
+
+	io = ios + free_ios;
+	free_ios = io->next;
+
+	io->time = ev->time;
+	io->sector = ev->sector;
+	io->sectors = ev->sectors;
+	io->op = ev->op;
+	io->miss = 0;
+
+	b = bucket(ev->sector);
+	io->next = *b;
+	*b = io - ios;
+}
+
+static void io_unlink(int *const link)
+{
+	int i;
+
+	i = *link;
+	*link = ios[i].next;
+	ios[i].next = free_ios;
+	free_ios = i;
+}
+
+static void io_completed(const struct trace_event *const ev)
+{
+	int *link;
+
+	for (link = bucket(ev->sector); *link >= 0; link = &ios[*link].next) {
+		if (ios[*link].sector == ev->sector) {
+			record_write(ios + *link, ev->time - ios[*link].time);
+			io_unlink(link);
+			return;
+		}
+	}
+}
+
+static void origin_queued(const struct trace_event *const ev)
+{
+	uint64_t start, end, block;
+	struct trace_io *io;
+	int i;
+
+	if (ev->sectors == 0)
+		return;
+
+	start = ev->sector / block_size;
+	end = (ev->sector + ev->sectors - 1) / block_size;
+	if (end - start >= TRACE_BUCKETS)
+		end = start + TRACE_BUCKETS - 1;
+
+	for (block = start; block <= end; ++block) {
+		for (i = buckets[block % TRACE_BUCKETS]; i >= 0; i = io->next) {
+			io = ios + i;
+			if (io->sector < ev->sector + ev->sectors &&
+					ev->sector < io->sector + io->sectors)
+				io->miss = 1;
+		}
+	}
+}
+
+/* Also writes everything when the capture ends (now == UINT64_MAX) */
+static void ios_expire(const uint64_t now)
+{
+	uint64_t cutoff;
+	unsigned i;
+	int *link;
+
+	cutoff = (now == UINT64_MAX) ? UINT64_MAX : now - TRACE_EXPIRE_NS;
+
+	for (i = 0; i < TRACE_BUCKETS; ++i) {
+
+		link = buckets + i;
+
+		while (*link >= 0) {
+			if (ios[*link].time < cutoff) {
+				record_write(ios + *link, 0);
+				io_unlink(link);
+			}
+			else {
+				link = &ios[*link].next;
+			}
+		}
+	}
+}
+
+/*
+ * Capture
+ */
+
+static void dev_open(const char *const uuid, struct trace_dev *const dev,
+		     const uint16_t act_mask, const uint32_t buf_size,
+		     const uint32_t nr_bufs)
+{
+	struct blk_user_trace_setup buts;
+
+	dev->path = zc_asprintf("/dev/mapper/zodcache-%s-%s", dev->type, uuid);
+
+	if ((dev->fd = open(dev->path, O_RDONLY | O_CLOEXEC)) < 0) {
+		perror(dev->path);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&buts, 0, sizeof buts);
+	buts.act_mask = act_mask;
+	buts.buf_size = buf_size;
+	buts.buf_nr = nr_bufs;
+
+	if (ioctl(dev->fd, BLKTRACESETUP, &buts) < 0) {
+		fprintf(stderr, "%s: BLKTRACESETUP: %m%s\n", dev->path,
+			errno == EBUSY ? " (already being traced?)" : "");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(dev->name, buts.name, sizeof dev->name);
+}
+
+/* Also called at exit, so a failed capture doesn't leave a trace set up */
+static void devs_close(void)
+{
+	unsigned i;
+
+	for (i = 0; i < TRACE_NR_DEVS; ++i) {
+
+		if (devs[i].fd < 0)
+			continue;
+
+		ioctl(devs[i].fd, BLKTRACESTOP);
+		ioctl(devs[i].fd, BLKTRACETEARDOWN);
+		close(devs[i].fd);
+		devs[i].fd = -1;
+	}
+}
+
+static void cpu_event(struct trace_cpu *const c, const unsigned dev,
+		      const struct blk_io_trace *const t)
+{
+	struct trace_event *ev;
+	unsigned action;
+
+	action = t->action & 0xffff;
+
+	if (!(action == __BLK_TA_QUEUE ||
+			(action == __BLK_TA_COMPLETE && dev == TRACE_DEV_SET)))
+		return;
+
+	if (c->head - __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) ==
+							TRACE_RING_SIZE) {
+		__atomic_fetch_add(&c->lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ev = c->ring + c->head % TRACE_RING_SIZE;
+	ev->time = t->time;
+	ev->sector = t->sector;
+	ev->sectors = t->bytes >> 9;
+	ev->dev = dev;
+	ev->type = (action == __BLK_TA_QUEUE) ? TRACE_EV_QUEUE
+					      : TRACE_EV_COMPLETE;
+
+	if (t->action & BLK_TC_ACT(BLK_TC_DISCARD))
+		ev->op = ZC_TRACE_OP_DISCARD;
+	else if (t->action & BLK_TC_ACT(BLK_TC_WRITE))
+		ev->op = (t->bytes == 0) ? ZC_TRACE_OP_FLUSH
+					 : ZC_TRACE_OP_WRITE;
+	else
+		ev->op = ZC_TRACE_OP_READ;
+
+	__atomic_store_n(&c->head, c->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the number of bytes left over (a partial event) */
+static size_t cpu_parse(struct trace_cpu *const c, const unsigned dev,
+			const uint8_t *buf, size_t len)
+{
+	struct blk_io_trace t;
+	size_t size;
+
+	while (len >= sizeof t) {
+
+		memcpy(&t, buf, sizeof t);
+
+		if ((t.magic & 0xffffff00) != BLK_IO_TRACE_MAGIC) {
+			fprintf(stderr, "%s: bad trace data (CPU %u)\n",
+				devs[dev].path, c->cpu);
+			stop = 1;
+			return 0;
+		}
+
+		size = sizeof t + t.pdu_len;
+		if (len < size)
+			break;
+
+		cpu_event(c, dev, &t);
+		buf += size;
+		len -= size;
+	}
+
+	return len;
+}
+
+static void *cpu_reader(void *const arg)
+{
+	struct trace_cpu *const c = arg;
+	struct pollfd pfds[TRACE_NR_DEVS];
+	size_t lens[TRACE_NR_DEVS], left;
+	uint8_t *bufs[TRACE_NR_DEVS];
+	_Bool got;
+	ssize_t n;
+	unsigned i;
+
+	for (i = 0; i < TRACE_NR_DEVS; ++i) {
+		bufs[i] = malloc(TRACE_READ_SIZE);
+		lens[i] = 0;
+		pfds[i].fd = c->fds[i];
+		pfds[i].events = POLLIN;
+	}
+
+	/* After the trace stops, keep going until the buffers are empty */
+	do {
+		got = 0;
+
+		if (!readers_stop)
+			poll(pfds, TRACE_NR_DEVS, TRACE_TICK_MS);
+
+		for (i = 0; i < TRACE_NR_DEVS; ++i) {
+
+			n = read(c->fds[i], bufs[i] + lens[i],
+				 TRACE_READ_SIZE - lens[i]);
+			if (n <= 0)
+				continue;
+
+			got = 1;
+			left = cpu_parse(c, i, bufs[i], lens[i] + n);
+			memmove(bufs[i], bufs[i] + lens[i] + n - left, left);
+			lens[i] = left;
+		}
+
+	} while (!readers_stop || got);
+
+	for (i = 0; i < TRACE_NR_DEVS; ++i)
+		free(bufs[i]);
+
+	return NULL;
+}
+
+static int event_cmp(const void *const a, const void *const b)
+{
+	const struct trace_event *x = a, *y = b;
+
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+/* Merges the CPUs' rings; events are only ordered within a tick's batch */
+static void cpus_drain(struct trace_cpu *const cpus, const unsigned nr_cpus,
+		       struct trace_event *const batch)
+{
+	const struct trace_event *ev;
+	unsigned i, head, tail, n;
+
+	for (n = 0, i = 0; i < nr_cpus; ++i) {
+
+		head = __atomic_load_n(&cpus[i].head, __ATOMIC_ACQUIRE);
+
+		for (tail = cpus[i].tail; tail != head; ++tail)
+			batch[n++] = cpus[i].ring[tail % TRACE_RING_SIZE];
+
+		__atomic_store_n(&cpus[i].tail, tail, __ATOMIC_RELEASE);
+		ring_lost += __atomic_exchange_n(&cpus[i].lost, 0,
+						 __ATOMIC_RELAXED);
+	}
+
+	qsort(batch, n, sizeof *batch, event_cmp);
+
+	for (i = 0; i < n; ++i) {
+
+		ev = batch + i;
+
+		if (ev->dev == TRACE_DEV_ORIGIN)
+			origin_queued(ev);
+		else if (ev->type == TRACE_EV_QUEUE)
+			io_queued(ev);
+		else
+			io_completed(ev);
+	}
+}
+
+static void cpus_start(struct trace_cpu *const cpus, const unsigned nr_cpus)
+{
+	sigset_t mask, old;
+	unsigned i, d;
+	char *path;
+	int ret;
+
+	/* Only the main thread gets signals */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+	for (i = 0; i < nr_cpus; ++i) {
+
+		cpus[i].cpu = i;
+
+		for (d = 0; d < TRACE_NR_DEVS; ++d) {
+
+			path = zc_asprintf("/sys/kernel/debug/block/%s/trace%u",
+					   devs[d].name, i);
+			cpus[i].fds[d] = open(path, O_RDONLY | O_NONBLOCK |
+							O_CLOEXEC);
+			if (cpus[i].fds[d] < 0) {
+				fprintf(stderr, "%s: %m (is debugfs mounted?)"
+					"\n", path);
+				exit(EXIT_FAILURE);
+			}
+
+			free(path);
+		}
+
+		if ((ret = pthread_create(&cpus[i].tid, NULL, cpu_reader,
+					  cpus + i)) != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void cpus_stop(struct trace_cpu *const cpus, const unsigned nr_cpus)
+{
+	unsigned i, d;
+
+	readers_stop = 1;
+
+	for (i = 0; i < nr_cpus; ++i) {
+		pthread_join(cpus[i].tid, NULL);
+		for (d = 0; d < TRACE_NR_DEVS; ++d)
+			close(cpus[i].fds[d]);
+	}
+}
+
+static int capture(int argc, char *argv[])
+{
+	struct sigaction sa = { .sa_handler = stop_handler };
+	uint64_t limit, ticks, buf_size, nr_bufs, mono;
+	struct zc_cache_status status;
+	struct trace_event *batch;
+	struct trace_cpu *cpus;
+	const char *uuid, *file;
+	unsigned nr_cpus, i;
+	char *target, *path;
+	int k;
+
+	file = NULL;
+	limit = 0;
+	buf_size = TRACE_DEFAULT_BUF_SIZE;
+	nr_bufs = TRACE_DEFAULT_NR_BUFS;
+
+	for (k = 1; k < argc - 1; ++k) {
+
+		if (strcmp(argv[k], "-o") == 0) {
+			file = option_value(argc, argv, k++);
+		}
+		else if (strcmp(argv[k], "-t") == 0) {
+			limit = parse_u64(option_value(argc, argv, k++),
+					  "time limit", 1, UINT32_MAX);
+		}
+		else if (strcmp(argv[k], "-b") == 0) {
+			if (zc_size_parse(option_value(argc, argv, k++),
+					  &buf_size) < 0)
+				exit(EXIT_FAILURE);
+			if (buf_size < 4096 || buf_size > 64 * 1024 * 1024)
+				usage_error();
+		}
+		else if (strcmp(argv[k], "-n") == 0) {
+			nr_bufs = parse_u64(option_value(argc, argv, k++),
+					    "buffer count", 2, 64);
+		}
+		else {
+			usage_error();
+		}
+	}
+
+	if (k != argc - 1)
+		usage_error();
+
+	uuid = argv[k];
+
+	target = zc_cache_target(uuid);
+	if (zc_dm_cache_status(target, &status) < 0)
+		exit(EXIT_FAILURE);
+	free(target);
+
+	block_size = status.block_size;
+	ios_init();
+
+	path = (file == NULL) ? zc_asprintf("%s.zct", uuid) : NULL;
+	if ((out_fd = open(file ? file : path, O_WRONLY | O_CREAT | O_TRUNC |
+							O_CLOEXEC, 0644)) < 0) {
+		perror(file ? file : path);
+		exit(EXIT_FAILURE);
+	}
+
+	nr_cpus = get_nprocs_conf();
+	cpus = calloc(nr_cpus, sizeof *cpus);
+	batch = malloc(nr_cpus * TRACE_RING_SIZE * sizeof *batch);
+	if (cpus == NULL || batch == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	atexit(devs_close);
+	dev_open(uuid, devs + TRACE_DEV_SET, BLK_TC_QUEUE | BLK_TC_COMPLETE,
+		 buf_size, nr_bufs);
+	dev_open(uuid, devs + TRACE_DEV_ORIGIN, BLK_TC_QUEUE, buf_size,
+		 nr_bufs);
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.magic = ZC_TRACE_MAGIC;
+	hdr.version = ZC_TRACE_VERSION;
+	snprintf(hdr.uuid, sizeof hdr.uuid, "%s", uuid);
+	hdr.block_size = block_size;
+	hdr.frame_size = ZC_TRACE_FRAME_SIZE;
+
+	/* blktrace timestamps are CLOCK_MONOTONIC */
+	mono = clock_ns(CLOCK_MONOTONIC);
+	hdr.start = clock_ns(CLOCK_REALTIME);
+	base_time = mono;
+	frame_reset();
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	cpus_start(cpus, nr_cpus);
+
+	for (i = 0; i < TRACE_NR_DEVS; ++i) {
+		if (ioctl(devs[i].fd, BLKTRACESTART) < 0) {
+			perror("BLKTRACESTART");
+			stop = 1;
+		}
+	}
+
+	fprintf(stderr, "Tracing %s; interrupt to stop\n", uuid);
+
+	for (ticks = 1; !stop; ++ticks) {
+
+		usleep(TRACE_TICK_MS * 1000);
+		cpus_drain(cpus, nr_cpus, batch);
+
+		if (ticks % TRACE_FLUSH_TICKS == 0) {
+			ios_expire(clock_ns(CLOCK_MONOTONIC));
+			frame_flush();
+		}
+
+		if (limit != 0 && ticks * TRACE_TICK_MS >= limit * 1000)
+			break;
+	}
+
+	for (i = 0; i < TRACE_NR_DEVS; ++i)
+		ioctl(devs[i].fd, BLKTRACESTOP);
+
+	cpus_stop(cpus, nr_cpus);
+	cpus_drain(cpus, nr_cpus, batch);
+	ios_expire(UINT64_MAX);
+	frame_flush();
+
+	devs_close();
+
+	if (close(out_fd) < 0) {
+		perror("close");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stderr, "%" PRIu64 " frame(s), %" PRIu64 " event(s) lost\n",
+		frame_nr + (frame->nr_records != 0), hdr.lost);
+
+	free(path);
+	free(batch);
+	free(cpus);
+	return 0;
+}
+
+/*
+ * Dump
+ */
+
+static const char *const op_names[] = { "R", "W", "D", "F" };
+static const char *const cache_names[] = { "-", "hit", "miss", "?" };
+
+static int dump(int argc, char *argv[])
+{
+	uint64_t nr, hits, misses;
+	struct zc_trace_rec rec;
+	struct zc_trace t;
+	int ret;
+
+	if (argc < 3 || argc > 4)
+		usage_error();
+
+	if (zc_trace_open(NULL, argv[2], &t) < 0)
+		exit(EXIT_FAILURE);
+
+	if (argc == 4 && zc_trace_seek(&t, parse_u64(argv[3], "frame", 0,
+						     t.nr_frames)) < 0)
+		exit(EXIT_FAILURE);
+
+	printf("# %s, block size %" PRIu64 " sectors, started %" PRIu64
+	       ".%09" PRIu64 "\n", t.hdr->uuid, t.hdr->block_size,
+	       t.hdr->start / 1000000000, t.hdr->start % 1000000000);
+	printf("%-18s %14s %8s %2s %4s %10s\n", "# TIME", "SECTOR", "SECTORS",
+	       "OP", "", "LATENCY_US");
+
+	nr = hits = misses = 0;
+
+	while ((ret = zc_trace_next(&t, &rec)) > 0) {
+
+		printf("%8" PRIu64 ".%09" PRIu64 " %14" PRIu64 " %8" PRIu32
+		       " %2s %4s %10" PRIu32 "\n", rec.time / 1000000000,
+		       rec.time % 1000000000, rec.sector, rec.sectors,
+		       op_names[rec.op], cache_names[rec.cache], rec.latency);
+
+		++nr;
+		hits += (rec.cache == ZC_TRACE_HIT);
+		misses += (rec.cache == ZC_TRACE_MISS);
+	}
+
+	printf("# %" PRIu64 " record(s), %" PRIu64 " hit(s), %" PRIu64
+	       " miss(es), %" PRIu64 " event(s) lost\n", nr, hits, misses,
+	       t.hdr->lost);
+
+	zc_trace_close(&t);
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	progname = argv[0];
+
+	if (argc >= 2 && strcmp(argv[1], "--dump") == 0)
+		return dump(argc, argv);
+
+	return capture(argc, argv);
+}
@@ -0,0 +1,9 @@
+#!/bin/sh
+
+#
+# Runs after the root filesystem has been unmounted.  Stopping the sets here
+# commits the cache metadata & policy hints and records a clean shutdown, so
+# zcstart can skip the metadata check at the next boot.
+#
+
+zcstop --all
@@ -0,0 +1,22 @@
+#!/bin/sh
+
+#
+# initqueue/finished hook.  A set whose origin holds a thin pool's data device
+# is marked "thin" in its registry file as soon as any of its members arrives;
+# zcstart activates the pool once the set has been assembled.  Until then,
+# hold off the end of the initqueue, so that boot doesn't carry on without the
+# pool -- but only for the first half of dracut's timeout (rd.retry), so that
+# a set that never completes doesn't end in the emergency shell.
+#
+
+if [ "${main_loop:-0}" -ge $(( ${RDRETRY:-360} / 2 )) ]; then
+    exit 0
+fi
+
+for f in /run/zodcache/*.members; do
+    [ -e "$f" ] || continue
+    grep -qx thin "$f" || continue
+    grep -qx assembled "$f" || exit 1
+done
+
+exit 0
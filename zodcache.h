@@ -17,6 +17,7 @@
 #ifndef ZC_ZODCACHE_H
 #define ZC_ZODCACHE_H
 
+#include <sys/types.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdarg.h>
@@ -24,6 +25,10 @@
 #define ZC_SB_MAGIC		0x20DCAC8E8EACDC20l
 #define ZC_UUID_BUF_SIZE	(sizeof "00000000-0000-0000-0000-000000000000")
 
+/* Runtime state (tmpfs) */
+#define ZC_RUN_DIR		"/run/zodcache"
+#define ZC_DAEMON_SOCKET	ZC_RUN_DIR "/zodcached.sock"
+
 /* These are used as array indices, so keep 'em zero-based and contiguous */
 #define ZC_SB_TYPE_ORIGIN	0
 #define ZC_SB_TYPE_CACHE	1
@@ -66,13 +71,311 @@ _Static_assert(sizeof(struct zc_sb_v0) ==
 			offsetof(struct zc_sb_v0, md_size) + sizeof(uint64_t),
 	       "Unexpected padding in struct zc_sb_v0");
 
-/* Callback type for zc_block_size_check() and zc_sb_v0_check() */
-typedef _Bool (*issue_cb_t)(char *issue, void *context);
+/*
+ * zodcache superblock extension
+ *
+ * Stored in the otherwise unused space that follows the superblock (at
+ * ZC_SB_EXT_OFFSET).  Set-wide state is kept in the extension of the component
+ * device that holds the dm-cache metadata (the metadata device or the
+ * combined cache device).  Devices formatted by older versions of mkzc have no
+ * extension; zc_sb_ext_read() returns an all-zero extension for them, which
+ * zc_sb_ext_write() will happily write back.
+ *
+ * The size field allows new fields to be appended; fields not present in an
+ * older on-disk extension are read as zero.  Same endianness rules as the
+ * superblock.
+ */
+#define ZC_SB_EXT_STATS_BOUNDS	8	/* latency histogram boundaries */
+#define ZC_SB_EXT_MAX_ZONES	16	/* uncached origin zones */
+
+#define ZC_SB_EXT_MAX_PINS	8	/* pinned extents */
+
+#define ZC_SB_EXT_CRYPT_CIPHER_SIZE	64	/* dm-crypt strings */
+#define ZC_SB_EXT_CRYPT_KEY_SIZE	192
+#define ZC_SB_EXT_THIN_POOL_SIZE	128
+
+/* Origin range that bypasses the cache (sectors, block-aligned) */
+struct zc_sb_zone {
+	uint64_t	start;
+	uint64_t	len;
+};
+
+/* Origin range that is kept in the pin area of the cache device (sectors) */
+struct zc_sb_pin {
+	uint64_t	start;
+	uint64_t	len;
+	uint64_t	offset;		/* in the pin area */
+	uint64_t	state;		/* ZC_PIN_* */
+};
+
+/* Pin states; the copy of a PENDING pin on the origin is authoritative */
+#define ZC_PIN_PENDING		0	/* being copied to the pin area */
+#define ZC_PIN_RESIDENT		1	/* mapped to the pin area */
+#define ZC_PIN_UNPINNING	2	/* being copied back to the origin */
+
+struct zc_sb_ext {
+	uint64_t	magic;
+	uint64_t	cksum;
+	uint64_t	size;
+	uint64_t	flags;
+	uint64_t	generation;
+	uint64_t	stats_areas;		/* 0 = no dm-stats regions */
+	uint64_t	stats_bounds[ZC_SB_EXT_STATS_BOUNDS];	/* ns */
+	uint64_t	ctl_target;		/* origin p99 (ns); 0 = off */
+	uint64_t	ctl_min_threshold;	/* sectors; 0 = default */
+	uint64_t	ctl_max_threshold;
+	uint64_t	budget_daily;		/* cache bytes/day; 0 = off */
+	uint64_t	budget_tbw;		/* rated endurance (bytes) */
+	uint64_t	budget_fallback;	/* ZC_SB_MODE_* when exhausted */
+	uint64_t	budget_start;		/* days since the epoch (UTC) */
+	uint64_t	budget_day;		/* day of budget_used */
+	uint64_t	budget_used;		/* bytes written on budget_day */
+	uint64_t	budget_total;		/* bytes written since start */
+	uint64_t	zones_count;
+	struct zc_sb_zone	zones[ZC_SB_EXT_MAX_ZONES];	/* sorted */
+	uint64_t	pin_offset;		/* on the cache member (sectors) */
+	uint64_t	pin_size;		/* sectors; 0 = no pin area */
+	uint64_t	pin_rate;		/* copy rate (KiB/s); 0 = no limit */
+	uint64_t	pins_count;
+	struct zc_sb_pin	pins[ZC_SB_EXT_MAX_PINS];	/* sorted */
+	uint64_t	era_offset;		/* on the metadata member (sectors) */
+	uint64_t	era_size;		/* sectors */
+	uint64_t	era_block_size;		/* sectors; 0 = no dm-era */
+	uint64_t	era_base;		/* added to the kernel's era */
+	uint64_t	era_issued;		/* highest era reported to users */
+	uint64_t	o_reloc;		/* origin member only; see below */
+	uint64_t	tune_read_ahead;	/* set device (KiB); ZC_TUNE_* */
+	uint64_t	tune_max_sectors[2];	/* origin, cache (KiB) */
+	uint64_t	tune_nr_requests[2];
+	uint64_t	tune_scheduler[2];	/* ZC_SCHED_* */
+	uint64_t	health_action;		/* ZC_HEALTH_*; 0 = off */
+	uint64_t	health_latency;		/* cache limit (ns); 0 = origin */
+	uint64_t	health_trip;		/* intervals; 0 = default */
+	uint64_t	health_recover;
+	uint64_t	scrub_next;		/* cache block to resume from */
+	uint64_t	scrub_done;		/* end of last full pass (time) */
+	uint64_t	scrub_found;		/* mismatches in current pass */
+	uint64_t	crypt_key_size;		/* bytes */
+	uint64_t	crypt_sector_size;	/* bytes; 0 = 512 */
+	char		crypt_cipher[ZC_SB_EXT_CRYPT_CIPHER_SIZE];
+	char		crypt_key[ZC_SB_EXT_CRYPT_KEY_SIZE];
+	char		o_thin_pool[ZC_SB_EXT_THIN_POOL_SIZE];	/* VG/LV */
+};
+
+/*
+ * A converted origin device (see zcconvert) may keep its data in place, with
+ * the first o_offset bytes, which the superblock displaced, at o_reloc (bytes)
+ * instead.  Origin sector n is then at device sector n (or o_reloc/512 + n),
+ * rather than o_offset/512 + n.  Recorded in the origin's own extension.
+ */
+
+/*
+ * A set with a cipher gets a dm-crypt device (zodcache-crypt-<uuid>) on top of
+ * its device, so the cache only ever holds ciphertext.  crypt_key is the
+ * absolute path of a key file, or a kernel keyring key (TYPE:DESCRIPTION) that
+ * zcstart can find.  The strings are NUL-terminated, and are stored as they
+ * are, rather than in 64-bit chunks.
+ */
+#define ZC_CRYPT_DEFAULT_CIPHER	"aes-xts-plain64"
+#define ZC_CRYPT_MAX_KEY_SIZE	128		/* bytes */
+
+/*
+ * An origin that holds an LVM thin pool's data device (as a PV) records the
+ * pool (VG/LV) in o_thin_pool, in its own extension.  zcstart activates the
+ * pool once the set has been assembled, and the registry marks the set while
+ * it is being assembled, so that pool activation at boot waits for the cache
+ * (see zodcache-thin.sh).  Stored like the crypt strings.  Every member's
+ * extension has ZC_SB_EXT_THIN set, so the set is marked by whichever member
+ * arrives first; that is all a separate cache device's extension holds.
+ */
+
+/*
+ * Queue settings applied when the set is assembled (see tune.c).  0 derives a
+ * value from the block size & the rotational flag of the device; KEEP leaves
+ * the kernel's setting alone.
+ */
+#define ZC_TUNE_AUTO		0
+#define ZC_TUNE_KEEP		UINT64_MAX
+
+#define ZC_SCHED_NONE		1	/* or noop */
+#define ZC_SCHED_DEADLINE	2	/* or mq-deadline */
+#define ZC_SCHED_BFQ		3
+#define ZC_SCHED_KYBER		4
+#define ZC_SCHED_CFQ		5
+
+/*
+ * What zodcached's health monitor (see health.c) does when the cache fails,
+ * becomes read-only or needs a check, or when it is slower than its limit.
+ */
+#define ZC_HEALTH_OFF		0
+#define ZC_HEALTH_ALERT		1	/* log only */
+#define ZC_HEALTH_PASSTHROUGH	2	/* bypass the cache */
+#define ZC_HEALTH_UNCACHE	3	/* also write back dirty blocks now */
+
+#define ZC_SB_EXT_MAGIC		0x20DCAC8EE7E0DC20l
+#define ZC_SB_EXT_OFFSET	512
+
+/* Extension flags */
+#define ZC_SB_EXT_CLEAN		0x1	/* set was last stopped by zcstop */
+#define ZC_SB_EXT_STATS_PRECISE	0x2	/* ns-resolution dm-stats timestamps */
+#define ZC_SB_EXT_FALLBACK	0x4	/* change mode when budget exhausted */
+#define ZC_SB_EXT_BYPASSED	0x8	/* cache bypassed by health monitor */
+#define ZC_SB_EXT_THIN		0x10	/* origin holds a thin pool */
+
+_Static_assert(sizeof(struct zc_sb_ext) ==
+			offsetof(struct zc_sb_ext, o_thin_pool) +
+						ZC_SB_EXT_THIN_POOL_SIZE,
+	       "Unexpected padding in struct zc_sb_ext");
+
+/*
+ * Callback type for zc_block_size_check() and zc_sb_v0_check().  The issue
+ * string is static; the callback must not free it.
+ */
+typedef _Bool (*issue_cb_t)(const char *issue, void *context);
+
+/*
+ * Library context (libzodcache).  Functions that take a context report errors
+ * through its log function and use no global state, so they may be called
+ * concurrently.  The older functions without a context parameter use a
+ * default context, whose log function is set with zc_err_set_fn(); they are
+ * only for the zodcache programs (see the end of this file).
+ */
+struct zc_ctx;
+
+typedef void (*zc_log_fn_t)(struct zc_ctx *ctx, int priority,
+			    const char *format, va_list ap);
+
+struct zc_ctx *zc_ctx_new(void);
+void zc_ctx_free(struct zc_ctx *ctx);
+void zc_ctx_set_log_fn(struct zc_ctx *ctx, zc_log_fn_t log_fn);
+void zc_ctx_set_userdata(struct zc_ctx *ctx, void *userdata);
+void *zc_ctx_get_userdata(const struct zc_ctx *ctx);
+
+/* Result of probing a single device with zc_probe_devices() */
+struct zc_probe {
+	const char		*path;		/* set by caller */
+	int			status;		/* ZC_PROBE_* */
+	int			error;		/* errno, if ZC_PROBE_ERROR */
+	const char		*issue;		/* static, if ZC_PROBE_INVALID */
+	dev_t			devno;
+	struct zc_sb_v0		sb;
+	struct zc_sb_ext	ext;
+};
+
+#define ZC_PROBE_MEMBER		0	/* valid zodcache component device */
+#define ZC_PROBE_NONE		1	/* no zodcache superblock */
+#define ZC_PROBE_INVALID	2	/* invalid superblock or extension */
+#define ZC_PROBE_ERROR		3	/* I/O error */
+
+#define ZC_PROBE_MAX_THREADS	64
+
+/*
+ * Cache layout plan for zc_plan().  All sizes are in bytes.  The kernel memory
+ * estimates cover only the structures that grow with the number of cache
+ * blocks; dm-bufio's metadata block cache is shared by all sets.
+ */
+struct zc_plan {
+	/* Set by caller */
+	uint64_t		origin_size;	/* 0 if unknown */
+	uint64_t		cache_size;
+	uint64_t		md_avail;	/* separate metadata; 0 if none */
+	uint64_t		block_size;
+	uint64_t		alignment;
+	unsigned		md_version;	/* dm-cache metadata format */
+	unsigned		hint_size;	/* policy hint; ZC_PLAN_SMQ_HINT */
+	/* Results */
+	uint64_t		nr_blocks;
+	uint64_t		c_size;		/* cache area */
+	uint64_t		md_size;	/* metadata area */
+	uint64_t		md_needed;
+	uint64_t		md_wasted;
+	uint64_t		kmem_cache;	/* dm-cache target */
+	uint64_t		kmem_policy;	/* smq policy */
+};
+
+#define ZC_PLAN_SMQ_HINT	4
+
+/*
+ * I/O trace log, written by zctrace and read with zc_trace_open().  The header
+ * is followed by fixed-size frames, so a mapped log can be decoded starting at
+ * any frame.  A frame is a struct zc_trace_frame, then records encoded as
+ * LEB128 varints relative to the previous record (or the frame header):
+ *
+ *	queue time - previous queue time (ns, zigzag)
+ *	sector - end of previous I/O (zigzag); 0 for sequential I/O
+ *	sectors << 4 | cache << 2 | op
+ *	latency (us); 0 if the completion wasn't seen
+ *
+ * Records are in order of completion, so queue times can go backwards.
+ */
+#define ZC_TRACE_MAGIC		0x314543415254435Aull	/* "ZCTRACE1" */
+#define ZC_TRACE_VERSION	1
+#define ZC_TRACE_HDR_SIZE	4096
+#define ZC_TRACE_FRAME_SIZE	4096
+
+#define ZC_TRACE_OP_READ	0
+#define ZC_TRACE_OP_WRITE	1
+#define ZC_TRACE_OP_DISCARD	2
+#define ZC_TRACE_OP_FLUSH	3
+
+/* Inferred from origin traffic while the I/O was in flight */
+#define ZC_TRACE_UNKNOWN	0
+#define ZC_TRACE_HIT		1
+#define ZC_TRACE_MISS		2
+
+struct zc_trace_hdr {
+	uint64_t		magic;
+	uint64_t		version;
+	char			uuid[40];
+	uint64_t		start;		/* CLOCK_REALTIME (ns) of time 0 */
+	uint64_t		block_size;	/* sectors */
+	uint64_t		frame_size;
+	uint64_t		lost;		/* events dropped; buffers full */
+};
+
+struct zc_trace_frame {
+	uint64_t		time;		/* ns */
+	uint64_t		sector;
+	uint32_t		nr_records;
+	uint32_t		size;		/* bytes of records */
+};
+
+struct zc_trace_rec {
+	uint64_t		time;		/* queued; ns since start */
+	uint64_t		sector;
+	uint32_t		sectors;
+	uint32_t		latency;	/* us */
+	unsigned		op;		/* ZC_TRACE_OP_* */
+	unsigned		cache;		/* ZC_TRACE_{UNKNOWN,HIT,MISS} */
+};
+
+/* Reader state; fields are private except hdr and nr_frames */
+struct zc_trace {
+	struct zc_ctx		*ctx;
+	const uint8_t		*map;
+	size_t			size;
+	const struct zc_trace_hdr *hdr;
+	uint64_t		nr_frames;
+	uint64_t		frame;		/* next frame to decode */
+	const uint8_t		*pos;
+	const uint8_t		*end;
+	uint32_t		left;		/* records left in frame */
+	uint64_t		time;
+	uint64_t		sector;
+};
+
+/* Big enough for any zc_size_format_r() output */
+#define ZC_SIZE_BUF_SIZE	40
 
-void zc_err_set_fn(void (*err_fn)(int priority, const char *format, va_list ap));
 uint64_t zc_sb_v0_cksum(const struct zc_sb_v0 *sb);
-int zc_sb_v0_write(int fd, struct zc_sb_v0 *sb);
-int zc_sb_v0_read(int fd, struct zc_sb_v0 *sb);
+int zc_sb_v0_pwrite(struct zc_ctx *ctx, int fd, struct zc_sb_v0 *sb);
+int zc_sb_v0_pread(struct zc_ctx *ctx, int fd, struct zc_sb_v0 *sb);
+void zc_sb_ext_init(struct zc_sb_ext *ext);
+uint64_t zc_sb_ext_cksum(const struct zc_sb_ext *ext);
+int zc_sb_ext_pwrite(struct zc_ctx *ctx, int fd, struct zc_sb_ext *ext);
+int zc_sb_ext_pread(struct zc_ctx *ctx, int fd, struct zc_sb_ext *ext);
+ssize_t zc_probe_devices(struct zc_ctx *ctx, struct zc_probe *probes,
+			 size_t count, unsigned nr_threads);
 void zc_sb_v0_uuid_get(uint8_t uuid[16], const struct zc_sb_v0 *sb);
 void zc_sb_v0_uuid_set(const uint8_t uuid[16], struct zc_sb_v0 *sb);
 _Bool zc_block_size_check(uint64_t block_size, issue_cb_t issue_cb,
@@ -82,13 +385,44 @@ _Bool zc_sb_v0_check(const struct zc_sb_v0 *sb, issue_cb_t issue_cb,
 		     void *context);
 _Bool zc_sb_v0_is_valid(const struct zc_sb_v0 *sb);
 char *zc_size_format(uint64_t size, _Bool verbose);
+char *zc_size_format_r(uint64_t size, _Bool verbose,
+		       char buf[ZC_SIZE_BUF_SIZE]);
+const char *zc_uuid_format(const uint8_t uuid[16], char buf[ZC_UUID_BUF_SIZE]);
+const char *zc_sb_uuid_format(const struct zc_sb_v0 *sb,
+			      char buf[ZC_UUID_BUF_SIZE]);
+int zc_zone_add(struct zc_ctx *ctx, struct zc_sb_ext *ext, uint64_t start,
+		uint64_t len, uint64_t o_sectors, uint64_t block_sectors);
+int zc_zone_remove(struct zc_ctx *ctx, struct zc_sb_ext *ext, uint64_t start,
+		   uint64_t len);
+int zc_zone_parse(struct zc_ctx *ctx, const char *s, uint64_t *start,
+		  uint64_t *len);
+int zc_pin_add(struct zc_ctx *ctx, struct zc_sb_ext *ext, uint64_t start,
+	       uint64_t len, uint64_t o_sectors, uint64_t block_sectors);
+int zc_pin_find(const struct zc_sb_ext *ext, uint64_t start, uint64_t len);
+int zc_pin_in_flight(const struct zc_sb_ext *ext);
+void zc_pin_delete(struct zc_sb_ext *ext, unsigned i);
+int zc_plan(struct zc_ctx *ctx, struct zc_plan *plan);
+int zc_crypt_parse(struct zc_ctx *ctx, struct zc_sb_ext *ext,
+		   const char *cipher, const char *key);
+int zc_trace_open(struct zc_ctx *ctx, const char *path, struct zc_trace *t);
+void zc_trace_close(struct zc_trace *t);
+int zc_trace_seek(struct zc_trace *t, uint64_t frame);
+int zc_trace_next(struct zc_trace *t, struct zc_trace_rec *rec);
+
+/*
+ * For the zodcache programs, which build lib.c in; not exported by
+ * libzodcache (see libzodcache.map).  These log through the process-wide
+ * default context, and zc_asprintf() aborts if it runs out of memory.
+ */
+void zc_err_set_fn(void (*err_fn)(int priority, const char *format, va_list ap));
+int zc_sb_v0_write(int fd, struct zc_sb_v0 *sb);
+int zc_sb_v0_read(int fd, struct zc_sb_v0 *sb);
+int zc_sb_ext_write(int fd, struct zc_sb_ext *ext);
+int zc_sb_ext_read(int fd, struct zc_sb_ext *ext);
 int zc_block_size_parse(const char *s, uint64_t *block_size);
 int zc_size_parse(const char *s, uint64_t *size);
 const char *zc_cache_mode_format(uint64_t cache_mode, _Bool quiet);
 int zc_cache_mode_parse(const char *s, uint64_t *cache_mode);
-const char *zc_uuid_format(const uint8_t uuid[16], char buf[ZC_UUID_BUF_SIZE]);
-const char *zc_sb_uuid_format(const struct zc_sb_v0 *sb,
-			      char buf[ZC_UUID_BUF_SIZE]);
 const char *zc_dev_type_format(uint64_t dev_type, _Bool quiet);
 char *zc_asprintf(const char *format, ...)
 				__attribute__((format(printf, 1, 2)));
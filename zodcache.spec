@@ -5,44 +5,95 @@ Release:	1%{?dist}
 URL:		https://github.com/ipilcher/zodcache
 Source:		%{name}-%{version}.tar.gz
 License:	GPLv2
-BuildRequires:	device-mapper-devel libuuid-devel
+BuildRequires:	device-mapper-devel libuuid-devel systemd-devel
+Requires:	device-mapper-persistent-data
 
 %description
 zodcache is a block device caching mechanism that uses device mapper
 (dm-cache).
 
+%package devel
+Summary:	Development files for libzodcache
+Requires:	%{name}%{?_isa} = %{version}-%{release}
+
+%description devel
+Header file and library link for libzodcache, which reads, writes and
+validates zodcache superblocks.
+
 %prep
 %setup -q
 
 %build
-gcc -O3 -Wall -Wextra -o mkzc mkzc.c lib.c -luuid
-gcc -O3 -Wall -Wextra -o zcdump zcdump.c lib.c
-gcc -O3 -Wall -Wextra -o zcstart zcstart.c lib.c -ldevmapper
+# The programs build lib.c in; the library only exports its public API
+gcc -O3 -Wall -Wextra -fPIC -shared -pthread -o libzodcache.so.0.1.0 lib.c \
+	-Wl,-soname,libzodcache.so.0 -Wl,--version-script=libzodcache.map
+ln -sf libzodcache.so.0.1.0 libzodcache.so.0
+ln -sf libzodcache.so.0 libzodcache.so
+gcc -O3 -Wall -Wextra -pthread -o mkzc mkzc.c lib.c -luuid
+gcc -O3 -Wall -Wextra -pthread -o zcdump zcdump.c lib.c
+gcc -O3 -Wall -Wextra -pthread -o zcconvert zcconvert.c lib.c
+gcc -O3 -Wall -Wextra -pthread -o zcplan zcplan.c lib.c
+gcc -O3 -Wall -Wextra -pthread -o zcstart zcstart.c assemble.c dm.c \
+	registry.c stats.c tune.c lib.c -ldevmapper
+gcc -O3 -Wall -Wextra -pthread -o zcstop zcstop.c assemble.c dm.c \
+	registry.c stats.c tune.c lib.c -ldevmapper
+gcc -O3 -Wall -Wextra -pthread -o zcctl zcctl.c assemble.c dm.c registry.c \
+	stats.c tune.c cmeta.c lib.c -ldevmapper
+gcc -O3 -Wall -Wextra -pthread -o zodcached zodcached.c assemble.c dm.c \
+	registry.c stats.c tune.c controller.c health.c lib.c \
+	-ldevmapper -ludev
+gcc -O3 -Wall -Wextra -pthread -o zctrace zctrace.c assemble.c dm.c \
+	registry.c stats.c tune.c lib.c -ldevmapper
 
 %install
 rm -rf %{buildroot}
+mkdir -p %{buildroot}%{_libdir} %{buildroot}%{_includedir}
+cp -P libzodcache.so* %{buildroot}%{_libdir}/
+cp zodcache.h %{buildroot}%{_includedir}/
 mkdir -p %{buildroot}/usr/sbin
-cp mkzc zcdump zcstart %{buildroot}/usr/sbin/
+cp mkzc zcdump zcconvert zcplan zcstart zcstop zcctl zodcached zctrace \
+	%{buildroot}/usr/sbin/
+mkdir -p %{buildroot}/usr/lib/systemd/system
+cp zodcached.service %{buildroot}/usr/lib/systemd/system/
 mkdir -p %{buildroot}/usr/lib/udev/rules.d
 cp 69-zodcache.rules %{buildroot}/usr/lib/udev/rules.d/
 mkdir -p %{buildroot}/usr/lib/dracut/modules.d/90zodcache
-cp module-setup.sh %{buildroot}/usr/lib/dracut/modules.d/90zodcache/
+cp module-setup.sh zodcache-shutdown.sh zodcache-thin.sh \
+	%{buildroot}/usr/lib/dracut/modules.d/90zodcache/
 mkdir -p %{buildroot}/etc/dracut.conf.d
 cp 50-zodcache.conf %{buildroot}/etc/dracut.conf.d/
 
 %clean
 rm -rf %{buildroot}
 
+%post -p /sbin/ldconfig
+
+%postun -p /sbin/ldconfig
+
 %files
+%attr(0755,root,root) %{_libdir}/libzodcache.so.0*
 %attr(0755,root,root) /usr/sbin/mkzc
 %attr(0755,root,root) /usr/sbin/zcdump
+%attr(0755,root,root) /usr/sbin/zcconvert
+%attr(0755,root,root) /usr/sbin/zcplan
 %attr(0755,root,root) /usr/sbin/zcstart
+%attr(0755,root,root) /usr/sbin/zcstop
+%attr(0755,root,root) /usr/sbin/zcctl
+%attr(0755,root,root) /usr/sbin/zodcached
+%attr(0755,root,root) /usr/sbin/zctrace
+%attr(0644,root,root) /usr/lib/systemd/system/zodcached.service
 %attr(0644,root,root) /usr/lib/udev/rules.d/69-zodcache.rules
 %attr(0755,root,root) %dir /usr/lib/dracut/modules.d/90zodcache
 %attr(0755,root,root) /usr/lib/dracut/modules.d/90zodcache/module-setup.sh
+%attr(0755,root,root) /usr/lib/dracut/modules.d/90zodcache/zodcache-shutdown.sh
+%attr(0755,root,root) /usr/lib/dracut/modules.d/90zodcache/zodcache-thin.sh
 %attr(0644,root,root) %config(noreplace) /etc/dracut.conf.d/50-zodcache.conf
 %attr(0644,root,root) %doc LICENSE
 
+%files devel
+%attr(0644,root,root) %{_includedir}/zodcache.h
+%{_libdir}/libzodcache.so
+
 %changelog
 * Tue Dec 27 2016 Ian Pilcher <arequipeno@gmail.com> - 0.0.2-1
 - Fix metadata size calculation
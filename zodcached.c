@@ -0,0 +1,927 @@
+/*
+ * Copyright 2015, 2016 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranties of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the test of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * zodcached -- optional long-running replacement for the per-device zcstart
+ * invocations from 69-zodcache.rules.
+ *
+ * Listens for block device events on the udev netlink monitor, keeps an index
+ * of member devices by set UUID, and assembles each set as soon as it is
+ * complete.  Each member is started by a zcstart child, so that a slow start
+ * (e.g. a metadata repair) doesn't hold up other events or sets; the registry
+ * serializes them, and lets them overlap with zcstart runs from the udev rule
+ * (which stops running zcstart once the daemon answers on its socket).
+ *
+ * Status queries are answered on a Unix stream socket (ZC_DAEMON_SOCKET).  The
+ * client sends one command line; the daemon replies with zero or more lines,
+ * followed by "OK" or "ERR <message>", and closes the connection.
+ *
+ *	list		<uuid> <state> <members present>/3
+ *	members		<uuid> <type> <device> <major>:<minor>
+ *	status <uuid>	<key>: <value> lines, including live cache counters
+ *	reload <uuid>	(re)reads the set's superblocks and its controller,
+ *			budget & health settings
+ *
+ * Sets whose superblock extension has a controller target or a cache write
+ * budget (see zcctl controller & zcctl budget) are managed by controller.c.
+ * Sets with a health action (see zcctl health) are watched by health.c, which
+ * takes over the cache mode while the cache is bypassed.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/sysmacros.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <inttypes.h>
+#include <time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <libudev.h>
+
+#include "zodcache.h"
+#include "zcdm.h"
+
+#define NR_MEMBER_TYPES		(ZC_SB_TYPE_METADATA + 1)
+
+struct member {
+	char			*path;
+	dev_t			devno;
+	struct zc_sb_v0		sb;
+};
+
+struct zc_set {
+	struct zc_set		*next;
+	char			uuid[ZC_UUID_BUF_SIZE];
+	/* A combined cache device is both the cache and metadata member */
+	struct member		*members[NR_MEMBER_TYPES];
+	_Bool			assembled;
+	_Bool			degraded;	/* see zc_member_gone() */
+	_Bool			loaded;		/* extension read since then */
+	_Bool			pinning;	/* pinned extent being copied */
+	struct zc_ctl		*ctl;
+	struct zc_health	*health;
+};
+
+/* A running zcstart child */
+struct job {
+	struct job		*next;
+	pid_t			pid;
+	char			uuid[ZC_UUID_BUF_SIZE];
+	char			*path;
+};
+
+static struct zc_set *sets;
+static struct job *jobs;
+static sigset_t chld_mask;
+static volatile sig_atomic_t stop;
+
+static struct zc_set *set_find(const char *const uuid)
+{
+	struct zc_set *set;
+
+	for (set = sets; set != NULL; set = set->next) {
+		if (strcmp(set->uuid, uuid) == 0)
+			return set;
+	}
+
+	return NULL;
+}
+
+static struct zc_set *set_get(const char *const uuid)
+{
+	struct zc_set *set;
+
+	if ((set = set_find(uuid)) != NULL)
+		return set;
+
+	set = calloc(1, sizeof *set);
+	if (set == NULL) {
+		zc_err(LOG_CRIT, "Memory allocation failure. Aborting.\n");
+		abort();
+	}
+
+	strcpy(set->uuid, uuid);
+	set->next = sets;
+	sets = set;
+
+	return set;
+}
+
+static void set_free_if_empty(struct zc_set *const set)
+{
+	struct zc_set **s;
+	unsigned i;
+
+	for (i = 0; i < NR_MEMBER_TYPES; ++i) {
+		if (set->members[i] != NULL)
+			return;
+	}
+
+	for (s = &sets; *s != set; s = &(*s)->next);
+	*s = set->next;
+	if (set->ctl != NULL)
+		zc_ctl_free(set->ctl);
+	if (set->health != NULL)
+		zc_health_free(set->health);
+	free(set);
+}
+
+static struct member *member_find(const dev_t devno, struct zc_set **const set)
+{
+	struct zc_set *s;
+	unsigned i;
+
+	for (s = sets; s != NULL; s = s->next) {
+		for (i = 0; i < NR_MEMBER_TYPES; ++i) {
+			if (s->members[i] != NULL &&
+					s->members[i]->devno == devno) {
+				*set = s;
+				return s->members[i];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static unsigned set_nr_members(const struct zc_set *const set)
+{
+	unsigned i, n;
+
+	for (i = 0, n = 0; i < NR_MEMBER_TYPES; ++i)
+		n += (set->members[i] != NULL);
+
+	return n;
+}
+
+static _Bool set_bypassed(const struct zc_set *const set)
+{
+	return set->health != NULL && zc_health_bypassed(set->health);
+}
+
+/*
+ * Starts (or restarts) the controller if the set has a target configured.  The
+ * health monitor keeps its state (and its event thread) until the set stops.
+ */
+static void set_load_ctl(struct zc_set *const set)
+{
+	const struct member *md;
+	struct zc_sb_ext ext;
+	char *name;
+	int fd;
+
+	if (set->ctl != NULL) {
+		zc_ctl_free(set->ctl);
+		set->ctl = NULL;
+	}
+
+	set->pinning = 0;
+	set->loaded = 0;
+
+	md = set->members[ZC_SB_TYPE_METADATA];
+	if (!set->assembled || md == NULL) {
+		if (set->health != NULL) {
+			zc_health_free(set->health);
+			set->health = NULL;
+		}
+		return;
+	}
+
+	if ((fd = zc_member_ext_open(md->devno, &ext)) < 0)
+		return;
+
+	close(fd);
+
+	set->loaded = 1;
+	set->pinning = (zc_pin_in_flight(&ext) >= 0);
+
+	if (set->health != NULL) {
+		zc_health_configure(set->health, &ext);
+	}
+	else if (ext.health_action != ZC_HEALTH_OFF) {
+		set->health = zc_health_new(set->uuid, &ext, &md->sb,
+					    md->devno);
+	}
+
+	/* Undoes any write budget fallback, if the budget was disabled */
+	if (ext.budget_daily == 0 && !set_bypassed(set)) {
+		name = zc_cache_target(set->uuid);
+		zc_dm_cache_set_mode(name, md->sb.cache_mode);
+		free(name);
+	}
+
+	if (ext.ctl_target != 0 || ext.budget_daily != 0)
+		set->ctl = zc_ctl_new(set->uuid, &ext, &md->sb, md->devno);
+}
+
+/*
+ * Picks up state changes made by zcstart or zcstop.  The extension is only
+ * read again when the set is assembled or stopped; changes to it are picked
+ * up through the reload command (see zcctl).
+ */
+static void set_refresh(struct zc_set *const set)
+{
+	struct zc_registry reg;
+
+	if (zc_registry_open(&reg, set->uuid) < 0)
+		return;
+
+	set->assembled = reg.assembled;
+	set->degraded = reg.degraded;
+	zc_registry_close(&reg);
+
+	if (set->assembled != set->loaded)
+		set_load_ctl(set);
+}
+
+/* Starts a member in a zcstart child; see job_reap() */
+static void job_start(const char *const path, const char *const uuid)
+{
+	struct job *job;
+
+	job = malloc(sizeof *job);
+	if (job == NULL || (job->path = strdup(path)) == NULL) {
+		zc_err(LOG_CRIT, "Memory allocation failure. Aborting.\n");
+		abort();
+	}
+
+	if ((job->pid = fork()) < 0) {
+		zc_err(LOG_ERR, "%s: fork: %m\n", path);
+		free(job->path);
+		free(job);
+		return;
+	}
+
+	if (job->pid == 0) {
+		sigprocmask(SIG_UNBLOCK, &chld_mask, NULL);
+		execlp("zcstart", "zcstart", "--udev", path, (char *)NULL);
+		_exit(127);
+	}
+
+	strcpy(job->uuid, uuid);
+	job->next = jobs;
+	jobs = job;
+}
+
+/* Reaps finished zcstart children; waits for all of them, if asked */
+static void job_reap(const _Bool all)
+{
+	struct job **p, *job;
+	struct zc_set *set;
+	_Bool assembled;
+	int status;
+	pid_t pid;
+
+	while (jobs != NULL &&
+			(pid = waitpid(-1, &status, all ? 0 : WNOHANG)) != 0) {
+
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			zc_err(LOG_ERR, "waitpid: %m\n");
+			return;
+		}
+
+		for (p = &jobs; *p != NULL && (*p)->pid != pid; p = &(*p)->next);
+		if ((job = *p) == NULL)
+			continue;
+
+		*p = job->next;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			zc_err(LOG_ERR, "%s: failed to start member\n",
+			       job->path);
+
+		/* The member may have gone in the meantime */
+		if ((set = set_find(job->uuid)) != NULL) {
+			assembled = set->assembled;
+			set_refresh(set);
+			if (!assembled && set->assembled)
+				zc_err(LOG_NOTICE, "%s: assembled\n", set->uuid);
+		}
+
+		free(job->path);
+		free(job);
+	}
+}
+
+static void device_added(const char *const path, const dev_t devno)
+{
+	struct member *member;
+	struct zc_set *set;
+	struct zc_sb_v0 sb;
+	char uuid[ZC_UUID_BUF_SIZE];
+	dev_t probed;
+
+	/*
+	 * A member of a set that isn't assembled may have been re-announced
+	 * after the set was torn down (see zc_member_gone), so start it again
+	 */
+	if ((member = member_find(devno, &set)) != NULL) {
+		if (!set->assembled)
+			job_start(member->path, set->uuid);
+		return;
+	}
+
+	if (zc_member_probe(path, &sb, &probed, /* quiet = */ 1) != 1)
+		return;
+
+	member = malloc(sizeof *member);
+	if (member == NULL || (member->path = strdup(path)) == NULL) {
+		zc_err(LOG_CRIT, "Memory allocation failure. Aborting.\n");
+		abort();
+	}
+
+	member->devno = probed;
+	member->sb = sb;
+
+	set = set_get(zc_sb_uuid_format(&sb, uuid));
+
+	if (sb.type == ZC_SB_TYPE_COMBINED) {
+		set->members[ZC_SB_TYPE_CACHE] = member;
+		set->members[ZC_SB_TYPE_METADATA] = member;
+	}
+	else {
+		set->members[sb.type] = member;
+	}
+
+	zc_err(LOG_INFO, "%s: %s device for %s (%u/%u members)\n", path,
+	       zc_dev_type_format(sb.type, 0), uuid, set_nr_members(set),
+	       NR_MEMBER_TYPES);
+
+	job_start(path, uuid);
+}
+
+static void device_removed(const dev_t devno)
+{
+	struct member *member;
+	struct zc_set *set;
+	unsigned i;
+
+	if ((member = member_find(devno, &set)) == NULL)
+		return;
+
+	zc_err(LOG_NOTICE, "%s: %s device for %s removed\n", member->path,
+	       zc_dev_type_format(member->sb.type, 0), set->uuid);
+
+	if (zc_member_gone(set->uuid, devno) < 0)
+		zc_err(LOG_ERR, "%s: failed to clean up set\n", set->uuid);
+
+	for (i = 0; i < NR_MEMBER_TYPES; ++i) {
+		if (set->members[i] == member)
+			set->members[i] = NULL;
+	}
+
+	free(member->path);
+	free(member);
+
+	set_refresh(set);
+	set_free_if_empty(set);
+}
+
+static void handle_device(struct udev_device *const dev, const char *action)
+{
+	const char *path, *sysname, *flag;
+
+	path = udev_device_get_devnode(dev);
+	sysname = udev_device_get_sysname(dev);
+
+	if (path == NULL || sysname == NULL)
+		return;
+
+	if (strcmp(action, "remove") == 0) {
+		device_removed(udev_device_get_devnum(dev));
+		return;
+	}
+
+	/* Same filtering as 69-zodcache.rules */
+	flag = udev_device_get_property_value(dev,
+					      "DM_UDEV_DISABLE_OTHER_RULES_FLAG");
+	if (flag != NULL && strcmp(flag, "1") == 0)
+		return;
+
+	if (strncmp(sysname, "fd", 2) == 0 || strncmp(sysname, "sr", 2) == 0)
+		return;
+
+	device_added(path, udev_device_get_devnum(dev));
+}
+
+/* Picks up devices that were present before the daemon started */
+static void coldplug(struct udev *const udev)
+{
+	struct udev_list_entry *entry;
+	struct udev_enumerate *e;
+	struct udev_device *dev;
+
+	if (		!(e = udev_enumerate_new(udev))			||
+
+			udev_enumerate_add_match_subsystem(e, "block") < 0 ||
+
+			udev_enumerate_scan_devices(e) < 0		) {
+
+		zc_err(LOG_ERR, "Failed to enumerate block devices\n");
+		exit(EXIT_FAILURE);
+	}
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+
+		dev = udev_device_new_from_syspath(udev,
+					udev_list_entry_get_name(entry));
+		if (dev == NULL)
+			continue;
+
+		handle_device(dev, "add");
+		udev_device_unref(dev);
+	}
+
+	udev_enumerate_unref(e);
+	job_reap(1);
+}
+
+static void reply(FILE *const fp, const char *const format, ...)
+				__attribute__((format(printf, 2, 3)));
+
+static void reply(FILE *const fp, const char *const format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(fp, format, ap);
+	va_end(ap);
+}
+
+static const char *set_state(const struct zc_set *const set)
+{
+	if (set->assembled)
+		return "assembled";
+
+	return set->degraded ? "degraded" : "incomplete";
+}
+
+static void cmd_list(FILE *const fp)
+{
+	struct zc_set *set;
+
+	for (set = sets; set != NULL; set = set->next) {
+		reply(fp, "%s %s %u/%u\n", set->uuid, set_state(set),
+		      set_nr_members(set), NR_MEMBER_TYPES);
+	}
+
+	reply(fp, "OK\n");
+}
+
+static void cmd_members(FILE *const fp)
+{
+	static const char *const types[] = { "origin", "cache", "metadata" };
+	struct zc_set *set;
+	unsigned i;
+
+	for (set = sets; set != NULL; set = set->next) {
+		for (i = 0; i < NR_MEMBER_TYPES; ++i) {
+
+			if (set->members[i] == NULL)
+				continue;
+
+			reply(fp, "%s %s %s %u:%u\n", set->uuid, types[i],
+			      set->members[i]->path,
+			      major(set->members[i]->devno),
+			      minor(set->members[i]->devno));
+		}
+	}
+
+	reply(fp, "OK\n");
+}
+
+static void cmd_status(FILE *const fp, const char *const uuid)
+{
+	static const char *const types[] = { "origin", "cache", "metadata" };
+	struct zc_cache_status status;
+	const struct zc_sb_v0 *sb;
+	struct zc_set *set;
+	unsigned i;
+	char *name;
+
+	if ((set = set_find(uuid)) == NULL) {
+		reply(fp, "ERR unknown set\n");
+		return;
+	}
+
+	reply(fp, "state: %s\n", set_state(set));
+
+	for (i = 0, sb = NULL; i < NR_MEMBER_TYPES; ++i) {
+
+		if (set->members[i] == NULL) {
+			reply(fp, "%s: -\n", types[i]);
+			continue;
+		}
+
+		sb = &set->members[i]->sb;
+		reply(fp, "%s: %s\n", types[i], set->members[i]->path);
+	}
+
+	if (sb != NULL) {
+		reply(fp, "block_size: %" PRIu64 "\n", sb->block_size);
+		reply(fp, "cache_mode: %s\n",
+		      zc_cache_mode_format(sb->cache_mode, 1));
+	}
+
+	if (set->ctl != NULL)
+		zc_ctl_report(set->ctl, fp);
+
+	if (set->health != NULL)
+		zc_health_report(set->health, fp);
+
+	if (set->assembled) {
+
+		name = zc_cache_target(uuid);
+
+		if (zc_dm_cache_status(name, &status) < 0) {
+			free(name);
+			reply(fp, "ERR failed to get cache status\n");
+			return;
+		}
+
+		free(name);
+
+		if (status.failed) {
+			reply(fp, "health: failed\n");
+		}
+		else {
+			reply(fp, "health: %s\n", status.needs_check ?
+			      "needs_check" : status.read_only ?
+							"read_only" : "ok");
+			reply(fp, "cache_blocks: %" PRIu64 "/%" PRIu64 "\n",
+			      status.used, status.total);
+			reply(fp, "dirty: %" PRIu64 "\n", status.dirty);
+			reply(fp, "read_hits: %" PRIu64 "\n",
+			      status.read_hits);
+			reply(fp, "read_misses: %" PRIu64 "\n",
+			      status.read_misses);
+			reply(fp, "write_hits: %" PRIu64 "\n",
+			      status.write_hits);
+			reply(fp, "write_misses: %" PRIu64 "\n",
+			      status.write_misses);
+			reply(fp, "promotions: %" PRIu64 "\n",
+			      status.promotions);
+			reply(fp, "demotions: %" PRIu64 "\n",
+			      status.demotions);
+		}
+	}
+
+	reply(fp, "OK\n");
+}
+
+/* zcctl reblock rewrites the members' superblocks */
+static void set_reread(struct zc_set *const set)
+{
+	struct member *member;
+	struct zc_sb_v0 sb;
+	unsigned i;
+	int fd;
+
+	for (i = 0; i < NR_MEMBER_TYPES; ++i) {
+
+		if ((member = set->members[i]) == NULL)
+			continue;
+
+		if ((fd = open(member->path, O_RDONLY | O_CLOEXEC)) < 0) {
+			zc_err(LOG_ERR, "%s: %m\n", member->path);
+			continue;
+		}
+
+		if (zc_sb_v0_read(fd, &sb) == 0 && zc_sb_v0_is_valid(&sb))
+			member->sb = sb;
+
+		close(fd);
+	}
+}
+
+static void cmd_reload(FILE *const fp, const char *const uuid)
+{
+	struct zc_set *set;
+
+	if ((set = set_find(uuid)) == NULL) {
+		reply(fp, "ERR unknown set\n");
+		return;
+	}
+
+	set_reread(set);
+	set_load_ctl(set);
+	reply(fp, "OK\n");
+}
+
+/* Runs the controllers & health checks every ZC_CTL_INTERVAL seconds */
+static int ctl_tick_all(void)
+{
+	static struct timespec next;
+	struct timespec now;
+	struct zc_set *set;
+	_Bool active;
+
+	for (active = 0, set = sets; set != NULL; set = set->next)
+		active |= (set->ctl != NULL || set->health != NULL ||
+			   set->pinning);
+
+	if (!active)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec < next.tv_sec || (now.tv_sec == next.tv_sec &&
+					 now.tv_nsec < next.tv_nsec)) {
+		return (next.tv_sec - now.tv_sec) * 1000 +
+				(next.tv_nsec - now.tv_nsec) / 1000000 + 1;
+	}
+
+	for (set = sets; set != NULL; set = set->next) {
+
+		/* The set may have been stopped by zcstop */
+		if (set->ctl != NULL || set->health != NULL)
+			set_refresh(set);
+
+		/* Lets the controller reapply its own mode, if any */
+		if (set->health != NULL && zc_health_tick(set->health) > 0)
+			set_load_ctl(set);
+
+		if (set->ctl != NULL && !set_bypassed(set))
+			zc_ctl_tick(set->ctl);
+
+		/* Finishes the copy once it's in sync */
+		if (set->pinning)
+			set->pinning = (zc_set_pins_update(set->uuid) > 0);
+	}
+
+	next = now;
+	next.tv_sec += ZC_CTL_INTERVAL;
+
+	return ZC_CTL_INTERVAL * 1000;
+}
+
+/* Messages from the health monitor's event & probe threads */
+static void handle_health(const int fd)
+{
+	struct zc_health_msg msg;
+	struct zc_set *set;
+
+	while (read(fd, &msg, sizeof msg) == sizeof msg) {
+
+		/* The set may have been stopped in the meantime */
+		set = set_find(msg.uuid);
+		if (set == NULL || set->health == NULL)
+			continue;
+
+		if (zc_health_event(set->health, &msg) > 0)
+			set_load_ctl(set);
+	}
+}
+
+static void handle_client(const int listen_fd)
+{
+	static const struct timeval timeout = { .tv_sec = 1 };
+	char line[128], *nl;
+	FILE *fp;
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			zc_err(LOG_WARNING, "accept: %m\n");
+		return;
+	}
+
+	/* Don't let a stuck client stall device event handling */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+	fp = fdopen(fd, "r+");
+	if (fp == NULL) {
+		zc_err(LOG_WARNING, "fdopen: %m\n");
+		close(fd);
+		return;
+	}
+
+	if (fgets(line, sizeof line, fp) == NULL) {
+		fclose(fp);
+		return;
+	}
+
+	if ((nl = strchr(line, '\n')) != NULL)
+		*nl = '\0';
+
+	fseek(fp, 0, SEEK_CUR);	/* switch stream from reading to writing */
+
+	if (strcmp(line, "list") == 0)
+		cmd_list(fp);
+	else if (strcmp(line, "members") == 0)
+		cmd_members(fp);
+	else if (strncmp(line, "status ", 7) == 0)
+		cmd_status(fp, line + 7);
+	else if (strncmp(line, "reload ", 7) == 0)
+		cmd_reload(fp, line + 7);
+	else
+		reply(fp, "ERR unknown command\n");
+
+	fclose(fp);
+}
+
+static int listen_socket(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	strcpy(addr.sun_path, ZC_DAEMON_SOCKET);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		zc_err(LOG_ERR, "socket: %m\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Left behind if the daemon crashed */
+	unlink(ZC_DAEMON_SOCKET);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+					listen(fd, 16) < 0) {
+		zc_err(LOG_ERR, "%s: %m\n", ZC_DAEMON_SOCKET);
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static void libdm_log_fn(const int level __attribute__((unused)),
+			 const char *const file __attribute__((unused)),
+			 const int line __attribute__((unused)),
+			 const int dm_errno_or_class __attribute__((unused)),
+			 const char *const format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vsyslog(LOG_PRI(level), format, ap);
+	va_end(ap);
+}
+
+static void stop_handler(const int signum __attribute__((unused)))
+{
+	stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa = { .sa_handler = stop_handler };
+	struct udev_monitor *mon;
+	struct signalfd_siginfo si;
+	struct pollfd fds[4];
+	struct udev_device *dev;
+	struct zc_set *set;
+	struct udev *udev;
+	int log_opts, health_pipe, chld_fd;
+
+	if (argc == 2 && strcmp(argv[1], "-f") == 0) {
+		log_opts = LOG_PID | LOG_PERROR;
+	}
+	else if (argc == 1) {
+		log_opts = LOG_PID;
+	}
+	else {
+		fprintf(stderr, "Usage: %s [-f]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	openlog("zodcached", log_opts, LOG_DAEMON);
+	setlogmask(LOG_UPTO(LOG_INFO));
+	zc_err_set_fn(vsyslog);
+	dm_log_with_errno_init(libdm_log_fn);
+	dm_udev_set_sync_support(1);
+
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	/* zcstart children are reaped from the main loop */
+	sigemptyset(&chld_mask);
+	sigaddset(&chld_mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &chld_mask, NULL) < 0 ||
+			(chld_fd = signalfd(-1, &chld_mask,
+					    SFD_CLOEXEC | SFD_NONBLOCK)) < 0) {
+		zc_err(LOG_ERR, "signalfd: %m\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (mkdir(ZC_RUN_DIR, 0755) < 0 && errno != EEXIST) {
+		zc_err(LOG_ERR, "%s: %m\n", ZC_RUN_DIR);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Before coldplug(), which starts the health monitors */
+	if ((health_pipe = zc_health_pipe()) < 0)
+		exit(EXIT_FAILURE);
+
+	if (		!(udev = udev_new())				||
+
+			!(mon = udev_monitor_new_from_netlink(udev,
+							      "udev"))	||
+
+			udev_monitor_filter_add_match_subsystem_devtype(mon,
+							"block", NULL) < 0 ||
+
+			udev_monitor_enable_receiving(mon) < 0		) {
+
+		zc_err(LOG_ERR, "Failed to set up udev monitor\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Start listening before scanning, so nothing slips through the gap.
+	 * The socket is created last, once the scan's zcstart children have
+	 * finished; until it exists, the udev rule keeps running zcstart (and
+	 * the registry sorts out any overlap).
+	 */
+	coldplug(udev);
+
+	fds[0].fd = udev_monitor_get_fd(mon);
+	fds[0].events = POLLIN;
+	fds[1].fd = listen_socket();
+	fds[1].events = POLLIN;
+	fds[2].fd = health_pipe;
+	fds[2].events = POLLIN;
+	fds[3].fd = chld_fd;
+	fds[3].events = POLLIN;
+
+	zc_err(LOG_INFO, "Ready\n");
+
+	while (!stop) {
+
+		/* Wakes up for the next controller tick, if any */
+		if (poll(fds, 4, ctl_tick_all()) < 0) {
+			if (errno == EINTR)
+				continue;
+			zc_err(LOG_ERR, "poll: %m\n");
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			dev = udev_monitor_receive_device(mon);
+			if (dev != NULL) {
+				handle_device(dev,
+					      udev_device_get_action(dev) ?: "");
+				udev_device_unref(dev);
+			}
+		}
+
+		if (fds[1].revents & POLLIN)
+			handle_client(fds[1].fd);
+
+		if (fds[2].revents & POLLIN)
+			handle_health(fds[2].fd);
+
+		if (fds[3].revents & POLLIN) {
+			while (read(chld_fd, &si, sizeof si) == sizeof si);
+			job_reap(0);
+		}
+	}
+
+	/* Lets any member starts in progress finish */
+	job_reap(1);
+
+	/* Saves the write budget counters; a cache bypass stays in effect */
+	for (set = sets; set != NULL; set = set->next) {
+		if (set->ctl != NULL)
+			zc_ctl_free(set->ctl);
+		if (set->health != NULL)
+			zc_health_free(set->health);
+	}
+
+	unlink(ZC_DAEMON_SOCKET);
+	close(fds[1].fd);
+	udev_monitor_unref(mon);
+	udev_unref(udev);
+
+	return stop ? EXIT_SUCCESS : EXIT_FAILURE;
+}